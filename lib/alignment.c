@@ -14,6 +14,10 @@
 #include "alignment.h"
 
 #define EPSLON 1.e-12
+#define SITEPATTERN_BLOCK 256 /* site columns transposed at a time by each thread, before hashing */
+#define VARIABLE_SITES_BLOCK 4096 /* columns compared at a time, row-wise, by each thread */
+#define DISTANCE_TILE_BYTES 262144 /* packed sequences of a pair of tiles of the distance matrix (half of a typical L2 cache) */
+#define PAIRWISE_BOUND_BLOCK 256 /* sites compared by the bounded pairwise functions between checks of the threshold */
 int char2bit[256][2] = {{0xffff}}; /* DNA base to bitpattern translation, with 1st element set to arbitrary value */
 int pairdist[15][15][2]; /* pairwise distance table with #matches, #transitions and #transversions for each pair */
 
@@ -29,6 +33,16 @@ void read_assumptions_nexus_sequence (char *line, alignment align);
 /*! \brief Reduce site columns to only those with distinct patterns; original sites can be found through
  * alignment_struct::site_pattern */
 void alignment_create_sitepattern (alignment align);
+/*! \brief site column and hash of its states, sorted by alignment_create_sitepattern() */
+typedef struct
+{
+  uint64_t hash;
+  int col;
+} site_column_hash;
+/*! \brief comparison by hash and then by column, used by qsort() */
+int compare_site_column_hash (const void *a, const void *b);
+/*! \brief true if all taxa have the same state at columns s1 and s2 */
+bool alignment_columns_are_equal (alignment align, int s1, int s2);
 /*! \brief If taxon labels have spaces or characters with special meaning for newick trees then
  * alignment_struct::taxshort will have their legal versions; otherwise it will link to taxlabel */
 void alignment_shorten_taxa_names (alignment align);
@@ -41,6 +55,17 @@ void store_filename_in_alignment (alignment align, char *seqfilename);
 void calc_empirical_equilibrium_freqs (char *seq, int *pfreq, int nsites, double *result);
 /*! \brief uses Kimura's two-parameter model to calculate distance and ti/tv rate ratio between sequencies */
 void biomcmc_calc_pairwise_distance_K2P (char *s1, char *s2, int *w, int nsites, double *result);
+/*! \brief transition and transversion counts in result[] as proportions of the valid sites */
+void pairwise_K2P_proportions (double *result, double valid_sites);
+/*! \brief running moments of K2P distances and ti/tv ratios (Welford), and sum of JC distances */
+typedef struct
+{
+  double count, mean_d, m2_d, mean_r, m2_r, sum_jc;
+} distance_moments;
+/*! \brief K2P and JC distances between sequences i and j of dist, accumulating their moments into acc */
+void distance_matrix_K2P_JC_pair (distance_matrix dist, packed_alignment pk, int i, int j, distance_moments *acc);
+/*! \brief combines the moments of b into a */
+void distance_moments_merge (distance_moments *a, distance_moments *b);
 /*! \brief initializes char2bit vector (local to this file) A->0001 C->0010 G->0100 T->1000 */
 void initialize_char2bit_table (void);
 
@@ -494,57 +519,96 @@ read_assumptions_nexus_sequence (char *line, alignment align)
 void
 alignment_create_sitepattern (alignment align)
 {
-  /* faster version: whenever we find a duplicate, we swap the column with the last one; even with this extra copying we
-   * have O(nchar * ln(nchar)) comparisions */
-  int s1, s2, seq, *index, nchar = align->nchar;
-  bool equal;
+  /* columns are hashed (in parallel, one block of columns per thread at a time) and sorted by hash, s.t. identical columns
+   * are neighbours; columns with the same hash are then compared to resolve collisions. O(nchar * ln(nchar)) */
+  int i, j, k, s, seq, n_run = 0, npat = 0, nchar = align->nchar, ntax = align->ntax, *run, *rep;
+  char **str = align->character->string;
+  site_column_hash *col;
 
   /* only aligned sequences have vector site_pattern (if one needs original pattern at position */
   align->site_pattern = (int *) biomcmc_malloc (nchar * sizeof (int));
-  index = (int *) biomcmc_malloc (nchar * sizeof (int)); 
+  col = (site_column_hash*) biomcmc_malloc (nchar * sizeof (site_column_hash));
+  rep = (int *) biomcmc_malloc (nchar * sizeof (int)); /* representative (first) column with same pattern */
+  run = (int *) biomcmc_malloc ((nchar + 1) * sizeof (int)); /* start of each run of same hash in col[] */
 
-  for (s1=0; s1 < nchar; s1++) index[s1] = align->site_pattern[s1] = s1;
+#ifdef _OPENMP
+#pragma omp parallel shared(col,str,nchar,ntax) private(i,k,s,seq)
+#endif
+  {
+    char *block = (char*) biomcmc_malloc (SITEPATTERN_BLOCK * ntax * sizeof (char)); /* transposed, one column per row */
+#ifdef _OPENMP
+#pragma omp for schedule(static)
+#endif
+    for (i = 0; i < nchar; i += SITEPATTERN_BLOCK) {
+      k = (nchar - i < SITEPATTERN_BLOCK) ? nchar - i : SITEPATTERN_BLOCK;
+      for (seq = 0; seq < ntax; seq++) for (s = 0; s < k; s++) block[s * ntax + seq] = str[seq][i + s];
+      for (s = 0; s < k; s++) {
+        col[i + s].hash = biomcmc_xxh64 (block + s * ntax, (size_t) ntax, 0);
+        col[i + s].col  = i + s;
+      }
+    }
+    free (block);
+  }
 
-  for (s1 = 0; s1 < nchar- 1; s1++) {
-    for (s2 = s1 + 1; s2 < nchar; s2++) {
-      /* compare site columns s1 and s2 for same pattern (=same state for all taxa) */
-      for (equal = true, seq = 0; (equal == true) && (seq < align->ntax); seq++) 
-        if (align->character->string[seq][s1] != align->character->string[seq][s2]) equal = false;
+  qsort (col, nchar, sizeof (site_column_hash), compare_site_column_hash); /* same hash sorted by column */
+  for (i = 0; i < nchar; i++) if (!i || (col[i].hash != col[i-1].hash)) run[n_run++] = i;
+  run[n_run] = nchar;
 
-      if (equal == true) { /* s1 and s2 have identical patterns */
-        align->site_pattern[ index[s2] ] = s1; /* map between compressed (just patterns) and original columns */
-        nchar--;
-        if (s2 < nchar) { /* replace pattern s2 by pattern of last site under analysis */
-          index[s2] = index[nchar];
-          for (seq = 0; seq < align->ntax; seq++) 
-            align->character->string[seq][s2] = align->character->string[seq][nchar];
-        }
-        s2--;/* compare again, since character[][s2] now contains last site */
-      }// if (equalpattern)
-    }// for (s2)
-    /* in some cases (next)idx[s1] = (prev)idx[s2] = idx[nchar] */
-    if (align->site_pattern[ index[s1] ] > s1) align->site_pattern[ index[s1] ] = s1; 
-  }// for (s1)
-  /* in some cases (next)idx[s1] = (prev)idx[s2] = idx[nchar] */
-  if (align->site_pattern[ index[s1] ] > s1) align->site_pattern[ index[s1] ] = s1; 
-
-  align->npat = nchar; /* since char_vector::nchars is obsolete we need to store the number of patterns here */
-
-  if (nchar < align->nchar) { /* we have more than one site column with same pattern */
+  /* a column is a new pattern unless it is equal to a previous representative with same hash */
+#ifdef _OPENMP
+#pragma omp parallel for schedule(dynamic,256) shared(col,rep,run,n_run,align) private(i,j,k)
+#endif
+  for (k = 0; k < n_run; k++) for (i = run[k]; i < run[k+1]; i++) {
+    rep[col[i].col] = col[i].col;
+    for (j = run[k]; j < i; j++) if ((rep[col[j].col] == col[j].col) && alignment_columns_are_equal (align, col[j].col, col[i].col)) {
+      rep[col[i].col] = col[j].col; break;
+    }
+  }
+
+  /* patterns are numbered in order of first appearance, and run[] becomes the original column of each pattern */
+  for (s = 0; s < nchar; s++) {
+    if (rep[s] == s) { run[npat] = s; align->site_pattern[s] = npat++; }
+    else align->site_pattern[s] = align->site_pattern[ rep[s] ];
+  }
+
+  align->npat = npat; /* since char_vector::nchars is obsolete we need to store the number of patterns here */
+
+  if (npat < nchar) { /* we have more than one site column with same pattern */
+#ifdef _OPENMP
+#pragma omp parallel for schedule(dynamic) shared(align,str,run,npat) private(seq,i)
+#endif
     for (seq = 0; seq < align->character->nstrings; seq++) { /* compress char_vector to store only patterns (unique) */
-      align->character->string[seq] = 
-      (char *) biomcmc_realloc ((char*) align->character->string[seq], (nchar + 1) * sizeof (char));
-      align->character->string[seq][nchar] = '\0';
-      align->character->nchars[seq] = (size_t) nchar;
+      for (i = 0; i < npat; i++) str[seq][i] = str[seq][ run[i] ]; /* run[i] >= i */
+      str[seq] = (char *) biomcmc_realloc ((char*) str[seq], (npat + 1) * sizeof (char));
+      str[seq][npat] = '\0';
+      align->character->nchars[seq] = (size_t) npat;
     }
   }
 
   /* calculate frequency of each pattern */
-  align->pattern_freq = (int *) biomcmc_malloc (nchar * sizeof (int)); 
-  for (s1=0; s1 < nchar; s1++) align->pattern_freq[s1] = 0;
-  for (s1=0; s1 < align->nchar; s1++) align->pattern_freq[ align->site_pattern[s1] ]++;
+  align->pattern_freq = (int *) biomcmc_malloc (npat * sizeof (int)); 
+  for (s = 0; s < npat; s++) align->pattern_freq[s] = 0;
+  for (s = 0; s < nchar; s++) align->pattern_freq[ align->site_pattern[s] ]++;
 
-  if (index) free (index);
+  free (col);
+  free (rep);
+  free (run);
+}
+
+int
+compare_site_column_hash (const void *a, const void *b)
+{
+  const site_column_hash *x = (const site_column_hash*) a, *y = (const site_column_hash*) b;
+  if (x->hash != y->hash) return (x->hash < y->hash) ? -1 : 1;
+  return x->col - y->col;
+}
+
+bool
+alignment_columns_are_equal (alignment align, int s1, int s2)
+{
+  int seq;
+  for (seq = 0; seq < align->ntax; seq++) if (align->character->string[seq][s1] != align->character->string[seq][s2]) return false;
+  return true;
 }
 
 void
@@ -699,9 +763,12 @@ distance_matrix
 new_distance_matrix_from_alignment (alignment align)
 {
   distance_matrix dist;
-  int i, j;
-  double result[4], s1 = 0., s2 = 0., jc_proportion, 
-         count = 0., this_r, this_d, delta_d, delta_r; /* online calculation of mean and var */
+  packed_alignment pk;
+  variable_sites vs;
+  distance_moments acc, *thread_acc;
+  int i, I, J, n_tile, tile, n_pairs, n_threads = 1;
+  const int pad = 3; /* moments of distinct threads are more than 64 bytes apart, avoiding false sharing */
+  double result[4], s1 = 0.;
 
   if (!align->is_aligned) biomcmc_error ("pairwise distances can be calculated only for aligned sequences");
   if (align->character->nstrings < 2) biomcmc_error ("must have at least two sequences to calculate distances");
@@ -715,56 +782,108 @@ new_distance_matrix_from_alignment (alignment align)
   for (i=0; i < 4; i++)  s1 += result[i]; 
   for (i=0; i < 4; i++) dist->freq[i] = result[i]/s1; /* we may have roundoff errors */
 
+  /*    Kimura's two-parameter and Jukes-Cantor distances, by tiles of tile x tile sequences s.t. both blocks of packed
+   *    sequences fit in L2 cache; moments of each pair of tiles are accumulated locally and then merged into those of
+   *    the thread, which are merged at the end */
+
+  vs = new_variable_sites_from_alignment (align);
+  pk = new_packed_alignment_from_variable_sites (align, vs); /* bit-parallel, over variable columns only */
+  del_variable_sites (vs); /* kept by pk */
+  if (pk->n_words) tile = DISTANCE_TILE_BYTES / (2 * pk->n_words * PACKED_PLANES * sizeof (uint64_t));
+  else tile = dist->size; /* all columns are constant: no packed sites, and distances come from their counts */
+  if (tile < 1) tile = 1;
+  n_tile = (dist->size + tile - 1) / tile;
+  n_pairs = n_tile * (n_tile + 1) / 2; /* pairs of tiles (I,J) with J <= I */
+#ifdef _OPENMP
+  n_threads = omp_get_max_threads ();
+#endif
+  thread_acc = (distance_moments*) biomcmc_malloc ((size_t) n_threads * pad * sizeof (distance_moments));
+  for (i = 0; i < n_threads; i++) thread_acc[i * pad].count = thread_acc[i * pad].mean_d = thread_acc[i * pad].m2_d = 
+                                  thread_acc[i * pad].mean_r = thread_acc[i * pad].m2_r = thread_acc[i * pad].sum_jc = 0.;
 
-  /*    Kimura's two-parameter distance; result[] will hold partial counts (which will also be used in JC distance) */
-
-  for (i=1; i < dist->size; i++) for (j=0; j < i; j++) {
-    biomcmc_calc_pairwise_distance_K2P (align->character->string[i], align->character->string[j], align->pattern_freq,
-                                align->npat, result);
-
-    jc_proportion = result[0] + result[1]; /* total proportion of differences (ti+tv) used in Jukes-Cantor formula */
-
-    if (jc_proportion) { /* sequences are not identical */
-      /* K2P distance must return real (not complex) numbers */
-      if (result[1] >= (0.5 - EPSLON)) result[1] = 0.5 - EPSLON; /* Q < 1/2 */
-      if ((2*result[0] +result[1]) >= (1. - EPSLON)) result[0] = 0.5 * (1. - result[1] - EPSLON); /* 2P+Q < 1 */
-
-      /* calculation of distance using K2P (also called K80) formula (JMolecEvol 1999, p274; Felsenstein book 2004) */
-      s1 = log (1.- 2.*result[0] - result[1]);
-      s2 = log (1. - 2.* result[1]);
-      dist->d[j][i] = -0.5 * s1 - 0.25 * s2; /* upper triangular matrix will hold K2P pairwise distance */
-
-      /* online mean and variance calculation */
-      count += 1.;
-      this_d = dist->d[j][i];       /* average K2P distance over all sequences */
-      if (s2) this_r = s1/s2 - 0.5; /* average value of ti/tv rate ratio (=alpha/(2*beta) */
-      else this_r = 40;             /* large number (if all subst. are transitions) */
-      delta_d = this_d - dist->mean_K2P_dist; 
-      dist->mean_K2P_dist += delta_d / count; 
-      dist->var_K2P_dist += delta_d * (this_d - dist->mean_K2P_dist); 
-      delta_r = this_r - dist->mean_R;
-      dist->mean_R += delta_r / count;
-      dist->var_R += delta_r * (this_r - dist->mean_R);
-
-      /* calculation of distance using Jukes-Cantor formula (Z. Yang book 2006; Felsenstein book 2004) */
-      if (jc_proportion >= (0.75 - EPSLON)) jc_proportion = 0.75 - EPSLON;
-      s1 = 1. - (4. * jc_proportion)/3.;
-      dist->d[i][j] = -0.75 * log (s1);      /* lower triangular matrix will hold JC pairwise distance*/
-      dist->mean_JC_dist += dist->d[i][j];   /* average JC distance over all sequences */ 
-    }
-
-    else { /* sequences are identical */
-      dist->d[j][i] = dist->d[i][j] = 0.;
-    }
+#ifdef _OPENMP
+#pragma omp parallel for schedule(dynamic,1) shared(dist,pk,thread_acc,tile,n_pairs) private(i,I,J)
+#endif
+  for (i = 0; i < n_pairs; i++) {
+    int j, k, thread = 0;
+    distance_moments local = {0., 0., 0., 0., 0., 0.};
+#ifdef _OPENMP
+    thread = omp_get_thread_num ();
+#endif
+    for (I = 0; (I + 1) * (I + 2) / 2 <= i; I++); /* i-th pair of tiles, row-wise over the lower triangle */
+    J = i - I * (I + 1) / 2;
+    for (j = I * tile; (j < (I + 1) * tile) && (j < dist->size); j++)
+      for (k = J * tile; (k < (J + 1) * tile) && (k < j); k++) distance_matrix_K2P_JC_pair (dist, pk, j, k, &local);
+    distance_moments_merge (thread_acc + thread * pad, &local);
   }
+  del_packed_alignment (pk);
 
-  dist->mean_JC_dist  *=  2./(double)(dist->size * (dist->size-1));
-  dist->var_K2P_dist /= count - 1.; /* online algortihm ... */ 
-  dist->var_R        /= count - 1.; /* ... means are already calculated */
+  acc = thread_acc[0];
+  for (i = 1; i < n_threads; i++) distance_moments_merge (&acc, thread_acc + i * pad);
+  free (thread_acc);
+
+  dist->mean_K2P_dist = acc.mean_d;
+  dist->var_K2P_dist  = acc.m2_d / (acc.count - 1.); /* online algortihm ... */ 
+  dist->mean_R        = acc.mean_r;
+  dist->var_R         = acc.m2_r / (acc.count - 1.); /* ... means are already calculated */
+  dist->mean_JC_dist  = acc.sum_jc * 2./(double)(dist->size * (dist->size-1));
 
   return dist;
 }
 
+void
+distance_matrix_K2P_JC_pair (distance_matrix dist, packed_alignment pk, int i, int j, distance_moments *acc)
+{
+  double result[2], s1, s2, jc_proportion, this_r, this_d, delta_d, delta_r;
+
+  packed_alignment_pairwise_distance_K2P (pk, i, j, result);
+  jc_proportion = result[0] + result[1]; /* total proportion of differences (ti+tv) used in Jukes-Cantor formula */
+
+  if (!jc_proportion) { dist->d[j][i] = dist->d[i][j] = 0.; return; } /* sequences are identical */
+
+  /* K2P distance must return real (not complex) numbers */
+  if (result[1] >= (0.5 - EPSLON)) result[1] = 0.5 - EPSLON; /* Q < 1/2 */
+  if ((2*result[0] +result[1]) >= (1. - EPSLON)) result[0] = 0.5 * (1. - result[1] - EPSLON); /* 2P+Q < 1 */
+
+  /* calculation of distance using K2P (also called K80) formula (JMolecEvol 1999, p274; Felsenstein book 2004) */
+  s1 = log (1.- 2.*result[0] - result[1]);
+  s2 = log (1. - 2.* result[1]);
+  dist->d[j][i] = -0.5 * s1 - 0.25 * s2; /* upper triangular matrix will hold K2P pairwise distance */
+
+  /* online (Welford) mean and variance calculation */
+  acc->count += 1.;
+  this_d = dist->d[j][i];       /* average K2P distance over all sequences */
+  if (s2) this_r = s1/s2 - 0.5; /* average value of ti/tv rate ratio (=alpha/(2*beta) */
+  else this_r = 40;             /* large number (if all subst. are transitions) */
+  delta_d = this_d - acc->mean_d; 
+  acc->mean_d += delta_d / acc->count; 
+  acc->m2_d += delta_d * (this_d - acc->mean_d); 
+  delta_r = this_r - acc->mean_r;
+  acc->mean_r += delta_r / acc->count;
+  acc->m2_r += delta_r * (this_r - acc->mean_r);
+
+  /* calculation of distance using Jukes-Cantor formula (Z. Yang book 2006; Felsenstein book 2004) */
+  if (jc_proportion >= (0.75 - EPSLON)) jc_proportion = 0.75 - EPSLON;
+  s1 = 1. - (4. * jc_proportion)/3.;
+  dist->d[i][j] = -0.75 * log (s1);      /* lower triangular matrix will hold JC pairwise distance*/
+  acc->sum_jc += dist->d[i][j];          /* average JC distance over all sequences */ 
+}
+
+void
+distance_moments_merge (distance_moments *a, distance_moments *b)
+{ /* parallel version of Welford's algorithm (Chan et al. 1979) */
+  double n = a->count + b->count, delta;
+  if (!b->count) return;
+  delta = b->mean_d - a->mean_d;
+  a->mean_d += delta * b->count / n;
+  a->m2_d   += b->m2_d + delta * delta * a->count * b->count / n;
+  delta = b->mean_r - a->mean_r;
+  a->mean_r += delta * b->count / n;
+  a->m2_r   += b->m2_r + delta * delta * a->count * b->count / n;
+  a->sum_jc += b->sum_jc;
+  a->count = n;
+}
+
 void
 calc_empirical_equilibrium_freqs (char *seq, int *pfreq, int nsites, double *result)
 {
@@ -803,6 +922,12 @@ biomcmc_calc_pairwise_distance_K2P (char *s1, char *s2, int *w, int nsites, doub
     result[0] += (double)(pairdist[b1-1][b2-1][0]) * weight; /* number of transitions */
     result[1] += (double)(pairdist[b1-1][b2-1][1]) * weight; /* number of transversions */
   }
+  pairwise_K2P_proportions (result, valid_sites);
+}
+
+void
+pairwise_K2P_proportions (double *result, double valid_sites)
+{
   if (valid_sites) {
     result[0] /= valid_sites; /* result[] now has total counts (per sequence) but we want */ 
     result[1] /= valid_sites; /* fraction per site (between zero and one) */
@@ -812,6 +937,238 @@ biomcmc_calc_pairwise_distance_K2P (char *s1, char *s2, int *w, int nsites, doub
   else result[0] = result[1] = 1.;
 }
 
+double
+pairwise_K2P_distance (double p_ti, double p_tv)
+{ /* K2P distance must return real (not complex) numbers, as in new_distance_matrix_from_alignment() */
+  if (p_tv >= (0.5 - EPSLON)) p_tv = 0.5 - EPSLON; /* Q < 1/2 */
+  if ((2. * p_ti + p_tv) >= (1. - EPSLON)) p_ti = 0.5 * (1. - p_tv - EPSLON); /* 2P+Q < 1 */
+  return -0.5 * log (1. - 2. * p_ti - p_tv) - 0.25 * log (1. - 2. * p_tv);
+}
+
+static inline bool
+pairwise_K2P_distance_exceeds (double p_ti, double p_tv, double max_distance)
+{ /* since x <= -log(1-x) <= x/(1-x), the logarithms are needed only when the distance is close to max_distance */
+  double u = 2. * p_ti + p_tv, v = 2. * p_tv;
+  if ((u < (1. - EPSLON)) && (p_tv < (0.5 - EPSLON))) {
+    if ((p_ti + p_tv) > max_distance) return true;
+    if ((0.5 * u / (1. - u) + 0.25 * v / (1. - v)) <= max_distance) return false;
+  }
+  return (pairwise_K2P_distance (p_ti, p_tv) > max_distance);
+}
+
+bool
+biomcmc_calc_pairwise_distance_K2P_bounded (char *s1, char *s2, int *w, int nsites, double max_distance, double *result)
+{
+  int i, end, b1, b2;
+  double weight = 1., default_w = 1., degeneracy, valid_sites = 0., unseen = 0.;
+  
+  if (char2bit[0][0] == 0xffff) initialize_char2bit_table (); /* translation table between ACGT to 1248 */
+  if (w) for (i = 0; i < nsites; i++) unseen += w[i];
+  else unseen = (double) nsites;
+
+  result[0] = result[1] = 0.;
+  for (i = 0; i < nsites;) {
+    end = (i + PAIRWISE_BOUND_BLOCK < nsites) ? i + PAIRWISE_BOUND_BLOCK : nsites;
+    for (; i < end; i++) { /* same as biomcmc_calc_pairwise_distance_K2P() */
+      b1  = char2bit[ (int)s1[i] ][0]; b2  = char2bit[ (int)s2[i] ][0];
+      degeneracy  = (double) (char2bit[ (int)s1[i] ][1] *  char2bit[ (int)s2[i] ][1]);
+      if (w) default_w = w[i];
+      unseen -= default_w;
+      if (!degeneracy) continue; 
+      weight = default_w / degeneracy;
+      valid_sites += default_w;
+      result[0] += (double)(pairdist[b1-1][b2-1][0]) * weight; /* number of transitions */
+      result[1] += (double)(pairdist[b1-1][b2-1][1]) * weight; /* number of transversions */
+    }
+    /* distance increases with both proportions, which are at least the current counts over all sites that may be valid */
+    if ((i < nsites) && pairwise_K2P_distance_exceeds (result[0] / (valid_sites + unseen), result[1] / (valid_sites + unseen), max_distance)) {
+      result[0] /= (valid_sites + unseen);
+      result[1] /= (valid_sites + unseen);
+      return false;
+    }
+  }
+  pairwise_K2P_proportions (result, valid_sites);
+  return !pairwise_K2P_distance_exceeds (result[0], result[1], max_distance);
+}
+
+bool
+biomcmc_pairwise_score_matches_bounded (char *s1, char *s2, int nsites, int max_incompatible, double *result)
+{
+  int i, end, b1, b2, d1, d2, valid, equal, compat, r_acgt = 0, r_exact = 0, r_partial = 0, n_valid = 0;
+  double wcompat = 0.; 
+  if (char2bit[0][0] == 0xffff) initialize_char2bit_table (); /* translation table between ACGT to 1248 */
+
+  for (i = 0; i < nsites;) {
+    end = (i + PAIRWISE_BOUND_BLOCK < nsites) ? i + PAIRWISE_BOUND_BLOCK : nsites;
+    for (; i < end; i++) { /* as biomcmc_pairwise_score_matches(), but without branches */
+      b1 = char2bit[ (int)s1[i] ][0]; b2 = char2bit[ (int)s2[i] ][0];
+      d1 = char2bit[ (int)s1[i] ][1]; d2 = char2bit[ (int)s2[i] ][1]; // degeneracy
+      valid  = ((d1 & 3) > 0) & ((d2 & 3) > 0); // neither is 0 ("-") or 4 ("N")
+      equal  = valid & (b1 == b2);
+      compat = valid & ((b1 & b2) > 0);
+      r_exact   += equal;
+      r_acgt    += equal & ((d1 & d2) == 1);
+      r_partial += compat;
+      wcompat   += (compat ? (1./(double)(d1 * d2)) : 0.);
+      n_valid   += valid;
+    }
+    if ((n_valid - r_acgt) > max_incompatible) break;
+  }
+  /* from more strict to more lax */
+  *(result) = (double)(r_acgt);  // ACGT only matches
+  *(result+1) = (double)(r_exact); // text matches (B<->B etc) 
+  *(result+2) = wcompat; // weighted compatible ( W<->W not a 100% match but 25%)  
+  *(result+3) = (double)(r_partial); // compatible (e.g. W<->A)
+  *(result+4) = (double)(n_valid); 
+  return ((n_valid - r_acgt) <= max_incompatible);
+}
+
+variable_sites
+new_variable_sites_from_alignment (alignment align)
+{
+  int i, j, k, c, d, n_seq = align->character->nstrings;
+  char **str = align->character->string;
+  bool *is_var;
+  variable_sites vs;
+
+  if (char2bit[0][0] == 0xffff) initialize_char2bit_table (); /* translation table between ACGT to 1248 */
+  vs = (variable_sites) biomcmc_malloc (sizeof (struct variable_sites_struct));
+  vs->ref_counter = 1;
+  vs->n_col = (align->pattern_freq ? align->npat : align->nchar);
+  for (i = 0; i < n_seq; i++) if (align->character->nchars[i] != (size_t) vs->n_col) 
+    biomcmc_error ("variable sites need aligned sequences, but sequence %d has %d sites instead of %d", i+1, (int) align->character->nchars[i], vs->n_col);
+
+  /* row-wise comparison with first sequence, over blocks of columns */
+  is_var = (bool*) biomcmc_malloc (vs->n_col * sizeof (bool));
+#ifdef _OPENMP
+#pragma omp parallel for schedule(static) shared(vs,str,is_var,n_seq) private(i,j,k)
+#endif
+  for (j = 0; j < vs->n_col; j += VARIABLE_SITES_BLOCK) {
+    int end = ((vs->n_col - j) < VARIABLE_SITES_BLOCK) ? vs->n_col : j + VARIABLE_SITES_BLOCK;
+    for (k = j; k < end; k++) is_var[k] = false;
+    for (i = 1; i < n_seq; i++) for (k = j; k < end; k++) is_var[k] |= (str[i][k] != str[0][k]);
+  }
+
+  for (vs->n_var = 0, k = 0; k < vs->n_col; k++) if (is_var[k]) vs->n_var++;
+  vs->idx  = (size_t*) biomcmc_malloc ((vs->n_var + 1) * sizeof (size_t));
+  vs->freq = (int*) biomcmc_malloc ((vs->n_var + 1) * sizeof (int));
+  for (c = 0; c < 16; c++) vs->mono_freq[c] = 0;
+  vs->mono_indel = 0;
+  for (i = 0, k = 0; k < vs->n_col; k++) {
+    j = (align->pattern_freq ? align->pattern_freq[k] : 1);
+    if (is_var[k]) { vs->idx[i] = (size_t) k; vs->freq[i++] = j; }
+    else if (char2bit[(int) str[0][k]][1]) vs->mono_freq[ char2bit[(int) str[0][k]][0] ] += j;
+    else vs->mono_indel += j;
+  }
+  free (is_var);
+
+  /* constant columns contribute the same to every pair (the degeneracy is the number of states in the IUPAC code) */
+  for (i = 0; i < 3; i++) vs->mono_K2P[i] = 0.;
+  for (i = 0; i < 5; i++) vs->mono_score[i] = 0.;
+  for (c = 1; c < 16; c++) if (vs->mono_freq[c]) {
+    for (d = 0, i = 0; i < 4; i++) d += (c >> i) & 1;
+    vs->mono_K2P[0] += (double)(pairdist[c-1][c-1][0] * vs->mono_freq[c]) / (double) (d * d);
+    vs->mono_K2P[1] += (double)(pairdist[c-1][c-1][1] * vs->mono_freq[c]) / (double) (d * d);
+    vs->mono_K2P[2] += (double) vs->mono_freq[c];
+    if (!(d & 3)) continue; /* N, not considered by biomcmc_pairwise_score_matches() */
+    if (d == 1) vs->mono_score[0] += (double) vs->mono_freq[c];
+    vs->mono_score[1] += (double) vs->mono_freq[c];
+    vs->mono_score[2] += (double) vs->mono_freq[c] / (double) (d * d);
+    vs->mono_score[3] += (double) vs->mono_freq[c];
+    vs->mono_score[4] += (double) vs->mono_freq[c];
+  }
+  return vs;
+}
+
+void
+del_variable_sites (variable_sites vs)
+{
+  if (!vs) return;
+  if (--vs->ref_counter) return;
+  if (vs->freq) free (vs->freq);
+  if (vs->idx)  free (vs->idx);
+  free (vs);
+}
+
+void
+biomcmc_calc_pairwise_distance_K2P_variable_sites (char *s1, char *s2, variable_sites vs, double *result)
+{
+  int i, b1, b2;
+  size_t k;
+  double weight, degeneracy, valid_sites = vs->mono_K2P[2];
+
+  if (char2bit[0][0] == 0xffff) initialize_char2bit_table (); /* translation table between ACGT to 1248 */
+  result[0] = vs->mono_K2P[0];
+  result[1] = vs->mono_K2P[1];
+  for (i = 0; i < vs->n_var; i++) {
+    k = vs->idx[i];
+    b1 = char2bit[ (int)s1[k] ][0]; b2 = char2bit[ (int)s2[k] ][0];
+    degeneracy = (double) (char2bit[ (int)s1[k] ][1] *  char2bit[ (int)s2[k] ][1]);
+    if (!degeneracy) continue; /* indels */
+    weight = (double) vs->freq[i] / degeneracy;
+    valid_sites += (double) vs->freq[i];
+    result[0] += (double)(pairdist[b1-1][b2-1][0]) * weight; /* number of transitions */
+    result[1] += (double)(pairdist[b1-1][b2-1][1]) * weight; /* number of transversions */
+  }
+  pairwise_K2P_proportions (result, valid_sites);
+}
+
+void
+biomcmc_pairwise_score_matches_variable_sites (char *s1, char *s2, variable_sites vs, double *result)
+{
+  int i, b1, b2, d1, d2;
+  size_t k;
+  double w;
+
+  if (char2bit[0][0] == 0xffff) initialize_char2bit_table (); /* translation table between ACGT to 1248 */
+  for (i = 0; i < 5; i++) result[i] = vs->mono_score[i];
+  for (i = 0; i < vs->n_var; i++) {
+    k = vs->idx[i];
+    b1 = char2bit[ (int)s1[k] ][0]; b2 = char2bit[ (int)s2[k] ][0];
+    d1 = char2bit[ (int)s1[k] ][1]; d2 = char2bit[ (int)s2[k] ][1]; // degeneracy
+    if (!(d1 & 3) || !(d2 & 3)) continue; // one of them is 0 ("-") or 4 ("N")
+    w = (double) vs->freq[i];
+    if (b1 == b2) {
+      result[1] += w; // exact matches
+      if ((d1 & d2) == 1) result[0] += w; // ACGT matches
+    }
+    if (b1 & b2) {
+      result[2] += w / (double)(d1 * d2); // weighted compatible
+      result[3] += w; // compatible
+    }
+    result[4] += w;
+  }
+}
+
+void  
+biomcmc_pairwise_score_matches_truncated_variable_sites (char *s1, char *s2, variable_sites vs, int max_incompatible, int *result)
+{ // as biomcmc_pairwise_score_matches_truncated_idx(), but starting from constant columns (which are compatible or not, for all pairs)
+  int i, b1, b2, d1, d2, w;
+  int r_acgt = (int) vs->mono_score[0], r_exact = (int) vs->mono_score[1], r_partial = (int) vs->mono_score[3], n_valid = (int) vs->mono_score[4];
+  size_t k;
+
+  if (char2bit[0][0] == 0xffff) initialize_char2bit_table (); /* translation table between ACGT to 1248 */
+  if (max_incompatible < 1) max_incompatible = 1; // equiv to stop whenever not identical 
+
+  for (i = 0; (i < vs->n_var) && ((n_valid - r_acgt) < max_incompatible); i++) {
+    k = vs->idx[i];
+    b1 = char2bit[ (int)s1[k] ][0]; b2 = char2bit[ (int)s2[k] ][0];
+    d1 = char2bit[ (int)s1[k] ][1]; d2 = char2bit[ (int)s2[k] ][1]; // degeneracy
+    if (!(d1 & 3) || !(d2 & 3)) continue; // one of them is 0 ("-") or 4 ("N")
+    w = vs->freq[i];
+    if (b1 == b2) {
+      r_exact += w;
+      if ((d1 & d2) == 1) r_acgt += w;
+    }
+    r_partial += (((b1&b2) > 0)  ? w : 0);
+    n_valid += w;
+  }
+  result[0] = r_acgt;
+  result[1] = r_exact;
+  result[2] = r_partial;
+  result[3] = n_valid; 
+}
+
 void  // simplified version just to find number of matches considering ambiguous sites
 biomcmc_pairwise_score_matches (char *s1, char *s2, int nsites, double *result)
 {
@@ -883,6 +1240,271 @@ biomcmc_pairwise_score_matches_truncated_idx (char *s1, char *s2, int nsites, in
   return; 
 }
 
+packed_alignment
+new_packed_alignment_from_alignment (alignment align)
+{
+  return new_packed_alignment_from_variable_sites (align, NULL);
+}
+
+packed_alignment
+new_packed_alignment_from_variable_sites (alignment align, variable_sites vs)
+{
+  int i, k, w, c;
+  uint64_t *x, b;
+  packed_alignment pk;
+  empfreq ef;
+
+  if (!vs && (!align->is_aligned || !align->pattern_freq)) biomcmc_error ("only aligned sequences (with site patterns) can be packed");
+  if (char2bit[0][0] == 0xffff) initialize_char2bit_table (); /* translation table between ACGT to 1248 */
+  pk = (packed_alignment) biomcmc_malloc (sizeof (struct packed_alignment_struct));
+  pk->ntax = align->character->nstrings;
+  pk->npat = (vs ? vs->n_var : align->npat);
+  pk->n_words = (pk->npat + 63) / 64;
+  pk->ref_counter = 1;
+  pk->vs = vs;
+  if (vs) vs->ref_counter++;
+  pk->bits      = (uint64_t**) biomcmc_malloc (pk->ntax * sizeof (uint64_t*));
+  pk->freq      = (int*) biomcmc_malloc ((pk->n_words * 64 + 1) * sizeof (int));
+  pk->pattern   = (int*) biomcmc_malloc ((pk->npat + 1) * sizeof (int));
+  pk->word_freq = (int*) biomcmc_malloc ((pk->n_words + 1) * sizeof (int));
+  pk->cum_freq  = (int64_t*) biomcmc_malloc ((pk->n_words + 1) * sizeof (int64_t));
+
+  ef = new_empfreq_sort_decreasing ((vs ? vs->freq : align->pattern_freq), pk->npat, 2); /* type 2 = int */
+  for (k = 0; k < pk->npat; k++) {
+    pk->pattern[k] = (vs ? (int) vs->idx[ ef->i[k].idx ] : ef->i[k].idx);
+    pk->freq[k] = ef->i[k].freq;
+  }
+  for (; k < pk->n_words * 64; k++) pk->freq[k] = 0; /* padding, never valid */
+  del_empfreq (ef);
+  for (w = 0; w < pk->n_words; w++) {
+    pk->word_freq[w] = pk->freq[64 * w];
+    for (k = 64 * w + 1; (k < 64 * (w + 1)) && (k < pk->npat); k++) if (pk->freq[k] != pk->word_freq[w]) pk->word_freq[w] = -1;
+  }
+  pk->cum_freq[0] = 0;
+  for (w = 0; w < pk->n_words; w++) for (pk->cum_freq[w+1] = pk->cum_freq[w], k = 64 * w; k < 64 * (w + 1); k++) pk->cum_freq[w+1] += pk->freq[k];
+
+#ifdef _OPENMP
+#pragma omp parallel for schedule(dynamic,16) shared(align,pk) private(i,k,c,x,b)
+#endif
+  for (i = 0; i < pk->ntax; i++) {
+    x = pk->bits[i] = (uint64_t*) biomcmc_malloc (pk->n_words * PACKED_PLANES * sizeof (uint64_t));
+    for (k = 0; k < pk->n_words * PACKED_PLANES; k++) x[k] = 0ULL;
+    for (k = 0; k < pk->npat; k++) {
+      c = (int) align->character->string[i][ pk->pattern[k] ];
+      if (!char2bit[c][1]) continue; /* indel (or illegal char) */
+      b = 1ULL << (k & 63);
+      x = pk->bits[i] + (k >> 6) * PACKED_PLANES;
+      if (char2bit[c][0] & 1) x[0] |= b;
+      if (char2bit[c][0] & 2) x[1] |= b;
+      if (char2bit[c][0] & 4) x[2] |= b;
+      if (char2bit[c][0] & 8) x[3] |= b;
+      if (char2bit[c][1] == 1) x[4] |= b;
+      x[5] |= b;
+    }
+  }
+  return pk;
+}
+
+void
+del_packed_alignment (packed_alignment pk)
+{
+  int i;
+  if (!pk) return;
+  if (--pk->ref_counter) return;
+  if (pk->bits) {
+    for (i = pk->ntax - 1; i >= 0; i--) if (pk->bits[i]) free (pk->bits[i]);
+    free (pk->bits);
+  }
+  if (pk->cum_freq)  free (pk->cum_freq);
+  if (pk->word_freq) free (pk->word_freq);
+  if (pk->pattern)   free (pk->pattern);
+  if (pk->freq)      free (pk->freq);
+  del_variable_sites (pk->vs);
+  free (pk);
+}
+
+static inline int
+packed_popcount (uint64_t x)
+{
+#if defined(__GNUC__) || defined(__clang__)
+  return __builtin_popcountll (x);
+#else
+  x -= (x >> 1) & 0x5555555555555555ULL;
+  x = (x & 0x3333333333333333ULL) + ((x >> 2) & 0x3333333333333333ULL);
+  x = (x + (x >> 4)) & 0x0f0f0f0f0f0f0f0fULL;
+  return (int) ((x * 0x0101010101010101ULL) >> 56);
+#endif
+}
+
+/* IUPAC code (A=1, C=2, G=4, T=8) of site s of a word */
+#define packed_site_state(x,s) ((int) ((((x)[0] >> (s)) & 1) | ((((x)[1] >> (s)) & 1) << 1) | ((((x)[2] >> (s)) & 1) << 2) | ((((x)[3] >> (s)) & 1) << 3)))
+
+/* sum of frequencies of the sites set in mask, from word w */
+static inline int64_t
+packed_weighted_count (packed_alignment pk, int w, uint64_t mask)
+{
+  int64_t count = 0;
+  if (pk->word_freq[w] >= 0) return (int64_t) pk->word_freq[w] * packed_popcount (mask);
+  for (; mask; mask &= mask - 1) count += pk->freq[64 * w + packed_popcount ((mask & -mask) - 1)];
+  return count;
+}
+
+/* if max_distance < DBL_MAX, returns false as soon as the distance is larger, with lower bounds of the proportions */
+static inline bool
+packed_pairwise_distance_K2P_kernel (packed_alignment pk, uint64_t *x, uint64_t *y, double max_distance, double *result)
+{
+  int w, end, s, b1, b2;
+  int64_t n_ti = 0, n_tv = 0, n_valid = 0;
+  double amb_ti = 0., amb_tv = 0., weight, mono[3] = {0., 0., 0.};
+  uint64_t valid, both, amb;
+
+  if (pk->vs) for (w = 0; w < 3; w++) mono[w] = pk->vs->mono_K2P[w]; /* constant columns, not packed */
+  for (w = 0; w < pk->n_words;) {
+    end = (w + PAIRWISE_BOUND_BLOCK/64 < pk->n_words) ? w + PAIRWISE_BOUND_BLOCK/64 : pk->n_words;
+    for (; w < end; w++, x += PACKED_PLANES, y += PACKED_PLANES) {
+      if (!(valid = x[5] & y[5])) continue;
+      both = x[4] & y[4]; /* both unambiguous: transitions are A<->G and C<->T, and transversions purine<->pyrimidine */
+      n_valid += packed_weighted_count (pk, w, valid);
+      n_ti += packed_weighted_count (pk, w, ((x[0] & y[2]) | (x[2] & y[0]) | (x[1] & y[3]) | (x[3] & y[1])) & both);
+      n_tv += packed_weighted_count (pk, w, (((x[0] | x[2]) & (y[1] | y[3])) | ((x[1] | x[3]) & (y[0] | y[2]))) & both);
+      for (amb = valid & ~both; amb; amb &= amb - 1) { /* ambiguous sites, as in biomcmc_calc_pairwise_distance_K2P() */
+        s = packed_popcount ((amb & -amb) - 1);
+        b1 = packed_site_state (x, s);
+        b2 = packed_site_state (y, s);
+        weight = (double) pk->freq[64 * w + s] / (double) (packed_popcount (b1) * packed_popcount (b2));
+        amb_ti += (double)(pairdist[b1-1][b2-1][0]) * weight;
+        amb_tv += (double)(pairdist[b1-1][b2-1][1]) * weight;
+      }
+    }
+    if ((max_distance < DBL_MAX) && (w < pk->n_words)) { /* proportions are at least the counts over all sites that may be valid */
+      weight = (double) (n_valid + pk->cum_freq[pk->n_words] - pk->cum_freq[w]) + mono[2];
+      result[0] = ((double) n_ti + amb_ti + mono[0]) / weight;
+      result[1] = ((double) n_tv + amb_tv + mono[1]) / weight;
+      if (pairwise_K2P_distance_exceeds (result[0], result[1], max_distance)) return false;
+    }
+  }
+  result[0] = (double) n_ti + amb_ti;
+  result[1] = (double) n_tv + amb_tv;
+  if (pk->vs) {
+    result[0] += mono[0];
+    result[1] += mono[1];
+    pairwise_K2P_proportions (result, (double) n_valid + mono[2]);
+  }
+  else pairwise_K2P_proportions (result, (double) n_valid);
+  return ((max_distance == DBL_MAX) || !pairwise_K2P_distance_exceeds (result[0], result[1], max_distance));
+}
+
+/* if max_incompatible < DBL_MAX, stops after the block where incompatible sites (n_valid - r_acgt) exceed it */
+static inline bool
+packed_pairwise_score_matches_kernel (packed_alignment pk, uint64_t *x, uint64_t *y, double max_incompatible, double *result)
+{
+  int w, end, s, b1, b2;
+  int64_t r_acgt = 0, r_exact = 0, r_partial = 0, n_valid = 0;
+  double wcompat = 0., mono_incompatible = 0.;
+  uint64_t valid, equal, compat, amb;
+
+  if (pk->vs) mono_incompatible = pk->vs->mono_score[4] - pk->vs->mono_score[0];
+  for (w = 0; w < pk->n_words;) {
+    end = (w + PAIRWISE_BOUND_BLOCK/64 < pk->n_words) ? w + PAIRWISE_BOUND_BLOCK/64 : pk->n_words;
+    for (; w < end; w++, x += PACKED_PLANES, y += PACKED_PLANES) {
+      /* sites where neither is an indel nor N */
+      valid = x[5] & y[5] & ~(x[0] & x[1] & x[2] & x[3]) & ~(y[0] & y[1] & y[2] & y[3]); 
+      if (!valid) continue;
+      equal  = ~((x[0] ^ y[0]) | (x[1] ^ y[1]) | (x[2] ^ y[2]) | (x[3] ^ y[3])) & valid;
+      compat = ((x[0] & y[0]) | (x[1] & y[1]) | (x[2] & y[2]) | (x[3] & y[3])) & valid;
+      n_valid   += packed_weighted_count (pk, w, valid);
+      r_exact   += packed_weighted_count (pk, w, equal);
+      r_acgt    += packed_weighted_count (pk, w, equal & x[4]);
+      r_partial += packed_weighted_count (pk, w, compat);
+      wcompat   += (double) packed_weighted_count (pk, w, compat & x[4] & y[4]);
+      for (amb = compat & ~(x[4] & y[4]); amb; amb &= amb - 1) { /* partial matches */
+        s = packed_popcount ((amb & -amb) - 1);
+        b1 = packed_site_state (x, s);
+        b2 = packed_site_state (y, s);
+        wcompat += (double) pk->freq[64 * w + s] / (double) (packed_popcount (b1) * packed_popcount (b2));
+      }
+    }
+    if ((double) (n_valid - r_acgt) + mono_incompatible > max_incompatible) break;
+  }
+  result[0] = (double) r_acgt;
+  result[1] = (double) r_exact;
+  result[2] = wcompat;
+  result[3] = (double) r_partial;
+  result[4] = (double) n_valid;
+  if (pk->vs) for (w = 0; w < 5; w++) result[w] += pk->vs->mono_score[w]; /* constant columns, not packed */
+  return (result[4] - result[0] <= max_incompatible);
+}
+
+#if !defined(BIOMCMC_NO_SIMD) && (defined(__x86_64__) || defined(__i386__)) && (defined(__GNUC__) || defined(__clang__))
+#define BIOMCMC_X86_POPCNT
+/* same kernels compiled with the popcnt instruction, chosen at runtime */
+__attribute__((target("popcnt"))) static bool
+packed_pairwise_distance_K2P_popcnt (packed_alignment pk, uint64_t *x, uint64_t *y, double max_distance, double *result)
+{ return packed_pairwise_distance_K2P_kernel (pk, x, y, max_distance, result); }
+
+__attribute__((target("popcnt"))) static bool
+packed_pairwise_score_matches_popcnt (packed_alignment pk, uint64_t *x, uint64_t *y, double max_incompatible, double *result)
+{ return packed_pairwise_score_matches_kernel (pk, x, y, max_incompatible, result); }
+#endif
+
+void
+packed_alignment_pairwise_distance_K2P (packed_alignment pk, int i, int j, double *result)
+{
+  packed_alignment_pairwise_distance_K2P_bounded (pk, i, j, DBL_MAX, result);
+}
+
+void
+packed_alignment_pairwise_score_matches (packed_alignment pk, int i, int j, double *result)
+{
+  packed_alignment_pairwise_score_matches_bounded (pk, i, j, DBL_MAX, result);
+}
+
+bool
+packed_alignment_pairwise_distance_K2P_bounded (packed_alignment pk, int i, int j, double max_distance, double *result)
+{
+#ifdef BIOMCMC_X86_POPCNT
+  if (__builtin_cpu_supports ("popcnt")) return packed_pairwise_distance_K2P_popcnt (pk, pk->bits[i], pk->bits[j], max_distance, result);
+#endif
+  return packed_pairwise_distance_K2P_kernel (pk, pk->bits[i], pk->bits[j], max_distance, result);
+}
+
+bool
+packed_alignment_pairwise_score_matches_bounded (packed_alignment pk, int i, int j, double max_incompatible, double *result)
+{
+#ifdef BIOMCMC_X86_POPCNT
+  if (__builtin_cpu_supports ("popcnt")) return packed_pairwise_score_matches_popcnt (pk, pk->bits[i], pk->bits[j], max_incompatible, result);
+#endif
+  return packed_pairwise_score_matches_kernel (pk, pk->bits[i], pk->bits[j], max_incompatible, result);
+}
+
+void
+packed_alignment_K2P_distance_generator (void *data, int i, int j, double *result)
+{
+  packed_alignment_K2P_distance_generator_bounded (data, i, j, DBL_MAX, result);
+}
+
+void
+packed_alignment_K2P_distance_generator_bounded (void *data, int i, int j, double threshold, double *result)
+{
+  double prop[2];
+  packed_alignment_pairwise_distance_K2P_bounded ((packed_alignment) data, i, j, threshold, prop);
+  result[0] = pairwise_K2P_distance (prop[0], prop[1]); /* lower bound (but above threshold) if stopped early */
+}
+
+void
+packed_alignment_mismatch_distance_generator (void *data, int i, int j, double *result)
+{
+  packed_alignment_mismatch_distance_generator_bounded (data, i, j, DBL_MAX, result);
+}
+
+void
+packed_alignment_mismatch_distance_generator_bounded (void *data, int i, int j, double threshold, double *result)
+{
+  double score[5];
+  packed_alignment_pairwise_score_matches_bounded ((packed_alignment) data, i, j, threshold, score);
+  result[0] = score[4] - score[0];
+}
+
 void
 biomcmc_count_sequence_acgt (char *s1, int nsites, double *result)
 {
@@ -956,3 +1578,40 @@ store_likelihood_info_at_leaf (double **l, char *align, int n_pat, int n_state)
   for (j = 0; j < n_pat; j++) for (i=0; i < n_state; i++)
     if (char2bit[ (int)align[j] ][0] & (1 << i)) l[j][i] = 1.;
 }
+
+void
+store_tip_states_at_leaf (uint8_t *tip, char *align, int *pattern, int n_pat)
+{
+  int j; /*the calling function should check if char2bit is initialized or not... */ 
+  if (pattern) for (j = 0; j < n_pat; j++) tip[j] = (uint8_t) (char2bit[ (int)align[pattern[j]] ][0] & 0xf);
+  else         for (j = 0; j < n_pat; j++) tip[j] = (uint8_t) (char2bit[ (int)align[j] ][0] & 0xf);
+}
+
+int
+alignment_charset_patterns (alignment align, int charset, int *pattern, int *freq)
+{
+  int i, s, p, n_pat = 0, *idx;
+  bool *in_charset = NULL;
+
+  if (!align->site_pattern) biomcmc_error ("alignment was not compacted into site patterns");
+  if (charset >= align->n_charset) biomcmc_error ("CHARSET %d requested but alignment has only %d", charset + 1, align->n_charset);
+  idx = (int*) biomcmc_malloc (align->npat * sizeof (int)); /* pattern index within the charset, or -1 if absent */
+  for (i = 0; i < align->npat; i++) idx[i] = -1;
+
+  if (charset < 0) { /* sites not covered by any CHARSET (i.e. all sites if there is no ASSUMPTIONS block) */
+    in_charset = (bool*) biomcmc_malloc (align->nchar * sizeof (bool));
+    for (s = 0; s < align->nchar; s++) in_charset[s] = false;
+    for (i = 0; i < align->n_charset; i++) for (s = align->charset_start[i]; s <= align->charset_end[i]; s++) in_charset[s] = true;
+  }
+
+  for (s = ((charset < 0) ? 0 : align->charset_start[charset]); s <= ((charset < 0) ? align->nchar - 1 : align->charset_end[charset]); s++) {
+    if (in_charset && in_charset[s]) continue;
+    p = align->site_pattern[s];
+    if (idx[p] < 0) { idx[p] = n_pat; pattern[n_pat] = p; freq[n_pat++] = 0; }
+    freq[idx[p]]++;
+  }
+
+  if (in_charset) free (in_charset);
+  free (idx);
+  return n_pat;
+}
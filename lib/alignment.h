@@ -27,6 +27,10 @@
 #include "nexus_common.h"
 
 typedef struct alignment_struct* alignment;
+typedef struct packed_alignment_struct* packed_alignment;
+typedef struct variable_sites_struct* variable_sites;
+
+#define PACKED_PLANES 6 /*!< \brief bitmasks per word of 64 sites: A, C, G, T (IUPAC code), unambiguous and valid (not indel) */
 
 /*! \brief Data from alignment file. */
 struct alignment_struct
@@ -45,6 +49,42 @@ struct alignment_struct
   int ref_counter;
 };
 
+/*! \brief Aligned sequences as bitmasks over sites, for bit-parallel pairwise comparisons (64 sites per word operation).
+ *
+ * Each base of the 4-bit IUPAC code (A=1, C=2, G=4, T=8) is one bit plane, besides a plane of unambiguous sites and one
+ * of valid (non-indel) sites. Sites are the alignment patterns sorted by decreasing frequency, s.t. most words of 64 sites
+ * have the same frequency and weighted counts are one popcount; ambiguous sites are visited one by one. */
+struct packed_alignment_struct
+{
+  int ntax, npat, n_words; /*! \brief number of sequences, of sites (patterns) and of 64-bit words per plane */
+  uint64_t **bits;  /*! \brief PACKED_PLANES consecutive words per 64 sites, for each sequence */
+  int *freq;        /*! \brief frequency of each site (pattern frequency, in packed order) */
+  int *pattern;     /*! \brief pattern (column of alignment_struct::character) of each site */
+  int *word_freq;   /*! \brief frequency shared by all sites of a word, or -1 if they differ */
+  int64_t *cum_freq; /*! \brief sum of frequencies of all sites before each word (cum_freq[n_words] is the total) */
+  variable_sites vs; /*! \brief if not NULL, only its variable columns were packed and constant ones are added as a whole */
+  int ref_counter;
+};
+
+/*! \brief Columns of the aligned sequences where not all sequences have the same character, with their weights, and the
+ * contribution of the constant columns (the same for any pair of sequences) to the pairwise kernels.
+ *
+ * When most columns are constant (e.g. outbreak data) the pairwise functions accepting this view take time proportional
+ * to the number of variable columns. Columns are those of alignment_struct::character (i.e. patterns if compressed). */
+struct variable_sites_struct
+{
+  int n_col, n_var; /*! \brief number of columns, and of variable columns */
+  size_t *idx;      /*! \brief index of each variable column (as used by biomcmc_pairwise_score_matches_truncated_idx()) */
+  int *freq;        /*! \brief weight of each variable column (pattern frequency, or one if alignment is not compressed) */
+  int mono_freq[16];/*! \brief weighted number of constant columns with each IUPAC code (A=1, C=2, G=4, T=8, R=5, N=15 etc.) */
+  int mono_indel;   /*! \brief weighted number of constant columns of indels (or other characters without states) */
+  /*! \brief weighted transitions, transversions and valid sites of the constant columns, as counted by biomcmc_calc_pairwise_distance_K2P() */
+  double mono_K2P[3];
+  /*! \brief contribution of the constant columns to each of the five scores of biomcmc_pairwise_score_matches() */
+  double mono_score[5];
+  int ref_counter;
+};
+
 /*! \brief Reads DNA alignment (guess format between FASTA and NEXUS) from file and store info in alignment_struct. */
 alignment read_alignment_from_file (char *seqfilename);
 /*! \brief Given one char_vector of names and one of sequences (e.g. from GFF3) returns a fasta-like "alignment" */
@@ -63,7 +103,8 @@ void del_alignment (alignment align);
 
 /*! \brief new matrix of pairwise distance by simply excluding original elements not present in valid[] */
 distance_matrix new_distance_matrix_from_valid_matrix_elems (distance_matrix original, int *valid, int n_valid);
-/*! \brief creates and calculates matrix of pairwise distances based on alignment */
+/*! \brief creates and calculates matrix of pairwise distances based on alignment (packed sequences, thus elements are
+ * those of biomcmc_calc_pairwise_distance_K2P() up to rounding) */
 distance_matrix new_distance_matrix_from_alignment (alignment align);
 
 /*! \brief uses Kimura's two-parameter model to calculate distance and ti/tv rate ratio between sequencies */
@@ -72,6 +113,52 @@ void biomcmc_calc_pairwise_distance_K2P (char *s1, char *s2, int *w, int nsites,
 void biomcmc_pairwise_score_matches (char *s1, char *s2, int nsites, double *result);
 /*! \brief find number of matches considering ambiguous sites, using index of polymorphic columns and stopping when partial mismatches exceed threshold. Notice that results[] is distinct from above */
 void biomcmc_pairwise_score_matches_truncated_idx (char *s1, char *s2, int nsites, int max_incompatible, int *result, size_t *idx);
+/*! \brief one pass over the sequences finding the variable columns, their weights and the constant column counts */
+variable_sites new_variable_sites_from_alignment (alignment align);
+void del_variable_sites (variable_sites vs);
+/*! \brief biomcmc_calc_pairwise_distance_K2P() over the variable columns of vs (weighted), plus its constant columns */
+void biomcmc_calc_pairwise_distance_K2P_variable_sites (char *s1, char *s2, variable_sites vs, double *result);
+/*! \brief biomcmc_pairwise_score_matches() over the variable columns of vs (weighted), plus its constant columns */
+void biomcmc_pairwise_score_matches_variable_sites (char *s1, char *s2, variable_sites vs, double *result);
+/*! \brief biomcmc_pairwise_score_matches_truncated_idx() over the variable columns of vs (weighted), starting from the
+ * counts of its constant columns */
+void biomcmc_pairwise_score_matches_truncated_variable_sites (char *s1, char *s2, variable_sites vs, int max_incompatible, int *result);
+/*! \brief biomcmc_calc_pairwise_distance_K2P() checking, at every block of sites, if the K2P distance is already known to
+ * be larger than max_distance. Returns true if distance is not larger than max_distance (and result[] is exact); otherwise
+ * result[] may have only lower bounds of the transition and transversion proportions */
+bool biomcmc_calc_pairwise_distance_K2P_bounded (char *s1, char *s2, int *w, int nsites, double max_distance, double *result);
+/*! \brief biomcmc_pairwise_score_matches() stopping at the first block of sites after which the incompatible sites
+ * (result[4] - result[0]) exceed max_incompatible. Returns false if it stopped (result[] has then the partial counts) */
+bool biomcmc_pairwise_score_matches_bounded (char *s1, char *s2, int nsites, int max_incompatible, double *result);
+/*! \brief K2P distance from proportions of transitions and transversions (result[] of biomcmc_calc_pairwise_distance_K2P()) */
+double pairwise_K2P_distance (double p_ti, double p_tv);
+
+/*! \brief packed (bit plane) copy of the patterns of an aligned alignment, weighted by alignment_struct::pattern_freq */
+packed_alignment new_packed_alignment_from_alignment (alignment align);
+/*! \brief packed copy of the variable columns of vs only (or of all patterns if vs is NULL); the pairwise functions add
+ * the constant columns of vs */
+packed_alignment new_packed_alignment_from_variable_sites (alignment align, variable_sites vs);
+void del_packed_alignment (packed_alignment pk);
+/*! \brief same as biomcmc_calc_pairwise_distance_K2P() between sequences i and j with pattern frequencies as weights, up
+ * to rounding (fractions of ambiguous sites and constant columns are summed in another order) */
+void packed_alignment_pairwise_distance_K2P (packed_alignment pk, int i, int j, double *result);
+/*! \brief same as biomcmc_pairwise_score_matches() between sequences i and j, but with each pattern counted as many times
+ * as its frequency (i.e. over the original sites) */
+void packed_alignment_pairwise_score_matches (packed_alignment pk, int i, int j, double *result);
+/*! \brief packed_alignment_pairwise_distance_K2P() stopping once the distance is known to be larger than max_distance, as
+ * biomcmc_calc_pairwise_distance_K2P_bounded(). Sites are sorted by frequency, thus most of the weight is seen first */
+bool packed_alignment_pairwise_distance_K2P_bounded (packed_alignment pk, int i, int j, double max_distance, double *result);
+/*! \brief packed_alignment_pairwise_score_matches() stopping once the weighted incompatible sites (result[4] - result[0])
+ * exceed max_incompatible, as biomcmc_pairwise_score_matches_bounded() */
+bool packed_alignment_pairwise_score_matches_bounded (packed_alignment pk, int i, int j, double max_incompatible, double *result);
+/*! \brief distance_generator wrappers with a packed_alignment as data, returning its K2P distance (see
+ * distance_generator_set_function_data() and distance_generator_set_bounded_function_data()) */
+void packed_alignment_K2P_distance_generator (void *data, int i, int j, double *result);
+void packed_alignment_K2P_distance_generator_bounded (void *data, int i, int j, double threshold, double *result);
+/*! \brief distance_generator wrappers with a packed_alignment as data, returning the weighted number of incompatible sites
+ * (valid sites without an ACGT match) */
+void packed_alignment_mismatch_distance_generator (void *data, int i, int j, double *result);
+void packed_alignment_mismatch_distance_generator_bounded (void *data, int i, int j, double threshold, double *result);
 /*! \brief proportion of  unambiguous (ACGT), partially ambiguous (RW etc), and completely ambiguous (N? etc) sites */
 void biomcmc_count_sequence_acgt (char *s1, int nsites, double *result);
 
@@ -80,5 +167,15 @@ void biomcmc_count_sequence_acgt (char *s1, int nsites, double *result);
  * 0001, C-> 0010 etc) (e.g. A -> 0001, C-> 0010 etc) (e.g. A -> 0001, C-> 0010 etc) */
 void store_likelihood_info_at_leaf (double **l, char *align, int n_pat, int n_state);
 
+/*! \brief compact version of store_likelihood_info_at_leaf(), with one bitmask (A=1, C=2, G=4, T=8, R=5 etc.) per pattern.
+ * If pattern is not NULL then only columns pattern[0...n_pat-1] of align are used (e.g. one gene segment) */
+void store_tip_states_at_leaf (uint8_t *tip, char *align, int *pattern, int n_pat);
+
+/*! \brief distinct site patterns of one gene segment (CHARSET) as indices of alignment_struct::character columns (pattern[]),
+ * together with their frequencies within the segment (freq[]). Both vectors must have at least alignment_struct::npat
+ * elements, and the number of patterns is returned. If charset is negative, then sites not covered by any CHARSET are
+ * used (all sites if there are no CHARSETs). */
+int alignment_charset_patterns (alignment align, int charset, int *pattern, int *freq);
+
 #endif
 
@@ -29,6 +29,7 @@ extern "C" {
 #include "fortune_cookies.h"
 #include "suffix_tree.h"
 #include "kmerhash.h"
+#include "fasta_index.h"
 #include "parsimony.h"
 #include "genetree.h"
 #include "topology_space.h"
@@ -16,6 +16,7 @@ static void expand_cluster_order (goptics_cluster gop, point *current);
 static void update_results_from_current_point (goptics_cluster gop, point *current);
 static void set_core_dist (goptics_cluster gop, point *current);
 static void order_seeds_update (goptics_cluster gop, point *this);
+static void update_max_distance (goptics_cluster gop, double de, double *max_distance);
 static int compare_edgearray_item_increasing (const void *a, const void *b); 
 edgearray_item* generate_graph (goptics_cluster gop); // cannot declare static (internal linkage) since -Wall would complain
 static void aux_generate_Va_n (goptics_cluster gop, int idx);
@@ -34,6 +35,7 @@ new_goptics_cluster (distance_generator dg, int min_points, double epsilon)
   goptics_cluster gop = (goptics_cluster) biomcmc_malloc (sizeof (struct goptics_cluster_struct));
   gop->d = dg; dg->ref_counter++;
   gop->epsilon = epsilon;
+  distance_generator_set_threshold (dg, epsilon); // farther pairs are never edges (a larger epsilon resets lower bounds)
   if (min_points > dg->n_samples) min_points = dg->n_samples;
   gop->min_points = min_points;
   gop->n_order = 0;
@@ -202,6 +204,13 @@ order_seeds_update (goptics_cluster gop, point *this)
   }
 }
 
+static void
+update_max_distance (goptics_cluster gop, double de, double *max_distance)
+{ // above its threshold a bounded generator may return only a lower bound, thus such pairs count as the threshold itself
+  if (gop->d->bounded_function && (de > gop->d->threshold)) de = gop->d->threshold;
+  if (de > *max_distance) *max_distance = de;
+}
+
 static int 
 compare_edgearray_item_increasing (const void *a, const void *b) 
 {
@@ -221,7 +230,7 @@ generate_graph (goptics_cluster gop)
 
   for(j = 1; j < gop->d->n_samples; j++) for(i = 0; i < j; i++) { // just to find size of edge_array
     de = distance_generator_get (gop->d, i, j);
-    if (de > gop->max_distance) gop->max_distance = de;
+    update_max_distance (gop, de, &gop->max_distance);
     if (de <=  gop->epsilon) gop->num_edges += 2; 
   }
 
@@ -250,13 +259,17 @@ static void
 aux_generate_Va_n (goptics_cluster gop, int idx)
 { // aux function for CPU parallel
   int i;
-  double de;
+  double de, max_distance = -1.;
   gop->Va_n[idx] = 0;
   for(i = 0; i < gop->d->n_samples; ++i) if (idx != i) {
     de = distance_generator_get (gop->d, i, idx);
-    if (de > gop->max_distance) gop->max_distance = de;
+    update_max_distance (gop, de, &max_distance);
     if ( de <=  gop->epsilon) gop->Va_n[idx] += 1;
   }
+#ifdef _OPENMP
+#pragma omp critical (goptics_max_distance)
+#endif
+  if (max_distance > gop->max_distance) gop->max_distance = max_distance; // shared by all threads
 }
 
 edgearray_item* 
@@ -272,7 +285,7 @@ generate_graph_multithread (goptics_cluster gop)
   gop->Va_i[0] = 0;
   gop->num_edges = gop->Va_n[0];
   for(i = 1; i < gop->d->n_samples; i++) {
-    gop->Va_i[i] = gop->Va_i[i-1] + gop->Va_n[i];
+    gop->Va_i[i] = gop->Va_i[i-1] + gop->Va_n[i-1]; // neighbours of i start after those of i-1
     gop->num_edges += gop->Va_n[i];
   }
   Ea = (edgearray_item*) biomcmc_malloc ((sizeof (edgearray_item) * gop->num_edges));
@@ -285,8 +298,7 @@ generate_graph_multithread (goptics_cluster gop)
     double de;
     int pointer = gop->Va_i[idx];
     if (gop->Va_n[idx] > 0) for (j = 0; j < gop->d->n_samples; ++j) if (idx != j) {
-      de = distance_generator_get (gop->d, j, idx); // original has i, idx
-      if (de > gop->max_distance) gop->max_distance = de;
+      de = distance_generator_get (gop->d, j, idx); // original has i, idx (max_distance was found by aux_generate_Va_n())
       if ( de <=  gop->epsilon) {
         Ea[pointer].id = j;
         Ea[pointer].distance = de;
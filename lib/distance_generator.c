@@ -26,6 +26,8 @@ new_distance_generator (int n_samples, int n_distances)
   }
   d->data = NULL;
   d->distance_function = NULL;
+  d->bounded_function = NULL;
+  d->threshold = DBL_MAX;
   d->which_distance = 0;
   d->ref_counter = 1;
   return d;
@@ -59,7 +61,8 @@ distance_generator_get_at_distance (distance_generator d, int i, int j, int whic
   if (j < i) { int tmp = i; i = j; j = tmp; } // upper diagonal: i<j in 2D[i][j] => 1D[j(j-1)/2 + i]
   int idx =  ((j * (j-1)) / 2 + i);
   if (! d->cached[idx]) {
-    d->distance_function (d->data, i, j, d->dist[idx]); // last arg is vector where result distances will go
+    if (d->bounded_function) d->bounded_function (d->data, i, j, d->threshold, d->dist[idx]);
+    else d->distance_function (d->data, i, j, d->dist[idx]); // last arg is vector where result distances will go
     d->cached[idx] = true;
   }
   return d->dist[idx][which_distance];
@@ -69,9 +72,26 @@ void
 distance_generator_set_function_data (distance_generator d, void (*lowlevel_dist_funct)(void*, int, int, double*), void *extra_data)
 {
   d->distance_function = lowlevel_dist_funct; // lowlevel_dist_funct (extra_data, i, j, *results[n_distances])
+  d->bounded_function = NULL;
   d->data = extra_data;
 }
 
+void
+distance_generator_set_bounded_function_data (distance_generator d, void (*lowlevel_dist_funct)(void*, int, int, double, double*), void *extra_data)
+{
+  d->bounded_function = lowlevel_dist_funct; // lowlevel_dist_funct (extra_data, i, j, threshold, *results[n_distances])
+  d->distance_function = NULL;
+  d->data = extra_data;
+}
+
+void
+distance_generator_set_threshold (distance_generator d, double threshold)
+{
+  // cached lower bounds remain valid for a smaller threshold, but a larger one needs them recalculated
+  if (d->bounded_function && (threshold > d->threshold)) distance_generator_reset (d);
+  d->threshold = threshold;
+}
+
 void 
 distance_generator_set_which_distance (distance_generator d, int which_distance)
 {
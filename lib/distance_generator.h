@@ -25,6 +25,8 @@ struct distance_generator_struct
   bool *cached;  // if pair has been calculated or not (we assume all distances for this pair are calculated together)
   void *data;    // extra data (original features, sequences, etc. used by the distance_function() )
   void (*distance_function) (void*, int, int, double*); // defined elsewhere, receives data, i, and j, returns double[]
+  void (*bounded_function) (void*, int, int, double, double*); // as distance_function, but may give up above threshold
+  double threshold; // pairs farther than this may have only a lower bound (above threshold) calculated by bounded_function
   int ref_counter;
 };
 
@@ -38,6 +40,12 @@ void distance_generator_set_function_data (distance_generator d, void (*lowlevel
 /*! \brief distance wrapper may return several distances, but only one is returned by get(); this sets which
  * one (should be called before e.g. clustering) */
 void distance_generator_set_which_distance (distance_generator d, int which_distance);
+/*! \brief like distance_generator_set_function_data(), but wrapper receives the threshold (after j) and may stop once it
+ * knows the distance is larger; it then returns any value above threshold (e.g. a lower bound), which is cached as such.
+ * Threshold is DBL_MAX (i.e. exact distances) unless set by distance_generator_set_threshold() */
+void distance_generator_set_bounded_function_data (distance_generator d, void (*lowlevel_dist_funct)(void*, int, int, double, double*), void *extra_data);
+/*! \brief only distances up to threshold are needed exactly (e.g. GOPTICS epsilon); has effect only with a bounded function */
+void distance_generator_set_threshold (distance_generator d, double threshold);
 void distance_generator_reset (distance_generator d);
 
 #endif
@@ -19,6 +19,7 @@
  */
 
 #include "empirical_frequency.h"
+#include "random_number_gen.h"
 
 int compare_empfreq_element_decreasing (const void *a, const void *b);
 int compare_empfreq_element_increasing (const void *a, const void *b);
@@ -130,6 +131,54 @@ del_empfreq_double (empfreq_double efd)
   free (efd);
 }
 
+bootstrap_weights
+new_bootstrap_weights (int *freq, int n_pat, int n_rep, uint64_t seed)
+{
+  bootstrap_weights bw;
+  int i, j, b, *site_pattern;
+
+  bw = (bootstrap_weights) biomcmc_malloc (sizeof (struct bootstrap_weights_struct));
+  bw->n_rep = n_rep;
+  bw->n_pat = n_pat;
+  bw->ref_counter = 1;
+  for (bw->n_sites = 0, i = 0; i < n_pat; i++) bw->n_sites += freq[i];
+  if ((n_rep < 1) || (bw->n_sites < 1)) biomcmc_error ("bootstrap needs at least one replicate and one site");
+  bw->w      = (int*) biomcmc_malloc ((size_t) n_rep * n_pat * sizeof (int));
+  bw->active = (int*) biomcmc_malloc (n_pat * sizeof (int));
+  /* pattern of each original site, s.t. sampling a site is a single lookup */
+  site_pattern = (int*) biomcmc_malloc (bw->n_sites * sizeof (int));
+  for (j = 0, i = 0; i < n_pat; i++) for (b = 0; b < freq[i]; b++) site_pattern[j++] = i;
+
+#ifdef _OPENMP
+#pragma omp parallel for schedule(static) shared(bw,site_pattern,seed) private(b,i)
+#endif
+  for (b = 0; b < n_rep; b++) {
+    rng_taus_struct r = {{0ULL}, 0}; /* private to the thread, and reseeded for each replicate (seeding uses the initial values) */
+    int *w = bw->w + (size_t) b * bw->n_pat;
+    rng_set_taus (&r, seed + (uint64_t) b, b);
+    for (i = 0; i < bw->n_pat; i++) w[i] = 0;
+    /* 53 most significant bits as a uniform number in [0,1), scaled to the number of sites */
+    for (i = 0; i < bw->n_sites; i++) w[ site_pattern[(int) ((double) (rng_get_taus (&r) >> 11) * 0x1p-53 * bw->n_sites)] ]++;
+  }
+
+  for (bw->n_active = 0, i = 0; i < n_pat; i++) {
+    for (b = 0; (b < n_rep) && !bw->w[(size_t) b * n_pat + i]; b++);
+    if (b < n_rep) bw->active[bw->n_active++] = i;
+  }
+  free (site_pattern);
+  return bw;
+}
+
+void
+del_bootstrap_weights (bootstrap_weights bw)
+{
+  if (!bw) return;
+  if (--bw->ref_counter) return;
+  if (bw->active) free (bw->active);
+  if (bw->w) free (bw->w);
+  free (bw);
+}
+
 empfreq
 new_empfreq_sort_decreasing (void *vec, int n, char type)
 {
@@ -25,6 +25,7 @@
 
 typedef struct empfreq_struct* empfreq;
 typedef struct empfreq_double_struct* empfreq_double;
+typedef struct bootstrap_weights_struct* bootstrap_weights;
 
 typedef struct
 {
@@ -56,6 +57,19 @@ struct empfreq_double_struct
   int ref_counter;
 };
 
+/*! \brief Nonparametric bootstrap replicates of a set of site patterns, as multinomial resamplings of their frequencies
+ * (i.e. without building new alignments) */
+struct bootstrap_weights_struct
+{
+  int n_rep;      /*! \brief number of replicates */
+  int n_pat;      /*! \brief number of patterns (length of each replicate) */
+  int n_sites;    /*! \brief sum of original frequencies, which is also the sum of weights of each replicate */
+  int *w;         /*! \brief weight of pattern i in replicate b is w[b * n_pat + i] */
+  int *active;    /*! \brief patterns with nonzero weight in at least one replicate (the others can be skipped) */
+  int n_active;   /*! \brief number of elements in active[] */
+  int ref_counter;
+};
+
 void sort_empfreq_decreasing (empfreq ef);
 void sort_empfreq_increasing (empfreq ef);
 void sort_empfreq_double_decreasing (empfreq_double efd);
@@ -74,6 +88,11 @@ empfreq_double new_empfreq_double_sort_increasing (double *vec, int n);
 empfreq new_empfreq_from_int (int *vec, int n); // like `sort | uniq` in linux
 empfreq new_empfreq_from_int_weighted (int *vec, int n, int *weight);
 empfreq new_empfreq_merge_empfreqs (empfreq a1, empfreq a2);
+/*! \brief n_rep bootstrap replicates of patterns with frequencies freq[] (sites are sampled with replacement), generated in
+ * parallel. Each replicate has its own random number stream, s.t. the weights depend only on seed and not on the number
+ * of threads */
+bootstrap_weights new_bootstrap_weights (int *freq, int n_pat, int n_rep, uint64_t seed);
+void del_bootstrap_weights (bootstrap_weights bw);
 int find_mode_int (int *vec, int n);
 int find_mode_int_weighted (int *vec, int n, int *weight);
 
@@ -0,0 +1,411 @@
+/* SPDX-License-Identifier: GPL-3.0-or-later
+ *
+ * This file is part of biomcmc-lib, a low-level library for phylogenomic analysis.
+ * Copyright (C) 2019-today  Leonardo de Oliveira Martins [ leomrtns at gmail.com;  http://www.leomartins.org ]
+ *
+ * biomcmc is free software; you can redistribute it and/or modify it under the terms of the GNU General Public
+ * License as published by the Free Software Foundation; either version 2 of the License, or (at your option) any later
+ * version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY; without even the implied
+ * warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details (file "COPYING" or http://www.gnu.org/copyleft/gpl.html).
+ */
+/*! \file
+ *  \brief Memory-mapped FASTA files with a faidx-style index, for random access to sequences.
+ */
+
+#include "fasta_index.h"
+#include <sys/mman.h>
+#include <inttypes.h> /* PRId64 */
+
+/*! \brief new record starting at byte offset, with name given by the first word within the n_name chars of name_start */
+void fasta_index_add_record (fasta_index fai, int *n_alloc, char *name_start, size_t n_name, int64_t offset);
+/*! \brief scans the memory map for the position, length and line widths of each sequence */
+void fasta_index_create_from_map (fasta_index fai);
+/*! \brief reads index file; returns false if it does not exist, is older than the FASTA file, or does not fit the map */
+bool fasta_index_read_index_file (fasta_index fai, char *fainame);
+/*! \brief start of the description line of sequence i (i.e. the '>') */
+char* fasta_index_description_line (fasta_index fai, int i);
+/*! \brief checks if record i of an index read from file is a sequence of the map, with the same name, and followed
+ * by record i+1 (or by the end of file) */
+bool fasta_index_record_fits_map (fasta_index fai, int i);
+/*! \brief saves index file, silently giving up if it cannot be created (e.g. read-only directory) */
+void fasta_index_write_index_file (fasta_index fai, char *fainame);
+/*! \brief length of sequences i and j, which must be the same (aligned) */
+int fasta_index_pair_length (fasta_index fai, int i, int j);
+
+fasta_index
+new_fasta_index_from_file (char *seqfilename)
+{
+  int fd, i;
+  size_t len = strlen (seqfilename);
+  struct stat st;
+  unsigned char *m;
+  char *fainame;
+  fasta_index fai;
+
+  if ((fd = open (seqfilename, O_RDONLY)) < 0) biomcmc_error ("Could not open FASTA file \"%s\" for indexing", seqfilename);
+  if (fstat (fd, &st) || (st.st_size < 1)) biomcmc_error ("FASTA file \"%s\" is empty or could not be read", seqfilename);
+
+  fai = (fasta_index) biomcmc_malloc (sizeof (struct fasta_index_struct));
+  fai->ref_counter = 1;
+  fai->n_seqs = 0;
+  fai->name = new_char_vector (1);
+  fai->name_hash = NULL;
+  fai->offset = fai->length = fai->line_bases = fai->line_width = NULL;
+  fai->seq = NULL;
+  fai->map_size = (size_t) st.st_size;
+  fai->map = (char*) mmap (NULL, fai->map_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close (fd); /* mapping remains valid */
+  if (fai->map == MAP_FAILED) biomcmc_error ("Could not map FASTA file \"%s\" into memory", seqfilename);
+  fai->filename = (char*) biomcmc_malloc ((len + 1) * sizeof (char));
+  memcpy (fai->filename, seqfilename, len + 1);
+
+  m = (unsigned char*) fai->map; /* magic numbers of gzip, bzip2 and xz */
+  if (((fai->map_size > 1) && (m[0] == 0x1f) && (m[1] == 0x8b)) ||
+      ((fai->map_size > 2) && (m[0] == 'B') && (m[1] == 'Z') && (m[2] == 'h')) ||
+      ((fai->map_size > 5) && (m[0] == 0xfd) && !memcmp (m + 1, "7zXZ", 4) && (m[5] == 0)))
+    biomcmc_error ("FASTA file \"%s\" is compressed, and can only be indexed if uncompressed", seqfilename);
+
+  fainame = (char*) biomcmc_malloc ((len + 5) * sizeof (char));
+  memcpy (fainame, seqfilename, len);
+  memcpy (fainame + len, ".fai", 5);
+  if (!fasta_index_read_index_file (fai, fainame)) {
+    fasta_index_create_from_map (fai);
+    fasta_index_write_index_file (fai, fainame);
+  }
+  free (fainame);
+
+  fai->name_hash = new_hashtable (fai->n_seqs);
+  for (i = 0; i < fai->n_seqs; i++) insert_hashtable (fai->name_hash, fai->name->string[i], i);
+  fai->seq = (char**) biomcmc_malloc (fai->n_seqs * sizeof (char*));
+  for (i = 0; i < fai->n_seqs; i++) fai->seq[i] = NULL;
+  return fai;
+}
+
+void
+del_fasta_index (fasta_index fai)
+{
+  int i;
+  if (!fai) return;
+  if (--fai->ref_counter) return;
+  if (fai->seq) { /* views point to the map and are not freed */
+    for (i = 0; i < fai->n_seqs; i++) if (fai->seq[i] && ((fai->seq[i] < fai->map) || (fai->seq[i] >= fai->map + fai->map_size)))
+      free (fai->seq[i]);
+    free (fai->seq);
+  }
+  if (fai->map && (fai->map != MAP_FAILED)) munmap (fai->map, fai->map_size);
+  if (fai->line_width) free (fai->line_width);
+  if (fai->line_bases) free (fai->line_bases);
+  if (fai->length) free (fai->length);
+  if (fai->offset) free (fai->offset);
+  if (fai->filename) free (fai->filename);
+  del_hashtable (fai->name_hash);
+  del_char_vector (fai->name);
+  free (fai);
+}
+
+void
+fasta_index_add_record (fasta_index fai, int *n_alloc, char *name_start, size_t n_name, int64_t offset)
+{
+  char *name;
+  size_t k;
+  int i = fai->n_seqs++;
+
+  if (fai->n_seqs > *n_alloc) {
+    *n_alloc = 2 * fai->n_seqs;
+    fai->offset     = (int64_t*) biomcmc_realloc ((int64_t*) fai->offset,     *n_alloc * sizeof (int64_t));
+    fai->length     = (int64_t*) biomcmc_realloc ((int64_t*) fai->length,     *n_alloc * sizeof (int64_t));
+    fai->line_bases = (int64_t*) biomcmc_realloc ((int64_t*) fai->line_bases, *n_alloc * sizeof (int64_t));
+    fai->line_width = (int64_t*) biomcmc_realloc ((int64_t*) fai->line_width, *n_alloc * sizeof (int64_t));
+  }
+  fai->offset[i] = offset;
+  fai->length[i] = fai->line_bases[i] = fai->line_width[i] = 0;
+
+  for (; n_name && isspace ((unsigned char)(*name_start)); name_start++) n_name--; /* leading spaces */
+  for (k = 0; (k < n_name) && !isspace ((unsigned char) name_start[k]); k++); /* first word, as samtools faidx */
+  name = (char*) biomcmc_malloc ((k + 1) * sizeof (char));
+  memcpy (name, name_start, k);
+  name[k] = '\0';
+  char_vector_add_string_at_position (fai->name, name, i); /* name may be empty, but position is kept */
+  free (name);
+}
+
+void
+fasta_index_create_from_map (fasta_index fai)
+{
+  int i = -1, n_alloc = 0;
+  int64_t bases, width;
+  bool regular = true, short_line = false;
+  char *p = fai->map, *end = fai->map + fai->map_size, *eol, *c;
+
+  for (; p < end; p = eol + 1) {
+    if (!(eol = (char*) memchr (p, '\n', end - p))) eol = end;
+    if (*p == '>') {
+      if ((i >= 0) && !regular) fai->line_bases[i] = fai->line_width[i] = 0;
+      fasta_index_add_record (fai, &n_alloc, p + 1, eol - p - 1, (eol < end) ? eol + 1 - fai->map : (int64_t) fai->map_size);
+      i = fai->n_seqs - 1;
+      regular = true; short_line = false;
+      continue;
+    }
+    for (bases = 0, c = p; c < eol; c++) if (!isspace ((unsigned char)(*c))) bases++;
+    if (i < 0) {
+      if (bases) biomcmc_error ("FASTA file \"%s\" has sequence data before the first sequence name", fai->filename);
+      continue;
+    }
+    fai->length[i] += bases;
+    width = eol - p + 1;
+    /* only the last line may be shorter, and bases must be contiguous (at most a '\r' before the '\n') */
+    if (bases < (eol - p - ((eol > p) && (eol[-1] == '\r')))) regular = false;
+    if (!bases) { short_line = true; continue; } /* empty line, allowed only at the end */
+    if (short_line) regular = false;
+    if (!fai->line_bases[i]) { fai->line_bases[i] = bases; fai->line_width[i] = width; }
+    else if (bases < fai->line_bases[i]) short_line = true;
+    else if ((bases > fai->line_bases[i]) || ((eol < end) && (width != fai->line_width[i]))) regular = false;
+  }
+  if ((i >= 0) && !regular) fai->line_bases[i] = fai->line_width[i] = 0;
+  if (!fai->n_seqs) biomcmc_error ("no sequences found in FASTA file \"%s\"", fai->filename);
+}
+
+bool
+fasta_index_read_index_file (fasta_index fai, char *fainame)
+{
+  int i, k, n_alloc = 0;
+  bool valid = true;
+  int64_t col[4];
+  char *line = NULL, *tab;
+  size_t linelength = 0;
+  struct stat st_fasta, st_index;
+  FILE *stream;
+
+  if (stat (fai->filename, &st_fasta) || stat (fainame, &st_index)) return false;
+  if (st_index.st_mtime < st_fasta.st_mtime) return false; /* FASTA file was modified after index */
+  if (!(stream = fopen (fainame, "r"))) return false;
+
+  while (biomcmc_getline (&line, &linelength, stream) != -1) { /* NAME LENGTH OFFSET LINEBASES LINEWIDTH */
+    for (k = 3; k >= 0; k--) { /* name may have spaces, thus columns are read from the end */
+      if (!(tab = strrchr (line, '\t'))) break;
+      col[k] = (int64_t) strtoll (tab + 1, NULL, 10);
+      *tab = '\0';
+    }
+    if (k >= 0) { valid = false; break; } /* malformed line */
+    fasta_index_add_record (fai, &n_alloc, line, strlen (line), col[1]);
+    i = fai->n_seqs - 1;
+    fai->length[i] = col[0];
+    fai->line_bases[i] = col[2];
+    fai->line_width[i] = col[3];
+    if ((col[0] < 0) || (col[1] < 1) || (col[1] > (int64_t) fai->map_size) || (col[2] < 0) || (col[3] < col[2]) ||
+        (col[2] && (col[1] + (col[0] / col[2]) * col[3] + (col[0] % col[2]) > (int64_t) fai->map_size))) { valid = false; break; }
+  }
+  fclose (stream);
+  if (line) free (line);
+
+  /* all lines are valid, and sequences are where the index says (a cheap check that it belongs to this file) */
+  for (i = 0; valid && (i < fai->n_seqs); i++) valid = fasta_index_record_fits_map (fai, i);
+  if (valid && fai->n_seqs) return true;
+  /* invalid index: start again from scratch */
+  del_char_vector (fai->name);
+  fai->name = new_char_vector (1);
+  fai->n_seqs = 0;
+  return false;
+}
+
+bool
+fasta_index_record_fits_map (fasta_index fai, int i)
+{
+  int64_t last;
+  size_t n = strlen (fai->name->string[i]);
+  char *start = fasta_index_description_line (fai, i), *end = fai->map + fai->offset[i] - 1, *next;
+
+  if (*end != '\n') return false; /* sequence starts after a line break */
+  if (*(start++) != '>') return false; /* ... of a description line */
+  while ((start < end) && isspace ((unsigned char)(*start))) start++;
+  if ((end - start < (int64_t) n) || memcmp (start, fai->name->string[i], n)) return false; /* with this name */
+  if ((start + n < end) && !isspace ((unsigned char) start[n])) return false;
+  next = (i + 1 < fai->n_seqs) ? fasta_index_description_line (fai, i + 1) : fai->map + fai->map_size;
+  if (next <= end) return false; /* records are in file order */
+  if (!fai->line_bases[i] || !fai->length[i]) return true;
+  last = fai->offset[i] + ((fai->length[i] - 1) / fai->line_bases[i]) * fai->line_width[i] + (fai->length[i] - 1) % fai->line_bases[i];
+  if (isspace ((unsigned char) fai->map[last])) return false; /* last base is followed only by spaces... */
+  for (last++; (fai->map + last < next) && isspace ((unsigned char) fai->map[last]); last++);
+  return (fai->map + last == next); /* ... until the next record (thus no record was added) */
+}
+
+void
+fasta_index_write_index_file (fasta_index fai, char *fainame)
+{
+  int i;
+  FILE *stream = fopen (fainame, "w");
+  if (!stream) return;
+  for (i = 0; i < fai->n_seqs; i++)
+    fprintf (stream, "%s\t%" PRId64 "\t%" PRId64 "\t%" PRId64 "\t%" PRId64 "\n", fai->name->string[i], fai->length[i],
+             fai->offset[i], fai->line_bases[i], fai->line_width[i]);
+  fclose (stream);
+}
+
+int
+fasta_index_find_name (fasta_index fai, char *name)
+{
+  return lookup_hashtable (fai->name_hash, name);
+}
+
+char*
+fasta_index_description_line (fasta_index fai, int i)
+{
+  char *start = fai->map + fai->offset[i];
+  if ((start > fai->map) && (start[-1] == '\n')) start--; /* description is the line before the first base */
+  while ((start > fai->map) && (start[-1] != '\n')) start--;
+  return start;
+}
+
+char*
+fasta_index_copy_description (fasta_index fai, int i)
+{
+  char *start = fasta_index_description_line (fai, i), *end = fai->map + fai->offset[i], *desc;
+
+  if (*start == '>') start++;
+  while ((start < end) && isspace ((unsigned char)(*start))) start++;
+  while ((end > start) && isspace ((unsigned char) end[-1])) end--; /* trailing spaces, '\r' and '\n' */
+  desc = (char*) biomcmc_malloc ((end - start + 1) * sizeof (char));
+  memcpy (desc, start, end - start);
+  desc[end - start] = '\0';
+  return desc;
+}
+
+char*
+fasta_index_sequence_view (fasta_index fai, int i)
+{
+  if ((fai->line_bases[i] < 1) || (fai->length[i] > fai->line_bases[i])) return NULL; /* not a single line */
+  return fai->map + fai->offset[i];
+}
+
+char*
+fasta_index_copy_sequence (fasta_index fai, int i, char *dest)
+{
+  int64_t k = 0, n, j;
+  char *s = fai->map + fai->offset[i];
+
+  if (!dest) dest = (char*) biomcmc_malloc ((fai->length[i] + 1) * sizeof (char));
+  if (fai->line_bases[i]) for (; k < fai->length[i]; k += n, s += fai->line_width[i]) { /* whole lines at a time */
+    n = (fai->length[i] - k < fai->line_bases[i]) ? fai->length[i] - k : fai->line_bases[i];
+    for (j = 0; j < n; j++) dest[k + j] = toupper ((unsigned char) s[j]);
+  }
+  else for (; k < fai->length[i]; s++) if (!isspace ((unsigned char)(*s))) dest[k++] = toupper ((unsigned char)(*s));
+  dest[k] = '\0';
+  return dest;
+}
+
+char*
+fasta_index_sequence (fasta_index fai, int i)
+{
+  int64_t k;
+  char *s;
+
+#ifdef _OPENMP
+#pragma omp atomic read
+#endif
+  s = fai->seq[i];
+  if (s) return s;
+
+  if ((s = fasta_index_sequence_view (fai, i))) { /* single line, but can be used only if already uppercase */
+    for (k = 0; (k < fai->length[i]) && (s[k] == toupper ((unsigned char) s[k])); k++);
+    if (k < fai->length[i]) s = NULL;
+  }
+  if (!s) s = fasta_index_copy_sequence (fai, i, NULL);
+
+#ifdef _OPENMP
+#pragma omp critical (fasta_index_sequence)
+#endif
+  { /* another thread may have materialised it in the meantime */
+    if (!fai->seq[i]) {
+#ifdef _OPENMP
+#pragma omp atomic write
+#endif
+      fai->seq[i] = s;
+    }
+    else {
+      if ((s < fai->map) || (s >= fai->map + fai->map_size)) free (s);
+      s = fai->seq[i];
+    }
+  }
+  return s;
+}
+
+alignment
+new_alignment_from_fasta_index (fasta_index fai, int *idx, int n_idx, bool compact_patterns)
+{
+  int i, k;
+  char *desc;
+  alignment align;
+  char_vector taxlabel, character;
+
+  if (!idx) n_idx = fai->n_seqs;
+  if (n_idx < 1) biomcmc_error ("empty subset of sequences from FASTA file \"%s\"", fai->filename);
+  taxlabel  = new_char_vector (n_idx);
+  character = new_char_vector (n_idx);
+  for (i = 0; i < n_idx; i++) {
+    k = (idx ? idx[i] : i);
+    if ((k < 0) || (k >= fai->n_seqs)) biomcmc_error ("sequence %d not found in FASTA file \"%s\"", k, fai->filename);
+    desc = fasta_index_copy_description (fai, k);
+    char_vector_add_string_at_position (taxlabel, desc, i);
+    free (desc);
+  }
+
+#ifdef _OPENMP
+#pragma omp parallel for schedule(dynamic,16) shared(fai,idx,character) private(i,k)
+#endif
+  for (i = 0; i < n_idx; i++) { /* each sequence replaces the empty string */
+    k = (idx ? idx[i] : i);
+    free (character->string[i]);
+    character->string[i] = fasta_index_copy_sequence (fai, k, NULL);
+    character->nchars[i] = (size_t) fai->length[k];
+  }
+  character->next_avail = n_idx;
+
+  align = new_alignment_from_taxlabel_and_character_vectors (taxlabel, character, fai->filename, compact_patterns);
+  del_char_vector (taxlabel); /* alignment keeps its own reference */
+  del_char_vector (character);
+  return align;
+}
+
+int
+fasta_index_pair_length (fasta_index fai, int i, int j)
+{
+  if (fai->length[i] != fai->length[j])
+    biomcmc_error ("pairwise distances can be calculated only for aligned sequences, but sequences %d and %d from FASTA "
+                   "file \"%s\" have lengths %" PRId64 " and %" PRId64, i, j, fai->filename, fai->length[i], fai->length[j]);
+  return (int) fai->length[i];
+}
+
+void
+fasta_index_K2P_distance_generator (void *data, int i, int j, double *result)
+{
+  fasta_index_K2P_distance_generator_bounded (data, i, j, DBL_MAX, result);
+}
+
+void
+fasta_index_K2P_distance_generator_bounded (void *data, int i, int j, double threshold, double *result)
+{
+  fasta_index fai = (fasta_index) data;
+  double prop[2];
+  biomcmc_calc_pairwise_distance_K2P_bounded (fasta_index_sequence (fai, i), fasta_index_sequence (fai, j), NULL,
+                                              fasta_index_pair_length (fai, i, j), threshold, prop);
+  result[0] = pairwise_K2P_distance (prop[0], prop[1]); /* lower bound (but above threshold) if stopped early */
+}
+
+void
+fasta_index_mismatch_distance_generator (void *data, int i, int j, double *result)
+{
+  fasta_index_mismatch_distance_generator_bounded (data, i, j, DBL_MAX, result);
+}
+
+void
+fasta_index_mismatch_distance_generator_bounded (void *data, int i, int j, double threshold, double *result)
+{
+  fasta_index fai = (fasta_index) data;
+  double score[5];
+  biomcmc_pairwise_score_matches_bounded (fasta_index_sequence (fai, i), fasta_index_sequence (fai, j),
+                                          fasta_index_pair_length (fai, i, j), (threshold < INT_MAX) ? (int) threshold : INT_MAX, score);
+  result[0] = score[4] - score[0];
+}
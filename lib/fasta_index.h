@@ -0,0 +1,79 @@
+/* SPDX-License-Identifier: GPL-3.0-or-later
+ *
+ * This file is part of biomcmc-lib, a low-level library for phylogenomic analysis.
+ * Copyright (C) 2019-today  Leonardo de Oliveira Martins [ leomrtns at gmail.com;  http://www.leomartins.org ]
+ *
+ * biomcmc is free software; you can redistribute it and/or modify it under the terms of the GNU General Public
+ * License as published by the Free Software Foundation; either version 2 of the License, or (at your option) any later
+ * version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY; without even the implied
+ * warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details (file "COPYING" or http://www.gnu.org/copyleft/gpl.html).
+ */
+
+/*! \file fasta_index.h
+ *  \brief Random access to the sequences of a (uncompressed) FASTA file, without reading all of them into memory.
+ *
+ *  The file is memory-mapped and an index with the position and length of each sequence is stored beside it, with the
+ *  same columns as the samtools faidx index (file name with suffix ".fai"), which can also be read. The index is read
+ *  again if it is not older than the FASTA file, and is recreated otherwise. Sequences are materialised only when first
+ *  needed (e.g. by the distance_generator wrappers below), directly from the file (a view, without copy) if stored in a
+ *  single line in uppercase, and copied otherwise. Any subset of sequences can also be copied into an alignment.
+ */
+
+#ifndef _biomcmc_fasta_index_h_
+#define _biomcmc_fasta_index_h_
+
+#include "alignment.h"
+
+typedef struct fasta_index_struct* fasta_index;
+
+struct fasta_index_struct
+{
+  int n_seqs;             /*! \brief number of sequences in file */
+  char_vector name;       /*! \brief sequence names (first word of description line, as samtools faidx) */
+  hashtable name_hash;    /*! \brief index of each sequence name */
+  int64_t *offset;        /*! \brief position in file of first base of each sequence */
+  int64_t *length;        /*! \brief number of bases of each sequence (excluding line breaks) */
+  int64_t *line_bases;    /*! \brief bases per line, or zero if lines have distinct lengths (or spaces) */
+  int64_t *line_width;    /*! \brief bytes per line, including the line break */
+  char **seq;             /*! \brief sequences materialised by fasta_index_sequence(), or NULL (inside map if not copied) */
+  char *map;              /*! \brief read-only memory map of the whole FASTA file */
+  size_t map_size;        /*! \brief size of the file in bytes */
+  char *filename;
+  int ref_counter;
+};
+
+/*! \brief maps the FASTA file into memory, reading its index if up to date or creating (and saving, if possible) the
+ * index otherwise. Compressed files cannot be mapped and should be read with read_fasta_alignment_from_file() */
+fasta_index new_fasta_index_from_file (char *seqfilename);
+void del_fasta_index (fasta_index fai);
+/*! \brief index of sequence with this name (first word of its description), or -1 if not found */
+int fasta_index_find_name (fasta_index fai, char *name);
+/*! \brief whole description line of sequence i (without the '>' and surrounding spaces), newly allocated */
+char* fasta_index_copy_description (fasta_index fai, int i);
+/*! \brief sequence i inside the memory map (not null-terminated, with fasta_index_struct::length chars, and as in the
+ * file e.g. lowercase is kept) if stored in a single line; otherwise NULL, and fasta_index_copy_sequence() must be used */
+char* fasta_index_sequence_view (fasta_index fai, int i);
+/*! \brief copies sequence i into dest without line breaks and in uppercase (as read_fasta_alignment_from_file()), where
+ * dest must have length+1 chars; if dest is NULL a new string is allocated. Returns dest (or new string) */
+char* fasta_index_copy_sequence (fasta_index fai, int i, char *dest);
+/*! \brief sequence i in uppercase (as read_fasta_alignment_from_file()) with fasta_index_struct::length chars, not
+ * necessarily null-terminated. It is materialised at the first call (thread-safe) and kept until del_fasta_index(): a
+ * view if possible, or a copy otherwise */
+char* fasta_index_sequence (fasta_index fai, int i);
+/*! \brief alignment with only the sequences idx[] of the index (all of them if idx is NULL), copied in parallel from the
+ * file; compact_patterns is as in read_fasta_alignment_from_file(), and names are whole description lines */
+alignment new_alignment_from_fasta_index (fasta_index fai, int *idx, int n_idx, bool compact_patterns);
+/*! \brief distance_generator wrappers with a fasta_index as data, returning the K2P distance between sequences i and j
+ * of the file, which must have the same length (see distance_generator_set_function_data() and
+ * distance_generator_set_bounded_function_data()). Only sequences of requested pairs are materialised */
+void fasta_index_K2P_distance_generator (void *data, int i, int j, double *result);
+void fasta_index_K2P_distance_generator_bounded (void *data, int i, int j, double threshold, double *result);
+/*! \brief distance_generator wrappers with a fasta_index as data, returning the number of incompatible sites (valid sites
+ * without an ACGT match) between sequences i and j of the file, which must have the same length */
+void fasta_index_mismatch_distance_generator (void *data, int i, int j, double *result);
+void fasta_index_mismatch_distance_generator_bounded (void *data, int i, int j, double threshold, double *result);
+
+#endif
@@ -17,10 +17,116 @@
 
 #include "likelihood.h"
 
-const int LikScaleFrequency = 20;
+const double LikScaleThreshold = 0x1p-256; /* partial likelihoods are rescaled (by a power of two) when smaller than this */
+const double LikScaleThresholdFloat = 0x1p-64; /* same, for single precision (float) storage */
+const double LikFloatMaxScaleRate = 0.25; /* single precision is abandoned if more than this fraction of updates need rescaling */
+const double LikRepeatMaxFraction = 0.8; /* site repeats are not used at nodes with more classes than this fraction of patterns */
+const double LikMinBranchLength = 1.e-8, LikMaxBranchLength = 10.; /* bounds for branch length optimisation */
+const int LikBatchBlockSize = 64; /* number of patterns per block when evaluating a batch of proposals */
+/* below this number of patterns per thread, nodes are calculated as tasks over independent subtrees (and pattern blocks) */
+const int LikTaskMaxPatternsPerThread = 512;
+const int LikTaskMinBlockSize = 32; /* smallest pattern block of a task */
+const int LikTaskMinLeaves = 32;    /* smaller trees are always parallel over patterns */
 
 /*! \brief main function that calculates log(likelihood) for changed nodes (called by high-level functions */
 void calculate_ln_likelihood_proposal (phylogeny phy, topology tre);
+/*! \brief recalculate transition matrices of branches below nodes[], if their length or the model changed */
+void update_branch_transition_matrices (phylogeny phy, topology tre, topol_node *nodes, int n_nodes);
+/*! \brief partial likelihood of node from its children, for all rate categories of one pattern; returns number of rescalings */
+static inline int lk_update_node_at_pattern (lk_vector node, lk_vector left, lk_vector right, double *Pl, double *Pr, int n_cat, int pat);
+/*! \brief partial likelihood of node when at least one child is a leaf (with one state per pattern) */
+static inline int lk_update_node_at_pattern_tip (lk_vector node, lk_vector left, lk_vector right, double *Pl, double *Pr, int n_cat, int pat);
+/*! \brief partial likelihood of node stored in single precision (children are also floats, or leaves) */
+static inline int lk_update_node_at_pattern_float (lk_vector node, lk_vector left, lk_vector right, double *Pl, double *Pr, int n_cat, int pat);
+/*! \brief log likelihood of one pattern, combining the two children of the root and averaging over rate categories */
+static inline double lk_ln_likelihood_at_pattern (lk_vector left, lk_vector right, double *P, double *pi, int n_cat, int pat);
+/*! \brief optimise length of branch above node and then of its subtree, updating the u and d vectors on the way */
+void optimise_subtree_branch_lengths (phylogeny phy, topology tre, topol_node node, double *table, double *ln_max);
+/*! \brief Newton-Raphson maximisation of branch length given the eigenspace table (from lk_edge_sumtable()) */
+double optimise_edge_newton_raphson (phylogeny phy, double *table, double *ln_max, double blen);
+/*! \brief copy partial likelihoods (and scaling factors) from one lk_vector to another */
+void lk_copy_vector (phylogeny phy, lk_vector to, lk_vector from);
+/*! \brief partial likelihood of node from its children for all patterns */
+void lk_update_vector (phylogeny phy, lk_vector node, lk_vector left, lk_vector right, double *Pl, double *Pr);
+/*! \brief per pattern, category and eigenvalue terms of the likelihood of a branch, s.t. it can be quickly evaluated for
+ * any branch length. ln_max has the largest scaling factor per pattern */
+void lk_edge_sumtable (phylogeny phy, lk_vector u_vec, lk_vector d_vec, double *table, double *ln_max);
+/*! \brief ln(likelihood) and its derivatives as a function of the branch length, from the table built by lk_edge_sumtable() */
+double lk_edge_from_sumtable (phylogeny phy, double *table, double *ln_max, double blength, double *first_deriv, double *second_deriv);
+/*! \brief calculates lnlk() for loci phy[] with updated[] set (all if NULL) in decreasing order of cost, balancing the
+ * load among threads. Locus i uses topology tre[tre_idx[i]], or tre[0] if tre_idx is NULL */
+void lk_schedule_loci (phylogeny *phy, int n_loci, topology *tre, int *tre_idx, int *order, bool *updated, void (*lnlk) (phylogeny, topology));
+/*! \brief topology of locus i in lk_schedule_loci() */
+#define lk_locus_topology(tre,tre_idx,i) ((tre_idx) ? (tre)[(tre_idx)[(i)]] : (tre)[0])
+/*! \brief class (site repeat) of pattern pat below vector u: leaf state, class, or pattern itself if not using repeats */
+#define lk_vector_class(u,pat) ((u)->tip ? (int) (u)->tip[(pat)] : lk_vector_idx(u,pat))
+/*! \brief classes of identical patterns below node (site repeats), from the classes of its children. Returns the number
+ * of classes, with one representative pattern per class in first[], or zero if values should be stored per pattern */
+int lk_site_repeats (phylogeny phy, lk_vector node, lk_vector left, lk_vector right, int *first, uint64_t *hkey, int *hval, int hsize);
+/*! \brief vector being calculated at node: proposal vector if proposal is true, or vector after current otherwise */
+#define lk_vector_of(phy,nd,proposal) ((proposal) ? (phy)->l[(nd)->id]->d_proposal : (phy)->l[(nd)->id]->d_current->next)
+/*! \brief true if there are too few patterns to keep all threads busy, but enough nodes to calculate independent
+ * subtrees in parallel (see lk_ln_likelihood_subtree_tasks()) */
+bool lk_use_subtree_tasks (phylogeny phy, topology tre);
+/*! \brief ln(likelihood) updating nodes[] (in postorder, as lk_ln_likelihood_site_repeats()), where each node and block
+ * of patterns is a task depending only on the same block of its children, s.t. independent subtrees run in parallel */
+double lk_ln_likelihood_subtree_tasks (phylogeny phy, topology tre, topol_node *nodes, int n_nodes, bool proposal, int *n_scaled);
+/*! \brief vector of a node calculated under a memory budget: d_current->next (all nodes are recalculated), d_proposal 
+ * (node changed by the proposal) or d_current (unchanged subtree) */
+#define LK_MEM_NEXT     0
+#define LK_MEM_PROPOSAL 1
+#define LK_MEM_CURRENT  2
+#define lk_memory_vector(phy,nd,which) ((which) == LK_MEM_NEXT ? (phy)->l[(nd)->id]->d_current->next : \
+                                        ((which) == LK_MEM_PROPOSAL ? (phy)->l[(nd)->id]->d_proposal : (phy)->l[(nd)->id]->d_current))
+/*! \brief ln(likelihood) updating nodes[] one at a time (parallel over patterns) under a memory budget, recalculating
+ * evicted vectors of their children when needed */
+double lk_ln_likelihood_memory_bounded (phylogeny phy, topology tre, topol_node *nodes, int n_nodes, bool proposal, int *n_scaled);
+/*! \brief calculate vector (given by which) of node, first recalculating evicted vectors below it; returns number of rescalings */
+int lk_memory_compute_node (phylogeny phy, topology tre, topol_node node, int which, bool recompute);
+/*! \brief vector (given by which of its parent) of child with storage and valid values, which is pinned until released */
+lk_vector lk_memory_pin_child (phylogeny phy, topology tre, topol_node child, int which, int *n_scaled);
+/*! \brief error if vector was never calculated (e.g. ln_likelihood() was not called before ln_likelihood_moved_branches()) */
+#define lk_vector_check_resident(u,nd) do { if (!lk_vector_is_resident (u)) \
+  biomcmc_error ("partial likelihoods of node %d were not calculated (ln_likelihood() must be called first)", (nd)->id); } while (0)
+/*! \brief ln(likelihood) calculating all nodes (body of ln_likelihood(), without the cache) */
+void lk_ln_likelihood_all_nodes (phylogeny phy, topology tre);
+/*! \brief true if state (topology, branch lengths and model) of tre is in phylogeny_struct::cache, in which case
+ * lk_proposal (and pat_lnLk, if cached) are updated */
+bool lk_cache_lookup (phylogeny phy, topology tre);
+/*! \brief store lk_proposal (and pat_lnLk) of the state of tre in phylogeny_struct::cache */
+void lk_cache_store (phylogeny phy, topology tre);
+/*! \brief two keys (topology, and model plus branch lengths) of the state of tre, and its slot in the cache */
+int lk_cache_keys (phylogeny phy, topology tre, uint64_t *key);
+/*! \brief hashes of topology (key[0]) and of model version and branch lengths (key[1]) */
+void lk_tree_keys (phylogeny phy, topology tre, uint64_t *key);
+/*! \brief true if partition i was calculated for this tree and model (and updates its tree_key[] if set is true) */
+bool lk_partition_is_current (partitioned_phylogeny pp, int i, topology tre, bool set);
+/*! \brief error if accepted vectors are outdated, in functions that use them directly */
+#define lk_cache_check_current(phy) do { if ((phy)->cache && (phy)->cache->stale) \
+  biomcmc_error ("accepted partial likelihoods came from the cache (ln_likelihood() must be called and accepted first)"); } while (0)
+/*! \brief ln(likelihood) updating nodes[] in postorder with site repeats (using d_proposal if proposal is true, or
+ * d_current->next otherwise), returning the weighted sum over patterns */
+double lk_ln_likelihood_site_repeats (phylogeny phy, topology tre, topol_node *nodes, int n_nodes, bool proposal, int *n_scaled);
+/*! \brief falls back to double precision if single precision vectors needed too many rescalings (out of n_updates) */
+void lk_check_single_precision (phylogeny phy, int n_scaled, int n_updates);
+/*! \brief ln(likelihood) of topology using temporary vectors in single or double precision, without changing phy */
+double lk_ln_likelihood_temporary_vectors (phylogeny phy, topology tre, bool single_precision);
+/*! \brief transition matrices of branch above node (or integrated over branch lengths, if phylogeny_struct::use_blength is
+ * false); for leaves, their product with each possible leaf state */
+#define lk_branch_matrix(phy,tre,node) (((phy)->use_blength && (tre)->blength) ? (phy)->l[(node)->id]->pmat : \
+                                        ((node)->internal ? (phy)->model->Qt : (phy)->model->Qt_tip))
+
+/*! \brief one partial likelihood vector calculation, within a batch of proposal topologies */
+typedef struct
+{
+  int id;                      /*! \brief node (same id in all proposals) */
+  lk_vector node, left, right; /*! \brief destination and children vectors */
+  double *Pl, *Pr;             /*! \brief transition matrices of left and right children */
+} lk_batch_task;
+
+/*! \brief transition matrix of branch above node for one proposal, reusing the cached matrix or one calculated in
+ * scratch[] by another proposal (indexed by node id and branch length) if possible */
+double *lk_batch_branch_matrix (phylogeny phy, topology tre, topol_node node, double *scratch, int *mat_id, double *mat_bl, int *n_mat);
 
 /* real calculation (posterior distribution, using data) */
 /*! \brief ln(likelihood) of topology, updating all internal nodes */ 
@@ -30,11 +136,14 @@ void ln_likelihood_moved_branches_real (phylogeny phy, topology tre);
 /*! \brief ln(likelihood) of topology, based on changed nodes by statically updating lk_vector (under calling 
  * function control) */
 void ln_likelihood_moved_branches_at_lk_vector_real (phylogeny phy, topology tre, int idx);
+/*! \brief ln(likelihood) of several proposal topologies at once, each into its own lk_vector slot */
+void ln_likelihood_moved_branches_at_lk_vector_batch_real (phylogeny phy, topology *tre, int n_prop, double *lnLk);
 
 /* pointer to real or dummy likelihood calculation (defined in likelihood.h as external) */
 void (*ln_likelihood) (phylogeny phy, topology tre) = &ln_likelihood_real;
 void (*ln_likelihood_moved_branches) (phylogeny phy, topology tre) = &ln_likelihood_moved_branches_real;
 void (*ln_likelihood_moved_branches_at_lk_vector) (phylogeny phy, topology tre, int idx) = &ln_likelihood_moved_branches_at_lk_vector_real;
+void (*ln_likelihood_moved_branches_at_lk_vector_batch) (phylogeny phy, topology *tre, int n_prop, double *lnLk) = &ln_likelihood_moved_branches_at_lk_vector_batch_real;
 
 /* dummy likelihood calculations (prior distribution, always zero) */
 void
@@ -46,6 +155,9 @@ ln_likelihood_moved_branches_dummy (phylogeny phy, topology tre)
 void
 ln_likelihood_moved_branches_at_lk_vector_dummy (phylogeny phy, topology tre, int idx) 
 { phy->lk_proposal = 0.; (void) tre; (void) idx; }
+void
+ln_likelihood_moved_branches_at_lk_vector_batch_dummy (phylogeny phy, topology *tre, int n_prop, double *lnLk) 
+{ int j; for (j = 0; j < n_prop; j++) lnLk[j] = 0.; phy->lk_proposal = 0.; (void) tre; }
 
 void
 set_likelihood_to_prior (void)
@@ -53,6 +165,7 @@ set_likelihood_to_prior (void)
   ln_likelihood = &ln_likelihood_dummy;
   ln_likelihood_moved_branches = &ln_likelihood_moved_branches_dummy;
   ln_likelihood_moved_branches_at_lk_vector = &ln_likelihood_moved_branches_at_lk_vector_dummy;
+  ln_likelihood_moved_branches_at_lk_vector_batch = &ln_likelihood_moved_branches_at_lk_vector_batch_dummy;
 }
 
 void
@@ -61,80 +174,102 @@ set_likelihood_to_posterior (void)
   ln_likelihood = &ln_likelihood_real;
   ln_likelihood_moved_branches = &ln_likelihood_moved_branches_real;
   ln_likelihood_moved_branches_at_lk_vector = &ln_likelihood_moved_branches_at_lk_vector_real;
+  ln_likelihood_moved_branches_at_lk_vector_batch = &ln_likelihood_moved_branches_at_lk_vector_batch_real;
 }
 
 void
 ln_likelihood_real (phylogeny phy, topology tre)
 { /* current --> proposal (=current->next) --> current */
-  int i, cat, pat, s1, s2;
-  double LikSite, lkMax, lkl, lkr, *left, *right, sum_of_lnLk = 0.;
-  bool scale;
-
   if (!tre->traversal_updated) update_topology_traversal (tre);
+  if (phy->cache && lk_cache_lookup (phy, tre)) return;
+  lk_ln_likelihood_all_nodes (phy, tre);
+  if (phy->cache) lk_cache_store (phy, tre);
+}
+
+void
+lk_ln_likelihood_all_nodes (phylogeny phy, topology tre)
+{
+  int i, pat, n_scaled = 0;
+  double sum_of_lnLk = 0.;
+
+  get_likelihood_kernel (); /* forces CPU detection outside parallel region */
+  update_branch_transition_matrices (phy, tre, tre->postorder, tre->nleaves - 1);
+  if (!phy->mem) for (i = 0; i < tre->nleaves - 2; i++) phylogeny_acquire_lk_vector (phy, phy->l[tre->postorder[i]->id]->d_current->next);
 
-  /*  "collapse(2)" only avail in openMP3.0 -- it collapses two for loops into one */
+  if (phy->mem) /* node by node, keeping only a subset of the vectors */
+    sum_of_lnLk = lk_ln_likelihood_memory_bounded (phy, tre, tre->postorder, tre->nleaves - 2, false, &n_scaled);
+  else if (phy->use_site_repeats) /* node by node, once per class of identical subtree patterns */
+    sum_of_lnLk = lk_ln_likelihood_site_repeats (phy, tre, tre->postorder, tre->nleaves - 2, false, &n_scaled);
+  else if (lk_use_subtree_tasks (phy, tre)) /* few patterns: threads also work on independent subtrees */
+    sum_of_lnLk = lk_ln_likelihood_subtree_tasks (phy, tre, tre->postorder, tre->nleaves - 2, false, &n_scaled);
+  else {
+    for (i = 0; i < tre->nleaves - 2; i++) phy->l[tre->postorder[i]->id]->d_current->next->n_rep = 0; /* one value per pattern */
 #ifdef _OPENMP
-#pragma omp parallel for shared(phy,tre) \
-  private(pat,cat,i,s1,s2,lkl,lkr,left,right,LikSite,lkMax,scale) reduction (+:sum_of_lnLk)
+#pragma omp parallel for schedule(static,phy->pattern_chunk) shared(phy,tre) private(pat,i) reduction (+:sum_of_lnLk,n_scaled)
 #endif
-  for (pat = 0; pat < phy->npat; pat++) { 
-    for (cat = 0; cat < phy->model->nrates; cat++) {
-      for (i = 0; i < tre->nleaves - 2; i++) { /* skip postorder[nleaves-2] which is root node */
-        scale = !(tre->postorder[i]->level % LikScaleFrequency); 
-        lkMax = 0.; /* maximum partial likelihood for this node/category/pattern */
-
-        left  = phy->l[tre->postorder[i]->left->id ]->d_current->next->lk[cat][pat];
-        right = phy->l[tre->postorder[i]->right->id]->d_current->next->lk[cat][pat];
-          
-        phy->l[tre->postorder[i]->id]->d_current->next->lnmax[cat][pat] = 
-        (phy->l[tre->postorder[i]->left->id ]->d_current->next->lnmax[cat][pat] +
-         phy->l[tre->postorder[i]->right->id]->d_current->next->lnmax[cat][pat]);
-
-        for (s1 = 0; s1 < 4; s1++) {
-          lkl = lkr = 0.0;
-          for (s2 = 0; s2 < 4; s2++) {
-            lkl += phy->model->Q[cat][s1][s2] * left[s2];
-            lkr += phy->model->Q[cat][s1][s2] * right[s2];
-          }
-          LikSite = phy->l[tre->postorder[i]->id]->d_current->next->lk[cat][pat][s1] = lkr * lkl;
-          if (scale && (LikSite > lkMax)) lkMax = LikSite; /* may slow down since compared many times, most of them "false" */
-        }
-          
-        if (scale) {
-          /* scale the partial likelihoods to avoid underflow: unlike Yang's suggestion (JMolEvol.2000.423) we scale
-           * each pattern, while he suggested over all patterns/sites. Each rate category is treated independently. */
-          if (lkMax <= 0.) biomcmc_error ("underflow: all partial likelihoods are <= 0.");
-
-          /* reescale only a few times since it is computationally expensive. Note that 
-           * left->split->n_ones >= right->split->n_ones always (by design of update_topology_traversal() ) */
-          phy->l[tre->postorder[i]->id]->d_current->next->lnmax[cat][pat] += log (lkMax);
-          for (s1 = 0; s1 < 4; s1++) phy->l[tre->postorder[i]->id]->d_current->next->lk[cat][pat][s1] /= lkMax;
-        }
-
-      } // for (i < tre->nleaves) 
+    for (pat = 0; pat < phy->npat; pat++) { 
+      if (!phy->weight[pat]) { phy->pat_lnLk[pat] = 0.; continue; } /* e.g. bootstrap or jackknife reweighting */
+      for (i = 0; i < tre->nleaves - 2; i++) /* skip postorder[nleaves-2] which is root node */
+        n_scaled += lk_update_node_at_pattern (phy->l[tre->postorder[i]->id]->d_current->next, phy->l[tre->postorder[i]->left->id]->d_current->next,
+                                   phy->l[tre->postorder[i]->right->id]->d_current->next, lk_branch_matrix (phy, tre, tre->postorder[i]->left), 
+                                   lk_branch_matrix (phy, tre, tre->postorder[i]->right), phy->model->nrates, pat);
 
       /* root node is superfluous: the site likelihood is calculated between root->left and root->right */
-      LikSite = 0.;
-      left  = phy->l[tre->root->left->id ]->d_current->next->lk[cat][pat];
-      right = phy->l[tre->root->right->id]->d_current->next->lk[cat][pat];
-      /* lkMax will contain the sum of all scaling factors in log scale */
-      lkMax = (phy->l[tre->root->left->id ]->d_current->next->lnmax[cat][pat] + 
-               phy->l[tre->root->right->id]->d_current->next->lnmax[cat][pat]);
-
-      for (s1 = 0; s1 < 4; s1++) for (s2 = 0; s2 < 4; s2++) /* likelihood at root for pattern */
-        LikSite += phy->model->pi[s1] * left[s1] * phy->model->Q[cat][s1][s2] * right[s2];
-
-      /* log likelihood of pattern, averaged over discretized rates */
-      if (!cat) phy->pat_lnLk[pat] = log (LikSite) + lkMax; /* logspace_add(A,B) = log(exp(A)+exp(B)) below */
-      else      phy->pat_lnLk[pat] = biomcmc_logspace_add (phy->pat_lnLk[pat], log (LikSite) + lkMax);
-    } // for (category)
-
-    /* phylogenetic log likelihood over sites (weighted patterns), summed through parallel reduction */
-    sum_of_lnLk += phy->pat_lnLk[pat] * phy->weight[pat];
-  } // for (pattern) 
+      phy->pat_lnLk[pat] = lk_ln_likelihood_at_pattern (phy->l[tre->root->left->id]->d_current->next, 
+                                                        phy->l[tre->root->right->id]->d_current->next, 
+                                                        lk_branch_matrix (phy, tre, tre->root), phy->model->pi, phy->model->nrates, pat);
+      /* phylogenetic log likelihood over sites (weighted patterns), summed through parallel reduction */
+      sum_of_lnLk += phy->pat_lnLk[pat] * phy->weight[pat];
+    } // for (pattern) 
+  }
 
   /* log (phy->model->nrates) is irreleveant in MCMC since it is a constant. It's here for completeness */
   phy->lk_proposal = sum_of_lnLk - ((double) (phy->nsites) * log ((double) phy->model->nrates));
+  lk_check_single_precision (phy, n_scaled, (tre->nleaves - 2) * phy->npat * phy->model->nrates);
+}
+
+void
+ln_likelihood_bootstrap (phylogeny phy, topology tre, bootstrap_weights bw, double *lnLk)
+{
+  int i, j, b, pat, n_scaled = 0;
+  double sum_of_lnLk, log_nrates = (double) (phy->nsites) * log ((double) phy->model->nrates);
+
+  if (bw->n_pat != phy->npat) biomcmc_error ("bootstrap replicates have %d patterns but phylogeny has %d", bw->n_pat, phy->npat);
+  if (phy->mem) biomcmc_error ("bootstrap replicates are not available under a memory budget");
+  if (!tre->traversal_updated) update_topology_traversal (tre);
+  get_likelihood_kernel (); /* forces CPU detection outside parallel region */
+  update_branch_transition_matrices (phy, tre, tre->postorder, tre->nleaves - 1);
+  for (i = 0; i < tre->nleaves - 2; i++) {
+    phylogeny_acquire_lk_vector (phy, phy->l[tre->postorder[i]->id]->d_current->next);
+    phy->l[tre->postorder[i]->id]->d_current->next->n_rep = 0; /* one value per pattern */
+  }
+  for (pat = 0; pat < phy->npat; pat++) phy->pat_lnLk[pat] = 0.; /* patterns absent from all replicates */
+
+  /* single pass over the patterns present in at least one replicate */
+#ifdef _OPENMP
+#pragma omp parallel for shared(phy,tre,bw) private(pat,i,j) reduction (+:n_scaled)
+#endif
+  for (j = 0; j < bw->n_active; j++) { 
+    pat = bw->active[j];
+    for (i = 0; i < tre->nleaves - 2; i++) /* skip postorder[nleaves-2] which is root node */
+      n_scaled += lk_update_node_at_pattern (phy->l[tre->postorder[i]->id]->d_current->next, phy->l[tre->postorder[i]->left->id]->d_current->next,
+                                 phy->l[tre->postorder[i]->right->id]->d_current->next, lk_branch_matrix (phy, tre, tre->postorder[i]->left), 
+                                 lk_branch_matrix (phy, tre, tre->postorder[i]->right), phy->model->nrates, pat);
+    phy->pat_lnLk[pat] = lk_ln_likelihood_at_pattern (phy->l[tre->root->left->id]->d_current->next, 
+                                                      phy->l[tre->root->right->id]->d_current->next, 
+                                                      lk_branch_matrix (phy, tre, tre->root), phy->model->pi, phy->model->nrates, pat);
+  }
+
+  /* each replicate is a reweighting of the site likelihoods */
+#ifdef _OPENMP
+#pragma omp parallel for shared(phy,bw,lnLk,log_nrates) private(b,j,sum_of_lnLk)
+#endif
+  for (b = 0; b < bw->n_rep; b++) {
+    int *w = bw->w + (size_t) b * bw->n_pat;
+    for (sum_of_lnLk = 0., j = 0; j < bw->n_active; j++) sum_of_lnLk += phy->pat_lnLk[bw->active[j]] * (double) w[bw->active[j]];
+    lnLk[b] = sum_of_lnLk - log_nrates;
+  }
+  lk_check_single_precision (phy, n_scaled, (tre->nleaves - 2) * bw->n_active * phy->model->nrates);
 }
 
 void 
@@ -144,6 +279,10 @@ accept_likelihood (phylogeny phy, topology tre)
   /* when working with u_done preorder update should come here */
 
   phy->lk_current = phy->lk_proposal;
+  if (phy->cache) {
+    phy->cache->stale = phy->cache->hit; /* cached proposal has no vectors */
+    if (phy->cache->hit) return;
+  }
 
   for (i=tre->nleaves; i < tre->nnodes; i++) { /* topology and phylogeny share same ids */
     phy->l[i]->d_current = phy->l[i]->d_current->next; /* update lk ring */
@@ -157,6 +296,16 @@ ln_likelihood_moved_branches_real (phylogeny phy, topology tre)
 
   if (!tre->traversal_updated) update_topology_traversal (tre);
   if ((!tre->n_undone) && tre->root->left->d_done && tre->root->right->d_done) return; 
+  if (phy->cache) {
+    if (lk_cache_lookup (phy, tre)) return;
+    if (phy->cache->stale) { /* accepted vectors are outdated (a cached state was accepted), thus all nodes are calculated */
+      lk_ln_likelihood_all_nodes (phy, tre);
+      for (i = tre->nleaves; i < tre->nnodes; i++) phy->l[i]->d_proposal = phy->l[i]->d_current->next;
+      phy->cache->full = true;
+      lk_cache_store (phy, tre);
+      return;
+    }
+  }
 
   for (i = 0; i < tre->n_undone; i++) { /* scan all nodes with d_done = false, but updating only children */ 
     if (tre->undone[i]->left->d_done) phy->l[ tre->undone[i]->left->id  ]->d_proposal = phy->l[ tre->undone[i]->left->id  ]->d_current;
@@ -167,6 +316,7 @@ ln_likelihood_moved_branches_real (phylogeny phy, topology tre)
   }
 
   calculate_ln_likelihood_proposal (phy, tre);
+  if (phy->cache) lk_cache_store (phy, tre);
 }
 
 void 
@@ -176,6 +326,13 @@ accept_likelihood_moved_branches (phylogeny phy, topology tre)
   /* when working with u_done preorder update should come here */
 
   phy->lk_current = phy->lk_proposal;
+  if (phy->cache && (phy->cache->hit || phy->cache->full)) {
+    if (phy->cache->full) for (i = tre->nleaves; i < tre->nnodes; i++) phy->l[i]->d_current = phy->l[i]->d_proposal;
+    phy->cache->stale = phy->cache->hit; /* cached proposal has no vectors, while a full calculation updated all */
+    phy->cache->full = false;
+    for (i = 0; i < tre->n_undone; i++) tre->undone[i]->d_done = true; 
+    return;
+  }
 
   for (i = 0; i < tre->n_undone; i++) { /* topology and phylogeny share same ids */
     phy->l[tre->undone[i]->id]->d_current = phy->l[tre->undone[i]->id]->d_proposal; /* update lk ring */
@@ -191,8 +348,11 @@ ln_likelihood_moved_branches_at_lk_vector_real (phylogeny phy, topology tre, int
 
   if (!tre->traversal_updated) update_topology_traversal (tre);
   if (!idx) biomcmc_error ("proposal likelihood will overwrite accepted (not your fault, it's a bug)");
+  if (phy->mem) biomcmc_error ("proposals by lk_vector index are not available under a memory budget");
+  lk_cache_check_current (phy);
 
   for (i = 0; i < tre->n_undone; i++) { /* scan all nodes with d_done = false, but updating only children */ 
+    phy->l[ tre->undone[i]->id ]->d_batch[idx] = NULL; /* slot is not from a batch anymore */
     if (tre->undone[i]->left->d_done) phy->l[ tre->undone[i]->left->id  ]->d_proposal = phy->l[ tre->undone[i]->left->id  ]->d[0];
     else                              phy->l[ tre->undone[i]->left->id  ]->d_proposal = phy->l[ tre->undone[i]->left->id  ]->d[idx];
 
@@ -207,93 +367,1085 @@ void
 accept_likelihood_moved_branches_at_lk_vector (phylogeny phy, topology tre, int idx, double likelihood)
 {
   int i;
+  node_likelihood l;
   /* when working with u_done preorder update should come here */
 
   phy->lk_accepted = likelihood;
 
   for (i = 0; i < tre->n_undone - 1; i++) { /* topology and phylogeny share same ids */
-    phy->l[tre->undone[i]->id]->d_accepted = phy->l[tre->undone[i]->id]->d_current = 
-    phy->l[tre->undone[i]->id]->d[idx]; /* update lk ring */
+    l = phy->l[tre->undone[i]->id];
+    l->d_accepted = l->d_current = (l->d_batch[idx] ? l->d_batch[idx] : l->d[idx]); /* update lk ring */
     tre->undone[i]->d_done = true; /* update tree d_done (since we still don't use u_done) */
   }
 }
 
 
+void
+ln_likelihood_partitioned (partitioned_phylogeny pp, topology tre)
+{
+  int i;
+  if (!tre->traversal_updated) update_topology_traversal (tre); /* tree hashes must be up to date */
+  for (i = 0; i < pp->n_part; i++) pp->updated[i] = !lk_partition_is_current (pp, i, tre, false);
+  lk_schedule_loci (pp->part, pp->n_part, &tre, NULL, pp->order, pp->updated, ln_likelihood);
+  for (pp->lk_proposal = 0., i = 0; i < pp->n_part; i++) {
+    if (!pp->updated[i]) pp->part[i]->lk_proposal = pp->part[i]->lk_current;
+    pp->lk_proposal += pp->part[i]->lk_proposal;
+  }
+}
+
+void 
+accept_likelihood_partitioned (partitioned_phylogeny pp, topology tre)
+{
+  int i;
+  for (pp->lk_current = 0., i = 0; i < pp->n_part; i++) {
+    if (pp->updated[i]) {
+      accept_likelihood (pp->part[i], tre);
+      pp->version[i] = pp->part[i]->model->version;
+      lk_partition_is_current (pp, i, tre, true);
+      pp->updated[i] = false;
+    }
+    pp->lk_current += pp->part[i]->lk_current;
+  }
+}
+
+void
+ln_likelihood_moved_branches_partitioned (partitioned_phylogeny pp, topology tre)
+{
+  int i;
+  for (pp->lk_proposal = 0., i = 0; i < pp->n_part; i++) pp->updated[i] = true;
+  lk_schedule_loci (pp->part, pp->n_part, &tre, NULL, pp->order, pp->updated, ln_likelihood_moved_branches);
+  for (i = 0; i < pp->n_part; i++) pp->lk_proposal += pp->part[i]->lk_proposal;
+}
+
+void 
+accept_likelihood_moved_branches_partitioned (partitioned_phylogeny pp, topology tre)
+{
+  int i;
+  /* all partitions are accepted before the topology is marked as done (by the last call) */
+  for (pp->lk_current = 0., i = 0; i < pp->n_part; i++) {
+    accept_likelihood_moved_branches (pp->part[i], tre);
+    pp->version[i] = pp->part[i]->model->version;
+    lk_partition_is_current (pp, i, tre, true);
+    pp->updated[i] = false;
+    pp->lk_current += pp->part[i]->lk_current;
+  }
+}
+
+void
+ln_likelihood_multilocus (phylogeny *phy, int n_loci, topology *tre, int *tre_idx, bool moved_branches, double *lnLk)
+{
+  int i, *cost, *order;
+  empfreq ef;
+
+  if (n_loci < 1) return;
+  cost  = (int*) biomcmc_malloc (n_loci * sizeof (int));
+  order = (int*) biomcmc_malloc (n_loci * sizeof (int));
+  for (i = 0; i < n_loci; i++) cost[i] = phy[i]->npat * phy[i]->model->nrates;
+  /* largest loci first, s.t. the small ones at the end fill the idle threads */
+  ef = new_empfreq_sort_decreasing (cost, n_loci, 2); /* 2 -> vector of ints */
+  for (i = 0; i < n_loci; i++) order[i] = ef->i[i].idx;
+  del_empfreq (ef);
+
+  lk_schedule_loci (phy, n_loci, tre, tre_idx, order, NULL, (moved_branches ? ln_likelihood_moved_branches : ln_likelihood));
+  if (lnLk) for (i = 0; i < n_loci; i++) lnLk[i] = phy[i]->lk_proposal;
+  free (order);
+  free (cost);
+}
+
+void
+accept_likelihood_multilocus (phylogeny *phy, int n_loci, topology *tre, int *tre_idx, bool moved_branches)
+{
+  int i;
+  /* a shared topology is marked as done only by the last call, thus the other loci still see its undone[] nodes */
+  for (i = 0; i < n_loci; i++) {
+    if (moved_branches) accept_likelihood_moved_branches (phy[i], lk_locus_topology (tre, tre_idx, i));
+    else                accept_likelihood (phy[i], lk_locus_topology (tre, tre_idx, i));
+  }
+}
+
+void
+lk_schedule_loci (phylogeny *phy, int n_loci, topology *tre, int *tre_idx, int *order, bool *updated, void (*lnlk) (phylogeny, topology))
+{
+  int i, n_large = 0, n_threads = 1;
+  double cost, total_cost = 0.;
+
+  /* shared state (also of topologies used by several loci) is updated here, outside the parallel region */
+  for (i = 0; i < n_loci; i++) if (!lk_locus_topology (tre, tre_idx, i)->traversal_updated) update_topology_traversal (lk_locus_topology (tre, tre_idx, i));
+  get_likelihood_kernel (); /* forces CPU detection outside parallel region */
+#ifdef _OPENMP
+  n_threads = omp_get_max_threads ();
+#endif
+
+  for (i = 0; i < n_loci; i++) if (!updated || updated[i]) total_cost += (double) (phy[i]->npat * phy[i]->model->nrates);
+  /* loci are sorted by decreasing cost, thus the large ones (which would leave other threads idle) come first */
+  for (n_large = 0; n_large < n_loci; n_large++) {
+    cost = (double) (phy[order[n_large]]->npat * phy[order[n_large]]->model->nrates);
+    if ((n_threads == 1) || (cost * (double) n_threads < total_cost)) break;
+  }
+  
+  for (i = 0; i < n_large; i++) if (!updated || updated[order[i]]) /* parallel over patterns */
+    lnlk (phy[order[i]], lk_locus_topology (tre, tre_idx, order[i]));
+
+  /* one locus per thread, largest first (nested pattern loops run serially within each thread) */
+#ifdef _OPENMP
+#pragma omp parallel for schedule(dynamic,1) shared(phy,tre,tre_idx,order,updated,lnlk,n_large,n_loci) private(i)
+#endif
+  for (i = n_large; i < n_loci; i++) if (!updated || updated[order[i]]) lnlk (phy[order[i]], lk_locus_topology (tre, tre_idx, order[i]));
+}
+
+void
+ln_likelihood_moved_branches_at_lk_vector_batch_real (phylogeny phy, topology *tre, int n_prop, double *lnLk)
+{
+  int i, j, k, pat, blk, n_scaled = 0, n_task = 0, n_mat = 0, max_mat = 0, *mat_id, *root_same;
+  size_t mat_size = (size_t) phy->model->nrates * lk_tip_states (phy->model->n_state) * phy->model->n_state;
+  double *scratch, *mat_bl, *pat_lnLk, **root_P;
+  lk_vector *root_left, *root_right;
+  lk_batch_task *task;
+  topol_node nd;
+
+  if (phy->mem) biomcmc_error ("a batch of proposals is not available under a memory budget");
+  lk_cache_check_current (phy);
+  if (n_prop >= phy->l[phy->ntax]->n_cycle) biomcmc_error ("%d proposals don't fit in a ring of %d lk_vectors (first is accepted)", 
+                                                           n_prop, phy->l[phy->ntax]->n_cycle);
+  get_likelihood_kernel (); /* forces CPU detection outside parallel region */
+  phylogeny_order_accepted_lk_vector (phy);
+  for (j = 0; j < n_prop; j++) {
+    if (!tre[j]->traversal_updated) update_topology_traversal (tre[j]);
+    max_mat += 2 * tre[j]->n_undone + 1;
+  }
+
+  task      = (lk_batch_task*) biomcmc_malloc (max_mat * sizeof (lk_batch_task));
+  scratch   = (double*) biomcmc_malloc_aligned (max_mat * mat_size * sizeof (double));
+  mat_id    = (int*)    biomcmc_malloc (max_mat * sizeof (int));
+  mat_bl    = (double*) biomcmc_malloc (max_mat * sizeof (double));
+  root_same = (int*)    biomcmc_malloc (n_prop * sizeof (int));
+  root_P    = (double**) biomcmc_malloc (n_prop * sizeof (double*));
+  root_left = (lk_vector*) biomcmc_malloc (2 * n_prop * sizeof (lk_vector));
+  root_right = root_left + n_prop;
+  pat_lnLk  = (double*) biomcmc_malloc ((size_t) n_prop * phy->npat * sizeof (double));
+
+  /* list of vectors to be calculated, in postorder within each proposal. A node already calculated by a previous proposal
+   * with the same children vectors and matrices is not recalculated, and its d_batch[] slot points to the existing vector */
+  for (j = 0; j < n_prop; j++) {
+    for (i = 0; i < tre[j]->n_undone; i++) if ((nd = tre[j]->undone[i]) != tre[j]->root) {
+      task[n_task].id = nd->id;
+      task[n_task].node  = phy->l[nd->id]->d[j+1];
+      task[n_task].left  = (nd->left->d_done  ? phy->l[nd->left->id]->d[0]  : phy->l[nd->left->id]->d_batch[j+1]);
+      task[n_task].right = (nd->right->d_done ? phy->l[nd->right->id]->d[0] : phy->l[nd->right->id]->d_batch[j+1]);
+      task[n_task].Pl = lk_batch_branch_matrix (phy, tre[j], nd->left,  scratch, mat_id, mat_bl, &n_mat);
+      task[n_task].Pr = lk_batch_branch_matrix (phy, tre[j], nd->right, scratch, mat_id, mat_bl, &n_mat);
+      for (k = 0; k < n_task; k++) if ((task[k].id == nd->id) && (task[k].left == task[n_task].left) && (task[k].right == task[n_task].right) && 
+                                       (task[k].Pl == task[n_task].Pl) && (task[k].Pr == task[n_task].Pr)) break;
+      if (k < n_task) phy->l[nd->id]->d_batch[j+1] = task[k].node; /* shared with previous proposal */
+      else phylogeny_acquire_lk_vector (phy, (phy->l[nd->id]->d_batch[j+1] = task[n_task++].node)); /* one value per pattern */
+    }
+    nd = tre[j]->root;
+    root_left[j]  = (nd->left->d_done  ? phy->l[nd->left->id]->d[0]  : phy->l[nd->left->id]->d_batch[j+1]);
+    root_right[j] = (nd->right->d_done ? phy->l[nd->right->id]->d[0] : phy->l[nd->right->id]->d_batch[j+1]);
+    root_P[j] = lk_batch_branch_matrix (phy, tre[j], nd, scratch, mat_id, mat_bl, &n_mat);
+    for (root_same[j] = -1, k = 0; k < j; k++) if ((root_left[k] == root_left[j]) && (root_right[k] == root_right[j]) && (root_P[k] == root_P[j])) {
+      root_same[j] = k; break; 
+    }
+  }
+
+  /* single pass over patterns, for all proposals. Patterns are visited in blocks, s.t. each vector is read and written
+   * contiguously within a block (instead of jumping between many vectors at every pattern) */
+#ifdef _OPENMP
+#pragma omp parallel for shared(phy,task,n_task,root_left,root_right,root_P,root_same,pat_lnLk,n_prop) private(pat,blk,i,j) reduction(+:n_scaled)
+#endif
+  for (blk = 0; blk < phy->npat; blk += LikBatchBlockSize) {
+    for (i = 0; i < n_task; i++) for (pat = blk; (pat < blk + LikBatchBlockSize) && (pat < phy->npat); pat++) if (phy->weight[pat])
+      n_scaled += lk_update_node_at_pattern (task[i].node, task[i].left, task[i].right, task[i].Pl, task[i].Pr, phy->model->nrates, pat);
+    for (j = 0; j < n_prop; j++) if (root_same[j] < 0) for (pat = blk; (pat < blk + LikBatchBlockSize) && (pat < phy->npat); pat++)
+      pat_lnLk[(size_t) j * phy->npat + pat] = (phy->weight[pat] ? lk_ln_likelihood_at_pattern (root_left[j], root_right[j], root_P[j],
+                                                                                               phy->model->pi, phy->model->nrates, pat) : 0.);
+  }
+
+  for (j = 0; j < n_prop; j++) {
+    if (root_same[j] >= 0) { lnLk[j] = lnLk[root_same[j]]; continue; }
+    for (lnLk[j] = 0., pat = 0; pat < phy->npat; pat++) lnLk[j] += pat_lnLk[(size_t) j * phy->npat + pat] * phy->weight[pat];
+    /* log (phy->model->nrates) is irreleveant in MCMC since it is a constant. It's here for completeness */
+    lnLk[j] -= ((double) (phy->nsites) * log ((double) phy->model->nrates));
+  }
+  if (n_prop) phy->lk_proposal = lnLk[n_prop - 1];
+  lk_check_single_precision (phy, n_scaled, n_task * phy->npat * phy->model->nrates);
+
+  free (task);
+  free (scratch);
+  free (mat_id);
+  free (mat_bl);
+  free (root_same);
+  free (root_P);
+  free (root_left);
+  free (pat_lnLk);
+}
+
+double *
+lk_batch_branch_matrix (phylogeny phy, topology tre, topol_node node, double *scratch, int *mat_id, double *mat_bl, int *n_mat)
+{
+  int i;
+  size_t mat_size = (size_t) phy->model->nrates * lk_tip_states (phy->model->n_state) * phy->model->n_state;
+  double blen, *P, Pt[phy->model->nrates * phy->model->n_state * phy->model->n_state];
+  node_likelihood l = phy->l[node->id];
+
+  if (!phy->use_blength || !tre->blength) return lk_branch_matrix (phy, tre, node);
+  if (node == tre->root) blen = tre->blength[tre->root->left->id] + tre->blength[tre->root->right->id];
+  else blen = tre->blength[node->id];
+  if ((l->pmat_blength == blen) && (l->pmat_version == phy->model->version)) return l->pmat;
+  for (i = 0; i < *n_mat; i++) if ((mat_id[i] == node->id) && (mat_bl[i] == blen)) return scratch + i * mat_size;
+
+  P = scratch + (*n_mat) * mat_size;
+  if (node->internal) update_transition_matrix_from_branch_length (phy->model, P, blen);
+  else { /* leaves store P(t) times each possible state */
+    update_transition_matrix_from_branch_length (phy->model, Pt, blen);
+    update_tip_table_from_transition_matrix (phy->model, P, Pt);
+  }
+  mat_id[*n_mat] = node->id;
+  mat_bl[(*n_mat)++] = blen;
+  return P;
+}
+
 void
 calculate_ln_likelihood_proposal (phylogeny phy, topology tre)
 { 
-  int i, cat, pat, s1, s2;
-  double LikSite, lkMax, lkl, lkr, *left, *right, sum_of_lnLk = 0.;
-  bool scale;
+  int i, pat, n_scaled = 0;
+  double sum_of_lnLk = 0.;
+
+  get_likelihood_kernel (); /* forces CPU detection outside parallel region */
+  /* only branches below changed nodes (undone[]) may have a different length: others are not used */
+  update_branch_transition_matrices (phy, tre, tre->undone, tre->n_undone);
+  if (!phy->mem) for (i = 0; i < tre->n_undone - 1; i++) { /* postorder, thus changed children already have storage */
+    lk_vector_check_resident (phy->l[tre->undone[i]->left->id]->d_proposal, tre->undone[i]->left);
+    lk_vector_check_resident (phy->l[tre->undone[i]->right->id]->d_proposal, tre->undone[i]->right);
+    phylogeny_acquire_lk_vector (phy, phy->l[tre->undone[i]->id]->d_proposal);
+  }
 
+  if (phy->mem) /* unchanged subtrees are recalculated if their vectors were evicted */
+    sum_of_lnLk = lk_ln_likelihood_memory_bounded (phy, tre, tre->undone, tre->n_undone - 1, true, &n_scaled);
+  else if (phy->use_site_repeats) /* classes of the unchanged nodes are reused, only those of undone[] are recalculated */
+    sum_of_lnLk = lk_ln_likelihood_site_repeats (phy, tre, tre->undone, tre->n_undone - 1, true, &n_scaled);
+  else if (lk_use_subtree_tasks (phy, tre))
+    sum_of_lnLk = lk_ln_likelihood_subtree_tasks (phy, tre, tre->undone, tre->n_undone - 1, true, &n_scaled);
+  else {
+    for (i = 0; i < tre->n_undone - 1; i++) phy->l[tre->undone[i]->id]->d_proposal->n_rep = 0; /* one value per pattern */
 #ifdef _OPENMP
-#pragma omp parallel for  shared(phy,tre) \
-  private(pat,cat,i,s1,s2,lkl,lkr,left,right,LikSite,lkMax,scale) reduction (+:sum_of_lnLk)
+#pragma omp parallel for schedule(static,phy->pattern_chunk) shared(phy,tre) private(pat,i) reduction (+:sum_of_lnLk,n_scaled)
 #endif
-  for (pat = 0; pat < phy->npat; pat++) {
-    for (cat = 0; cat < phy->model->nrates; cat++) {
-      for (i = 0; i < tre->n_undone - 1; i++) { /* only nodes nodes that changed minus the root (n_undone -1)  */
-        scale = !(tre->undone[i]->level % LikScaleFrequency); /* crude choice (the best would be distance from leaves) */ 
-
-        left  = phy->l[ tre->undone[i]->left->id  ]->d_proposal->lk[cat][pat];
-        right = phy->l[ tre->undone[i]->right->id ]->d_proposal->lk[cat][pat];
-
-        phy->l[ tre->undone[i]->id        ]->d_proposal->lnmax[cat][pat] = 
-        phy->l[ tre->undone[i]->left->id  ]->d_proposal->lnmax[cat][pat] +
-        phy->l[ tre->undone[i]->right->id ]->d_proposal->lnmax[cat][pat];
-
-        /* reescale only a few times since it is computationally expensive. Note that 
-         * left->split->n_ones >= right->split->n_ones always (by design of update_topology_traversal() ) */
-        if (scale) { /* reescaling is necessary */ 
-          lkMax = 0.; /* maximum partial likelihood for this node/category/pattern */
-          for (s1 = 0; s1 < 4; s1++) {
-            lkl = lkr = 0.0;
-            for (s2 = 0; s2 < 4; s2++) {
-              lkl += phy->model->Q[cat][s1][s2] * left[s2];
-              lkr += phy->model->Q[cat][s1][s2] * right[s2];
-            }
-            LikSite = phy->l[tre->undone[i]->id]->d_proposal->lk[cat][pat][s1] = lkr * lkl;
-            if (LikSite > lkMax) lkMax = LikSite;
-          }
-
-          if (lkMax <= 0.) biomcmc_error ("underflow: all partial likelihoods are <= 0.");
-          phy->l[tre->undone[i]->id]->d_proposal->lnmax[cat][pat] += log (lkMax);
-          for (s1 = 0; s1 < 4; s1++)
-            phy->l[tre->undone[i]->id]->d_proposal->lk[cat][pat][s1] /= lkMax;
-        } 
-
-        else { /* do not reescale: economize four comparisons (search for maximum) */
-          for (s1 = 0; s1 < 4; s1++) {
-            lkl = lkr = 0.0;
-            for (s2 = 0; s2 < 4; s2++) {
-              lkl += phy->model->Q[cat][s1][s2] * left[s2];
-              lkr += phy->model->Q[cat][s1][s2] * right[s2];
-            }
-            phy->l[tre->undone[i]->id]->d_proposal->lk[cat][pat][s1] = lkr * lkl;
-          }
-        }
-      } // for (i < tre->n_undone) 
+    for (pat = 0; pat < phy->npat; pat++) {
+      if (!phy->weight[pat]) { phy->pat_lnLk[pat] = 0.; continue; }
+      /* only nodes nodes that changed minus the root (n_undone -1). Scaling is a crude choice (the best would be distance from leaves) */
+      for (i = 0; i < tre->n_undone - 1; i++) 
+        n_scaled += lk_update_node_at_pattern (phy->l[tre->undone[i]->id]->d_proposal, phy->l[tre->undone[i]->left->id]->d_proposal,
+                                   phy->l[tre->undone[i]->right->id]->d_proposal, lk_branch_matrix (phy, tre, tre->undone[i]->left), 
+                                   lk_branch_matrix (phy, tre, tre->undone[i]->right), phy->model->nrates, pat);
 
       /* root node is superfluous: the site likelihood is calculated between root->left and root->right.
        * By design the heavier node (more nodes) is on the left */
-      LikSite = 0.;
-      
-      left  = phy->l[ tre->root->left->id  ]->d_proposal->lk[cat][pat];
-      right = phy->l[ tre->root->right->id ]->d_proposal->lk[cat][pat];
+      phy->pat_lnLk[pat] = lk_ln_likelihood_at_pattern (phy->l[tre->root->left->id]->d_proposal, 
+                                                        phy->l[tre->root->right->id]->d_proposal, 
+                                                        lk_branch_matrix (phy, tre, tre->root), phy->model->pi, phy->model->nrates, pat);
+      sum_of_lnLk += phy->pat_lnLk[pat] * phy->weight[pat];
+    } // for (pattern) 
+  }
+
+  /* log (phy->model->nrates) is irreleveant in MCMC since it is a constant. It's here for completeness */
+  phy->lk_proposal = sum_of_lnLk - ((double) (phy->nsites) * log ((double) phy->model->nrates));
+  lk_check_single_precision (phy, n_scaled, (tre->n_undone - 1) * phy->npat * phy->model->nrates);
+}
+
+void
+ln_likelihood_upstream (phylogeny phy, topology tre)
+{
+  int i, pat;
+  topol_node p;
+
+  if (!tre->traversal_updated) update_topology_traversal (tre);
+  get_likelihood_kernel (); /* forces CPU detection outside parallel region */
+  update_branch_transition_matrices (phy, tre, tre->postorder, tre->nleaves - 1);
+  if (phy->mem) biomcmc_error ("upstream partial likelihoods are not available under a memory budget");
+  lk_cache_check_current (phy);
+  phylogeny_set_single_precision (phy, false); /* upstream vectors are always in double precision */
+  for (i = 0; i < tre->nnodes; i++) if (tre->nodelist[i] != tre->root) phylogeny_acquire_lk_vector (phy, phy->l[tre->nodelist[i]->id]->u_current);
+
+  /* root's children share one branch, s.t. the upstream vector of one is the downstream vector of the other */
+  p = tre->root;
+  lk_copy_vector (phy, phy->l[p->left->id]->u_current,  phy->l[p->right->id]->d_current);
+  lk_copy_vector (phy, phy->l[p->right->id]->u_current, phy->l[p->left->id]->d_current);
+
+#ifdef _OPENMP
+#pragma omp parallel for schedule(static,phy->pattern_chunk) shared(phy,tre) private(pat,i,p)
+#endif
+  for (pat = 0; pat < phy->npat; pat++) if (phy->weight[pat]) { 
+    /* preorder: postorder[nleaves-2] is the root, already done above */
+    for (i = tre->nleaves - 3; i >= 0; i--) { 
+      p = tre->postorder[i]; /* both children of p receive (P_sister d_sister) o (P_p u_p) */
+      lk_update_node_at_pattern (phy->l[p->left->id]->u_current, phy->l[p->right->id]->d_current, phy->l[p->id]->u_current,
+                                 lk_branch_matrix (phy, tre, p->right), lk_branch_matrix (phy, tre, (p->up == tre->root) ? p->up : p), 
+                                 phy->model->nrates, pat);
+      lk_update_node_at_pattern (phy->l[p->right->id]->u_current, phy->l[p->left->id]->d_current, phy->l[p->id]->u_current,
+                                 lk_branch_matrix (phy, tre, p->left), lk_branch_matrix (phy, tre, (p->up == tre->root) ? p->up : p), 
+                                 phy->model->nrates, pat);
+    }
+  }
+  for (i = 0; i < tre->nnodes; i++) tre->nodelist[i]->u_done = true;
+}
+
+double
+ln_likelihood_at_edge (phylogeny phy, topology tre, topol_node node, double blength, double *first_deriv, double *second_deriv)
+{
+  double lnL, *table, *ln_max;
+
+  if (node == tre->root) biomcmc_error ("root node has no branch above it (its children share the same branch)");
+  if (phy->single_precision) biomcmc_error ("ln_likelihood_upstream() must be called first (and converts phylogeny to double precision)");
+  lk_vector_check_resident (phy->l[node->id]->d_current, node);
+  if (!phy->l[node->id]->u_current->lk)
+    biomcmc_error ("upstream partial likelihoods of node %d are missing (ln_likelihood_upstream() must be called first)", node->id);
+  table  = (double*) biomcmc_malloc_aligned ((size_t) phy->npat * phy->model->nrates * phy->model->n_state * sizeof (double));
+  ln_max = (double*) biomcmc_malloc ((size_t) phy->npat * sizeof (double));
+
+  lk_edge_sumtable (phy, phy->l[node->id]->u_current, phy->l[node->id]->d_current, table, ln_max);
+  lnL = lk_edge_from_sumtable (phy, table, ln_max, blength, first_deriv, second_deriv);
+
+  free (table);
+  free (ln_max);
+  return lnL;
+}
+
+double
+ln_likelihood_optimise_branch_lengths (phylogeny phy, topology tre, int n_sweeps, double tolerance)
+{
+  int i;
+  double lnL, *table, *ln_max;
+  lk_cache cache = phy->cache;
+
+  if (!phy->use_blength || !tre->blength) biomcmc_error ("branch lengths can only be optimised if they are used by the likelihood");
+  if (phy->mem) biomcmc_error ("branch lengths can't be optimised under a memory budget, since upstream vectors are needed");
+  phylogeny_set_single_precision (phy, false); /* derivatives need the upstream vectors, which are in double precision */
+  for (i = 0; i < tre->nnodes; i++) tre->blength[i] = BIOMCMC_MIN (BIOMCMC_MAX (tre->blength[i], LikMinBranchLength), LikMaxBranchLength);
+  table  = (double*) biomcmc_malloc_aligned ((size_t) phy->npat * phy->model->nrates * phy->model->n_state * sizeof (double));
+  ln_max = (double*) biomcmc_malloc ((size_t) phy->npat * sizeof (double));
+  phy->cache = NULL; /* vectors must be calculated at every step */
+  if (!tre->traversal_updated) update_topology_traversal (tre);
+
+  lk_ln_likelihood_all_nodes (phy, tre); /* not ln_likelihood(), which may point to the prior */
+  accept_likelihood (phy, tre);
+  for (i = 0; i < n_sweeps; i++) {
+    lnL = phy->lk_current;
+    /* preorder sweep, where d vectors are recalculated on the way back */
+    optimise_subtree_branch_lengths (phy, tre, tre->root->left,  table, ln_max);
+    optimise_subtree_branch_lengths (phy, tre, tre->root->right, table, ln_max);
+    lk_ln_likelihood_all_nodes (phy, tre);
+    accept_likelihood (phy, tre);
+    if (phy->lk_current - lnL < tolerance) break;
+  }
+  if ((phy->cache = cache)) cache->stale = cache->hit = false; /* accepted vectors are up to date */
+
+  free (table);
+  free (ln_max);
+  return phy->lk_current;
+}
+
+void
+optimise_subtree_branch_lengths (phylogeny phy, topology tre, topol_node node, double *table, double *ln_max)
+{
+  topol_node p = node->up;
+  double blen, ratio;
+
+  if (p != tre->root) { /* upstream vector from (updated) parent and sister */
+    lk_update_vector (phy, phy->l[node->id]->u_current, phy->l[node->sister->id]->d_current, phy->l[p->id]->u_current,
+                      lk_branch_matrix (phy, tre, node->sister), lk_branch_matrix (phy, tre, (p->up == tre->root) ? p->up : p));
+    blen = tre->blength[node->id];
+  }
+  else { /* children of root share same branch */
+    lk_copy_vector (phy, phy->l[node->id]->u_current, phy->l[node->sister->id]->d_current);
+    blen = tre->blength[node->id] + tre->blength[node->sister->id];
+  }
+
+  lk_edge_sumtable (phy, phy->l[node->id]->u_current, phy->l[node->id]->d_current, table, ln_max);
+  blen = optimise_edge_newton_raphson (phy, table, ln_max, blen);
+
+  if (p != tre->root) tre->blength[node->id] = blen;
+  else { /* root location along the branch is arbitrary: we keep the proportions */
+    ratio = tre->blength[node->id] + tre->blength[node->sister->id];
+    ratio = (ratio > 0.) ? tre->blength[node->id] / ratio : 0.5;
+    tre->blength[node->id] = blen * ratio;
+    tre->blength[node->sister->id] = blen - tre->blength[node->id];
+  }
+  update_branch_transition_matrices (phy, tre, &p, 1);
+
+  if (!node->internal) return;
+  optimise_subtree_branch_lengths (phy, tre, node->left,  table, ln_max);
+  optimise_subtree_branch_lengths (phy, tre, node->right, table, ln_max);
+  /* branch lengths below node have changed */
+  lk_update_vector (phy, phy->l[node->id]->d_current, phy->l[node->left->id]->d_current, phy->l[node->right->id]->d_current,
+                    lk_branch_matrix (phy, tre, node->left), lk_branch_matrix (phy, tre, node->right));
+}
+
+double
+optimise_edge_newton_raphson (phylogeny phy, double *table, double *ln_max, double blen)
+{
+  int iter, k;
+  double lnL, new_lnL, d1, d2, new_d1, new_d2, step, new_blen, diff;
+
+  lnL = lk_edge_from_sumtable (phy, table, ln_max, blen, &d1, &d2);
+  for (iter = 0; iter < 32; iter++) {
+    if (d2 < 0.) step = - d1 / d2;  /* Newton-Raphson step towards maximum */
+    else step = (d1 > 0.) ? blen : -0.5 * blen; /* not concave: we simply move uphill */
+    for (k = 0; k < 8; k++, step *= 0.5) { /* backtracking, if step is too long */
+      new_blen = BIOMCMC_MIN (BIOMCMC_MAX (blen + step, LikMinBranchLength), LikMaxBranchLength);
+      new_lnL = lk_edge_from_sumtable (phy, table, ln_max, new_blen, &new_d1, &new_d2);
+      if (new_lnL >= lnL) break;
+    }
+    if (k == 8) return blen; /* no improvement possible */
+    diff = fabs (new_blen - blen);
+    blen = new_blen; lnL = new_lnL; d1 = new_d1; d2 = new_d2;
+    if (diff < LikMinBranchLength) break;
+  }
+  return blen;
+}
+
+void
+lk_copy_vector (phylogeny phy, lk_vector to, lk_vector from)
+{
+  int i, s;
+  size_t n = (size_t) phy->npat * phy->model->nrates;
+  phylogeny_acquire_lk_vector (phy, to);
+  to->n_rep = 0; /* destination has one value per pattern */
+  if (from->n_rep) { /* site repeats are expanded */
+    for (i = 0; i < phy->npat; i++) {
+      memcpy (to->lk + (size_t) i * phy->model->nrates * phy->model->n_state, lk_vector_at (from, i, 0), 
+              phy->model->nrates * phy->model->n_state * sizeof (double));
+      memcpy (to->scale + (size_t) i * phy->model->nrates, &lk_vector_scale (from, i, 0), phy->model->nrates * sizeof (int));
+    }
+    return;
+  }
+  if (from->tip) { /* leaf: expand observed states */
+    for (i = 0; i < (int) n; i++) {
+      for (s = 0; s < phy->model->n_state; s++) to->lk[i * phy->model->n_state + s] = lk_tip_has_state (phy->model->n_state, from->tip[i / phy->model->nrates], s) ? 1. : 0.;
+      to->scale[i] = 0;
+    }
+    return;
+  }
+  memcpy (to->lk,    from->lk,    n * phy->model->n_state * sizeof (double));
+  memcpy (to->scale, from->scale, n * sizeof (int));
+}
+
+void
+lk_update_vector (phylogeny phy, lk_vector node, lk_vector left, lk_vector right, double *Pl, double *Pr)
+{
+  int pat;
+  get_likelihood_kernel (); /* forces CPU detection outside parallel region */
+  phylogeny_acquire_lk_vector (phy, node);
+  node->n_rep = 0; /* one value per pattern */
+#ifdef _OPENMP
+#pragma omp parallel for schedule(static,phy->pattern_chunk) shared(phy,node,left,right,Pl,Pr) private(pat)
+#endif
+  for (pat = 0; pat < phy->npat; pat++) if (phy->weight[pat]) lk_update_node_at_pattern (node, left, right, Pl, Pr, phy->model->nrates, pat);
+}
+
+void
+lk_edge_sumtable (phylogeny phy, lk_vector u_vec, lk_vector d_vec, double *table, double *ln_max)
+{
+  int pat, cat, k, s, n = phy->model->n_state, n_cat = phy->model->nrates;
+  int *scu, *scd, sc_max, scd_cat;
+  double a, b, *u, *d, *tab, dtip[n];
+  evolution_model m = phy->model;
+
+  /* P(t) = sum_k exp(-psi_k r t) z2[k] z1[k]^T  s.t. in eigenspace the site likelihood is a sum over k of 
+   * (sum_i pi_i u_i z2[k][i]) (sum_j z1[k][j] d_j) exp(-psi_k r t), where only the exponential depends on t */
+#ifdef _OPENMP
+#pragma omp parallel for schedule(static,phy->pattern_chunk) shared(phy,u_vec,d_vec,table,ln_max,m) private(pat,cat,k,s,a,b,u,d,scu,scd,sc_max,scd_cat,tab,dtip)
+#endif
+  for (pat = 0; pat < phy->npat; pat++) {
+    if (!phy->weight[pat]) { ln_max[pat] = 0.; continue; } /* table is not used by lk_edge_from_sumtable() */
+    u = lk_vector_at (u_vec, pat, 0);   scu = &lk_vector_scale (u_vec, pat, 0);
+    if (d_vec->tip) { /* leaf: same (unscaled) vector for all categories */
+      for (s = 0; s < n; s++) dtip[s] = lk_tip_has_state (n, d_vec->tip[pat], s) ? 1. : 0.;
+      d = dtip; scd = NULL;
+    }
+    else { d = lk_vector_at (d_vec, pat, 0);   scd = &lk_vector_scale (d_vec, pat, 0); }
+    tab = table + (size_t) pat * n_cat * n;
+    for (sc_max = scu[0] + (scd ? scd[0] : 0), cat = 1; cat < n_cat; cat++) 
+      if (sc_max < scu[cat] + (scd ? scd[cat] : 0)) sc_max = scu[cat] + (scd ? scd[cat] : 0);
+    ln_max[pat] = (double) sc_max * M_LN2;
+    for (cat = 0; cat < n_cat; cat++, u += n, tab += n) {
+      scd_cat = scd ? scd[cat] : 0;
+      for (k = 0; k < n; k++) {
+        for (a = b = 0., s = 0; s < n; s++) { a += m->pi[s] * u[s] * m->z2[k][s]; b += m->z1[k][s] * d[s]; }
+        tab[k] = ldexp (a * b, scu[cat] + scd_cat - sc_max); /* categories may have distinct scaling factors */
+      }
+      if (scd) d += n;
+    }
+  }
+}
+
+double
+lk_edge_from_sumtable (phylogeny phy, double *table, double *ln_max, double blength, double *first_deriv, double *second_deriv)
+{
+  int pat, cat, k, n = phy->model->n_state, n_cat = phy->model->nrates;
+  double mean_rate = 0., f0, f1, f2, lnL = 0., d1 = 0., d2 = 0., *tab;
+  double expo[n_cat * n], drate[n_cat * n]; /* exp(-psi * r * t) and -psi * r for each category and eigenvalue */
+  evolution_model m = phy->model;
+
+  for (cat = 0; cat < n_cat; cat++) mean_rate += m->rate[cat];
+  mean_rate /= (double) n_cat;
+  for (cat = 0; cat < n_cat; cat++) for (k = 0; k < n; k++) {
+    drate[cat * n + k] = - m->psi[k] * m->rate[cat] / mean_rate;
+    expo[cat * n + k] = exp (drate[cat * n + k] * blength);
+  }
+
+#ifdef _OPENMP
+#pragma omp parallel for schedule(static,phy->pattern_chunk) shared(phy,table,ln_max,expo,drate) private(pat,k,f0,f1,f2,tab) reduction (+:lnL,d1,d2)
+#endif
+  for (pat = 0; pat < phy->npat; pat++) if (phy->weight[pat]) {
+    tab = table + (size_t) pat * n_cat * n;
+    for (f0 = f1 = f2 = 0., k = 0; k < n_cat * n; k++) {
+      f0 += tab[k] * expo[k];
+      f1 += tab[k] * expo[k] * drate[k];
+      f2 += tab[k] * expo[k] * drate[k] * drate[k];
+    }
+    lnL += phy->weight[pat] * (log (f0) + ln_max[pat]);
+    d1  += phy->weight[pat] * f1 / f0;
+    d2  += phy->weight[pat] * (f2 / f0 - (f1 * f1) / (f0 * f0));
+  }
+
+  if (first_deriv)  *first_deriv  = d1;
+  if (second_deriv) *second_deriv = d2;
+  return lnL - ((double) (phy->nsites) * log ((double) n_cat));
+}
+
+void
+update_branch_transition_matrices (phylogeny phy, topology tre, topol_node *nodes, int n_nodes)
+{
+  int i, j;
+  double blen, Pt[phy->model->nrates * phy->model->n_state * phy->model->n_state];
+  topol_node child;
+  node_likelihood l;
+
+  if (!phy->use_blength || !tre->blength) return; /* branch lengths integrated out: evolution_model::Qt is used */
+  for (i = 0; i < n_nodes; i++) for (j = 0; j < 2; j++) {
+    if (nodes[i] == tre->root) { /* reversible model: two branches around root are merged into one */
+      if (j) break;
+      child = tre->root;
+      blen = tre->blength[tre->root->left->id] + tre->blength[tre->root->right->id];
+    }
+    else {
+      child = (j ? nodes[i]->right : nodes[i]->left);
+      blen = tre->blength[child->id];
+    }
+    l = phy->l[child->id];
+    if ((l->pmat_blength != blen) || (l->pmat_version != phy->model->version)) {
+      if (child->internal) update_transition_matrix_from_branch_length (phy->model, l->pmat, blen);
+      else { /* leaves store P(t) times each possible state */
+        update_transition_matrix_from_branch_length (phy->model, Pt, blen);
+        update_tip_table_from_transition_matrix (phy->model, l->pmat, Pt);
+      }
+      l->pmat_blength = blen;
+      l->pmat_version = phy->model->version;
+    }
+  }
+}
+
+static inline void
+lk_scale_at_pattern (double *lk, int n_state, int *scale, double lkMax)
+{
+  int s1, expo;
+  double factor;
+  /* scale the partial likelihoods to avoid underflow, by a power of two s.t. the largest is in [0.5, 1): unlike Yang's
+   * suggestion (JMolEvol.2000.423) we scale each pattern, while he suggested over all patterns/sites. Each rate category
+   * is treated independently. The multiplication is exact, and the log() is only taken at the root. */
+  if (lkMax <= 0.) biomcmc_error ("underflow: all partial likelihoods are <= 0.");
+  frexp (lkMax, &expo);
+  factor = ldexp (1., -expo);
+  for (s1 = 0; s1 < n_state; s1++) lk[s1] *= factor;
+  *scale += expo;
+}
+
+static inline int
+lk_update_node_at_pattern (lk_vector node, lk_vector left, lk_vector right, double *Pl, double *Pr, int n_cat, int pat)
+{ /* all rate categories of one pattern are contiguous in memory */
+  int cat, n = node->n_state, n_scaled = 0;
+  int *sc, *scl, *scr;
+  double lkMax, *lk, *lkl, *lkr;
+  lk_kernel kernel = lk_kernel_nstate[n]; /* specialised for this number of states */
+
+  if (node->lkf) return lk_update_node_at_pattern_float (node, left, right, Pl, Pr, n_cat, pat);
+  if (left->tip || right->tip) return lk_update_node_at_pattern_tip (node, left, right, Pl, Pr, n_cat, pat);
+  lk = lk_vector_at (node, pat, 0);   sc = &lk_vector_scale (node, pat, 0);
+  lkl = lk_vector_at (left, pat, 0);   scl = &lk_vector_scale (left, pat, 0);
+  lkr = lk_vector_at (right, pat, 0);  scr = &lk_vector_scale (right, pat, 0);
+
+  for (cat = 0; cat < n_cat; cat++, lk += n, lkl += n, lkr += n, Pl += n * n, Pr += n * n) {
+    sc[cat] = scl[cat] + scr[cat];
+    /* lkMax is the maximum partial likelihood for this node/category/pattern; Pl and Pr are transposed matrices */
+    lkMax = kernel->partial (lk, lkl, lkr, Pl, Pr);
+    if (lkMax < LikScaleThreshold) { lk_scale_at_pattern (lk, n, sc + cat, lkMax); n_scaled++; }
+  }
+  return n_scaled;
+}
+
+static inline int
+lk_update_node_at_pattern_tip (lk_vector node, lk_vector left, lk_vector right, double *Pl, double *Pr, int n_cat, int pat)
+{ /* at least one child is a leaf, for which Pl (or Pr) has the product of transition matrix by each possible state */
+  int cat, s1, n = node->n_state, n_tip = lk_tip_states (node->n_state), n_scaled = 0;
+  int *sc = &lk_vector_scale (node, pat, 0), *scr;
+  double lkMax, *lk = lk_vector_at (node, pat, 0), *tipl, *tipr, *lkr;
+  lk_kernel kernel = lk_kernel_nstate[n];
+  lk_vector tmp;
+
+  if (!left->tip) { tmp = left; left = right; right = tmp; tipl = Pl; Pl = Pr; Pr = tipl; } /* leaf is now on the left */
+  tipl = Pl + left->tip[pat] * n;
+
+  if (right->tip) { /* cherry: both children are leaves */
+    tipr = Pr + right->tip[pat] * n;
+    for (cat = 0; cat < n_cat; cat++, lk += n, tipl += n * n_tip, tipr += n * n_tip) {
+      for (lkMax = 0., s1 = 0; s1 < n; s1++) {
+        lk[s1] = tipl[s1] * tipr[s1];
+        if (lk[s1] > lkMax) lkMax = lk[s1];
+      }
+      sc[cat] = 0;
+      if (lkMax < LikScaleThreshold) { lk_scale_at_pattern (lk, n, sc + cat, lkMax); n_scaled++; }
+    }
+    return n_scaled;
+  }
+
+  lkr = lk_vector_at (right, pat, 0);  scr = &lk_vector_scale (right, pat, 0);
+  for (cat = 0; cat < n_cat; cat++, lk += n, lkr += n, tipl += n * n_tip, Pr += n * n) {
+    sc[cat] = scr[cat];
+    lkMax = kernel->partial_tip (lk, tipl, lkr, Pr);
+    if (lkMax < LikScaleThreshold) { lk_scale_at_pattern (lk, n, sc + cat, lkMax); n_scaled++; }
+  }
+  return n_scaled;
+}
+
+static inline int
+lk_update_node_at_pattern_float (lk_vector node, lk_vector left, lk_vector right, double *Pl, double *Pr, int n_cat, int pat)
+{ /* arithmetic is in double precision, and the result is rescaled (if needed) before being stored as float */
+  int cat, s1, n = node->n_state, n_tip = lk_tip_states (node->n_state), n_scaled = 0;
+  int *sc = &lk_vector_scale (node, pat, 0), *scl = NULL, *scr = NULL;
+  double lkMax, res[LK_KERNEL_MAX_STATES], *tipl = NULL, *tipr = NULL, *tmp;
+  float *lk = lk_vector_at_float (node, pat, 0), *lkl = NULL, *lkr = NULL;
+  lk_kernel kernel = lk_kernel_nstate[n];
+  lk_vector vtmp;
+
+  if (right->tip && !left->tip) { vtmp = left; left = right; right = vtmp; tmp = Pl; Pl = Pr; Pr = tmp; } /* leaf is on the left */
+  if (left->tip)  tipl = Pl + left->tip[pat] * n;
+  else { lkl = lk_vector_at_float (left, pat, 0);  scl = &lk_vector_scale (left, pat, 0); }
+  if (right->tip) tipr = Pr + right->tip[pat] * n;
+  else { lkr = lk_vector_at_float (right, pat, 0); scr = &lk_vector_scale (right, pat, 0); }
+
+  for (cat = 0; cat < n_cat; cat++, lk += n, Pl += n * n, Pr += n * n) {
+    if (tipr) for (lkMax = 0., s1 = 0; s1 < n; s1++) { /* cherry: both children are leaves */
+      res[s1] = tipl[s1] * tipr[s1];
+      if (res[s1] > lkMax) lkMax = res[s1];
+    }
+    else if (tipl) lkMax = kernel->partial_tip_mixed (res, tipl, lkr, Pr);
+    else           lkMax = kernel->partial_mixed (res, lkl, lkr, Pl, Pr);
+    sc[cat] = (scl ? scl[cat] : 0) + (scr ? scr[cat] : 0);
+    if (lkMax < LikScaleThresholdFloat) { lk_scale_at_pattern (res, n, sc + cat, lkMax); n_scaled++; }
+    for (s1 = 0; s1 < n; s1++) lk[s1] = (float) res[s1];
+    if (tipl) tipl += n * n_tip; else lkl += n;
+    if (tipr) tipr += n * n_tip; else lkr += n;
+  }
+  return n_scaled;
+}
+
+static inline double
+lk_ln_likelihood_at_pattern (lk_vector left, lk_vector right, double *P, double *pi, int n_cat, int pat)
+{
+  int cat, s1, s2, n = left->n_state, sc_max = 0, *scl = NULL, *scr = NULL;
+  double LikSite, lk = 0., tipl[LK_KERNEL_MAX_STATES], *lkl, *lkr = NULL;
+  float *lklf = NULL, *lkrf = NULL;
+  lk_kernel kernel = lk_kernel_nstate[n];
+  lk_vector tmp;
+
+  if (left->tip) { tmp = left; left = right; right = tmp; } /* reversible model: order of children is irrelevant */
+  if (left->tip) { /* both children are leaves: left vector is expanded */
+    for (s1 = 0; s1 < n; s1++) tipl[s1] = lk_tip_has_state (n, left->tip[pat], s1) ? 1. : 0.;
+    lkl = tipl;
+  }
+  else if (left->lkf) { lklf = lk_vector_at_float (left, pat, 0); lkl = tipl; scl = &lk_vector_scale (left, pat, 0); }
+  else { lkl = lk_vector_at (left, pat, 0); scl = &lk_vector_scale (left, pat, 0); }
+  if (right->lkf) { lkrf = lk_vector_at_float (right, pat, 0); scr = &lk_vector_scale (right, pat, 0); }
+  else if (!right->tip) { lkr = lk_vector_at (right, pat, 0); scr = &lk_vector_scale (right, pat, 0); }
+  /* largest scaling among categories, s.t. only one log() is needed per pattern */
+  if (scl || scr) for (sc_max = INT_MIN, cat = 0; cat < n_cat; cat++) 
+    if (sc_max < (scl ? scl[cat] : 0) + (scr ? scr[cat] : 0)) sc_max = (scl ? scl[cat] : 0) + (scr ? scr[cat] : 0);
+
+  for (cat = 0; cat < n_cat; cat++, P += n * n) {
+    if (lkrf) LikSite = kernel->root_mixed (lklf + n * cat, lkrf + n * cat, P, pi); /* both in single precision */
+    else if (right->tip) {
+      if (lklf) for (s1 = 0; s1 < n; s1++) tipl[s1] = (double) lklf[n * cat + s1]; /* lkl points to tipl */
+      for (LikSite = 0., s2 = 0; s2 < n; s2++) { /* only columns of observed states */
+        if (lk_tip_has_state (n, right->tip[pat], s2)) for (s1 = 0; s1 < n; s1++) LikSite += pi[s1] * lkl[s1] * P[n * s2 + s1];
+      }
+    }
+    else LikSite = kernel->root (lkl, lkr + n * cat, P, pi); /* likelihood at root for pattern */
+    if (!left->tip && !lklf) lkl += n;
+    /* likelihood of pattern summed over discretized rates, relative to largest scaling factor */
+    lk += ldexp (LikSite, (scl ? scl[cat] : 0) + (scr ? scr[cat] : 0) - sc_max);
+  }
+  return log (lk) + (double) sc_max * M_LN2;
+}
+
+void
+lk_check_single_precision (phylogeny phy, int n_scaled, int n_updates)
+{
+  if (!phy->single_precision || !n_updates) return;
+  /* frequent rescaling means that the float range is not enough for this data set: subsequent calculations are in
+   * double precision (current vectors are converted, keeping the values computed so far) */
+  if ((double) n_scaled > LikFloatMaxScaleRate * (double) n_updates) phylogeny_set_single_precision (phy, false);
+}
+
+double
+ln_likelihood_precision_discrepancy (phylogeny phy, topology tre, double *lnLk_double, double *lnLk_single)
+{
+  double lnl_d, lnl_s;
+  lnl_d = lk_ln_likelihood_temporary_vectors (phy, tre, false);
+  lnl_s = lk_ln_likelihood_temporary_vectors (phy, tre, true);
+  if (lnLk_double) *lnLk_double = lnl_d;
+  if (lnLk_single) *lnLk_single = lnl_s;
+  return lnl_s - lnl_d;
+}
+
+double
+lk_ln_likelihood_temporary_vectors (phylogeny phy, topology tre, bool single_precision)
+{
+  int i, pat, n_cat = phy->model->nrates;
+  size_t n = (size_t) phy->npat * n_cat * phy->model->n_state;
+  double sum_of_lnLk = 0.;
+  lk_vector *v;
+  topol_node p;
+
+  if (!tre->traversal_updated) update_topology_traversal (tre);
+  get_likelihood_kernel (); /* forces CPU detection outside parallel region */
+  update_branch_transition_matrices (phy, tre, tre->postorder, tre->nleaves - 1);
+
+  /* leaves are shared with phy; internal nodes have their own vectors (only the requested precision is allocated) */
+  v = (lk_vector*) biomcmc_malloc (phy->nnodes * sizeof (lk_vector));
+  for (i = 0; i < phy->ntax; i++) v[i] = phy->l[i]->d[0];
+  for (; i < phy->nnodes; i++) {
+    v[i] = (lk_vector) biomcmc_malloc (sizeof (struct lk_vector_struct));
+    v[i]->n_cat = n_cat;
+    v[i]->n_state = phy->model->n_state;
+    v[i]->tip = NULL;
+    v[i]->rep = NULL;
+    v[i]->n_rep = 0;
+    v[i]->lk  = single_precision ? NULL : (double*) biomcmc_malloc_aligned (n * sizeof (double));
+    v[i]->lkf = single_precision ? (float*) biomcmc_malloc_aligned (n * sizeof (float)) : NULL;
+    v[i]->scale = (int*) biomcmc_malloc_aligned ((size_t) phy->npat * n_cat * sizeof (int));
+  }
+
+#ifdef _OPENMP
+#pragma omp parallel for schedule(static,phy->pattern_chunk) shared(phy,tre,v) private(pat,i,p) reduction (+:sum_of_lnLk)
+#endif
+  for (pat = 0; pat < phy->npat; pat++) if (phy->weight[pat]) {
+    for (i = 0; i < tre->nleaves - 2; i++) { /* skip postorder[nleaves-2] which is root node */
+      p = tre->postorder[i];
+      lk_update_node_at_pattern (v[p->id], v[p->left->id], v[p->right->id], lk_branch_matrix (phy, tre, p->left), 
+                                 lk_branch_matrix (phy, tre, p->right), n_cat, pat);
+    }
+    sum_of_lnLk += phy->weight[pat] * lk_ln_likelihood_at_pattern (v[tre->root->left->id], v[tre->root->right->id], 
+                                                                   lk_branch_matrix (phy, tre, tre->root), phy->model->pi, n_cat, pat);
+  }
+
+  for (i = phy->ntax; i < phy->nnodes; i++) {
+    if (v[i]->lk)  free (v[i]->lk);
+    if (v[i]->lkf) free (v[i]->lkf);
+    free (v[i]->scale);
+    free (v[i]);
+  }
+  free (v);
+  return sum_of_lnLk - ((double) (phy->nsites) * log ((double) phy->model->nrates));
+}
+
+int
+lk_site_repeats (phylogeny phy, lk_vector node, lk_vector left, lk_vector right, int *first, uint64_t *hkey, int *hval, int hsize)
+{
+  int pat, h, n_rep = 0;
+  uint64_t key, n_right;
+
+  node->n_rep = 0;
+  /* a child storing all patterns has no repeats, thus neither has its parent */
+  if ((!left->tip && !left->n_rep) || (!right->tip && !right->n_rep)) return 0;
+  if (!node->rep) node->rep = (int*) biomcmc_malloc (phy->npat * sizeof (int));
+  n_right = (uint64_t) (right->tip ? lk_tip_states (right->n_state) : right->n_rep);
 
-      lkMax = (phy->l[ tre->root->left->id  ]->d_proposal->lnmax[cat][pat] + 
-               phy->l[ tre->root->right->id ]->d_proposal->lnmax[cat][pat]);
+  /* open addressing hash table, where the key is the pair of classes of the children */
+  for (h = 0; h < hsize; h++) hkey[h] = UINT64_MAX;
+  for (pat = 0; pat < phy->npat; pat++) {
+    key = (uint64_t) lk_vector_class (left, pat) * n_right + (uint64_t) lk_vector_class (right, pat);
+    for (h = biomcmc_hashint_64to32 (key) & (hsize - 1); (hkey[h] != UINT64_MAX) && (hkey[h] != key); h = (h + 1) & (hsize - 1));
+    if (hkey[h] == UINT64_MAX) { hkey[h] = key; hval[h] = n_rep; first[n_rep++] = pat; }
+    node->rep[pat] = hval[h];
+  }
+  if ((double) n_rep > LikRepeatMaxFraction * (double) phy->npat) return 0; /* few repeats: not worth the indirection */
+  return (node->n_rep = n_rep);
+}
+
+double
+lk_ln_likelihood_site_repeats (phylogeny phy, topology tre, topol_node *nodes, int n_nodes, bool proposal, int *n_scaled)
+{
+  int i, c, pat, n_rep, hsize, n_sc = 0, *first, *hval;
+  uint64_t *hkey;
+  double sum_of_lnLk = 0., *class_lnLk, *P;
+  struct lk_vector_struct root_vec; /* only the classes at the root are stored */
+  lk_vector v, left, right;
 
-      for (s1 = 0; s1 < 4; s1++) for (s2 = 0; s2 < 4; s2++)
-        LikSite += phy->model->pi[s1] * left[s1] * phy->model->Q[cat][s1][s2] * right[s2];
+  for (hsize = 2; hsize < 2 * phy->npat; hsize *= 2);
+  first = (int*) biomcmc_malloc (phy->npat * sizeof (int));
+  hval  = (int*) biomcmc_malloc (hsize * sizeof (int));
+  hkey  = (uint64_t*) biomcmc_malloc (hsize * sizeof (uint64_t));
+  class_lnLk = (double*) biomcmc_malloc (phy->npat * sizeof (double));
 
-      if (!cat) phy->pat_lnLk[pat] = log (LikSite) + lkMax; /* logspace_add(A,B) = log(exp(A)+exp(B)) below */
-      else      phy->pat_lnLk[pat] = biomcmc_logspace_add (phy->pat_lnLk[pat], log (LikSite) + lkMax);
-    } // for (category)
+  for (i = 0; i < n_nodes; i++) {
+    v     = lk_vector_of (phy, nodes[i], proposal);
+    left  = lk_vector_of (phy, nodes[i]->left, proposal);
+    right = lk_vector_of (phy, nodes[i]->right, proposal);
+    if (!(n_rep = lk_site_repeats (phy, v, left, right, first, hkey, hval, hsize))) /* one value per pattern */
+      for (n_rep = 0, pat = 0; pat < phy->npat; pat++) if (phy->weight[pat]) first[n_rep++] = pat;
+#ifdef _OPENMP
+#pragma omp parallel for shared(phy,tre,v,left,right,first,n_rep,i,nodes) private(c) reduction (+:n_sc)
+#endif
+    for (c = 0; c < n_rep; c++) /* each class is calculated at its first pattern */
+      n_sc += lk_update_node_at_pattern (v, left, right, lk_branch_matrix (phy, tre, nodes[i]->left), 
+                                         lk_branch_matrix (phy, tre, nodes[i]->right), phy->model->nrates, first[c]);
+  }
 
+  /* root node is superfluous: the site likelihood is calculated between root->left and root->right, once per class */
+  left  = lk_vector_of (phy, tre->root->left, proposal);
+  right = lk_vector_of (phy, tre->root->right, proposal);
+  root_vec.rep = NULL; 
+  root_vec.tip = NULL;
+  if (!(n_rep = lk_site_repeats (phy, &root_vec, left, right, first, hkey, hval, hsize))) 
+    for (n_rep = phy->npat, pat = 0; pat < phy->npat; pat++) first[pat] = pat;
+  P = lk_branch_matrix (phy, tre, tre->root);
+#ifdef _OPENMP
+#pragma omp parallel for shared(phy,left,right,first,n_rep,P,class_lnLk) private(c)
+#endif
+  for (c = 0; c < n_rep; c++) class_lnLk[c] = lk_ln_likelihood_at_pattern (left, right, P, phy->model->pi, phy->model->nrates, first[c]);
+  for (pat = 0; pat < phy->npat; pat++) {
+    phy->pat_lnLk[pat] = (phy->weight[pat] ? class_lnLk[lk_vector_idx ((&root_vec), pat)] : 0.);
     sum_of_lnLk += phy->pat_lnLk[pat] * phy->weight[pat];
-  } // for (pattern) 
+  }
 
-  /* log (phy->model->nrates) is irreleveant in MCMC since it is a constant. It's here for completeness */
-  phy->lk_proposal = sum_of_lnLk - ((double) (phy->nsites) * log ((double) phy->model->nrates));
+  if (root_vec.rep) free (root_vec.rep);
+  free (first);
+  free (hval);
+  free (hkey);
+  free (class_lnLk);
+  *n_scaled += n_sc;
+  return sum_of_lnLk;
+}
+
+bool
+lk_use_subtree_tasks (phylogeny phy, topology tre)
+{
+#ifdef _OPENMP
+  int n_threads = omp_get_max_threads ();
+  /* inside a parallel region (e.g. one partition per thread) there are no idle threads left */
+  if ((n_threads < 2) || omp_in_parallel ()) return false;
+  return ((tre->nleaves >= LikTaskMinLeaves) && (phy->npat < LikTaskMaxPatternsPerThread * n_threads));
+#else
+  (void) phy; (void) tre;
+  return false;
+#endif
+}
+
+double
+lk_ln_likelihood_subtree_tasks (phylogeny phy, topology tre, topol_node *nodes, int n_nodes, bool proposal, int *n_scaled)
+{
+  int i, pat, n_threads = 1, n_blk, blk_size, *thread_scaled, n_sc = 0;
+  const int pad = 16; /* counters of distinct threads are 64 bytes apart, avoiding false sharing */
+  char *dep;
+  double sum_of_lnLk = 0., *P;
+  lk_vector left, right;
+
+#ifdef _OPENMP
+  n_threads = omp_get_max_threads ();
+#endif
+  /* hybrid: patterns are split in (at least) one block per thread, and each node/block is a task */
+  blk_size = BIOMCMC_MAX ((phy->npat + n_threads - 1) / n_threads, LikTaskMinBlockSize);
+  n_blk = (phy->npat + blk_size - 1) / blk_size;
+  dep = (char*) biomcmc_malloc ((size_t) phy->nnodes * n_blk * sizeof (char)); /* only the addresses are used, as task dependencies */
+  thread_scaled = (int*) biomcmc_malloc ((size_t) n_threads * pad * sizeof (int));
+  for (i = 0; i < n_threads; i++) thread_scaled[i * pad] = 0;
+  for (i = 0; i < n_nodes; i++) lk_vector_of (phy, nodes[i], proposal)->n_rep = 0; /* one value per pattern */
+
+#ifdef _OPENMP
+#pragma omp parallel shared(phy,tre,nodes,n_nodes,proposal,dep,n_blk,blk_size,thread_scaled)
+#pragma omp single
+#endif
+  {
+    int j, b;
+    for (j = 0; j < n_nodes; j++) for (b = 0; b < n_blk; b++) {
+      char *d_node = dep + (size_t) nodes[j]->id * n_blk + b, *d_left = dep + (size_t) nodes[j]->left->id * n_blk + b, 
+           *d_right = dep + (size_t) nodes[j]->right->id * n_blk + b;
+      (void) d_node; (void) d_left; (void) d_right; /* unused without OpenMP */
+#ifdef _OPENMP
+#pragma omp task firstprivate(j,b) depend(in: d_left[0], d_right[0]) depend(out: d_node[0])
+#endif
+      {
+        int p, cnt = 0, last = BIOMCMC_MIN ((b + 1) * blk_size, phy->npat), thread = 0;
+        lk_vector v = lk_vector_of (phy, nodes[j], proposal), l = lk_vector_of (phy, nodes[j]->left, proposal),
+                  r = lk_vector_of (phy, nodes[j]->right, proposal);
+        double *Pl = lk_branch_matrix (phy, tre, nodes[j]->left), *Pr = lk_branch_matrix (phy, tre, nodes[j]->right);
+        for (p = b * blk_size; p < last; p++) if (phy->weight[p]) cnt += lk_update_node_at_pattern (v, l, r, Pl, Pr, phy->model->nrates, p);
+#ifdef _OPENMP
+        thread = omp_get_thread_num ();
+#endif
+        thread_scaled[thread * pad] += cnt;
+      }
+    }
+  } // parallel region (all tasks are finished at its implicit barrier)
+
+  /* root node is superfluous: the site likelihood is calculated between root->left and root->right */
+  left  = lk_vector_of (phy, tre->root->left, proposal);
+  right = lk_vector_of (phy, tre->root->right, proposal);
+  P = lk_branch_matrix (phy, tre, tre->root);
+#ifdef _OPENMP
+#pragma omp parallel for schedule(static,phy->pattern_chunk) shared(phy,left,right,P) private(pat) reduction (+:sum_of_lnLk)
+#endif
+  for (pat = 0; pat < phy->npat; pat++) {
+    phy->pat_lnLk[pat] = (phy->weight[pat] ? lk_ln_likelihood_at_pattern (left, right, P, phy->model->pi, phy->model->nrates, pat) : 0.);
+    sum_of_lnLk += phy->pat_lnLk[pat] * phy->weight[pat];
+  }
+
+  for (i = 0; i < n_threads; i++) n_sc += thread_scaled[i * pad];
+  *n_scaled += n_sc;
+  free (dep);
+  free (thread_scaled);
+  return sum_of_lnLk;
+}
+
+double
+lk_ln_likelihood_memory_bounded (phylogeny phy, topology tre, topol_node *nodes, int n_nodes, bool proposal, int *n_scaled)
+{
+  int i, pat, n_sc = 0, which = (proposal ? LK_MEM_PROPOSAL : LK_MEM_NEXT);
+  double sum_of_lnLk = 0., *P;
+  lk_vector left, right;
+
+  for (i = 0; i < n_nodes; i++) n_sc += lk_memory_compute_node (phy, tre, nodes[i], which, false);
+
+  /* root node is superfluous: the site likelihood is calculated between root->left and root->right */
+  left  = lk_memory_pin_child (phy, tre, tre->root->left, which, &n_sc);
+  right = lk_memory_pin_child (phy, tre, tre->root->right, which, &n_sc);
+  P = lk_branch_matrix (phy, tre, tre->root);
+#ifdef _OPENMP
+#pragma omp parallel for schedule(static,phy->pattern_chunk) shared(phy,left,right,P) private(pat) reduction (+:sum_of_lnLk)
+#endif
+  for (pat = 0; pat < phy->npat; pat++) {
+    phy->pat_lnLk[pat] = (phy->weight[pat] ? lk_ln_likelihood_at_pattern (left, right, P, phy->model->pi, phy->model->nrates, pat) : 0.);
+    sum_of_lnLk += phy->pat_lnLk[pat] * phy->weight[pat];
+  }
+  left->pinned--;
+  right->pinned--;
+  *n_scaled += n_sc;
+  return sum_of_lnLk;
+}
+
+lk_vector
+lk_memory_pin_child (phylogeny phy, topology tre, topol_node child, int which, int *n_scaled)
+{
+  lk_vector v;
+  /* unchanged children of a changed node have d_proposal = d_current, and so are all nodes below them */
+  if ((which == LK_MEM_PROPOSAL) && (phy->l[child->id]->d_proposal == phy->l[child->id]->d_current)) which = LK_MEM_CURRENT;
+  v = lk_memory_vector (phy, child, which);
+  if (!lk_vector_is_resident (v)) {
+    if (!child->internal) biomcmc_error ("leaf %d has no observed states", child->id);
+    *n_scaled += lk_memory_compute_node (phy, tre, child, which, true);
+  }
+  else if (!v->tip) phylogeny_acquire_lk_vector (phy, v); /* only marks it as recently used */
+  v->pinned++;
+  return v;
+}
+
+int
+lk_memory_compute_node (phylogeny phy, topology tre, topol_node node, int which, bool recompute)
+{
+  int pat, n_sc = 0;
+  double *Pl, *Pr;
+  lk_vector v = lk_memory_vector (phy, node, which), left, right;
+
+  /* children are pinned, s.t. the storage of one is not reused while the other (or the node itself) is calculated */
+  left  = lk_memory_pin_child (phy, tre, node->left,  which, &n_sc);
+  right = lk_memory_pin_child (phy, tre, node->right, which, &n_sc);
+  phylogeny_acquire_lk_vector (phy, v);
+  v->n_rep = 0; /* one value per pattern */
+  update_branch_transition_matrices (phy, tre, &node, 1); /* unchanged subtrees may have outdated (e.g. rejected) matrices */
+  Pl = lk_branch_matrix (phy, tre, node->left);
+  Pr = lk_branch_matrix (phy, tre, node->right);
+#ifdef _OPENMP
+#pragma omp parallel for schedule(static,phy->pattern_chunk) shared(phy,v,left,right,Pl,Pr) private(pat) reduction (+:n_sc)
+#endif
+  for (pat = 0; pat < phy->npat; pat++) if (phy->weight[pat]) n_sc += lk_update_node_at_pattern (v, left, right, Pl, Pr, phy->model->nrates, pat);
+  left->pinned--;
+  right->pinned--;
+  phy->mem->n_computed++;
+  if (recompute) phy->mem->n_recomputed++;
+  return n_sc;
+}
+
+int
+lk_cache_keys (phylogeny phy, topology tre, uint64_t *key)
+{
+  lk_tree_keys (phy, tre, key);
+  return (int) (biomcmc_hashint64_salted (key[0] ^ key[1], 7) % (uint64_t) phy->cache->n_slot);
+}
+
+void
+lk_tree_keys (phylogeny phy, topology tre, uint64_t *key)
+{
+  int i, k;
+  uint64_t bits, split;
+  topol_node nd;
+  key[0] = ((uint64_t) tre->hashID1 << 32) | (uint64_t) tre->hashID2;
+  if (!key[0]) key[0] = 1ULL; /* zero means empty slot */
+  key[1] = biomcmc_hashint64_salted ((uint64_t) phy->model->version, 1);
+  if (phy->use_blength && tre->blength) for (i = 0; i < tre->nnodes; i++) if ((nd = tre->nodelist[i]) != tre->root) {
+    /* node ids of the same topology may differ, thus each branch is identified by its split (leaves below it). Terms are
+     * summed s.t. the key doesn't depend on the order of the nodes */
+    for (split = 0ULL, k = 0; k < nd->split->n->ints; k++) split = biomcmc_hashint64_salted (split ^ nd->split->bs[k], 3);
+    memcpy (&bits, tre->blength + nd->id, sizeof (uint64_t));
+    key[1] += biomcmc_hashint64_salted (split ^ biomcmc_hashint64_salted (bits, 5), 7);
+  }
+}
+
+bool
+lk_partition_is_current (partitioned_phylogeny pp, int i, topology tre, bool set)
+{
+  uint64_t key[2];
+  bool current = (pp->version[i] == pp->part[i]->model->version);
+  lk_tree_keys (pp->part[i], tre, key);
+  current = current && (key[0] == pp->tree_key[2 * i]) && (key[1] == pp->tree_key[2 * i + 1]);
+  if (set) { pp->tree_key[2 * i] = key[0]; pp->tree_key[2 * i + 1] = key[1]; }
+  return current;
+}
+
+bool
+lk_cache_lookup (phylogeny phy, topology tre)
+{
+  uint64_t key[2];
+  int slot = lk_cache_keys (phy, tre, key);
+
+  phy->cache->n_lookup++;
+  phy->cache->full = false;
+  phy->cache->hit = ((phy->cache->key[2 * slot] == key[0]) && (phy->cache->key[2 * slot + 1] == key[1]));
+  if (!phy->cache->hit) return false;
+  phy->cache->n_hit++;
+  phy->lk_proposal = phy->cache->lnLk[slot];
+  if (phy->cache->pat_lnLk) memcpy (phy->pat_lnLk, phy->cache->pat_lnLk + (size_t) slot * phy->npat, phy->npat * sizeof (double));
+  return true;
+}
+
+void
+lk_cache_store (phylogeny phy, topology tre)
+{
+  uint64_t key[2];
+  int slot = lk_cache_keys (phy, tre, key);
+
+  phy->cache->key[2 * slot]     = key[0];
+  phy->cache->key[2 * slot + 1] = key[1];
+  phy->cache->lnLk[slot] = phy->lk_proposal;
+  if (phy->cache->pat_lnLk) memcpy (phy->cache->pat_lnLk + (size_t) slot * phy->npat, phy->pat_lnLk, phy->npat * sizeof (double));
 }
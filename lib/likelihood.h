@@ -21,6 +21,7 @@
 
 #include "phylogeny.h"
 #include "topology_common.h"
+#include "likelihood_kernel.h"
 
 /*! \brief ln(likelihood) of topology, updating all internal nodes */ 
 extern void (*ln_likelihood) (phylogeny phy, topology tre);
@@ -35,6 +36,68 @@ void accept_likelihood_moved_branches (phylogeny phy, topology tre);
 extern void (*ln_likelihood_moved_branches_at_lk_vector) (phylogeny phy, topology tre, int idx);
 void accept_likelihood_moved_branches_at_lk_vector (phylogeny phy, topology tre, int idx, double likelihood);
 
+/*! \brief ln(likelihood) of n_prop proposal topologies (e.g. multiple-try Metropolis), proposal j using slot j+1 of
+ * node_likelihood_struct::d[] and with its ln(likelihood) stored in lnLk[j]. 
+ *
+ * All proposals are evaluated in one pass over patterns: nodes with d_done use the accepted vectors, and a node with the
+ * same children vectors and branch lengths in several proposals is calculated only once (its
+ * node_likelihood_struct::d_batch[] slots point to the same vector). Calls phylogeny_order_accepted_lk_vector() itself, and proposal j is accepted with
+ * accept_likelihood_moved_branches_at_lk_vector (phy, tre[j], j+1, lnLk[j]). */
+extern void (*ln_likelihood_moved_branches_at_lk_vector_batch) (phylogeny phy, topology *tre, int n_prop, double *lnLk);
+
+/*! \brief ln(likelihood) of topology for each of the bootstrap replicates bw (see new_phylogeny_bootstrap_weights()),
+ * returned in lnLk[0...bw->n_rep-1]. Partial likelihoods are calculated once, only for patterns present in at least one
+ * replicate, in the proposal vectors (as ln_likelihood(), but should not be accepted since other patterns are skipped).
+ * Site ln(likelihoods) phylogeny_struct::pat_lnLk are kept (zero for skipped patterns). */
+void ln_likelihood_bootstrap (phylogeny phy, topology tre, bootstrap_weights bw, double *lnLk);
+
+/*! \brief upstream (preorder) partial likelihoods node_likelihood_struct::u_current of all nodes, from d_current (i.e. 
+ * after accept_likelihood()). The u vector of a node holds the likelihood of everything outside its subtree, at the top
+ * of its branch (the two children of the root share the same branch, of length t_left + t_right) */
+void ln_likelihood_upstream (phylogeny phy, topology tre);
+
+/*! \brief ln(likelihood) as a function of the length of branch above node, using only its d and u vectors (must be
+ * called after ln_likelihood_upstream()). First and second derivatives w.r.t. the branch length are stored in
+ * first_deriv and second_deriv if these are not NULL. For the children of the root the branch is t_left + t_right. */
+double ln_likelihood_at_edge (phylogeny phy, topology tre, topol_node node, double blength, double *first_deriv, double *second_deriv);
+
+/*! \brief maximum likelihood branch lengths (topology_struct::blength) by Newton-Raphson with analytical derivatives.
+ *
+ * Each sweep visits the branches in preorder, updating the upstream vector of each node from its parent's before
+ * optimising its branch, and recalculating the downstream vectors on the way back. Sweeps are repeated (up to n_sweeps)
+ * while ln(likelihood) improves by more than tolerance. Current partial likelihoods are overwritten, and
+ * phylogeny_struct::lk_current is updated and returned. */
+double ln_likelihood_optimise_branch_lengths (phylogeny phy, topology tre, int n_sweeps, double tolerance);
+
+/*! \brief ln(likelihood) of all partitions, updating all internal nodes of partitions whose evolution_model, topology
+ * or branch lengths changed since last accepted (or all partitions after partitioned_phylogeny_invalidate()); the others
+ * keep their lk_current.
+ *
+ * Partitions larger than the share of one thread are calculated in turn, each parallelised over its patterns; the
+ * remaining are distributed dynamically over threads from the largest to the smallest, one partition per thread. */
+void ln_likelihood_partitioned (partitioned_phylogeny pp, topology tre);
+void accept_likelihood_partitioned (partitioned_phylogeny pp, topology tre);
+
+/*! \brief ln(likelihood) of all partitions, based on changed nodes (see ln_likelihood_moved_branches()), with the same
+ * scheduling as ln_likelihood_partitioned() */
+void ln_likelihood_moved_branches_partitioned (partitioned_phylogeny pp, topology tre);
+void accept_likelihood_moved_branches_partitioned (partitioned_phylogeny pp, topology tre);
+
+/*! \brief ln(likelihood) of n_loci independent phylogenies (e.g. gene families), all calculated in one parallel region
+ * and returned in lnLk[] (if not NULL) besides phylogeny_struct::lk_proposal of each locus.
+ *
+ * Locus i uses topology tre[tre_idx[i]], or tre[0] if tre_idx is NULL (same topology for all loci). If moved_branches
+ * is true then only the changed nodes are recalculated (see ln_likelihood_moved_branches()). Scheduling is the same as
+ * in ln_likelihood_partitioned(): loci are distributed dynamically over threads from the largest to the smallest. */
+void ln_likelihood_multilocus (phylogeny *phy, int n_loci, topology *tre, int *tre_idx, bool moved_branches, double *lnLk);
+/*! \brief accept the proposals of ln_likelihood_multilocus() for all loci */
+void accept_likelihood_multilocus (phylogeny *phy, int n_loci, topology *tre, int *tre_idx, bool moved_branches);
+
+/*! \brief difference between ln(likelihood) calculated with partial likelihoods stored in single precision and in double
+ * precision (also returned in lnLk_single and lnLk_double if not NULL), for validating phylogeny_set_single_precision()
+ * on a data set. Uses temporary vectors, s.t. the phylogeny is not changed (besides its transition matrices) */
+double ln_likelihood_precision_discrepancy (phylogeny phy, topology tre, double *lnLk_double, double *lnLk_single);
+
 /*! \brief set likelihood functions to neglect alignment data, constant at one (ln = 0) [Bayesian prior] */
 void set_likelihood_to_prior (void);
 /*! \brief explicitly tell program that we must calculate likelihoods (simulating posterior distribution); set by default */
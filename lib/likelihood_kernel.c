@@ -0,0 +1,311 @@
+/* SPDX-License-Identifier: GPL-3.0-or-later
+ *
+ * This file is part of biomcmc-lib, a low-level library for phylogenomic analysis.
+ * Copyright (C) 2019-today  Leonardo de Oliveira Martins [ leomrtns at gmail.com;  http://www.leomartins.org ]
+ *
+ * biomcmc is free software; you can redistribute it and/or modify it under the terms of the GNU General Public
+ * License as published by the Free Software Foundation; either version 2 of the License, or (at your option) any later
+ * version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY; without even the implied
+ * warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details (file "COPYING" or http://www.gnu.org/copyleft/gpl.html).
+ */
+/*! \file
+ *  \brief partial likelihood kernels; SIMD versions are compiled with function-level target attributes such that the
+ *  library still runs on older CPUs (conda etc.) and the best version is chosen at runtime.
+ */
+
+#include "likelihood_kernel.h"
+
+#if !defined(BIOMCMC_NO_SIMD) && (defined(__x86_64__) || defined(__i386__)) && (defined(__GNUC__) || defined(__clang__))
+#define BIOMCMC_X86_SIMD
+#include <immintrin.h>
+#endif
+
+double lk_partial_4state_scalar (double *res, const double *left, const double *right, const double *Pl, const double *Pr);
+double lk_root_4state_scalar (const double *left, const double *right, const double *P, const double *pi);
+double lk_partial_4state_tip_scalar (double *res, const double *tip, const double *right, const double *Pr);
+double lk_partial_4state_dispatch (double *res, const double *left, const double *right, const double *Pl, const double *Pr);
+double lk_partial_4state_tip_dispatch (double *res, const double *tip, const double *right, const double *Pr);
+double lk_root_4state_dispatch (const double *left, const double *right, const double *P, const double *pi);
+double lk_partial_4state_mixed_scalar (double *res, const float *left, const float *right, const double *Pl, const double *Pr);
+double lk_partial_4state_tip_mixed_scalar (double *res, const double *tip, const float *right, const double *Pr);
+double lk_root_4state_mixed_scalar (const float *left, const float *right, const double *P, const double *pi);
+double lk_partial_4state_mixed_dispatch (double *res, const float *left, const float *right, const double *Pl, const double *Pr);
+double lk_partial_4state_tip_mixed_dispatch (double *res, const double *tip, const float *right, const double *Pr);
+double lk_root_4state_mixed_dispatch (const float *left, const float *right, const double *P, const double *pi);
+
+/* before first call the pointers lead to a function that detects the CPU features (defined in likelihood_kernel.h as external) */
+double (*lk_kernel_partial_4state) (double *res, const double *left, const double *right, const double *Pl, const double *Pr) = &lk_partial_4state_dispatch;
+double (*lk_kernel_root_4state) (const double *left, const double *right, const double *P, const double *pi) = &lk_root_4state_dispatch;
+double (*lk_kernel_partial_4state_tip) (double *res, const double *tip, const double *right, const double *Pr) = &lk_partial_4state_tip_dispatch;
+double (*lk_kernel_partial_4state_mixed) (double *res, const float *left, const float *right, const double *Pl, const double *Pr) = &lk_partial_4state_mixed_dispatch;
+double (*lk_kernel_partial_4state_tip_mixed) (double *res, const double *tip, const float *right, const double *Pr) = &lk_partial_4state_tip_mixed_dispatch;
+double (*lk_kernel_root_4state_mixed) (const float *left, const float *right, const double *P, const double *pi) = &lk_root_4state_mixed_dispatch;
+
+static int lk_kernel_level = -1; /* negative if not initialised yet */
+
+/* Kernels for N states, with children vectors of type T (double, or float for mixed precision where the arithmetic is
+ * still in double precision). N is a compile-time constant s.t. loops are unrolled and vectorised by the compiler, for the
+ * instruction set given by ATTR (e.g. a target attribute). The matrix-vector products are sums of scaled columns of the
+ * transposed matrices, and are thus contiguous in memory. */
+#define LK_KERNEL_NSTATE(N,T,NAME,ATTR) \
+ATTR double \
+lk_partial_##N##state##NAME (double *res, const T *left, const T *right, const double *Pl, const double *Pr) \
+{ \
+  int s1, s2; \
+  double lkl[N], lkr[N], lkMax = 0.; \
+  for (s1 = 0; s1 < N; s1++) lkl[s1] = lkr[s1] = 0.; \
+  for (s2 = 0; s2 < N; s2++) for (s1 = 0; s1 < N; s1++) { \
+    lkl[s1] += Pl[N * s2 + s1] * (double) left[s2]; \
+    lkr[s1] += Pr[N * s2 + s1] * (double) right[s2]; \
+  } \
+  for (s1 = 0; s1 < N; s1++) { \
+    res[s1] = lkl[s1] * lkr[s1]; \
+    if (res[s1] > lkMax) lkMax = res[s1]; \
+  } \
+  return lkMax; \
+} \
+ATTR double \
+lk_partial_##N##state_tip##NAME (double *res, const double *tip, const T *right, const double *Pr) \
+{ \
+  int s1, s2; \
+  double lkr[N], lkMax = 0.; \
+  for (s1 = 0; s1 < N; s1++) lkr[s1] = 0.; \
+  for (s2 = 0; s2 < N; s2++) for (s1 = 0; s1 < N; s1++) lkr[s1] += Pr[N * s2 + s1] * (double) right[s2]; \
+  for (s1 = 0; s1 < N; s1++) { \
+    res[s1] = lkr[s1] * tip[s1]; \
+    if (res[s1] > lkMax) lkMax = res[s1]; \
+  } \
+  return lkMax; \
+} \
+ATTR double \
+lk_root_##N##state##NAME (const T *left, const T *right, const double *P, const double *pi) \
+{ \
+  int s1, s2; \
+  double lkr[N], LikSite = 0.; \
+  for (s1 = 0; s1 < N; s1++) lkr[s1] = 0.; \
+  for (s2 = 0; s2 < N; s2++) for (s1 = 0; s1 < N; s1++) lkr[s1] += P[N * s2 + s1] * (double) right[s2]; \
+  for (s1 = 0; s1 < N; s1++) LikSite += pi[s1] * (double) left[s1] * lkr[s1]; \
+  return LikSite; \
+}
+
+LK_KERNEL_NSTATE(4, double, _scalar, )
+LK_KERNEL_NSTATE(4, float, _mixed_scalar, )
+LK_KERNEL_NSTATE(20, double, _scalar, )  /* amino acids */
+LK_KERNEL_NSTATE(20, float, _mixed_scalar, )
+LK_KERNEL_NSTATE(61, double, _scalar, )  /* codons */
+LK_KERNEL_NSTATE(61, float, _mixed_scalar, )
+
+#ifdef BIOMCMC_X86_SIMD
+
+/* largest and sum of the four doubles of a 256 bits register */
+#define lk_m256d_hmax(x) _mm_cvtsd_f64 (_mm_max_sd (_mm_max_pd (_mm256_castpd256_pd128 (x), _mm256_extractf128_pd (x, 1)), \
+                          _mm_unpackhi_pd (_mm_max_pd (_mm256_castpd256_pd128 (x), _mm256_extractf128_pd (x, 1)), \
+                                           _mm_max_pd (_mm256_castpd256_pd128 (x), _mm256_extractf128_pd (x, 1)))))
+#define lk_m256d_hsum(x) _mm_cvtsd_f64 (_mm_add_sd (_mm_add_pd (_mm256_castpd256_pd128 (x), _mm256_extractf128_pd (x, 1)), \
+                          _mm_unpackhi_pd (_mm_add_pd (_mm256_castpd256_pd128 (x), _mm256_extractf128_pd (x, 1)), \
+                                           _mm_add_pd (_mm256_castpd256_pd128 (x), _mm256_extractf128_pd (x, 1)))))
+
+__attribute__((target("avx2,fma"))) double
+lk_partial_4state_avx2 (double *res, const double *left, const double *right, const double *Pl, const double *Pr)
+{
+  __m256d l, r;
+  l = _mm256_mul_pd (_mm256_broadcast_sd (left), _mm256_loadu_pd (Pl));
+  r = _mm256_mul_pd (_mm256_broadcast_sd (right), _mm256_loadu_pd (Pr));
+  l = _mm256_fmadd_pd (_mm256_broadcast_sd (left + 1),  _mm256_loadu_pd (Pl + 4),  l);
+  r = _mm256_fmadd_pd (_mm256_broadcast_sd (right + 1), _mm256_loadu_pd (Pr + 4),  r);
+  l = _mm256_fmadd_pd (_mm256_broadcast_sd (left + 2),  _mm256_loadu_pd (Pl + 8),  l);
+  r = _mm256_fmadd_pd (_mm256_broadcast_sd (right + 2), _mm256_loadu_pd (Pr + 8),  r);
+  l = _mm256_fmadd_pd (_mm256_broadcast_sd (left + 3),  _mm256_loadu_pd (Pl + 12), l);
+  r = _mm256_fmadd_pd (_mm256_broadcast_sd (right + 3), _mm256_loadu_pd (Pr + 12), r);
+  l = _mm256_mul_pd (l, r); /* element-wise product of children */
+  _mm256_storeu_pd (res, l);
+  return lk_m256d_hmax (l);
+}
+
+__attribute__((target("avx2,fma"))) double
+lk_partial_4state_tip_avx2 (double *res, const double *tip, const double *right, const double *Pr)
+{
+  __m256d r;
+  r = _mm256_mul_pd (_mm256_broadcast_sd (right), _mm256_loadu_pd (Pr));
+  r = _mm256_fmadd_pd (_mm256_broadcast_sd (right + 1), _mm256_loadu_pd (Pr + 4),  r);
+  r = _mm256_fmadd_pd (_mm256_broadcast_sd (right + 2), _mm256_loadu_pd (Pr + 8),  r);
+  r = _mm256_fmadd_pd (_mm256_broadcast_sd (right + 3), _mm256_loadu_pd (Pr + 12), r);
+  r = _mm256_mul_pd (r, _mm256_loadu_pd (tip)); /* left child was precomputed */
+  _mm256_storeu_pd (res, r);
+  return lk_m256d_hmax (r);
+}
+
+__attribute__((target("avx2,fma"))) double
+lk_root_4state_avx2 (const double *left, const double *right, const double *P, const double *pi)
+{
+  __m256d r;
+  r = _mm256_mul_pd (_mm256_broadcast_sd (right), _mm256_loadu_pd (P));
+  r = _mm256_fmadd_pd (_mm256_broadcast_sd (right + 1), _mm256_loadu_pd (P + 4),  r);
+  r = _mm256_fmadd_pd (_mm256_broadcast_sd (right + 2), _mm256_loadu_pd (P + 8),  r);
+  r = _mm256_fmadd_pd (_mm256_broadcast_sd (right + 3), _mm256_loadu_pd (P + 12), r);
+  r = _mm256_mul_pd (r, _mm256_mul_pd (_mm256_loadu_pd (left), _mm256_loadu_pd (pi)));
+  return lk_m256d_hsum (r);
+}
+
+/* mixed precision versions: four floats are loaded and converted to doubles (halving the memory traffic) */
+__attribute__((target("avx2,fma"))) double
+lk_partial_4state_mixed_avx2 (double *res, const float *left, const float *right, const double *Pl, const double *Pr)
+{
+  __m256d l, r, x = _mm256_cvtps_pd (_mm_loadu_ps (left)), y = _mm256_cvtps_pd (_mm_loadu_ps (right));
+  l = _mm256_mul_pd (_mm256_permute4x64_pd (x, 0x00), _mm256_loadu_pd (Pl));
+  r = _mm256_mul_pd (_mm256_permute4x64_pd (y, 0x00), _mm256_loadu_pd (Pr));
+  l = _mm256_fmadd_pd (_mm256_permute4x64_pd (x, 0x55), _mm256_loadu_pd (Pl + 4),  l);
+  r = _mm256_fmadd_pd (_mm256_permute4x64_pd (y, 0x55), _mm256_loadu_pd (Pr + 4),  r);
+  l = _mm256_fmadd_pd (_mm256_permute4x64_pd (x, 0xaa), _mm256_loadu_pd (Pl + 8),  l);
+  r = _mm256_fmadd_pd (_mm256_permute4x64_pd (y, 0xaa), _mm256_loadu_pd (Pr + 8),  r);
+  l = _mm256_fmadd_pd (_mm256_permute4x64_pd (x, 0xff), _mm256_loadu_pd (Pl + 12), l);
+  r = _mm256_fmadd_pd (_mm256_permute4x64_pd (y, 0xff), _mm256_loadu_pd (Pr + 12), r);
+  l = _mm256_mul_pd (l, r);
+  _mm256_storeu_pd (res, l);
+  return lk_m256d_hmax (l);
+}
+
+__attribute__((target("avx2,fma"))) double
+lk_partial_4state_tip_mixed_avx2 (double *res, const double *tip, const float *right, const double *Pr)
+{
+  __m256d r, y = _mm256_cvtps_pd (_mm_loadu_ps (right));
+  r = _mm256_mul_pd (_mm256_permute4x64_pd (y, 0x00), _mm256_loadu_pd (Pr));
+  r = _mm256_fmadd_pd (_mm256_permute4x64_pd (y, 0x55), _mm256_loadu_pd (Pr + 4),  r);
+  r = _mm256_fmadd_pd (_mm256_permute4x64_pd (y, 0xaa), _mm256_loadu_pd (Pr + 8),  r);
+  r = _mm256_fmadd_pd (_mm256_permute4x64_pd (y, 0xff), _mm256_loadu_pd (Pr + 12), r);
+  r = _mm256_mul_pd (r, _mm256_loadu_pd (tip));
+  _mm256_storeu_pd (res, r);
+  return lk_m256d_hmax (r);
+}
+
+__attribute__((target("avx2,fma"))) double
+lk_root_4state_mixed_avx2 (const float *left, const float *right, const double *P, const double *pi)
+{
+  __m256d r, y = _mm256_cvtps_pd (_mm_loadu_ps (right));
+  r = _mm256_mul_pd (_mm256_permute4x64_pd (y, 0x00), _mm256_loadu_pd (P));
+  r = _mm256_fmadd_pd (_mm256_permute4x64_pd (y, 0x55), _mm256_loadu_pd (P + 4),  r);
+  r = _mm256_fmadd_pd (_mm256_permute4x64_pd (y, 0xaa), _mm256_loadu_pd (P + 8),  r);
+  r = _mm256_fmadd_pd (_mm256_permute4x64_pd (y, 0xff), _mm256_loadu_pd (P + 12), r);
+  r = _mm256_mul_pd (r, _mm256_mul_pd (_mm256_cvtps_pd (_mm_loadu_ps (left)), _mm256_loadu_pd (pi)));
+  return lk_m256d_hsum (r);
+}
+
+/* 20 and 61 states are long enough for the compiler to vectorise the columns (with FMA) */
+LK_KERNEL_NSTATE(20, double, _avx2, __attribute__((target("avx2,fma"))))
+LK_KERNEL_NSTATE(20, float, _mixed_avx2, __attribute__((target("avx2,fma"))))
+LK_KERNEL_NSTATE(61, double, _avx2, __attribute__((target("avx2,fma"))))
+LK_KERNEL_NSTATE(61, float, _mixed_avx2, __attribute__((target("avx2,fma"))))
+
+#endif // BIOMCMC_X86_SIMD
+
+/* kernels for other state spaces are updated together with the 4-state ones, by set_likelihood_kernel() */
+static struct lk_kernel_struct lk_kernel_4state = {4, &lk_partial_4state_dispatch, &lk_partial_4state_tip_dispatch, 
+  &lk_root_4state_dispatch, &lk_partial_4state_mixed_dispatch, &lk_partial_4state_tip_mixed_dispatch, &lk_root_4state_mixed_dispatch};
+static struct lk_kernel_struct lk_kernel_20state = {20, &lk_partial_20state_scalar, &lk_partial_20state_tip_scalar, 
+  &lk_root_20state_scalar, &lk_partial_20state_mixed_scalar, &lk_partial_20state_tip_mixed_scalar, &lk_root_20state_mixed_scalar};
+static struct lk_kernel_struct lk_kernel_61state = {61, &lk_partial_61state_scalar, &lk_partial_61state_tip_scalar, 
+  &lk_root_61state_scalar, &lk_partial_61state_mixed_scalar, &lk_partial_61state_tip_mixed_scalar, &lk_root_61state_mixed_scalar};
+
+lk_kernel lk_kernel_nstate[LK_KERNEL_MAX_STATES + 1] = {[4] = &lk_kernel_4state, [20] = &lk_kernel_20state, [61] = &lk_kernel_61state};
+
+#define lk_kernel_set_nstate(k,N,NAME) do { \
+  (k).partial = &lk_partial_##N##state##NAME;  (k).partial_tip = &lk_partial_##N##state_tip##NAME; \
+  (k).root = &lk_root_##N##state##NAME;  (k).partial_mixed = &lk_partial_##N##state_mixed##NAME; \
+  (k).partial_tip_mixed = &lk_partial_##N##state_tip_mixed##NAME;  (k).root_mixed = &lk_root_##N##state_mixed##NAME; } while (0)
+
+int
+set_likelihood_kernel (int simd_level)
+{
+  int best = BIOMCMC_SIMD_NONE;
+#ifdef BIOMCMC_X86_SIMD
+  __builtin_cpu_init ();
+  /* AVX-512 (both children in one register) was not faster than AVX2, since the operands must be assembled each time */
+  if (__builtin_cpu_supports ("avx2") && __builtin_cpu_supports ("fma")) best = BIOMCMC_SIMD_AVX2;
+#endif
+  if ((simd_level < 0) || (simd_level > best)) simd_level = best;
+
+  switch (simd_level) {
+#ifdef BIOMCMC_X86_SIMD
+    case BIOMCMC_SIMD_AVX2:
+      lk_kernel_partial_4state = &lk_partial_4state_avx2;
+      lk_kernel_root_4state    = &lk_root_4state_avx2;
+      lk_kernel_partial_4state_tip = &lk_partial_4state_tip_avx2;
+      lk_kernel_partial_4state_mixed = &lk_partial_4state_mixed_avx2;
+      lk_kernel_partial_4state_tip_mixed = &lk_partial_4state_tip_mixed_avx2;
+      lk_kernel_root_4state_mixed = &lk_root_4state_mixed_avx2;
+      lk_kernel_set_nstate (lk_kernel_20state, 20, _avx2);
+      lk_kernel_set_nstate (lk_kernel_61state, 61, _avx2);
+      break;
+#endif
+    default:
+      simd_level = BIOMCMC_SIMD_NONE;
+      lk_kernel_partial_4state = &lk_partial_4state_scalar;
+      lk_kernel_root_4state    = &lk_root_4state_scalar;
+      lk_kernel_partial_4state_tip = &lk_partial_4state_tip_scalar;
+      lk_kernel_partial_4state_mixed = &lk_partial_4state_mixed_scalar;
+      lk_kernel_partial_4state_tip_mixed = &lk_partial_4state_tip_mixed_scalar;
+      lk_kernel_root_4state_mixed = &lk_root_4state_mixed_scalar;
+      lk_kernel_set_nstate (lk_kernel_20state, 20, _scalar);
+      lk_kernel_set_nstate (lk_kernel_61state, 61, _scalar);
+  }
+  lk_kernel_4state.partial = lk_kernel_partial_4state;
+  lk_kernel_4state.partial_tip = lk_kernel_partial_4state_tip;
+  lk_kernel_4state.root = lk_kernel_root_4state;
+  lk_kernel_4state.partial_mixed = lk_kernel_partial_4state_mixed;
+  lk_kernel_4state.partial_tip_mixed = lk_kernel_partial_4state_tip_mixed;
+  lk_kernel_4state.root_mixed = lk_kernel_root_4state_mixed;
+  lk_kernel_level = simd_level;
+  return simd_level;
+}
+
+int
+get_likelihood_kernel (void)
+{
+  if (lk_kernel_level < 0) set_likelihood_kernel (BIOMCMC_SIMD_AUTO);
+  return lk_kernel_level;
+}
+
+double
+lk_partial_4state_dispatch (double *res, const double *left, const double *right, const double *Pl, const double *Pr)
+{
+  set_likelihood_kernel (BIOMCMC_SIMD_AUTO);
+  return lk_kernel_partial_4state (res, left, right, Pl, Pr);
+}
+
+double
+lk_partial_4state_tip_dispatch (double *res, const double *tip, const double *right, const double *Pr)
+{
+  set_likelihood_kernel (BIOMCMC_SIMD_AUTO);
+  return lk_kernel_partial_4state_tip (res, tip, right, Pr);
+}
+
+double
+lk_root_4state_dispatch (const double *left, const double *right, const double *P, const double *pi)
+{
+  set_likelihood_kernel (BIOMCMC_SIMD_AUTO);
+  return lk_kernel_root_4state (left, right, P, pi);
+}
+
+double
+lk_partial_4state_mixed_dispatch (double *res, const float *left, const float *right, const double *Pl, const double *Pr)
+{
+  set_likelihood_kernel (BIOMCMC_SIMD_AUTO);
+  return lk_kernel_partial_4state_mixed (res, left, right, Pl, Pr);
+}
+
+double
+lk_partial_4state_tip_mixed_dispatch (double *res, const double *tip, const float *right, const double *Pr)
+{
+  set_likelihood_kernel (BIOMCMC_SIMD_AUTO);
+  return lk_kernel_partial_4state_tip_mixed (res, tip, right, Pr);
+}
+
+double
+lk_root_4state_mixed_dispatch (const float *left, const float *right, const double *P, const double *pi)
+{
+  set_likelihood_kernel (BIOMCMC_SIMD_AUTO);
+  return lk_kernel_root_4state_mixed (left, right, P, pi);
+}
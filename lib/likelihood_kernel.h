@@ -0,0 +1,80 @@
+/* SPDX-License-Identifier: GPL-3.0-or-later
+ *
+ * This file is part of biomcmc-lib, a low-level library for phylogenomic analysis.
+ * Copyright (C) 2019-today  Leonardo de Oliveira Martins [ leomrtns at gmail.com;  http://www.leomartins.org ]
+ *
+ * biomcmc is free software; you can redistribute it and/or modify it under the terms of the GNU General Public
+ * License as published by the Free Software Foundation; either version 2 of the License, or (at your option) any later
+ * version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY; without even the implied
+ * warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details (file "COPYING" or http://www.gnu.org/copyleft/gpl.html).
+ */
+
+/*! \file likelihood_kernel.h
+ *  \brief Low-level partial likelihood kernels (scalar and SIMD), chosen at runtime from CPU features.
+ *
+ *  The transition matrices used by the kernels are stored transposed and contiguous (see evolution_model_struct::Qt),
+ *  such that column s2 of the original matrix \f$Q_{s1,s2}\f$ is a vector over s1 and the matrix-vector product becomes a
+ *  sum of four scaled columns (one broadcast and one fused multiply-add per state).
+ *
+ *  Other state spaces (amino acids, codons) use the same layout and have kernels generated at compile time for each number
+ *  of states, s.t. all loops have constant bounds and can be unrolled and vectorised (see lk_kernel_nstate).
+ */
+
+#ifndef _biomcmc_likelihood_kernel_h_
+#define _biomcmc_likelihood_kernel_h_
+
+#include "lowlevel.h"
+
+#define BIOMCMC_SIMD_AUTO  -1 /*!< \brief choose best available instruction set at runtime */
+#define BIOMCMC_SIMD_NONE   0 /*!< \brief scalar (portable) code, also the fallback */
+#define BIOMCMC_SIMD_AVX2   1 /*!< \brief AVX2 + FMA (four doubles per register) */
+
+#define LK_KERNEL_MAX_STATES 61 /*!< \brief largest number of states with specialised kernels (codons, without stop codons) */
+
+typedef struct lk_kernel_struct* lk_kernel;
+
+/*! \brief partial likelihood kernels for a given number of states, with the same arguments and matrix layout as the
+ * 4-state kernels lk_kernel_partial_4state() etc. */
+struct lk_kernel_struct
+{
+  int n_state; /*! \brief number of states (length of each partial likelihood vector) */
+  double (*partial) (double *res, const double *left, const double *right, const double *Pl, const double *Pr);
+  double (*partial_tip) (double *res, const double *tip, const double *right, const double *Pr);
+  double (*root) (const double *left, const double *right, const double *P, const double *pi);
+  double (*partial_mixed) (double *res, const float *left, const float *right, const double *Pl, const double *Pr);
+  double (*partial_tip_mixed) (double *res, const double *tip, const float *right, const double *Pr);
+  double (*root_mixed) (const float *left, const float *right, const double *P, const double *pi);
+};
+
+/*! \brief partial likelihood at parent from two children, \f$ res = (P_l \cdot left) \circ (P_r \cdot right)\f$,
+ * returning the largest element of res[] (used in rescaling). Matrices are transposed (Pt[s2*4+s1] = P[s1][s2]) */
+extern double (*lk_kernel_partial_4state) (double *res, const double *left, const double *right, const double *Pl, const double *Pr);
+/*! \brief partial likelihood at parent when left child is a leaf, \f$ res = tip \circ (P_r \cdot right)\f$, where tip already 
+ * contains the product of the leaf's transition matrix by its observed state (see evolution_model_struct::Qt_tip) */
+extern double (*lk_kernel_partial_4state_tip) (double *res, const double *tip, const double *right, const double *Pr);
+/*! \brief site likelihood at root, \f$ \sum_{s1} \pi_{s1} left_{s1} (P \cdot right)_{s1}\f$ with transposed matrix P */
+extern double (*lk_kernel_root_4state) (const double *left, const double *right, const double *P, const double *pi);
+
+/*! \brief mixed precision version of lk_kernel_partial_4state(), with children stored as floats; arithmetic and result
+ * are in double precision, s.t. the calling function can rescale it before storing as float */
+extern double (*lk_kernel_partial_4state_mixed) (double *res, const float *left, const float *right, const double *Pl, const double *Pr);
+/*! \brief mixed precision version of lk_kernel_partial_4state_tip() (right child stored as floats) */
+extern double (*lk_kernel_partial_4state_tip_mixed) (double *res, const double *tip, const float *right, const double *Pr);
+/*! \brief mixed precision version of lk_kernel_root_4state(), with children stored as floats and double accumulation */
+extern double (*lk_kernel_root_4state_mixed) (const float *left, const float *right, const double *P, const double *pi);
+
+/*! \brief kernels for each number of states, or NULL if there is no specialisation (available for 4, 20 and 61 states).
+ * Their instruction set is updated by set_likelihood_kernel(), which must thus be called outside parallel regions (e.g.
+ * through get_likelihood_kernel()) */
+extern lk_kernel lk_kernel_nstate[LK_KERNEL_MAX_STATES + 1];
+
+/*! \brief set kernels to a given instruction set (or best available if BIOMCMC_SIMD_AUTO), returning the one chosen.
+ * If the CPU does not support the requested set then falls back to the best supported one. */
+int set_likelihood_kernel (int simd_level);
+/*! \brief instruction set currently in use by the likelihood kernels (one of BIOMCMC_SIMD_NONE etc.) */
+int get_likelihood_kernel (void);
+
+#endif
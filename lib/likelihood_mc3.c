@@ -0,0 +1,154 @@
+/* SPDX-License-Identifier: GPL-3.0-or-later
+ *
+ * This file is part of biomcmc-lib, a low-level library for phylogenomic analysis.
+ * Copyright (C) 2019-today  Leonardo de Oliveira Martins [ leomrtns at gmail.com;  http://www.leomartins.org ]
+ *
+ * biomcmc is free software; you can redistribute it and/or modify it under the terms of the GNU General Public
+ * License as published by the Free Software Foundation; either version 2 of the License, or (at your option) any later
+ * version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY; without even the implied
+ * warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details (file "COPYING" or http://www.gnu.org/copyleft/gpl.html).
+ */
+/*! \file
+ *  \brief Metropolis-coupled MCMC over topologies, with one chain per thread between swap proposals.
+ */
+
+#include "likelihood_mc3.h"
+
+void mc3_chain_advance (mc3_chains mc, int c, int n_generations);
+void mc3_propose_swap (mc3_chains mc);
+
+mc3_chains
+new_mc3_chains (phylogeny phy, topology tre, int n_chains, double delta_heat, uint64_t seed)
+{
+  int i, *tre_idx;
+  mc3_chains mc;
+
+  if (n_chains < 1) biomcmc_error ("MC3 needs at least one chain");
+  if (delta_heat < 0.) biomcmc_error ("negative heat increment %lf", delta_heat);
+  if (!seed) seed = biomcmc_rng_get_initial_seed ();
+  mc = (mc3_chains) biomcmc_malloc (sizeof (struct mc3_chains_struct));
+  mc->n_chains = n_chains;
+  mc->ref_counter = 1;
+  mc->phy      = (phylogeny*)   biomcmc_malloc (n_chains * sizeof (phylogeny));
+  mc->tre      = (topology*)    biomcmc_malloc (n_chains * sizeof (topology));
+  mc->rng      = (biomcmc_rng*) biomcmc_malloc (n_chains * sizeof (biomcmc_rng));
+  mc->beta     = (double*) biomcmc_malloc (n_chains * sizeof (double));
+  mc->heat     = (int*) biomcmc_malloc (n_chains * sizeof (int));
+  mc->chain_at = (int*) biomcmc_malloc (n_chains * sizeof (int));
+  mc->n_proposed      = (int*) biomcmc_malloc (n_chains * sizeof (int));
+  mc->n_accepted      = (int*) biomcmc_malloc (n_chains * sizeof (int));
+  mc->n_swap_proposed = (int*) biomcmc_malloc (n_chains * sizeof (int));
+  mc->n_swap_accepted = (int*) biomcmc_malloc (n_chains * sizeof (int));
+  tre_idx = (int*) biomcmc_malloc (n_chains * sizeof (int));
+  mc->swap_rng = new_biomcmc_rng (seed, 0);
+
+  for (i = 0; i < n_chains; i++) {
+    mc->phy[i] = new_phylogeny_sharing_data (phy, 0); /* chains only need the accepted and proposal vectors */
+    mc->tre[i] = new_topology (tre->nleaves);
+    copy_topology_from_topology (mc->tre[i], tre);
+    mc->rng[i] = new_biomcmc_rng (seed + (uint64_t) (i + 1), i + 1);
+    mc->beta[i] = 1. / (1. + (double) i * delta_heat);
+    mc->heat[i] = mc->chain_at[i] = tre_idx[i] = i;
+    mc->n_proposed[i] = mc->n_accepted[i] = mc->n_swap_proposed[i] = mc->n_swap_accepted[i] = 0;
+  }
+
+  /* initial likelihoods, with the scheduling of independent loci */
+  ln_likelihood_multilocus (mc->phy, n_chains, mc->tre, tre_idx, false, NULL);
+  accept_likelihood_multilocus (mc->phy, n_chains, mc->tre, tre_idx, false);
+  free (tre_idx);
+  return mc;
+}
+
+void
+del_mc3_chains (mc3_chains mc)
+{
+  int i;
+  if (!mc) return;
+  if (--mc->ref_counter) return;
+  for (i = mc->n_chains - 1; i >= 0; i--) {
+    del_biomcmc_rng (mc->rng[i]);
+    del_topology (mc->tre[i]);
+    del_phylogeny (mc->phy[i]);
+  }
+  del_biomcmc_rng (mc->swap_rng);
+  if (mc->n_swap_accepted) free (mc->n_swap_accepted);
+  if (mc->n_swap_proposed) free (mc->n_swap_proposed);
+  if (mc->n_accepted) free (mc->n_accepted);
+  if (mc->n_proposed) free (mc->n_proposed);
+  if (mc->chain_at) free (mc->chain_at);
+  if (mc->heat) free (mc->heat);
+  if (mc->beta) free (mc->beta);
+  if (mc->rng) free (mc->rng);
+  if (mc->tre) free (mc->tre);
+  if (mc->phy) free (mc->phy);
+  free (mc);
+}
+
+void
+mc3_chains_run (mc3_chains mc, int n_generations, int swap_interval)
+{
+  int i, n_gen, n_done;
+
+  if (swap_interval < 1) swap_interval = 1;
+  get_likelihood_kernel (); /* forces CPU detection outside parallel region */
+
+  for (n_done = 0; n_done < n_generations; n_done += n_gen) {
+    n_gen = (n_generations - n_done < swap_interval) ? n_generations - n_done : swap_interval;
+    /* static schedule keeps each chain (and thus its partial likelihoods) on the same thread */
+#ifdef _OPENMP
+#pragma omp parallel for schedule(static,1) shared(mc,n_gen) private(i)
+#endif
+    for (i = 0; i < mc->n_chains; i++) mc3_chain_advance (mc, i, n_gen);
+    if (mc->n_chains > 1) mc3_propose_swap (mc);
+  }
+}
+
+void
+mc3_chain_advance (mc3_chains mc, int c, int n_generations)
+{
+  int g;
+  double u;
+  phylogeny phy = mc->phy[c];
+  topology tre = mc->tre[c];
+
+  for (g = 0; g < n_generations; g++) { /* each chain draws only from its own stream, thus chains don't wait for each other */
+    topology_apply_spr_stream (tre, true, mc->rng[c]);
+    u = biomcmc_rng_unif_pos_stream (mc->rng[c]);
+    update_topology_traversal (tre);
+    ln_likelihood_moved_branches (phy, tre);
+    mc->n_proposed[c]++;
+    if (log (u) < mc->beta[mc->heat[c]] * (phy->lk_proposal - phy->lk_current)) {
+      accept_likelihood_moved_branches (phy, tre);
+      clear_topology_flags (tre);
+      mc->n_accepted[c]++;
+    }
+    else topology_reset_random_move (tre);
+    update_topology_traversal (tre);
+  }
+}
+
+void
+mc3_propose_swap (mc3_chains mc)
+{
+  int k, i, j;
+  double ln_ratio, u;
+
+  k = (int) biomcmc_rng_unif_int_stream (mc->swap_rng, (uint32_t) (mc->n_chains - 1)); /* heat levels k and k+1 */
+  u = biomcmc_rng_unif_pos_stream (mc->swap_rng);
+
+  i = mc->chain_at[k];
+  j = mc->chain_at[k+1];
+  /* target of level k is L^beta_k, thus exchanging states x_i and x_j has ratio L(x_j)^(beta_k - beta_k+1) / L(x_i)^(...) */
+  ln_ratio = (mc->beta[k] - mc->beta[k+1]) * (mc->phy[j]->lk_current - mc->phy[i]->lk_current);
+  mc->n_swap_proposed[k]++;
+  if (log (u) < ln_ratio) {
+    mc->heat[i] = k + 1;
+    mc->heat[j] = k;
+    mc->chain_at[k] = j;
+    mc->chain_at[k+1] = i;
+    mc->n_swap_accepted[k]++;
+  }
+}
@@ -0,0 +1,60 @@
+/* SPDX-License-Identifier: GPL-3.0-or-later
+ *
+ * This file is part of biomcmc-lib, a low-level library for phylogenomic analysis.
+ * Copyright (C) 2019-today  Leonardo de Oliveira Martins [ leomrtns at gmail.com;  http://www.leomartins.org ]
+ *
+ * biomcmc is free software; you can redistribute it and/or modify it under the terms of the GNU General Public
+ * License as published by the Free Software Foundation; either version 2 of the License, or (at your option) any later
+ * version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY; without even the implied
+ * warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details (file "COPYING" or http://www.gnu.org/copyleft/gpl.html).
+ */
+
+/*! \file likelihood_mc3.h
+ *  \brief Metropolis-coupled MCMC (MC3) over topologies, with chains advancing in parallel.
+ *
+ *  Each chain has its own topology, partial likelihoods and random number stream, while the leaf states and pattern
+ *  weights are shared by all chains (see new_phylogeny_sharing_data()). Chains are distributed over the OpenMP threads
+ *  and run independently for a number of generations, after which they synchronise for one swap proposal between
+ *  adjacent temperatures. Since each chain has its own stream, results do not depend on the number of threads.
+ */
+
+#ifndef _biomcmc_likelihood_mc3_h_
+#define _biomcmc_likelihood_mc3_h_
+
+#include "likelihood.h"
+#include "topology_randomise.h"
+
+typedef struct mc3_chains_struct* mc3_chains;
+
+/*! \brief chains at different temperatures, where chain_at[0] is the cold chain (sampling the posterior) */
+struct mc3_chains_struct
+{
+  int n_chains;       /*! \brief number of chains (and of heat levels) */
+  phylogeny *phy;     /*! \brief partial likelihoods of each chain, with phylogeny_struct::lk_current of its topology */
+  topology *tre;      /*! \brief current topology of each chain */
+  biomcmc_rng *rng;   /*! \brief random number stream of each chain */
+  biomcmc_rng swap_rng; /*! \brief random number stream for swap proposals (used by master thread) */
+  double *beta;       /*! \brief inverse temperature of each heat level, \f$\beta_k = 1/(1 + k \Delta)\f$ */
+  int *heat;          /*! \brief heat level of each chain */
+  int *chain_at;      /*! \brief chain at each heat level (inverse of heat[]) */
+  int *n_proposed, *n_accepted; /*! \brief number of proposals and acceptances of each chain */
+  int *n_swap_proposed, *n_swap_accepted; /*! \brief swap proposals and acceptances between heat levels k and k+1 */
+  int ref_counter;
+};
+
+/*! \brief n_chains chains starting from topology tre (copied), with likelihoods from phylogeny phy, which is not changed
+ * but whose data is shared by the chains. Heat level k has inverse temperature 1/(1 + k * delta_heat), and chain c uses
+ * stream c+1 seeded with seed + c + 1 (the swap stream uses seed, or a seed based on time if zero) */
+mc3_chains new_mc3_chains (phylogeny phy, topology tre, int n_chains, double delta_heat, uint64_t seed);
+void del_mc3_chains (mc3_chains mc);
+
+/*! \brief n_generations SPR proposals on each chain (under a uniform prior), with one swap proposal between a random pair
+ * of adjacent heat levels every swap_interval generations. Chains advance in parallel between swaps (nested pattern
+ * loops run serially), each drawing its moves from its own stream (see topology_apply_spr_stream()), s.t. the global
+ * stream ::biomcmc_random_number is not used. */
+void mc3_chains_run (mc3_chains mc, int n_generations, int swap_interval);
+
+#endif
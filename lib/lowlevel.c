@@ -27,6 +27,16 @@ biomcmc_malloc (size_t size)
   return value;
 }
 
+void *
+biomcmc_malloc_aligned (size_t size)
+{
+  void *value = NULL;
+  if (size == 0) return NULL;
+  size = ((size + BIOMCMC_ALIGNMENT - 1) / BIOMCMC_ALIGNMENT) * BIOMCMC_ALIGNMENT; /* multiple of alignment (tail padding) */
+  if (posix_memalign (&value, BIOMCMC_ALIGNMENT, size)) biomcmc_error ( "biomcmc_malloc_aligned error allocating %d bites", size);
+  return value;
+}
+
 void *
 biomcmc_realloc (void *ptr, size_t size)
 {
@@ -28,6 +28,7 @@
 #include <ctype.h>      /* char operation functions (e.g. isspace() ), case convertion [ANSI C C89] */
 #include <math.h>       /* standard math functions (e.g. exp() ) [ANSI C C89] */
 #include <float.h>      /* DBL_MAX_EXP, DBL_EPSILON constants (to avoid underflow etc) */
+#include <limits.h>     /* INT_MAX, INT_MIN constants [ANSI C C89] */
 #include <time.h>       /* speed profiling(e.g. clock(), clock_gettime(), struct timespec ) [ANSI C C89] */
 #include <unistd.h>     /* system values checking at runtime (e.g. sysconf() ) [POSIX C] */
 #include <sys/time.h>   /* random seed (e.g. gettimeofday(), struct timeval) [POSIX C] */
@@ -60,6 +61,7 @@
 #define BIOMCMC_MIN(x,y) (((x)<(y)) ? (x) : (y))
 #define BIOMCMC_MAX(x,y) (((x)>(y)) ? (x) : (y))
 #define BIOMCMC_MOD(a)   (((a)>0)   ? (a) :(-a))
+#define BIOMCMC_ALIGNMENT 64 /*!< \brief memory alignment (in bytes) of large numeric blocks: one cache line (and two AVX2 registers) */
 
 
 /*! \brief Mnemonic for boolean (char is smaller than int) */
@@ -87,6 +89,14 @@ struct hungarian_struct
  *  \return pointer to newly allocated memory */
 void *biomcmc_malloc (size_t size);
 
+/*! \brief Memory-safe aligned malloc(), with memory aligned to BIOMCMC_ALIGNMENT bytes (a cache line).
+ *
+ *  The size is rounded up to a multiple of BIOMCMC_ALIGNMENT, such that SIMD loads never cross the allocated block.
+ *  Memory must be released with free().
+ *  \param[in] size allocated size, in bytes
+ *  \return pointer to newly allocated memory */
+void *biomcmc_malloc_aligned (size_t size);
+
 /*! \brief Memory-safe realloc() function.
  *
  * Changes the size of the memory block pointed to by ptr to size bytes. An error message is thrown in case of failure.
@@ -17,6 +17,19 @@ int update_biparsdatmat_column_from_ones (binary_parsimony_datamatrix mrp, topol
 void update_binary_parsimony_length (binary_parsimony pars, int new_columns_size);
 void update_binary_parsimony_datamatrix_column_if_new (binary_parsimony_datamatrix mrp);
 uint32_t hash_value_of_binary_parsimony_datamatrix_column (binary_parsimony_datamatrix mrp, int idx);
+/*! \brief true if there are too few columns to keep all threads busy, but enough nodes for independent subtrees */
+bool binary_parsimony_use_subtree_tasks (binary_parsimony pars, topology t);
+/*! \brief pars->score[] where each internal node and block of columns is a task depending only on the same block of its
+ * children, s.t. independent subtrees are calculated in parallel (each thread counts changes in its own score vector) */
+void binary_parsimony_score_by_subtree_tasks (binary_parsimony pars, topology t);
+
+/*! \brief parsimony score of column i (in pars->score[i]), updating the internal nodes in postorder */
+static inline void binary_parsimony_score_at_column (binary_parsimony pars, topology t, int i);
+
+/* below this number of columns per thread, nodes are calculated as tasks over independent subtrees (and column blocks) */
+const int BinParsTaskMaxColumnsPerThread = 1024;
+const int BinParsTaskMinBlockSize = 64; /* smallest column block of a task, also a multiple of the cache line (in bools) */
+const int BinParsTaskMinLeaves = 32;    /* smaller trees are always parallel over columns */
 
 binary_parsimony_datamatrix
 new_binary_parsimony_datamatrix (int n_sequences)
@@ -200,26 +213,20 @@ hash_value_of_binary_parsimony_datamatrix_column (binary_parsimony_datamatrix mr
 int
 binary_parsimony_score_of_topology (binary_parsimony pars, topology t)
 {
-  int i,j, pars_score = 0, incompatible = 0;
+  int i, pars_score = 0, incompatible = 0;
   double  incomplete = 0., complete = 0.;
-  bool s1, s2, intersection;
+  bool by_subtree;
   if (!t->traversal_updated) update_topology_traversal (t);
   for (i=0; i < pars->external->i; i++) pars->score[i] = 0;  // external->i < external->nchar since may have duplicates
+  by_subtree = binary_parsimony_use_subtree_tasks (pars, t);
+  if (by_subtree) binary_parsimony_score_by_subtree_tasks (pars, t); // few columns: threads work on independent subtrees
 #ifdef _OPENMP
-#pragma omp parallel for shared(pars, t) \
-  private(i,j,s1,s2,intersection) reduction (+:pars_score, incompatible, incomplete)
+#pragma omp parallel for shared(pars, t, by_subtree) \
+  private(i) reduction (+:pars_score, incompatible, incomplete, complete)
 #endif
   for (i=0; i < pars->external->i; i++) { // pthreads would go here
-    for (j=0; j < t->nleaves-2; j++) {
-      /* id (0...nleaves) are leaves; (nleaves...2x nleaves-1) are internal nodes */
-      if (t->postorder[j]->left->internal) s1 = pars->internal->s[t->postorder[j]->left->id - t->nleaves][i];
-      else s1 = pars->external->s[t->postorder[j]->left->id][i];
-      if (t->postorder[j]->right->internal) s2 = pars->internal->s[t->postorder[j]->right->id - t->nleaves][i];
-      else s2 = pars->external->s[t->postorder[j]->right->id][i];
-      intersection = s1 & s2; // 11, 01, 00, or 10 
-      if (!intersection) { pars->score[i]++; intersection = s1|s2; } //00 only arises with 10 & 01  
-      pars->internal->s[t->postorder[j]->id - t->nleaves][i] =  intersection;
-    } // for j in tree node
+    if (!pars->external->freq[i]) continue; // columns with zero weight (e.g. absent from a bootstrap replicate) are skipped
+    if (!by_subtree) binary_parsimony_score_at_column (pars, t, i);
     pars_score += (pars->score[i] * pars->external->freq[i]); // only external has freqs
     if (pars->score[i] > 1) incompatible += pars->external->freq[i];
     incomplete += (double) (pars->score[i] * pars->external->freq[i]) / (double) (pars->external->occupancy[i]); // trees w more species are less penalised
@@ -232,6 +239,116 @@ binary_parsimony_score_of_topology (binary_parsimony pars, topology t)
   return pars_score;
 }
 
+void
+binary_parsimony_bootstrap_scores (binary_parsimony pars, topology t, bootstrap_weights bw, int *score)
+{
+  int i, b;
+  if (bw->n_pat != pars->external->i) biomcmc_error ("bootstrap replicates have %d columns but matrix has %d", bw->n_pat, pars->external->i);
+  if (!t->traversal_updated) update_topology_traversal (t);
+  for (i=0; i < pars->external->i; i++) pars->score[i] = 0;
+  if (binary_parsimony_use_subtree_tasks (pars, t)) binary_parsimony_score_by_subtree_tasks (pars, t);
+  else {
+    /* single pass over the columns present in at least one replicate */
+#ifdef _OPENMP
+#pragma omp parallel for shared(pars, t, bw) private(i)
+#endif
+    for (i=0; i < bw->n_active; i++) binary_parsimony_score_at_column (pars, t, bw->active[i]);
+  }
+  /* each replicate is a reweighting of the column scores */
+#ifdef _OPENMP
+#pragma omp parallel for shared(pars, bw, score) private(b,i)
+#endif
+  for (b=0; b < bw->n_rep; b++) {
+    int *w = bw->w + (size_t) b * bw->n_pat;
+    for (score[b] = 0, i=0; i < bw->n_active; i++) score[b] += pars->score[bw->active[i]] * w[bw->active[i]];
+  }
+}
+
+static inline void
+binary_parsimony_score_at_column (binary_parsimony pars, topology t, int i)
+{
+  int j;
+  bool s1, s2, intersection;
+  for (j=0; j < t->nleaves-2; j++) {
+    /* id (0...nleaves) are leaves; (nleaves...2x nleaves-1) are internal nodes */
+    if (t->postorder[j]->left->internal) s1 = pars->internal->s[t->postorder[j]->left->id - t->nleaves][i];
+    else s1 = pars->external->s[t->postorder[j]->left->id][i];
+    if (t->postorder[j]->right->internal) s2 = pars->internal->s[t->postorder[j]->right->id - t->nleaves][i];
+    else s2 = pars->external->s[t->postorder[j]->right->id][i];
+    intersection = s1 & s2; // 11, 01, 00, or 10 
+    if (!intersection) { pars->score[i]++; intersection = s1|s2; } //00 only arises with 10 & 01  
+    pars->internal->s[t->postorder[j]->id - t->nleaves][i] =  intersection;
+  } // for j in tree node
+}
+
+bool
+binary_parsimony_use_subtree_tasks (binary_parsimony pars, topology t)
+{
+#ifdef _OPENMP
+  int n_threads = omp_get_max_threads ();
+  if ((n_threads < 2) || omp_in_parallel ()) return false;
+  return ((t->nleaves >= BinParsTaskMinLeaves) && (pars->external->i < BinParsTaskMaxColumnsPerThread * n_threads));
+#else
+  (void) pars; (void) t;
+  return false;
+#endif
+}
+
+void
+binary_parsimony_score_by_subtree_tasks (binary_parsimony pars, topology t)
+{
+  int i, k, n_threads = 1, n_blk, blk_size, stride, n_col = pars->external->i, *thread_score;
+  char *dep;
+
+#ifdef _OPENMP
+  n_threads = omp_get_max_threads ();
+#endif
+  blk_size = BIOMCMC_MAX ((n_col + n_threads - 1) / n_threads, BinParsTaskMinBlockSize);
+  blk_size = ((blk_size + BinParsTaskMinBlockSize - 1) / BinParsTaskMinBlockSize) * BinParsTaskMinBlockSize;
+  n_blk = (n_col + blk_size - 1) / blk_size;
+  stride = ((n_col + 15) / 16) * 16; /* score vectors of distinct threads do not share cache lines */
+  dep = (char*) biomcmc_malloc ((size_t) t->nnodes * n_blk * sizeof (char)); /* only the addresses are used, as task dependencies */
+  thread_score = (int*) biomcmc_malloc ((size_t) n_threads * stride * sizeof (int));
+  for (i = 0; i < n_threads * stride; i++) thread_score[i] = 0;
+
+#ifdef _OPENMP
+#pragma omp parallel shared(pars, t, dep, n_blk, blk_size, stride, thread_score)
+#pragma omp single
+#endif
+  {
+    int j, b;
+    for (j = 0; j < t->nleaves - 2; j++) for (b = 0; b < n_blk; b++) {
+      topol_node nd = t->postorder[j];
+      char *d_node = dep + (size_t) nd->id * n_blk + b, *d_left = dep + (size_t) nd->left->id * n_blk + b, 
+           *d_right = dep + (size_t) nd->right->id * n_blk + b;
+      (void) d_node; (void) d_left; (void) d_right; /* unused without OpenMP */
+#ifdef _OPENMP
+#pragma omp task firstprivate(nd, b) depend(in: d_left[0], d_right[0]) depend(out: d_node[0])
+#endif
+      {
+        int c, last = BIOMCMC_MIN ((b + 1) * blk_size, pars->external->i), *score = thread_score;
+        bool s1, s2, intersection;
+#ifdef _OPENMP
+        score = thread_score + (size_t) omp_get_thread_num () * stride;
+#endif
+        for (c = b * blk_size; c < last; c++) {
+          if (nd->left->internal) s1 = pars->internal->s[nd->left->id - t->nleaves][c];
+          else s1 = pars->external->s[nd->left->id][c];
+          if (nd->right->internal) s2 = pars->internal->s[nd->right->id - t->nleaves][c];
+          else s2 = pars->external->s[nd->right->id][c];
+          intersection = s1 & s2;
+          if (!intersection) { score[c]++; intersection = s1|s2; }
+          pars->internal->s[nd->id - t->nleaves][c] = intersection;
+        }
+      }
+    }
+  } // parallel region (all tasks are finished at its implicit barrier)
+
+  for (k = 0; k < n_threads; k++) for (i = 0; i < n_col; i++) pars->score[i] += thread_score[(size_t) k * stride + i];
+  free (dep);
+  free (thread_score);
+}
+
 void
 pairwise_distances_from_binary_parsimony_datamatrix (binary_parsimony_datamatrix mrp, double **dist, int size_dist)
 {
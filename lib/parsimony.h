@@ -50,6 +50,10 @@ void del_binary_parsimony (binary_parsimony pars);
 /*! \brief given a map[] with location in sptree of gene tree leaves, update binary matrix with splits from genetree */
 void update_binary_parsimony_from_topology (binary_parsimony pars, topology t, int *map, int n_species);
 int binary_parsimony_score_of_topology (binary_parsimony pars, topology t);
+/*! \brief parsimony score of topology for each bootstrap replicate (in score[0...bw->n_rep-1]), where bw was created from
+ * the column frequencies, i.e. new_bootstrap_weights (pars->external->freq, pars->external->i, n_rep, seed). Column
+ * scores are calculated once, skipping columns absent from all replicates */
+void binary_parsimony_bootstrap_scores (binary_parsimony pars, topology t, bootstrap_weights bw, int *score);
 void pairwise_distances_from_binary_parsimony_datamatrix (binary_parsimony_datamatrix mrp, double **dist, int n_dist);
 
 #endif
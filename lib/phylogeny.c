@@ -17,24 +17,70 @@
  */
 
 #include "phylogeny.h"
+#include "likelihood_kernel.h"
 
-node_likelihood new_node_likelihood (int n_cat, int n_pat, int n_state, int n_cycle);
-void            del_node_likelihood (node_likelihood l, int n_cat, int n_pat);
+node_likelihood new_node_likelihood (int n_cat, int n_pat, int n_state, int n_cycle, bool is_leaf);
+void            del_node_likelihood (node_likelihood l);
 lk_vector new_lk_vector (int n_cat, int n_pat, int n_state);
-void      del_lk_vector (lk_vector u, int n_cat, int n_pat);
+lk_vector new_lk_vector_tip (int n_cat, int n_pat, int n_state);
+void      del_lk_vector (lk_vector u);
+void      lk_vector_set_single_precision (lk_vector u, int n_pat, bool single_precision);
+void      lk_memory_update_capacity (phylogeny phy);
+void      lk_memory_append (lk_memory mem, lk_vector u);
+void      lk_memory_remove (lk_memory mem, lk_vector u);
+void      lk_memory_evict (lk_memory mem, lk_vector u);
+lk_vector lk_memory_victim (lk_memory mem);
+void      lk_first_touch (phylogeny phy, void *p, size_t bytes_per_pattern);
+phylogeny new_phylogeny_with_data (int n_tax, int n_cat, int n_pat, int n_state, int n_cycle, phylogeny data);
+
+phylogeny new_phylogeny_from_alignment_patterns (alignment align, int *pattern, int *freq, int n_pat, int n_cat, int n_state, int n_cycle, 
+                                                 distance_matrix external_dist);
 
-void init_evolution_model_parameters (evolution_model m, double kappa, double alpha, double beta, double *pi);
 void init_eigenvectors_from_eq_frequencies (double **z1, double **z2, double *pi);
+void init_eigenvectors_equal_input (double **z1, double **z2, double *pi, int n_state);
 
 phylogeny
 new_phylogeny_from_alignment (alignment align, int n_cat, int n_state, int n_cycle, distance_matrix external_dist)
 {
-  int i, j, k, l;
+  phylogeny phy;
+  phy = new_phylogeny_from_alignment_patterns (align, NULL, align->pattern_freq, align->npat, n_cat, n_state, n_cycle, external_dist);
+  phy->align_filename = align->filename; /* inherit original file name information */
+  align->filename = NULL;
+  return phy;
+}
+
+phylogeny
+new_phylogeny_from_alignment_charset (alignment align, int charset, int n_cat, int n_state, int n_cycle, distance_matrix external_dist)
+{
+  int n_pat, *pattern, *freq;
+  phylogeny phy;
+
+  if (!align->is_aligned) biomcmc_error ("can't build a phylogeny, sequences not aligned");
+  pattern = (int*) biomcmc_malloc (align->npat * sizeof (int));
+  freq    = (int*) biomcmc_malloc (align->npat * sizeof (int));
+  n_pat = alignment_charset_patterns (align, charset, pattern, freq);
+  if (!n_pat) biomcmc_error ("no sites in gene segment %d", charset + 1);
+  phy = new_phylogeny_from_alignment_patterns (align, pattern, freq, n_pat, n_cat, n_state, n_cycle, external_dist);
+  if (align->filename) { /* alignment is shared by all segments, thus we keep a copy of its file name */
+    phy->align_filename = (char*) biomcmc_malloc ((strlen (align->filename) + 1) * sizeof (char));
+    strcpy (phy->align_filename, align->filename);
+  }
+  free (pattern);
+  free (freq);
+  return phy;
+}
+
+phylogeny
+new_phylogeny_from_alignment_patterns (alignment align, int *pattern, int *freq, int n_pat, int n_cat, int n_state, int n_cycle, 
+                                       distance_matrix external_dist)
+{
+  int i;
   phylogeny phy;
   distance_matrix dist;
   double alpha, beta;
 
   if (!align->is_aligned) biomcmc_error ("can't build a phylogeny, sequences not aligned");
+  if (n_state != 4) biomcmc_error ("alignment has nucleotides, but phylogeny has %d states (see phylogeny_set_leaf_states())", n_state);
 
   if (external_dist == NULL) dist = new_distance_matrix_from_alignment (align);
   else dist = external_dist;
@@ -44,22 +90,14 @@ new_phylogeny_from_alignment (alignment align, int n_cat, int n_state, int n_cyc
   beta  = dist->mean_K2P_dist / dist->var_K2P_dist;
   alpha = beta * dist->mean_K2P_dist;
 
-  phy = new_phylogeny (align->ntax, n_cat, align->npat, n_state, n_cycle);
+  phy = new_phylogeny (align->ntax, n_cat, n_pat, n_state, n_cycle);
   init_evolution_model_parameters (phy->model, dist->mean_R, alpha, beta, dist->freq);
-  phy->nsites = align->nchar; /* original number of sites (may be used to calculate some constant like gamma rates) */
-
-  phy->align_filename = align->filename; /* inherit original file name information */
-  align->filename = NULL;
 
-  for (i = 0; i < phy->ntax; i++) { /* store "trivial likelihood" at first rate category lk[0] */
-    store_likelihood_info_at_leaf (phy->l[i]->d[0]->lk[0], align->character->string[i], align->npat, n_state);
-    for (j=1; j<n_cat; j++) for (k=0; k < phy->npat; k++) { 
-      for (l=0; l < 4; l++) phy->l[i]->d[0]->lk[j][k][l] = phy->l[i]->d[0]->lk[0][k][l]; /* copy to other categories */
-      phy->l[i]->d[0]->lnmax[j][k] = 0.; /* log (scale factor) is zero since tips are already scaled */
-    }
-  }
+  /* leaves store only the observed states; they are never scaled */
+  for (i = 0; i < phy->ntax; i++) store_tip_states_at_leaf (phy->l[i]->d[0]->tip, align->character->string[i], pattern, n_pat);
 
-  for (i = 0; i < phy->npat; i++) phy->weight[i] = (double) align->pattern_freq[i];
+  /* original number of sites (may be used to calculate some constant like gamma rates) */
+  for (phy->nsites = 0, i = 0; i < phy->npat; i++) { phy->weight[i] = (double) freq[i]; phy->nsites += freq[i]; }
 
   if (external_dist == NULL) del_distance_matrix (dist);
 
@@ -68,6 +106,30 @@ new_phylogeny_from_alignment (alignment align, int n_cat, int n_state, int n_cyc
 
 phylogeny
 new_phylogeny (int n_tax, int n_cat, int n_pat, int n_state, int n_cycle)
+{
+  return new_phylogeny_with_data (n_tax, n_cat, n_pat, n_state, n_cycle, NULL);
+}
+
+phylogeny
+new_phylogeny_sharing_data (phylogeny phy, int n_cycle)
+{
+  phylogeny share;
+
+  share = new_phylogeny_with_data (phy->ntax, phy->model->nrates, phy->npat, phy->model->n_state, n_cycle, 
+                                   (phy->data ? phy->data : phy)); /* data is always owned by the original phylogeny */
+  copy_evolution_model (share->model, phy->model, true);
+  share->nsites = phy->nsites;
+  share->lk_current = share->lk_proposal = share->lk_accepted = phy->lk_accepted;
+  share->use_blength = phy->use_blength;
+  share->use_site_repeats = phy->use_site_repeats;
+  share->pattern_chunk = phy->pattern_chunk;
+  share->first_touch = phy->first_touch;
+  phylogeny_set_single_precision (share, phy->single_precision); /* vectors are not allocated yet */
+  return share;
+}
+
+phylogeny
+new_phylogeny_with_data (int n_tax, int n_cat, int n_pat, int n_state, int n_cycle, phylogeny data)
 {
   int i;
   phylogeny phy;
@@ -75,6 +137,7 @@ new_phylogeny (int n_tax, int n_cat, int n_pat, int n_state, int n_cycle)
   /* n_tax, n_pat   => stored here
    * n_cat, n_state => stored in evolution_model (n_cat = nrates)
    * n_cycle        => stored in node_likelihood */
+  if ((n_state > LK_KERNEL_MAX_STATES) || !lk_kernel_nstate[n_state]) biomcmc_error ("no likelihood kernels for %d states", n_state);
   phy = (phylogeny) biomcmc_malloc (sizeof (struct phylogeny_struct));
   phy->npat = n_pat;
   phy->ntax = n_tax;
@@ -82,16 +145,37 @@ new_phylogeny (int n_tax, int n_cat, int n_pat, int n_state, int n_cycle)
   phy->nnodes = 2 * n_tax - 1; 
   phy->lk_current = phy->lk_proposal = phy->lk_accepted = 0.;
   phy->align_filename = NULL;
+  phy->use_blength = true;
+  phy->single_precision = false;
+  phy->use_site_repeats = false;
+  phy->mem = NULL;
+  phy->cache = NULL;
+  phy->data = data;
+  phy->ref_counter = 1;
+  if (data) data->ref_counter++;
 
   phy->l = (node_likelihood*) biomcmc_malloc ((phy->nnodes) * sizeof (node_likelihood));
-  phy->weight   = (double*) biomcmc_malloc (n_pat * sizeof (double)); /* frequency of pattern */
   phy->pat_lnLk = (double*) biomcmc_malloc (n_pat * sizeof (double)); /* log likelihood of pattern */
+  if (data) phy->weight = data->weight;
+  else      phy->weight = (double*) biomcmc_malloc (n_pat * sizeof (double)); /* frequency of pattern */
 
   phy->model = new_evolution_model (n_cat, n_state);
 
   /* internal nodes must have at least one extra partial likelihood vectors (for proposal state) */
-  for (i = 0; i < n_tax; i++)  phy->l[i] = new_node_likelihood (n_cat, n_pat, n_state, 1); /* leaf */
-  for (; i < phy->nnodes; i++) phy->l[i] = new_node_likelihood (n_cat, n_pat, n_state, n_cycle + 2); /* internal node */
+  for (i = 0; i < n_tax; i++)  phy->l[i] = new_node_likelihood (n_cat, n_pat, n_state, 1, true); /* leaf */
+  for (; i < phy->nnodes; i++) phy->l[i] = new_node_likelihood (n_cat, n_pat, n_state, n_cycle + 2, false); /* internal node */
+  if (data) for (i = 0; i < n_tax; i++) { /* observed states are shared, but transition matrices (pmat) are not */
+    free (phy->l[i]->d[0]->tip);
+    phy->l[i]->d[0]->tip = data->l[i]->d[0]->tip;
+  }
+
+  /* leaves and per-pattern arrays are still untouched, and are placed here (before being filled by calling function) */
+  phylogeny_set_pattern_affinity (phy, 0, true);
+  lk_first_touch (phy, phy->pat_lnLk, sizeof (double));
+  if (!data) {
+    lk_first_touch (phy, phy->weight, sizeof (double));
+    for (i = 0; i < n_tax; i++) lk_first_touch (phy, phy->l[i]->d_current->tip, sizeof (uint8_t));
+  }
 
   return phy;
 }
@@ -100,17 +184,138 @@ void
 del_phylogeny (phylogeny phy)
 {
   int i;
+  phylogeny data;
   if (!phy) return;
+  if (--phy->ref_counter) return;
+  if ((data = phy->data)) { /* leaf states and pattern weights belong to the original phylogeny */
+    for (i = 0; i < phy->ntax; i++) phy->l[i]->d[0]->tip = NULL;
+    phy->weight = NULL;
+  }
   if (phy->weight)         free (phy->weight);
   if (phy->pat_lnLk)       free (phy->pat_lnLk);
   if (phy->align_filename) free (phy->align_filename);
+  if (phy->mem)            free (phy->mem);
+  if (phy->cache)          phylogeny_set_likelihood_cache (phy, 0, false);
   if (!phy->model) biomcmc_error ("I cannot deallocate phylogenetic memory since I lost the model");
   if (phy->l) {
-    for (i = phy->nnodes - 1; i >= 0; i--) del_node_likelihood (phy->l[i], phy->model->nrates, phy->npat);
+    for (i = phy->nnodes - 1; i >= 0; i--) del_node_likelihood (phy->l[i]);
     free (phy->l);
   }
   del_evolution_model (phy->model);
   free (phy);
+  del_phylogeny (data); /* only released if this was its last reference */
+}
+
+bootstrap_weights
+new_phylogeny_bootstrap_weights (phylogeny phy, int n_rep, uint64_t seed)
+{
+  int i, *freq = (int*) biomcmc_malloc (phy->npat * sizeof (int));
+  bootstrap_weights bw;
+  for (i = 0; i < phy->npat; i++) freq[i] = (int) (phy->weight[i] + 0.5); /* pattern frequencies, stored as doubles */
+  bw = new_bootstrap_weights (freq, phy->npat, n_rep, seed);
+  free (freq);
+  return bw;
+}
+
+void
+phylogeny_set_leaf_states (phylogeny phy, int leaf, int *state)
+{
+  int i, n = phy->model->n_state;
+  if ((leaf < 0) || (leaf >= phy->ntax)) biomcmc_error ("leaf %d does not exist in phylogeny with %d taxa", leaf, phy->ntax);
+  if (phy->data || (phy->ref_counter > 1)) biomcmc_error ("leaf states are shared with other phylogenies and cannot be changed");
+  for (i = 0; i < phy->npat; i++) {
+    if (n == 4) phy->l[leaf]->d[0]->tip[i] = (uint8_t) (state[i] & 0xf);
+    else phy->l[leaf]->d[0]->tip[i] = (uint8_t) (((state[i] < 0) || (state[i] >= n)) ? n : state[i]); /* n = missing data */
+  }
+}
+
+partitioned_phylogeny
+new_partitioned_phylogeny_from_alignment (alignment align, int n_cat, int n_state, int n_cycle, distance_matrix external_dist)
+{
+  int i, n_pat, *pattern, *freq, *cost;
+  partitioned_phylogeny pp;
+  distance_matrix dist;
+  empfreq ef;
+
+  if (!align->is_aligned) biomcmc_error ("can't build a phylogeny, sequences not aligned");
+  /* all segments start from the same model parameters, estimated from the whole alignment */
+  if (external_dist == NULL) dist = new_distance_matrix_from_alignment (align);
+  else dist = external_dist;
+
+  pp = (partitioned_phylogeny) biomcmc_malloc (sizeof (struct partitioned_phylogeny_struct));
+  pp->lk_current = pp->lk_proposal = pp->lk_accepted = 0.;
+  pp->n_part = align->n_charset;
+
+  /* sites not covered by any CHARSET form an extra partition (which is the whole alignment if there are no CHARSETs) */
+  pattern = (int*) biomcmc_malloc (align->npat * sizeof (int));
+  freq    = (int*) biomcmc_malloc (align->npat * sizeof (int));
+  n_pat = alignment_charset_patterns (align, -1, pattern, freq);
+  if (n_pat) pp->n_part++;
+  free (pattern);
+  free (freq);
+
+  pp->part    = (phylogeny*) biomcmc_malloc (pp->n_part * sizeof (phylogeny));
+  pp->order   = (int*)  biomcmc_malloc (pp->n_part * sizeof (int));
+  pp->version = (int*)  biomcmc_malloc (pp->n_part * sizeof (int));
+  pp->updated = (bool*) biomcmc_malloc (pp->n_part * sizeof (bool));
+  pp->tree_key = (uint64_t*) biomcmc_malloc (2 * pp->n_part * sizeof (uint64_t));
+  cost        = (int*)  biomcmc_malloc (pp->n_part * sizeof (int));
+
+  for (i = 0; i < align->n_charset; i++) 
+    pp->part[i] = new_phylogeny_from_alignment_charset (align, i, n_cat, n_state, n_cycle, dist);
+  if (i < pp->n_part) pp->part[i] = new_phylogeny_from_alignment_charset (align, -1, n_cat, n_state, n_cycle, dist);
+
+  for (i = 0; i < pp->n_part; i++) {
+    cost[i] = pp->part[i]->npat * pp->part[i]->model->nrates;
+    pp->version[i] = -1;
+    pp->updated[i] = false;
+    pp->tree_key[2 * i] = pp->tree_key[2 * i + 1] = 0ULL;
+  }
+  /* largest partitions first, s.t. the scheduler can balance the load among threads */
+  ef = new_empfreq_sort_decreasing (cost, pp->n_part, 2); /* 2 -> vector of ints */
+  for (i = 0; i < pp->n_part; i++) pp->order[i] = ef->i[i].idx;
+
+  del_empfreq (ef);
+  free (cost);
+  if (external_dist == NULL) del_distance_matrix (dist);
+  return pp;
+}
+
+void
+del_partitioned_phylogeny (partitioned_phylogeny pp)
+{
+  int i;
+  if (!pp) return;
+  if (pp->part) {
+    for (i = pp->n_part - 1; i >= 0; i--) del_phylogeny (pp->part[i]);
+    free (pp->part);
+  }
+  if (pp->order)   free (pp->order);
+  if (pp->version) free (pp->version);
+  if (pp->updated) free (pp->updated);
+  if (pp->tree_key) free (pp->tree_key);
+  free (pp);
+}
+
+void
+partitioned_phylogeny_invalidate (partitioned_phylogeny pp)
+{
+  int i;
+  for (i = 0; i < pp->n_part; i++) pp->version[i] = -1;
+}
+
+void
+phylogeny_set_single_precision (phylogeny phy, bool single_precision)
+{
+  int i, j;
+  lk_vector lk;
+  if (phy->single_precision == single_precision) return;
+  for (i = phy->ntax; i < phy->nnodes; i++) { /* whole ring, since d[] may have repeated elements */
+    lk = phy->l[i]->d_accepted;
+    for (j = 0; j < phy->l[i]->n_cycle; j++, lk = lk->next) lk_vector_set_single_precision (lk, phy->npat, single_precision);
+  }
+  phy->single_precision = single_precision;
+  if (phy->mem) lk_memory_update_capacity (phy); /* vectors have a different size */
 }
 
 void
@@ -121,7 +326,7 @@ phylogeny_order_accepted_lk_vector (phylogeny phy)
 
   for (i = phy->ntax; i < phy->nnodes; i++) { /* internal nodes only */
     lk = phy->l[i]->d_accepted; /* zeroes the ratchet (so that accepted->next->next = d[2] etc.) */
-    for (j = 0; j < phy->l[i]->n_cycle; j++, lk = lk->next) phy->l[i]->d[j] = lk;
+    for (j = 0; j < phy->l[i]->n_cycle; j++, lk = lk->next) { phy->l[i]->d[j] = lk; phy->l[i]->d_batch[j] = NULL; }
   }
 }
 
@@ -142,7 +347,7 @@ phylogeny_link_current_to_accepted (phylogeny phy)
 }	
 
 node_likelihood
-new_node_likelihood (int n_cat, int n_pat, int n_state, int n_cycle)
+new_node_likelihood (int n_cat, int n_pat, int n_state, int n_cycle, bool is_leaf)
 {
   int i;
   node_likelihood l;
@@ -151,10 +356,13 @@ new_node_likelihood (int n_cat, int n_pat, int n_state, int n_cycle)
   l->n_cycle = n_cycle;
   l->u = (lk_vector*) biomcmc_malloc ((l->n_cycle) * sizeof (lk_vector));
   l->d = (lk_vector*) biomcmc_malloc ((l->n_cycle) * sizeof (lk_vector));
+  l->d_batch = (lk_vector*) biomcmc_malloc ((l->n_cycle) * sizeof (lk_vector));
+  for (i=0; i < l->n_cycle; i++) l->d_batch[i] = NULL;
 
   for (i=0; i < l->n_cycle; i++) { /* doubly-linked circular list */
     l->u[i] = new_lk_vector (n_cat, n_pat, n_state);
-    l->d[i] = new_lk_vector (n_cat, n_pat, n_state);
+    if (is_leaf) l->d[i] = new_lk_vector_tip (n_cat, n_pat, n_state); /* only downstream vector is observed */
+    else         l->d[i] = new_lk_vector (n_cat, n_pat, n_state);
   }
 
   l->u[0]->prev = l->u[l->n_cycle-1];
@@ -172,72 +380,307 @@ new_node_likelihood (int n_cat, int n_pat, int n_state, int n_cycle)
   l->d_current = l->d_accepted = l->d[0];
   l->d_proposal = l->d[0];
 
+  if (is_leaf) l->pmat = (double*) biomcmc_malloc_aligned (n_cat * lk_tip_states (n_state) * n_state * sizeof (double));
+  else         l->pmat = (double*) biomcmc_malloc_aligned (n_cat * n_state * n_state * sizeof (double));
+  l->pmat_blength = -1.; /* forces calculation on first use */
+  l->pmat_version = 0;
+
   return l;
 }
 
 void
-del_node_likelihood (node_likelihood l, int n_cat, int n_pat)
+del_node_likelihood (node_likelihood l)
 {
   int i;
   if (!l) return;
   if (l->u) {
-    for (i = l->n_cycle - 1; i >= 0; i--) del_lk_vector (l->u[i], n_cat, n_pat);
+    for (i = l->n_cycle - 1; i >= 0; i--) del_lk_vector (l->u[i]);
     free (l->u);
   }
   if (l->d) {
-    for (i = l->n_cycle - 1; i >= 0; i--) del_lk_vector (l->d[i], n_cat, n_pat);
+    for (i = l->n_cycle - 1; i >= 0; i--) del_lk_vector (l->d[i]);
     free (l->d);
   }
+  if (l->d_batch) free (l->d_batch);
+  if (l->pmat) free (l->pmat);
   free (l);
 }
 
 lk_vector
 new_lk_vector (int n_cat, int n_pat, int n_state)
 {
-  int j, k;
   lk_vector u;
 
   u = (lk_vector) biomcmc_malloc (sizeof (struct lk_vector_struct));
   u->prev = u->next = NULL;
+  u->lru_prev = u->lru_next = NULL;
+  u->pinned  = 0;
+  u->n_cat   = n_cat;
+  u->n_state = n_state;
+  (void) n_pat;
+
+  /* storage is allocated on first use, as one aligned block each (see phylogeny_acquire_lk_vector()) */
+  u->lk    = NULL;
+  u->lkf   = NULL; /* see phylogeny_set_single_precision() */
+  u->rep   = NULL; /* allocated only if site repeats are used */
+  u->n_rep = 0;
+  u->scale = NULL;
+  u->tip   = NULL;
 
-  u->lk    = (double***) biomcmc_malloc ((n_cat) * sizeof (double**));
-  u->lnmax = (double**)  biomcmc_malloc ((n_cat) * sizeof (double*));
-  for (j = 0; j < n_cat; j++) { 
-    u->lk[j]    = (double**) biomcmc_malloc (n_pat * sizeof (double*));
-    u->lnmax[j] = (double*)  biomcmc_malloc (n_pat * sizeof (double));
-    for (k = 0; k < n_pat; k++) u->lk[j][k] = (double*) biomcmc_malloc (n_state * sizeof (double));
-  }
+  return u;
+}
+
+lk_vector
+new_lk_vector_tip (int n_cat, int n_pat, int n_state)
+{
+  lk_vector u;
+
+  u = (lk_vector) biomcmc_malloc (sizeof (struct lk_vector_struct));
+  u->prev = u->next = NULL;
+  u->lru_prev = u->lru_next = NULL;
+  u->pinned  = 0;
+  u->n_cat   = n_cat;
+  u->n_state = n_state;
+  u->lk = NULL;
+  u->lkf = NULL;
+  u->rep = NULL;
+  u->n_rep = 0;
+  u->scale = NULL;
+  u->tip = (uint8_t*) biomcmc_malloc ((size_t) n_pat * sizeof (uint8_t)); /* one byte per pattern */
 
   return u;
 }
 
 void
-del_lk_vector (lk_vector u, int n_cat, int n_pat)
+lk_vector_set_single_precision (lk_vector u, int n_pat, bool single_precision)
 {
-  if (!u) return;
-  if (u->lk) {
-    int j, k;
-    for (j = n_cat - 1; j >= 0; j--) { 
-      if (u->lk[j]) {
-        for (k = n_pat - 1; k >= 0; k--) if (u->lk[j][k]) free (u->lk[j][k]);
-        free (u->lk[j]);
+  int expo;
+  size_t i, j, n = (size_t) n_pat * u->n_cat * u->n_state;
+  double lkMax, factor;
+  if (u->tip) return; /* leaves store only the observed states */
+  if (single_precision && u->lk) {
+    u->lkf = (float*) biomcmc_malloc_aligned (n * sizeof (float));
+    for (i = 0; i < n; i += u->n_state) { /* values may be below float range, thus each block is rescaled to [0.5,1) */
+      for (lkMax = 0., j = 0; j < (size_t) u->n_state; j++) if (lkMax < u->lk[i+j]) lkMax = u->lk[i+j];
+      if (lkMax > 0.) { frexp (lkMax, &expo); u->scale[i / u->n_state] += expo; factor = ldexp (1., -expo); }
+      else factor = 1.;
+      for (j = 0; j < (size_t) u->n_state; j++) u->lkf[i+j] = (float) (u->lk[i+j] * factor);
+    }
+    free (u->lk);
+    u->lk = NULL;
+  }
+  else if (!single_precision && u->lkf) {
+    u->lk = (double*) biomcmc_malloc_aligned (n * sizeof (double));
+    for (i = 0; i < n; i++) u->lk[i] = (double) u->lkf[i];
+    free (u->lkf);
+    u->lkf = NULL;
+  }
+}
+
+bool
+phylogeny_acquire_lk_vector (phylogeny phy, lk_vector u)
+{
+  lk_vector w;
+  size_t n = (size_t) phy->npat * u->n_cat;
+
+  if (lk_vector_is_resident (u)) {
+    if (phy->mem && !u->tip) { lk_memory_remove (phy->mem, u); lk_memory_append (phy->mem, u); } /* now most recently used */
+    return true;
+  }
+  u->n_rep = 0; /* values will be calculated per pattern */
+  if (phy->mem) {
+    /* budget may have been reduced (or vectors became larger), thus storage is released */
+    while ((phy->mem->n_resident > phy->mem->max_resident) && (w = lk_memory_victim (phy->mem))) lk_memory_evict (phy->mem, w);
+    if ((phy->mem->n_resident == phy->mem->max_resident) && (w = lk_memory_victim (phy->mem))) {
+      lk_memory_remove (phy->mem, w); /* storage is handed over, avoiding a new allocation */
+      u->lk = w->lk;  u->lkf = w->lkf;  u->scale = w->scale;
+      w->lk = NULL;   w->lkf = NULL;    w->scale = NULL;
+      phy->mem->n_evicted++;
+      lk_memory_append (phy->mem, u);
+      return false;
+    }
+  }
+  if (phy->single_precision) u->lkf = (float*) biomcmc_malloc_aligned (n * u->n_state * sizeof (float));
+  else                       u->lk = (double*) biomcmc_malloc_aligned (n * u->n_state * sizeof (double));
+  u->scale = (int*) biomcmc_malloc_aligned (n * sizeof (int));
+  /* pages are placed close to the threads which will calculate each pattern (if phy->first_touch) */
+  if (u->lkf) lk_first_touch (phy, u->lkf, u->n_cat * u->n_state * sizeof (float));
+  else        lk_first_touch (phy, u->lk,  u->n_cat * u->n_state * sizeof (double));
+  lk_first_touch (phy, u->scale, u->n_cat * sizeof (int));
+  if (phy->mem) {
+    lk_memory_append (phy->mem, u);
+    if (++phy->mem->n_resident > phy->mem->peak_resident) phy->mem->peak_resident = phy->mem->n_resident;
+  }
+  return false;
+}
+
+void
+phylogeny_set_pattern_affinity (phylogeny phy, int n_threads, bool first_touch)
+{
+  /* patterns per page of the largest vectors (in double precision), s.t. threads don't share pages at chunk boundaries */
+  int per_page = BIOMCMC_MAX (1, 4096 / (int) (phy->model->nrates * phy->model->n_state * sizeof (double)));
+
+#ifdef _OPENMP
+  if (n_threads < 1) n_threads = omp_get_max_threads ();
+#endif
+  if (n_threads < 1) n_threads = 1;
+  phy->pattern_chunk = (phy->npat + n_threads - 1) / n_threads;
+  phy->pattern_chunk = BIOMCMC_MAX (1, ((phy->pattern_chunk + per_page - 1) / per_page) * per_page);
+  phy->first_touch = first_touch;
+}
+
+void
+phylogeny_set_likelihood_cache (phylogeny phy, int n_entries, bool store_patterns)
+{
+  if (phy->cache) {
+    if (phy->cache->pat_lnLk) free (phy->cache->pat_lnLk);
+    free (phy->cache->lnLk);
+    free (phy->cache->key);
+    free (phy->cache);
+    phy->cache = NULL;
+  }
+  if (n_entries < 1) return;
+  phy->cache = (lk_cache) biomcmc_malloc (sizeof (struct lk_cache_struct));
+  phy->cache->n_slot = n_entries;
+  phy->cache->store_patterns = store_patterns;
+  phy->cache->key  = (uint64_t*) biomcmc_malloc (2 * n_entries * sizeof (uint64_t));
+  phy->cache->lnLk = (double*) biomcmc_malloc (n_entries * sizeof (double));
+  if (store_patterns) phy->cache->pat_lnLk = (double*) biomcmc_malloc ((size_t) n_entries * phy->npat * sizeof (double));
+  else                phy->cache->pat_lnLk = NULL;
+  phy->cache->n_lookup = phy->cache->n_hit = 0;
+  /* the accepted vectors may not have been calculated yet (or may come from a previous cache) */
+  phy->cache->hit = phy->cache->full = false;
+  phy->cache->stale = true;
+  phylogeny_clear_likelihood_cache (phy);
+}
+
+void
+phylogeny_clear_likelihood_cache (phylogeny phy)
+{
+  int i;
+  if (!phy->cache) return;
+  for (i = 0; i < 2 * phy->cache->n_slot; i++) phy->cache->key[i] = 0ULL;
+}
+
+void
+lk_first_touch (phylogeny phy, void *p, size_t bytes_per_pattern)
+{
+  int pat;
+  if (!p) return;
+#ifdef _OPENMP
+#pragma omp parallel for schedule(static,phy->pattern_chunk) shared(phy,p,bytes_per_pattern) private(pat) if (phy->first_touch && (phy->npat > phy->pattern_chunk))
+#endif
+  for (pat = 0; pat < phy->npat; pat++) memset ((char*) p + (size_t) pat * bytes_per_pattern, 0, bytes_per_pattern);
+}
+
+void
+phylogeny_set_memory_budget (phylogeny phy, size_t budget)
+{
+  int i, j;
+  lk_vector lk, w;
+
+  if (!phy->mem) { 
+    phy->mem = (lk_memory) biomcmc_malloc (sizeof (struct lk_memory_struct));
+    phy->mem->lru_first = phy->mem->lru_last = NULL;
+    phy->mem->n_resident = 0;
+    for (i = 0; i < phy->nnodes; i++) {
+      lk = phy->l[i]->u_accepted; /* upstream vectors are not available under a budget */
+      for (j = 0; j < phy->l[i]->n_cycle; j++, lk = lk->next) lk_memory_evict (NULL, lk); 
+      if (i < phy->ntax) continue;
+      lk = phy->l[i]->d_accepted; /* whole ring, since d[] may have repeated elements */
+      for (j = 0; j < phy->l[i]->n_cycle; j++, lk = lk->next) if (lk_vector_is_resident (lk)) { 
+        lk_memory_append (phy->mem, lk); 
+        phy->mem->n_resident++; 
       }
-      if (u->lnmax[j]) free (u->lnmax[j]);
     }
-    if (u->lk)    free (u->lk);
-    if (u->lnmax) free (u->lnmax);
+    phylogeny_reset_memory_stats (phy);
   }
+  phy->mem->budget = budget;
+  lk_memory_update_capacity (phy);
+  while ((phy->mem->n_resident > phy->mem->max_resident) && (w = lk_memory_victim (phy->mem))) lk_memory_evict (phy->mem, w);
+}
+
+void
+phylogeny_reset_memory_stats (phylogeny phy)
+{
+  if (!phy->mem) return;
+  phy->mem->peak_resident = phy->mem->n_resident;
+  phy->mem->n_computed = phy->mem->n_recomputed = phy->mem->n_evicted = 0;
+}
+
+void
+lk_memory_update_capacity (phylogeny phy)
+{
+  size_t n = (size_t) phy->npat * phy->model->nrates;
+  phy->mem->vector_size = n * phy->model->n_state * (phy->single_precision ? sizeof (float) : sizeof (double)) + n * sizeof (int);
+  if (!phy->mem->budget || (phy->mem->budget / phy->mem->vector_size > (size_t) INT_MAX)) phy->mem->max_resident = INT_MAX;
+  else phy->mem->max_resident = (int) (phy->mem->budget / phy->mem->vector_size);
+}
+
+void
+lk_memory_append (lk_memory mem, lk_vector u)
+{ /* most recently used are at the end of the list */
+  u->lru_next = NULL;
+  u->lru_prev = mem->lru_last;
+  if (mem->lru_last) mem->lru_last->lru_next = u;
+  else mem->lru_first = u;
+  mem->lru_last = u;
+}
+
+void
+lk_memory_remove (lk_memory mem, lk_vector u)
+{
+  if (u->lru_prev) u->lru_prev->lru_next = u->lru_next;
+  else mem->lru_first = u->lru_next;
+  if (u->lru_next) u->lru_next->lru_prev = u->lru_prev;
+  else mem->lru_last = u->lru_prev;
+  u->lru_prev = u->lru_next = NULL;
+}
+
+void
+lk_memory_evict (lk_memory mem, lk_vector u)
+{ /* releases the storage of u (mem is NULL if u is not in the list) */
+  if (!u->lk && !u->lkf) return;
+  if (u->lk)    free (u->lk);
+  if (u->lkf)   free (u->lkf);
+  if (u->scale) free (u->scale);
+  u->lk = NULL;  u->lkf = NULL;  u->scale = NULL;
+  u->n_rep = 0;
+  if (!mem) return;
+  lk_memory_remove (mem, u);
+  mem->n_resident--;
+  mem->n_evicted++;
+}
+
+lk_vector
+lk_memory_victim (lk_memory mem)
+{ /* least recently used vector which is not in use */
+  lk_vector u;
+  for (u = mem->lru_first; u && u->pinned; u = u->lru_next);
+  return u;
+}
+
+void
+del_lk_vector (lk_vector u)
+{
+  if (!u) return;
+  if (u->lk)    free (u->lk);
+  if (u->lkf)   free (u->lkf);
+  if (u->rep)   free (u->rep);
+  if (u->scale) free (u->scale);
+  if (u->tip)   free (u->tip);
   free (u);
 }
 
 evolution_model
-new_evolution_model (int n_cat, int n_state) /*n_state MUST BE 4 */
+new_evolution_model (int n_cat, int n_state)
 {
   int i, j;
   evolution_model m;
   m = (evolution_model) biomcmc_malloc (sizeof (struct evolution_model_struct));
   m->nrates  = n_cat;
   m->n_state = n_state; 
+  m->version = 1;
   m->kappa = m->alpha = m->beta = 1.; /* arbitrary values */
 
   m->rate = (double*)   biomcmc_malloc (n_cat * sizeof (double));
@@ -247,9 +690,11 @@ new_evolution_model (int n_cat, int n_state) /*n_state MUST BE 4 */
     for (j = 0; j < n_state; j++)
       m->Q[i][j]  = (double*) biomcmc_malloc (n_state * sizeof (double));
   }
+  m->Qt = (double*) biomcmc_malloc (n_cat * n_state * n_state * sizeof (double));
+  m->Qt_tip = (double*) biomcmc_malloc_aligned (n_cat * lk_tip_states (n_state) * n_state * sizeof (double));
 
-  m->pi  = (double*) biomcmc_malloc ((n_state + 2) * sizeof (double)); /* pi[4] = pi_Y; pi[5] = pi_R */
-  for (i = 0; i < n_state; i++) m->pi[i] = 0.25;
+  m->pi  = (double*) biomcmc_malloc ((n_state + 2) * sizeof (double)); /* DNA: pi[4] = pi_Y; pi[5] = pi_R */
+  for (i = 0; i < n_state; i++) m->pi[i] = 1./(double) n_state;
   for (; i < n_state + 2; i++) m->pi[i] = 0.5; /* arbitrary values */
 
   m->psi = (double*) biomcmc_malloc (n_state * sizeof (double));
@@ -272,6 +717,8 @@ del_evolution_model (evolution_model m)
   if (!m) return;
   if (m->rate) free (m->rate);
   if (m->pi)   free (m->pi);
+  if (m->Qt)   free (m->Qt);
+  if (m->Qt_tip) free (m->Qt_tip);
   if (m->psi)  free (m->psi);
   if (m->z1) { for (i = m->n_state - 1; i >= 0; i--) if (m->z1[i]) free (m->z1[i]); free (m->z1); }
   if (m->z2) { for (i = m->n_state - 1; i >= 0; i--) if (m->z2[i]) free (m->z2[i]); free (m->z2); }
@@ -291,11 +738,14 @@ init_evolution_model_parameters (evolution_model m, double kappa, double alpha,
   int i;
 
   for (i = 0; i < m->n_state; i++) m->pi[i] = pi[i];
-  m->pi[4] = pi[1] + pi[3]; /* pi_Y = pi_C + pi_T */ /* ASSUMES n_state = 4 */
-  m->pi[5] = pi[0] + pi[2]; /* pi_R = pi_A + pi_G */
+  if (m->n_state == 4) {
+    m->pi[4] = pi[1] + pi[3]; /* pi_Y = pi_C + pi_T */
+    m->pi[5] = pi[0] + pi[2]; /* pi_R = pi_A + pi_G */
+  }
 
   /* initialize left and right eigenvectors (just need to be done once since eq. freqs. don't change) */
-  init_eigenvectors_from_eq_frequencies (m->z1, m->z2, m->pi);
+  if (m->n_state == 4) init_eigenvectors_from_eq_frequencies (m->z1, m->z2, m->pi);
+  else init_eigenvectors_equal_input (m->z1, m->z2, m->pi, m->n_state);
 
   m->kappa = kappa;
   m->alpha = alpha;
@@ -315,12 +765,17 @@ copy_evolution_model (evolution_model to, evolution_model from, bool copy_Qmatri
   to->kappa = from->kappa;
   to->alpha = from->alpha;
   to->beta  = from->beta;
+  to->version++; /* cached matrices are now outdated */
 
   for (i = 0; i < from->n_state + 2; i++) to->pi[i] = from->pi[i];
   for (i = 0; i < from->nrates; i++) to->rate[i] = from->rate[i];
 
   if (copy_Qmatrix) for (i = 0; i < from->nrates; i++) 
-    for (j = 0; j < from->n_state; j++) for (k = 0; k < from->n_state; k++) to->Q[i][j][k] = from->Q[i][j][k];
+    for (j = 0; j < from->n_state; j++) for (k = 0; k < from->n_state; k++) {
+      to->Q[i][j][k] = from->Q[i][j][k];
+      to->Qt[(i * from->n_state + k) * from->n_state + j] = from->Qt[(i * from->n_state + k) * from->n_state + j];
+    }
+  if (copy_Qmatrix) memcpy (to->Qt_tip, from->Qt_tip, from->nrates * lk_tip_states (from->n_state) * from->n_state * sizeof (double));
 
   for (j = 0; j < from->n_state; j++) {
     to->psi[j] = from->psi[j];
@@ -361,16 +816,42 @@ init_eigenvectors_from_eq_frequencies (double **z1, double **z2, double *pi)
   z2[2][2] = -pi[0]/pi[5];
 }
 
+void
+init_eigenvectors_equal_input (double **z1, double **z2, double *pi, int n_state)
+{
+  int i, j, k, s, r = 0;
+  /* P(i|j,t) = pi_i + (delta_ij - pi_i) exp(-beta t): the stationary term has z1[0] = pi and z2[0] = 1, and the other
+   * (degenerate) eigenvectors are e_s - pi, for all states s except a reference state r, whose column is a combination
+   * of the others (since sum_j pi_j (e_j - pi) = 0). Reference is the most frequent state for numerical stability. */
+  for (i = 1; i < n_state; i++) if (pi[i] > pi[r]) r = i;
+  for (i = 0; i < n_state; i++) { z1[0][i] = pi[i]; z2[0][i] = 1.; }
+  for (k = 1; k < n_state; k++) {
+    s = (k <= r) ? k - 1 : k; /* all states but r */
+    for (i = 0; i < n_state; i++) z1[k][i] = ((i == s) ? 1. : 0.) - pi[i];
+    for (j = 0; j < n_state; j++) z2[k][j] = (j == s) ? 1. : ((j == r) ? - pi[s] / pi[r] : 0.);
+  }
+}
+
 void
 update_model_eigenvalues_from_kappa (evolution_model m, double kappa)
 {  /* (double *psi, double *pi, double *kappa) */
-  double k = kappa * ((m->pi[0]*m->pi[2]) + (m->pi[1]*m->pi[3])) + (m->pi[4]*m->pi[5]);
+  int i;
+  double k;
+  if (m->n_state != 4) { /* equal-input model: rate beta normalised s.t. mean rate is one (and kappa is not used) */
+    for (k = 1., i = 0; i < m->n_state; i++) k -= m->pi[i] * m->pi[i];
+    m->psi[0] = 0.;
+    for (i = 1; i < m->n_state; i++) m->psi[i] = 1./k;
+    m->version++;
+    return;
+  }
+  k = kappa * ((m->pi[0]*m->pi[2]) + (m->pi[1]*m->pi[3])) + (m->pi[4]*m->pi[5]);
   //  k = (2. * k)/(2. + kappa);
   k = 0.5/k;
   m->psi[0] = 0.;
   m->psi[1] = k;
   m->psi[2] = ((kappa * m->pi[5]) + m->pi[4]) * k;
   m->psi[3] = ((kappa * m->pi[4]) + m->pi[5]) * k;
+  m->version++;
 }
 
 void
@@ -380,6 +861,36 @@ update_Q_matrix_from_average_rate (evolution_model m, double *lambda)
   for (cat = 0; cat < m->nrates; cat++) for (i=0; i < m->n_state; i++) for (j=0; j < m->n_state;j++) {
     m->Q[cat][j][i] = 0.;
     for (k=0; k < m->n_state; k++) m->Q[cat][j][i] += (m->z1[k][i] * m->z2[k][j])/(1. + (m->psi[k] * lambda[cat]));
+    m->Qt[(cat * m->n_state + i) * m->n_state + j] = m->Q[cat][j][i]; /* column i of Q is contiguous (SIMD kernels) */
+  }
+  update_tip_table_from_transition_matrix (m, m->Qt_tip, m->Qt);
+  m->version++; /* rates may have changed */
+}
+
+void
+update_tip_table_from_transition_matrix (evolution_model m, double *Ptip, double *Pt)
+{
+  int i, j, tip, cat, n = m->n_state, n_tip = lk_tip_states (m->n_state);
+  for (cat = 0; cat < m->nrates; cat++) for (tip = 0; tip < n_tip; tip++) for (i = 0; i < n; i++) {
+    Ptip[(cat * n_tip + tip) * n + i] = 0.;
+    for (j = 0; j < n; j++) if (lk_tip_has_state (n, tip, j)) Ptip[(cat * n_tip + tip) * n + i] += Pt[(cat * n + j) * n + i];
+  }
+}
+
+void
+update_transition_matrix_from_branch_length (evolution_model m, double *Pt, double blength)
+{
+  int i, j, k, cat, n = m->n_state;
+  double mean_rate = 0., expo[n];
+
+  for (cat = 0; cat < m->nrates; cat++) mean_rate += m->rate[cat];
+  mean_rate /= (double) m->nrates; /* gamma rates have mean alpha/beta, but here branch lengths are in substitutions/site */
+  for (cat = 0; cat < m->nrates; cat++) {
+    for (k = 0; k < n; k++) expo[k] = exp (- m->psi[k] * blength * m->rate[cat] / mean_rate);
+    for (i = 0; i < n; i++) for (j = 0; j < n; j++) {
+      Pt[(cat * n + i) * n + j] = 0.;
+      for (k = 0; k < n; k++) Pt[(cat * n + i) * n + j] += m->z1[k][i] * m->z2[k][j] * expo[k]; /* P(i|j,t) */
+    }
   }
 }
 
@@ -26,6 +26,15 @@ typedef struct phylogeny_struct* phylogeny;
 typedef struct evolution_model_struct* evolution_model;
 typedef struct node_likelihood_struct* node_likelihood;
 typedef struct lk_vector_struct* lk_vector;
+typedef struct partitioned_phylogeny_struct* partitioned_phylogeny;
+typedef struct lk_memory_struct* lk_memory;
+typedef struct lk_cache_struct* lk_cache;
+
+#define LK_TIP_STATES 16 /*!< \brief number of distinct leaf states (bitmask of ACGT, including ambiguous ones) */
+/*! \brief number of distinct leaf states: a bitmask for DNA, or otherwise one state index or n_state if missing data */
+#define lk_tip_states(n_state) ((n_state) == 4 ? LK_TIP_STATES : (n_state) + 1)
+/*! \brief true if leaf state tip (from 0 to lk_tip_states()-1) is compatible with state s */
+#define lk_tip_has_state(n_state,tip,s) ((n_state) == 4 ? (((tip) >> (s)) & 1) : (((tip) == (s)) || ((tip) == (n_state))))
 
 /*! \brief Model parameters and likelihood vectors for one segment. */
 struct phylogeny_struct
@@ -35,12 +44,38 @@ struct phylogeny_struct
   int nsites; /*! \brief Sequence original size, in sites (but in likelihood we use basically npat) */
   int ntax;   /*! \brief Number of taxa. */
   int nnodes;	/*! \brief Number of nodes (internal and leaves). */
-  double *weight; /*! \brief Frequency of each site pattern (same AGCT pattern). */
+  /*! \brief Frequency of each site pattern (same AGCT pattern). Patterns of weight zero are skipped by the likelihood
+   * calculations, thus if a weight changes from zero all partial likelihoods must be recalculated by ln_likelihood() */
+  double *weight;
   evolution_model model; /*! \brief Evolutionary model parameters */
   double lk_current;	/*! \brief Current \f$ ln(L) \f$. Equivalent to likelihood_accepted within minisample */
   double lk_proposal;	/*! \brief Proposal \f$ ln(L) \f$. Ultimately subject to acceptance/rejection by MCMC.*/
   double lk_accepted;	/*! \brief Accepted \f$ ln(L) \f$. */
   double *pat_lnLk;   /*! \brief sitewise (pattern-wise, in fact) log of likelihood, marginalized over rates */
+  /*! \brief if true (default) use topology_struct::blength with one transition matrix per branch; otherwise (or if tree has
+   * no branch lengths) all branches use evolution_model_struct::Q, where branch lengths are integrated out */
+  bool use_blength;
+  /*! \brief if true, downstream partial likelihoods of internal nodes are stored as floats (arithmetic is still in double
+   * precision). Set by phylogeny_set_single_precision(), and reverted to false if rescaling becomes too frequent */
+  bool single_precision;
+  /*! \brief if true, downstream vectors are calculated only once per class of patterns with identical states at the
+   * leaves of the subtree (site repeats), which saves time mostly with gappy or low-divergence alignments */
+  bool use_site_repeats;
+  /*! \brief memory budget for partial likelihoods, with usage statistics, or NULL if all vectors are kept once calculated
+   * (default). Set by phylogeny_set_memory_budget() */
+  lk_memory mem;
+  /*! \brief ln(likelihood) of recently evaluated states, or NULL (default). Set by phylogeny_set_likelihood_cache() */
+  lk_cache cache;
+  /*! \brief patterns per chunk of the static schedule shared by all pattern loops and by the first-touch initialisation
+   * of vectors, s.t. each thread always works on the same (NUMA-local) patterns. Set by phylogeny_set_pattern_affinity() */
+  int pattern_chunk;
+  /*! \brief if true (default), vectors are zeroed in parallel when allocated, with the schedule of pattern_chunk (otherwise
+   * by the allocating thread, which places all pages on its NUMA node) */
+  bool first_touch;
+  /*! \brief phylogeny owning the leaf states and pattern weights if these are shared with other phylogenies (see
+   * new_phylogeny_sharing_data()), or NULL if they belong to this one */
+  phylogeny data;
+  int ref_counter; /*! \brief number of references to this phylogeny (itself and the phylogenies sharing its data) */
   char *align_filename;  /*! \brief name of original alignment file, without extension */ 
 };
 
@@ -49,7 +84,9 @@ struct evolution_model_struct
 {
   double *rate,	 /*! \brief expected substitution rate (one for each gamma category) */
          ***Q,   /*! \brief Transition probability matrix (one 4x4 vector for each category) */
-         kappa,  /*! \brief transition/transversion ratio \f$\kappa_i\f$ for HKY model */
+         *Qt,    /*! \brief Transposed copy of Q, contiguous (n_state x n_state for each category) for the likelihood kernels */
+         *Qt_tip,/*! \brief Q times each of the LK_TIP_STATES leaf vectors, for each category (see update_tip_table_from_transition_matrix()) */
+         kappa,  /*! \brief transition/transversion ratio \f$\kappa_i\f$ for HKY model (DNA only) */
          *pi,    /*! \brief Equilibrium base distribution */
          **z1,   /*! \brief Left eigenvector for HKY model (depends on pi[]) */
          **z2,   /*! \brief Right eigenvector for HKY model (depends on pi[] */ 
@@ -57,7 +94,8 @@ struct evolution_model_struct
   double alpha,  /*! \brief alpha from the discrete gamma (sitewise heterogeneity) E[x]=alpha/beta */
          beta;   /*! \brief beta from the discrete gamma (sitewise heterogeneity) */
   int nrates,    /*! \brief number of discrete rate categories */
-      n_state;   /*! \brief number of states (4 for DNA, 64 for codon...) MUST BE 4 currently */
+      n_state,   /*! \brief number of states: 4 for DNA (HKY model), 20 for amino acids or 61 for codons (equal-input model) */
+      version;   /*! \brief changes whenever parameters are updated, invalidating cached per-branch transition matrices */
 };
 
 /*! \brief Partial Likelihood information for each node such that no calculation is necessary 
@@ -74,26 +112,131 @@ struct node_likelihood_struct
    * accessed through node_likelihood_struct::d_current->next. */
   lk_vector d_current;
   lk_vector d_proposal; /*!< \brief precalculated proposal vector element */
+  /*! \brief vector of each d[] slot in the last ln_likelihood_moved_branches_at_lk_vector_batch(), which may be the same
+   * for several slots (or NULL if the slot was not used by it); d[] itself always has distinct vectors */
+  lk_vector *d_batch;
   lk_vector u_accepted, /*!< \brief Upstream partial likelihood of last accepted topology (before update). */
             d_accepted; /*!< \brief Downstream partial likelihood of last accepted topology (before update). */
+  /*! \brief transposed transition matrices P(t) of the branch above this node, for each rate category (same layout
+   * as evolution_model_struct::Qt). At the root node it is P(t_left + t_right), between its children. At leaves it is
+   * the product of P(t) with each possible leaf state instead (same layout as evolution_model_struct::Qt_tip). */
+  double *pmat;
+  double pmat_blength; /*!< \brief branch length used in pmat (negative if not calculated yet) */
+  int pmat_version;    /*!< \brief evolution_model_struct::version used in pmat */
 };
 
 /*! \brief Circular linked list with partial likelihood information for a node. Its size is the largest between 
- * chain_data_struct::n_cycles and chain_data_struct::n_mini. */
+ * chain_data_struct::n_cycles and chain_data_struct::n_mini. 
+ *
+ * Values are stored in a single aligned block, pattern-major with interleaved categories: element (pat, cat, state) is
+ * at lk[(pat * n_cat + cat) * n_state + state], s.t. one pattern for all categories is contiguous in memory. With site
+ * repeats the pattern index is replaced by its class lk_vector_struct::rep[pat]. Use the accessors lk_vector_at() and
+ * lk_vector_scale() instead of indexing directly. */
 struct lk_vector_struct
 {
-  double ***lk;   /*! \brief Partial likelihood values for each pattern,  gamma category and state (A,G,C,T). */
-  double **lnmax; /*! \brief scaling factors following Yang's JMolEvol.2000.423 to avoid underflow */
+  double *lk;    /*! \brief Partial likelihood values for each pattern, gamma category and state (A,G,C,T). */
+  float *lkf;    /*! \brief single precision storage, used instead of lk (which is then NULL), same layout */
+  int *scale;    /*! \brief scaling factors to avoid underflow, as powers of two s.t. true value is lk * 2^scale (one per pattern and category) */
+  int *rep;      /*! \brief site repeats: class of each pattern, s.t. values are stored per class (if n_rep > 0) */
+  int n_rep;     /*! \brief number of classes of identical subtree patterns, or zero if values are stored per pattern */
+  uint8_t *tip;  /*! \brief leaves only: observed state per pattern (bitmask A=1,C=2,G=4,T=8 for DNA, see lk_tip_states()), in which case lk and scale are NULL */
+  int n_cat,     /*! \brief number of rate categories (stride between patterns is n_cat * n_state) */
+      n_state;   /*! \brief number of states */
   lk_vector next, prev; /*! \brief Double-linked circular list information */
+  lk_vector lru_prev, lru_next; /*! \brief neighbours in least-recently-used order, under a memory budget (see lk_memory_struct) */
+  int pinned;    /*! \brief nonzero while vector is being used, s.t. its storage cannot be reused */
+};
+
+/*! \brief partial likelihoods under a memory budget. Storage of vectors is allocated on first use; when the budget is
+ * reached the storage of the least recently used vector is handed to the new one, and the evicted vector is recalculated
+ * (from its children, recursively) if needed again. Only downstream vectors of ln_likelihood() and
+ * ln_likelihood_moved_branches() are available in this mode. */
+struct lk_memory_struct
+{
+  size_t budget,      /*! \brief maximum memory (bytes) used by the partial likelihood vectors, or zero if unlimited */
+         vector_size; /*! \brief memory used by one vector (values and scaling factors), at current precision */
+  int max_resident,   /*! \brief number of vectors which fit in the budget */
+      n_resident,     /*! \brief number of vectors currently with storage */
+      peak_resident;  /*! \brief largest n_resident so far (may exceed max_resident if all vectors were in use) */
+  uint64_t n_computed,  /*! \brief number of vectors calculated (over all patterns), including recalculations */
+           n_recomputed,/*! \brief number of vectors calculated again, since they had been evicted */
+           n_evicted;   /*! \brief number of vectors whose storage was handed to another */
+  lk_vector lru_first, lru_last; /*! \brief least and most recently used vectors with storage */
+};
+
+/*! \brief ln(likelihood) of recently evaluated states, keyed by topology (topology_struct::hashID1 and hashID2), branch
+ * lengths (each with the split below it) and evolution_model_struct::version. Looked up by ln_likelihood() and
+ * ln_likelihood_moved_branches() before any calculation; each key has one slot (direct mapping), and a new state
+ * overwrites the state in its slot.
+ *
+ * On a hit the partial likelihood vectors are not calculated, thus if the state is accepted the current vectors become
+ * outdated (stale) and the next ln_likelihood_moved_branches() recalculates all nodes. */
+struct lk_cache_struct
+{
+  int n_slot;          /*! \brief number of cached states */
+  bool store_patterns; /*! \brief if true, phylogeny_struct::pat_lnLk is also cached */
+  uint64_t *key;       /*! \brief two words per slot (topology, and model plus branch lengths), zero if empty */
+  double *lnLk,        /*! \brief cached phylogeny_struct::lk_proposal of each slot */
+         *pat_lnLk;    /*! \brief cached site ln(likelihoods) (npat per slot), if store_patterns */
+  uint64_t n_lookup,   /*! \brief number of lookups */
+           n_hit;      /*! \brief number of lookups found in cache */
+  bool hit,            /*! \brief true if the last proposal came from the cache (no vector was calculated) */
+       stale,          /*! \brief true if the accepted (current) vectors don't correspond to the accepted state */
+       full;           /*! \brief true if the last ln_likelihood_moved_branches() calculated all nodes (since stale) */
 };
 
+/*! \brief Gene segments (CHARSETs) of a concatenated alignment, each with its own site patterns and evolutionary model but
+ * sharing the topology. The total ln(likelihood) is the sum over partitions. */
+struct partitioned_phylogeny_struct
+{
+  phylogeny *part; /*! \brief one phylogeny (patterns, model and partial likelihoods) per partition */
+  int n_part;      /*! \brief number of partitions (CHARSETs, plus one for the sites outside any CHARSET if present) */
+  int *order;      /*! \brief partitions sorted by decreasing computational cost (patterns times rate categories) */
+  /*! \brief evolution_model_struct::version of each partition when its d_current vectors were calculated (negative if
+   * invalid, e.g. after partitioned_phylogeny_invalidate()) s.t. partitions with unchanged parameters are not
+   * recalculated */
+  int *version;
+  /*! \brief topology and branch length hashes (two per partition) when its d_current vectors were calculated, s.t.
+   * partitions are recalculated if the tree changed */
+  uint64_t *tree_key;
+  bool *updated;   /*! \brief partitions recalculated by last proposal (the others keep their current likelihoods) */
+  double lk_current, lk_proposal, lk_accepted; /*! \brief sum over partitions of phylogeny_struct::lk_current etc. */
+};
+
+/*! \brief true if vector has observed states (leaf) or storage for its partial likelihoods */
+#define lk_vector_is_resident(u) ((u)->tip || (u)->lk || (u)->lkf)
+/*! \brief position of pattern pat in vector (its class, if vector stores site repeats) */
+#define lk_vector_idx(u,pat) ((u)->n_rep ? (u)->rep[(pat)] : (pat))
+/*! \brief pointer to the n_state partial likelihoods of pattern pat and rate category cat */
+#define lk_vector_at(u,pat,cat) ((u)->lk + ((size_t) lk_vector_idx(u,pat) * (u)->n_cat + (cat)) * (u)->n_state)
+/*! \brief single precision version of lk_vector_at(), for vectors with lk_vector_struct::lkf */
+#define lk_vector_at_float(u,pat,cat) ((u)->lkf + ((size_t) lk_vector_idx(u,pat) * (u)->n_cat + (cat)) * (u)->n_state)
+/*! \brief binary exponent of the scaling factor of pattern pat and rate category cat (lvalue) */
+#define lk_vector_scale(u,pat,cat) ((u)->scale[(size_t) lk_vector_idx(u,pat) * (u)->n_cat + (cat)])
+
 
 phylogeny new_phylogeny_from_alignment (alignment align, int n_cat, int n_state, int n_cycle, distance_matrix external_dist);
 
 phylogeny new_phylogeny (int n_tax, int n_cat, int n_pat, int n_state, int n_cycle);
 
+/*! \brief phylogeny of one gene segment, with its distinct patterns (from alignment_charset_patterns()). If charset is
+ * negative, then uses the sites not covered by any CHARSET (all sites if alignment has no ASSUMPTIONS block). */
+phylogeny new_phylogeny_from_alignment_charset (alignment align, int charset, int n_cat, int n_state, int n_cycle, distance_matrix external_dist);
+
+/*! \brief phylogeny with its own evolution_model (a copy of the one from phy) and partial likelihoods, but whose leaf
+ * states and pattern weights are those of phy, e.g. for several chains over the same alignment. These must not be changed
+ * while shared, and are released with the last phylogeny using them. */
+phylogeny new_phylogeny_sharing_data (phylogeny phy, int n_cycle);
+
 void del_phylogeny (phylogeny phy);
 
+/*! \brief n_rep bootstrap replicates of the site patterns of phy (see new_bootstrap_weights()) */
+bootstrap_weights new_phylogeny_bootstrap_weights (phylogeny phy, int n_rep, uint64_t seed);
+
+/*! \brief observed states at a leaf of a phylogeny created with new_phylogeny(), one per pattern. For DNA it is a bitmask
+ * (A=1,C=2,G=4,T=8), and otherwise a state index where negative or larger values represent missing data */
+void phylogeny_set_leaf_states (phylogeny phy, int leaf, int *state);
+
 /* "rewinds" the circular liknked list of partial likelihoods such that we access the proposal likelihoods through d[]
  * instead of d->next->...->next. IOW makes the equivalence between a linked list and an array */
 void phylogeny_order_accepted_lk_vector (phylogeny phy);
@@ -105,6 +248,43 @@ void phylogeny_link_accepted_to_current (phylogeny phy);
  * functions generally work on d_current */
 void phylogeny_link_current_to_accepted (phylogeny phy);
 
+/*! \brief one phylogeny per CHARSET (with independent evolution_model), plus one for sites outside all CHARSETs if any */
+partitioned_phylogeny new_partitioned_phylogeny_from_alignment (alignment align, int n_cat, int n_state, int n_cycle, distance_matrix external_dist);
+void del_partitioned_phylogeny (partitioned_phylogeny pp);
+
+/*! \brief forces recalculation of all partitions (e.g. if partial likelihoods were changed outside ln_likelihood_partitioned()) */
+void partitioned_phylogeny_invalidate (partitioned_phylogeny pp);
+
+/*! \brief store downstream partial likelihoods of internal nodes as floats (if single_precision is true) or doubles,
+ * converting the existing values. Upstream vectors are always in double precision. */
+void phylogeny_set_single_precision (phylogeny phy, bool single_precision);
+
+/*! \brief keep at most budget bytes of partial likelihood vectors (or an unlimited amount if budget is zero), recalculating
+ * the others when needed. Statistics on memory usage and recalculations are in phylogeny_struct::mem */
+void phylogeny_set_memory_budget (phylogeny phy, size_t budget);
+
+/*! \brief zero the counters of phylogeny_struct::mem (besides the current number of vectors with storage) */
+void phylogeny_reset_memory_stats (phylogeny phy);
+/*! \brief allocate storage for u (or reuse the storage of the least recently used vector, under a memory budget) and mark
+ * it as most recently used. Returns true if u already had storage, i.e. its values are kept */
+bool phylogeny_acquire_lk_vector (phylogeny phy, lk_vector u);
+
+/*! \brief pattern loops are split into one contiguous chunk per thread (for n_threads, or the current number of OpenMP
+ * threads if n_threads < 1), ending at page boundaries of the partial likelihood vectors. If first_touch is true then
+ * vectors are zeroed in parallel with the same schedule when allocated (instead of by the calling thread), s.t. their
+ * pages are placed on the NUMA node of the thread that will use them. Vectors are allocated on first use, thus this
+ * should be called before the first likelihood calculation. Called by new_phylogeny() for the current number of threads.
+ *
+ * Threads must also be bound to cores (e.g. OMP_PROC_BIND=close OMP_PLACES=cores), otherwise the operating system may
+ * move them away from their memory. */
+void phylogeny_set_pattern_affinity (phylogeny phy, int n_threads, bool first_touch);
+
+/*! \brief cache of up to n_entries ln(likelihood) values (and site ln(likelihoods) if store_patterns is true), s.t.
+ * revisited states are not recalculated (see lk_cache_struct). A zero n_entries removes the cache. */
+void phylogeny_set_likelihood_cache (phylogeny phy, int n_entries, bool store_patterns);
+/*! \brief forget all cached values (must be called if pattern weights change), keeping the statistics */
+void phylogeny_clear_likelihood_cache (phylogeny phy);
+
 /*! \brief Phylogenetic evolutionary model parameters (for likelihood calculation) */
 evolution_model new_evolution_model (int n_cat, int n_state);
 void del_evolution_model (evolution_model m);
@@ -112,6 +292,11 @@ void del_evolution_model (evolution_model m);
 /*! \brief copy values from one evolution_model to another, possibly skipping the transition matrix */
 void copy_evolution_model (evolution_model to, evolution_model from, bool copy_Qmatrix);
 
+/*! \brief set equilibrium frequencies pi[], discrete gamma and transition matrices. For DNA the model is HKY with
+ * transition/transversion ratio kappa, while for other state spaces it is the equal-input model (Jukes-Cantor or Poisson
+ * if all frequencies are equal), and kappa is ignored. */
+void init_evolution_model_parameters (evolution_model m, double kappa, double alpha, double beta, double *pi);
+
 void update_model_eigenvalues_from_kappa (evolution_model m, double kappa);
 
 /*! \brief  HKY model integrated over branch length FIXME: change to E[x]=1/lambda (redo calcs) 
@@ -126,4 +311,12 @@ void update_model_eigenvalues_from_kappa (evolution_model m, double kappa);
  *  where \f$Z_i \f$ is the matrix of eigenvectors and \f$\psi_i \f$ are the eigenvalues for the HKY model. */
 void update_Q_matrix_from_average_rate (evolution_model m, double *lambda);
 
+/*! \brief Transposed transition matrices \f$P(t r_c) = Z e^{-\psi t r_c} Z^{-1}\f$ for a branch of length blength, for
+ * each rate category \f$c\f$ (with rates normalised to have mean one). Pt has the same layout as evolution_model_struct::Qt */
+void update_transition_matrix_from_branch_length (evolution_model m, double *Pt, double blength);
+
+/*! \brief For each leaf state (from 0 to lk_tip_states()-1) and category, the product of the transposed transition
+ * matrix Pt by the leaf vector, s.t. Ptip[(cat * n_tip + tip) * n_state + i] = \f$\sum_{j \in tip} P(j|i)\f$ */
+void update_tip_table_from_transition_matrix (evolution_model m, double *Ptip, double *Pt);
+
 #endif
@@ -83,6 +83,8 @@ new_biomcmc_rng (uint64_t seed, int stream_number)
   uint64_t useed = seed;
   biomcmc_rng r = (biomcmc_rng) biomcmc_malloc (sizeof (struct biomcmc_rng_struct));
   
+  memset (r, 0, sizeof (struct biomcmc_rng_struct)); /* rng_set_taus() mixes the seed into the existing state */
+  r->ref_counter = 1;
   rng_set_taus (&(r->taus), useed, stream_number);
   rng_get_brent_64bits (&useed); /* fast (one step) PRNG to change seed */
   rng_set_mt19937 (&(r->mt), useed); /* receive modified seed (but even same seed should work) */
@@ -178,21 +180,33 @@ biomcmc_rng_unif_pos32 (void)
 
 inline double
 biomcmc_rng_unif_pos (void)
+{
+  return biomcmc_rng_unif_pos_stream (biomcmc_random_number);
+}
+
+inline double
+biomcmc_rng_unif_pos_stream (biomcmc_rng r)
 {
   double x;
-  do { x = (biomcmc_rng_get_52 () / 4503599627370495.0); } while (x < 2 * DBL_MIN);
+  do { x = ((double) (biomcmc_rng_get_stream (r) >> 12) / 4503599627370495.0); } while (x < 2 * DBL_MIN);
   return x;
 }
 
 inline uint32_t
 biomcmc_rng_unif_int (uint32_t n)
+{
+  return biomcmc_rng_unif_int_stream (biomcmc_random_number, n);
+}
+
+inline uint32_t
+biomcmc_rng_unif_int_stream (biomcmc_rng r, uint32_t n)
 {
   uint32_t scale;
   uint32_t k;
   if (!n) biomcmc_error ("n must be larger than zero in uniform random number generator [32bits]");
   scale = 0xffffffffU/n;
 
-  do { k = biomcmc_rng_get_32 ()/scale; } while (k >= n);
+  do { k = biomcmc_rng_get_32_stream (r)/scale; } while (k >= n);
   return k;
 }
 
@@ -229,27 +243,33 @@ biomcmc_rng_get_algorithm (void)
 inline uint64_t
 biomcmc_rng_get (void)
 {
-  switch (biomcmc_random_number->algorithm) {
+  return biomcmc_rng_get_stream (biomcmc_random_number);
+}
+
+inline uint64_t
+biomcmc_rng_get_stream (biomcmc_rng r)
+{
+  switch (r->algorithm) {
     case 0:
-      return rng_get_mt19937 (&(biomcmc_random_number->mt)); // best dieharder results
+      return rng_get_mt19937 (&(r->mt)); // best dieharder results
     case 1:
-      return rng_get_taus (&(biomcmc_random_number->taus));
+      return rng_get_taus (&(r->taus));
     case 2:
-      return (rng_get_taus (&(biomcmc_random_number->taus)) ^ rng_get_mt19937 (&(biomcmc_random_number->mt)));
+      return (rng_get_taus (&(r->taus)) ^ rng_get_mt19937 (&(r->mt)));
     case 3: 
-      return rng_get_xoroshiro128p (&(biomcmc_random_number->mt.x[0])); // 2 vars 
+      return rng_get_xoroshiro128p (&(r->mt.x[0])); // 2 vars 
     case 4: 
-      return rng_get_xoroshiro128s (&(biomcmc_random_number->mt.x[4])); // 2 vars 
+      return rng_get_xoroshiro128s (&(r->mt.x[4])); // 2 vars 
     case 5:
-      return rng_get_xoroshiro128 (&(biomcmc_random_number->mt.x[8])); // 2 vars 
+      return rng_get_xoroshiro128 (&(r->mt.x[8])); // 2 vars 
     case 6:
-      return rng_get_brent_64bits (&(biomcmc_random_number->mt.x[12])); // 1 var 
+      return rng_get_brent_64bits (&(r->mt.x[12])); // 1 var 
     case 7:
-      return rng_get_splitmix64 (&(biomcmc_random_number->mt.x[16])); // 1 var 
+      return rng_get_splitmix64 (&(r->mt.x[16])); // 1 var 
     case 8:
-      return rng_get_xoroshiro256 (&(biomcmc_random_number->mt.x[20])); // 4 vars 
+      return rng_get_xoroshiro256 (&(r->mt.x[20])); // 4 vars 
     default:
-      return rng_get_std61 (&(biomcmc_random_number->mt.x[0])) ^ rng_get_gamerand64 (&(biomcmc_random_number->mt.x[1]));
+      return rng_get_std61 (&(r->mt.x[0])) ^ rng_get_gamerand64 (&(r->mt.x[1]));
   }
 }
 
@@ -263,18 +283,24 @@ biomcmc_rng_get_52 (void)
 
 inline uint32_t
 biomcmc_rng_get_32 (void)
+{ 
+  return biomcmc_rng_get_32_stream (biomcmc_random_number);
+}
+
+inline uint32_t
+biomcmc_rng_get_32_stream (biomcmc_rng r)
 { 
   /* Any subsequence has the same equidistribution properties of the most significant bits according to L'Ecuyer 
    * (for the Tausworthe algorithm) and Matsumoto (for the Mersenne twister); thus we can have 32 bit sequences by 
    * the independent sets of the 32 most and 32 least significant  bits. Each call to biomcmc_rng_get () thus 
    * generates two 32 bits pseudo-random numbers */
-  if (biomcmc_random_number->have_bit32) {
-    biomcmc_random_number->have_bit32 = false;
-    return (uint32_t) ((biomcmc_random_number->bit32 >> 32) & 0xffffffffU);
+  if (r->have_bit32) {
+    r->have_bit32 = false;
+    return (uint32_t) ((r->bit32 >> 32) & 0xffffffffU);
   }
-  biomcmc_random_number->bit32 = biomcmc_rng_get ();
-  biomcmc_random_number->have_bit32 = true;
-  return (uint32_t) (biomcmc_random_number->bit32 & 0xffffffffU);
+  r->bit32 = biomcmc_rng_get_stream (r);
+  r->have_bit32 = true;
+  return (uint32_t) (r->bit32 & 0xffffffffU);
 }
 
 /* * * * extra functions: gettimeofday() with maximum precision * * * */
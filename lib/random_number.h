@@ -130,6 +130,14 @@ extern double biomcmc_rng_unif_pos32 (void);
 /*! \brief Returns an integer (32 bits) random number between 0 and n (excluding n), provided \f$n < 4 10^9\f$ approx. */
 extern uint32_t biomcmc_rng_unif_int (uint32_t n);
 
+/* functions drawing from stream r instead of the global biomcmc_random_number, s.t. each thread can use its own stream
+ * (same sequence as the functions above if biomcmc_random_number is r) */
+
+/*! \brief as biomcmc_rng_unif_pos(), from stream r */
+extern double biomcmc_rng_unif_pos_stream (biomcmc_rng r);
+/*! \brief as biomcmc_rng_unif_int(), from stream r */
+extern uint32_t biomcmc_rng_unif_int_stream (biomcmc_rng r, uint32_t n);
+
 void biomcmc_rng_set_next_algorithm (void);
 void biomcmc_rng_set_algorithm (uint8_t algo);
 uint8_t biomcmc_rng_get_algorithm (void);
@@ -142,6 +150,10 @@ extern uint64_t biomcmc_rng_get (void);
 extern double   biomcmc_rng_get_52 (void);
 /*! \brief  new value with 32 random bits */
 extern uint32_t biomcmc_rng_get_32 (void);
+/*! \brief  new value with 64 random bits from stream r */
+extern uint64_t biomcmc_rng_get_stream (biomcmc_rng r);
+/*! \brief  new value with 32 random bits from stream r */
+extern uint32_t biomcmc_rng_get_32_stream (biomcmc_rng r);
 
 /*! \brief get current time with maximum precision and soter in vector time[2] */
 void biomcmc_get_time (int64_t *time);
@@ -679,6 +679,14 @@ raise_topology_flags (topology tree)
   for (i = tree->nleaves; i < tree->nnodes; i++) tree->nodelist[i]->d_done = tree->nodelist[i]->u_done = false;
 }
 
+void
+topology_flag_branch_as_changed (topology tree, topol_node node)
+{
+  if (node->up) undo_ddone (node->up); /* partial likelihood at node itself is not affected */
+  else          undo_ddone (node);
+  tree->traversal_updated = false; /* undone[] must be recalculated */
+}
+
 void
 topology_reset_random_move (topology tree)
 {
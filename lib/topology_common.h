@@ -171,6 +171,9 @@ void topology_undo_random_move (topology tree, bool update_done);
 void clear_topology_flags (topology tree);
 /*! \brief reset all d_done and u_done booleans to "false" (when updating a model parameter with MTM) */
 void raise_topology_flags (topology tree);
+/*! \brief flag the branch above node as changed (e.g. new branch length), s.t. only its ancestors have their
+ * likelihood recalculated (through topology_struct::undone) and only this branch has its transition matrix updated */
+void topology_flag_branch_as_changed (topology tree, topol_node node);
 /*! \brief revert last SPR branch swapping and clear flags (reject last proposal, in MCMC)  */
 void topology_reset_random_move (topology tree);
 
@@ -256,6 +256,12 @@ topology_apply_shortspr_weighted_subtree (topology tree, topol_node lca, double
 
 void
 topology_apply_spr_on_subtree (topology tree, topol_node lca, bool update_done)
+{ 
+  topology_apply_spr_on_subtree_stream (tree, lca, update_done, biomcmc_random_number);
+}
+
+void
+topology_apply_spr_on_subtree_stream (topology tree, topol_node lca, bool update_done, biomcmc_rng r)
 { 
   int i, n1, n2, *valid = tree->index, *invalid, *regraft, n_valid = 0, n_invalid = 0, n_regraft = 0;
   topol_node first_child = lca;
@@ -270,7 +276,7 @@ topology_apply_spr_on_subtree (topology tree, topol_node lca, bool update_done)
   if (lca->split->n_ones == 3) { /* three leaves => only 3 possible topols => only 2 possible swaps */
     /* 1) the 2 possible swaps can be done by chosing one of the two leaves at subtree as regraft: A or B in ((A,B),C)
      * 2) lca->left is internal (by design of traversal, see bipartition_is_larger() function); */
-    if (biomcmc_rng_unif_int (2)) apply_spr_at_nodes_LCAprune (tree, lca, lca->left->left, update_done);
+    if (biomcmc_rng_unif_int_stream (r, 2)) apply_spr_at_nodes_LCAprune (tree, lca, lca->left->left, update_done);
     else                          apply_spr_at_nodes_LCAprune (tree, lca, lca->left->right, update_done);
     return;
   }
@@ -287,7 +293,7 @@ topology_apply_spr_on_subtree (topology tree, topol_node lca, bool update_done)
 #ifdef BIOMCMC_DEBUG
   if (n_valid != (2*lca->split->n_ones - 1)) biomcmc_error ("%d nodes eligible in subtree with %d leaves (SPR)",n_valid, lca->split->n_ones);
 #endif
-  n1 = valid[ biomcmc_rng_unif_int (n_valid) ]; /* draw prune node */
+  n1 = valid[ biomcmc_rng_unif_int_stream (r, n_valid) ]; /* draw prune node */
 
   /* n_valid is always smaller than nnodes so we're safe (tree->index has only 4*nleaves = 2*nnodes + 2 elements */
   invalid = tree->index + n_valid; /* invalid[] vector points to after last element of valid[] */
@@ -314,7 +320,7 @@ topology_apply_spr_on_subtree (topology tree, topol_node lca, bool update_done)
     else regraft[n_regraft++] = valid[i];
   }
 
-  n2 = regraft[ biomcmc_rng_unif_int (n_regraft) ]; /* regraft node (here valid[] already has idx in postorder) */
+  n2 = regraft[ biomcmc_rng_unif_int_stream (r, n_regraft) ]; /* regraft node (here valid[] already has idx in postorder) */
 
   /* this wrapper function will decide if prune node is LCA or not of regraft */
   apply_spr_at_nodes (tree, tree->nodelist[n1], tree->nodelist[n2], update_done);
@@ -324,6 +330,12 @@ topology_apply_spr_on_subtree (topology tree, topol_node lca, bool update_done)
 
 void
 topology_apply_spr (topology tree, bool update_done)
+{ 
+  topology_apply_spr_stream (tree, update_done, biomcmc_random_number);
+}
+
+void
+topology_apply_spr_stream (topology tree, bool update_done, biomcmc_rng r)
 { 
   uint32_t n_left, n_right;
 
@@ -331,10 +343,10 @@ topology_apply_spr (topology tree, bool update_done)
   n_left  = tree->root->left->split->n_ones;
   n_right = tree->root->right->split->n_ones;
 
-  if     (n_right < 3) topology_apply_spr_on_subtree (tree, tree->root->left, update_done);
-  else if (n_left < 3) topology_apply_spr_on_subtree (tree, tree->root->right, update_done);
-  else if (biomcmc_rng_unif_int (n_right + n_left) < n_left) topology_apply_spr_on_subtree (tree, tree->root->left, update_done);
-  else                                                       topology_apply_spr_on_subtree (tree, tree->root->right, update_done);
+  if     (n_right < 3) topology_apply_spr_on_subtree_stream (tree, tree->root->left, update_done, r);
+  else if (n_left < 3) topology_apply_spr_on_subtree_stream (tree, tree->root->right, update_done, r);
+  else if (biomcmc_rng_unif_int_stream (r, n_right + n_left) < n_left) topology_apply_spr_on_subtree_stream (tree, tree->root->left, update_done, r);
+  else                                                                 topology_apply_spr_on_subtree_stream (tree, tree->root->right, update_done, r);
 }
 
 void
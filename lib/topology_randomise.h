@@ -38,6 +38,10 @@ void topology_apply_shortspr_weighted (topology tree, double *prob, bool update_
 void topology_apply_spr_on_subtree (topology tree, topol_node lca, bool update_done);
 /*! \brief random Subtree Prune-and-Regraft branch swapping */
 void topology_apply_spr (topology tree, bool update_done);
+/*! \brief as topology_apply_spr_on_subtree(), drawing from stream r instead of the global biomcmc_random_number */
+void topology_apply_spr_on_subtree_stream (topology tree, topol_node lca, bool update_done, biomcmc_rng r);
+/*! \brief as topology_apply_spr(), drawing from stream r (e.g. one stream per thread) */
+void topology_apply_spr_stream (topology tree, bool update_done, biomcmc_rng r);
 /*! \brief random Subtree Prune-and-Regraft branch swapping generalized (neglecting root) */
 void topology_apply_spr_unrooted (topology tree, bool update_done);
 /*! \brief random Nearest Neighbor Interchange branch swapping (SPR where regraft node is close to prune node) */
@@ -0,0 +1,695 @@
+#include <biomcmc.h>
+#include <check.h>
+#include <utime.h>
+
+#define TEST_SUCCESS 0
+#define TEST_FAILURE 1
+#define TEST_SKIPPED 77
+#define TEST_HARDERROR 99
+
+#ifndef TEST_FILE_DIR
+#define TEST_FILE_DIR "./files/"
+#endif
+
+char filename[2048] = TEST_FILE_DIR; // now we can memcpy() file names _after_ prefix_size
+size_t prefix_size = strlen(TEST_FILE_DIR); // all modifications to filename[] come after prefix_size
+int sitepattern_n_taxa[3] = {2, 12, 91};
+
+/* first n_sites of the first n_taxa sequences of the test file (not aligned, but they look like an alignment) */
+void
+truncated_sequences_from_file (int n_taxa, int n_sites, char_vector *taxlabel, char_vector *character)
+{
+  int i;
+  char *seq;
+  alignment full;
+
+  memcpy (filename + prefix_size, "bacteria_riboprot.fasta", 24);
+  full = read_fasta_alignment_from_file (filename, false);
+  if (full->ntax < n_taxa) ck_abort_msg ("test file has only %d sequences", full->ntax);
+  *taxlabel  = new_char_vector (n_taxa);
+  *character = new_char_vector (n_taxa);
+  seq = (char*) biomcmc_malloc ((n_sites + 1) * sizeof (char));
+  for (i = 0; i < n_taxa; i++) {
+    memcpy (seq, full->character->string[i], n_sites);
+    seq[n_sites] = '\0';
+    char_vector_add_string_at_position (*taxlabel, full->taxlabel->string[i], i);
+    char_vector_add_string_at_position (*character, seq, i);
+  }
+  free (seq);
+  del_alignment (full);
+}
+
+/* deterministic sequences derived from a random ACGT reference, with substitutions and, once in every 1/amb_rate sites,
+ * an IUPAC ambiguity code, indel or missing data (same sequences for same seed) */
+void
+synthetic_sequences (int n_taxa, int n_sites, int amb_rate, uint32_t seed, char_vector *taxlabel, char_vector *character)
+{
+  int i, s;
+  char *ref, *seq, name[32], *acgt = "ACGT", *amb = "RYKMSWBDHVN-?";
+  uint32_t x = seed;
+
+  *taxlabel  = new_char_vector (n_taxa);
+  *character = new_char_vector (n_taxa);
+  ref = (char*) biomcmc_malloc ((n_sites + 1) * sizeof (char));
+  seq = (char*) biomcmc_malloc ((n_sites + 1) * sizeof (char));
+  for (s = 0; s < n_sites; s++) { x = x * 1664525u + 1013904223u; ref[s] = acgt[(x >> 16) & 3]; }
+  for (i = 0; i < n_taxa; i++) {
+    for (s = 0; s < n_sites; s++) {
+      x = x * 1664525u + 1013904223u;
+      if (amb_rate && !((x >> 8) % amb_rate)) seq[s] = amb[(x >> 16) % 13];
+      else if (!((x >> 12) & 7)) seq[s] = acgt[(x >> 20) & 3];
+      else seq[s] = ref[s];
+    }
+    seq[n_sites] = '\0';
+    sprintf (name, "seq%d", i);
+    char_vector_add_string_at_position (*taxlabel, name, i);
+    char_vector_add_string_at_position (*character, seq, i);
+  }
+  free (ref);
+  free (seq);
+}
+
+/* previous alignment_create_sitepattern(), comparing all pairs of columns: duplicate columns are replaced by the last
+ * one. Returns npat, with the distinct columns in str[][0...npat-1] */
+int
+sitepattern_pairwise_comparison (char **str, int ntax, int nchar, int *site_pattern)
+{
+  int s1, s2, seq, *index;
+  bool equal;
+
+  index = (int *) biomcmc_malloc (nchar * sizeof (int));
+  for (s1=0; s1 < nchar; s1++) index[s1] = site_pattern[s1] = s1;
+
+  for (s1 = 0; s1 < nchar- 1; s1++) {
+    for (s2 = s1 + 1; s2 < nchar; s2++) {
+      for (equal = true, seq = 0; (equal == true) && (seq < ntax); seq++) if (str[seq][s1] != str[seq][s2]) equal = false;
+      if (equal == true) { /* s1 and s2 have identical patterns */
+        site_pattern[ index[s2] ] = s1;
+        nchar--;
+        if (s2 < nchar) { /* replace pattern s2 by pattern of last site under analysis */
+          index[s2] = index[nchar];
+          for (seq = 0; seq < ntax; seq++) str[seq][s2] = str[seq][nchar];
+        }
+        s2--;/* compare again, since str[][s2] now contains last site */
+      }
+    }
+    if (site_pattern[ index[s1] ] > s1) site_pattern[ index[s1] ] = s1;
+  }
+  if (site_pattern[ index[s1] ] > s1) site_pattern[ index[s1] ] = s1;
+  free (index);
+  return nchar;
+}
+
+START_TEST(sitepattern_equals_pairwise_comparison_loop)
+{
+  int i, s, p, n_taxa = sitepattern_n_taxa[_i], n_sites = 3000, npat, *site_pattern, *freq, *old_of_new;
+  char **str;
+  char_vector taxlabel, character;
+  alignment align;
+
+  truncated_sequences_from_file (n_taxa, n_sites, &taxlabel, &character);
+  str = (char**) biomcmc_malloc (n_taxa * sizeof (char*)); /* uppercase copies, as in alignment */
+  for (i = 0; i < n_taxa; i++) {
+    str[i] = (char*) biomcmc_malloc ((n_sites + 1) * sizeof (char));
+    for (s = 0; s <= n_sites; s++) str[i][s] = toupper (character->string[i][s]);
+  }
+  align = new_alignment_from_taxlabel_and_character_vectors (taxlabel, character, filename, true);
+
+  site_pattern = (int*) biomcmc_malloc (n_sites * sizeof (int));
+  npat = sitepattern_pairwise_comparison (str, n_taxa, n_sites, site_pattern);
+  ck_assert_int_eq (align->nchar, n_sites);
+  ck_assert_int_eq (align->npat, npat);
+
+  freq = (int*) biomcmc_malloc (npat * sizeof (int));
+  old_of_new = (int*) biomcmc_malloc (npat * sizeof (int));
+  for (p = 0; p < npat; p++) { freq[p] = 0; old_of_new[p] = -1; }
+  for (s = 0; s < n_sites; s++) { /* both must have the same partition of sites, even if patterns are numbered differently */
+    p = align->site_pattern[s];
+    freq[ site_pattern[s] ]++;
+    if (old_of_new[p] < 0) old_of_new[p] = site_pattern[s];
+    else if (old_of_new[p] != site_pattern[s]) ck_abort_msg ("site %d is in pattern %d but previous site of this pattern is not", s, p);
+  }
+  for (p = 0; p < npat; p++) {
+    if (align->pattern_freq[p] != freq[ old_of_new[p] ])
+      ck_abort_msg ("pattern %d has frequency %d but should have %d", p, align->pattern_freq[p], freq[ old_of_new[p] ]);
+    for (i = 0; i < n_taxa; i++) if (align->character->string[i][p] != str[i][ old_of_new[p] ])
+      ck_abort_msg ("pattern %d differs at sequence %d", p, i);
+  }
+
+  for (i = 0; i < n_taxa; i++) free (str[i]);
+  free (str);
+  free (freq);
+  free (old_of_new);
+  free (site_pattern);
+  del_char_vector (taxlabel);
+  del_char_vector (character);
+  del_alignment (align);
+}
+END_TEST
+
+/* packed (bit plane) kernels must give the same results as the character kernels, over compressed patterns (K2P) or
+ * over all sites (scores); raw holds the same sequences as align, but without compressing patterns */
+void
+compare_packed_with_char_kernels (alignment align, alignment raw)
+{
+  int i, j, k;
+  double r1[5], r2[5];
+  packed_alignment pk = new_packed_alignment_from_alignment (align);
+
+  ck_assert_int_eq (pk->npat, align->npat);
+  for (i = 1; i < align->ntax; i++) for (j = 0; j < i; j++) {
+    biomcmc_calc_pairwise_distance_K2P (align->character->string[i], align->character->string[j], align->pattern_freq, align->npat, r1);
+    packed_alignment_pairwise_distance_K2P (pk, i, j, r2);
+    for (k = 0; k < 2; k++) ck_assert_msg (fabs (r1[k] - r2[k]) < 1e-12, "K2P[%d] between %d and %d: %g != %g", k, i, j, r1[k], r2[k]);
+    ck_assert (packed_alignment_pairwise_distance_K2P_bounded (pk, i, j, 1e9, r2));
+    for (k = 0; k < 2; k++) ck_assert_msg (fabs (r1[k] - r2[k]) < 1e-12, "bounded K2P[%d] between %d and %d", k, i, j);
+
+    biomcmc_pairwise_score_matches (raw->character->string[i], raw->character->string[j], raw->nchar, r1);
+    packed_alignment_pairwise_score_matches (pk, i, j, r2);
+    for (k = 0; k < 5; k++) ck_assert_msg (fabs (r1[k] - r2[k]) < 1e-9, "score[%d] between %d and %d: %g != %g", k, i, j, r1[k], r2[k]);
+    ck_assert (packed_alignment_pairwise_score_matches_bounded (pk, i, j, 1e9, r2));
+    for (k = 0; k < 5; k++) ck_assert_msg (fabs (r1[k] - r2[k]) < 1e-9, "bounded score[%d] between %d and %d", k, i, j);
+  }
+  del_packed_alignment (pk);
+}
+
+/* number of sequences, sites and ambiguity rate: the first ones have up to one word of patterns (with padding), and the
+ * others have hundreds of patterns (many words, with distinct frequencies) */
+int packed_n_taxa[6]   = {2,  5,  7,   12,   8,   20};
+int packed_n_sites[6]  = {63, 64, 65, 1000, 2077, 3001};
+int packed_amb_rate[6] = {5,  9,  0,   11,   40,  7};
+
+START_TEST(packed_kernels_with_ambiguity_loop)
+{
+  char_vector taxlabel, character;
+  alignment align, raw;
+
+  synthetic_sequences (packed_n_taxa[_i], packed_n_sites[_i], packed_amb_rate[_i], 17 + _i, &taxlabel, &character);
+  align = new_alignment_from_taxlabel_and_character_vectors (taxlabel, character, filename, true);
+  del_char_vector (taxlabel);
+  del_char_vector (character);
+  synthetic_sequences (packed_n_taxa[_i], packed_n_sites[_i], packed_amb_rate[_i], 17 + _i, &taxlabel, &character);
+  raw = new_alignment_from_taxlabel_and_character_vectors (taxlabel, character, filename, false);
+  del_char_vector (taxlabel);
+  del_char_vector (character);
+  if (packed_n_sites[_i] > 500) ck_assert_int_gt (align->npat, 64);
+
+  compare_packed_with_char_kernels (align, raw);
+  del_alignment (align);
+  del_alignment (raw);
+}
+END_TEST
+
+START_TEST(packed_kernels_from_file)
+{
+  char_vector taxlabel, character;
+  alignment align, raw;
+
+  truncated_sequences_from_file (30, 2500, &taxlabel, &character);
+  align = new_alignment_from_taxlabel_and_character_vectors (taxlabel, character, filename, true);
+  del_char_vector (taxlabel);
+  del_char_vector (character);
+  truncated_sequences_from_file (30, 2500, &taxlabel, &character);
+  raw = new_alignment_from_taxlabel_and_character_vectors (taxlabel, character, filename, false);
+  del_char_vector (taxlabel);
+  del_char_vector (character);
+  ck_assert_int_gt (align->npat, 64);
+
+  compare_packed_with_char_kernels (align, raw);
+  del_alignment (align);
+  del_alignment (raw);
+}
+END_TEST
+
+/* distance matrix of many variable sites (thus many tiles of sequences) with n_threads threads */
+distance_matrix
+distance_matrix_with_threads (int n_threads)
+{
+  char_vector taxlabel, character;
+  alignment align;
+  distance_matrix dist;
+
+#ifdef _OPENMP
+  omp_set_num_threads (n_threads);
+#endif
+  synthetic_sequences (60, 20000, 25, 101, &taxlabel, &character);
+  align = new_alignment_from_taxlabel_and_character_vectors (taxlabel, character, filename, true);
+  dist = new_distance_matrix_from_alignment (align);
+  del_char_vector (taxlabel);
+  del_char_vector (character);
+  del_alignment (align);
+  return dist;
+}
+
+START_TEST(distance_matrix_independent_of_threads)
+{
+  int i, j, n_threads = 1;
+  distance_matrix serial, parallel;
+
+#ifdef _OPENMP
+  n_threads = omp_get_max_threads ();
+#endif
+  serial = distance_matrix_with_threads (1);
+  parallel = distance_matrix_with_threads (4); /* even if there are fewer cores */
+  for (i = 0; i < serial->size; i++) for (j = 0; j < serial->size; j++) if (serial->d[i][j] != parallel->d[i][j])
+    ck_abort_msg ("distance (%d,%d) with four threads is %.12g but with one thread is %.12g", i, j, parallel->d[i][j], serial->d[i][j]);
+  /* moments are merged in distinct orders */
+  ck_assert_msg (fabs (serial->mean_K2P_dist - parallel->mean_K2P_dist) < 1e-12 * serial->mean_K2P_dist, "mean K2P distance");
+  ck_assert_msg (fabs (serial->var_K2P_dist - parallel->var_K2P_dist) < 1e-9 * serial->var_K2P_dist, "variance of K2P distance");
+  ck_assert_msg (fabs (serial->mean_R - parallel->mean_R) < 1e-12 * serial->mean_R, "mean ti/tv ratio");
+  ck_assert_msg (fabs (serial->var_R - parallel->var_R) < 1e-9 * serial->var_R, "variance of ti/tv ratio");
+  ck_assert_msg (fabs (serial->mean_JC_dist - parallel->mean_JC_dist) < 1e-12 * serial->mean_JC_dist, "mean JC distance");
+  del_distance_matrix (serial);
+  del_distance_matrix (parallel);
+#ifdef _OPENMP
+  omp_set_num_threads (n_threads);
+#endif
+}
+END_TEST
+
+/* alignment from synthetic sequences where every seventh column is constant (with IUPAC codes, indels and missing data),
+ * all columns are constant (identical sequences), or no column is constant */
+alignment
+alignment_with_constant_columns (int n_taxa, int n_sites, int type, bool compact)
+{
+  int i, s;
+  char *amb = "ACGTRYKMSWBDHVN-?";
+  char_vector taxlabel, character;
+  alignment align;
+
+  synthetic_sequences (n_taxa, n_sites, 9, 29 + type, &taxlabel, &character);
+  for (s = 0; s < n_sites; s++) for (i = 1; i < n_taxa; i++) {
+    if ((type == 0) && !(s % 7)) character->string[i][s] = character->string[0][s] = amb[(s / 7) % 17];
+    if (type == 1) character->string[i][s] = character->string[0][s];
+    if ((type == 2) && (character->string[i][s] == character->string[0][s]))
+      character->string[i][s] = (character->string[0][s] == 'A' ? 'C' : 'A');
+  }
+  align = new_alignment_from_taxlabel_and_character_vectors (taxlabel, character, filename, compact);
+  del_char_vector (taxlabel);
+  del_char_vector (character);
+  return align;
+}
+
+START_TEST(variable_sites_equal_full_kernels_loop)
+{
+  int i, j, k, i1[4], i2[4];
+  double r1[5], r2[5];
+  alignment align, raw;
+  variable_sites vs, vs_raw;
+  packed_alignment pk;
+  size_t *idx;
+
+  align = alignment_with_constant_columns (9, 1500, _i, true);
+  raw = alignment_with_constant_columns (9, 1500, _i, false);
+  vs = new_variable_sites_from_alignment (align);
+  vs_raw = new_variable_sites_from_alignment (raw);
+  pk = new_packed_alignment_from_variable_sites (align, vs);
+  if (_i == 1) ck_assert_int_eq (vs->n_var, 0);
+  if (_i == 2) ck_assert_int_eq (vs->n_var, vs->n_col);
+  if (_i == 0) ck_assert_int_gt (vs->mono_freq[15], 0); /* N (or '?') columns */
+  if (_i == 0) ck_assert_int_gt (vs->mono_indel, 0);
+
+  idx = (size_t*) biomcmc_malloc (raw->nchar * sizeof (size_t));
+  for (k = 0; k < raw->nchar; k++) idx[k] = (size_t) k;
+  for (i = 1; i < align->ntax; i++) for (j = 0; j < i; j++) {
+    biomcmc_calc_pairwise_distance_K2P (align->character->string[i], align->character->string[j], align->pattern_freq, align->npat, r1);
+    biomcmc_calc_pairwise_distance_K2P_variable_sites (align->character->string[i], align->character->string[j], vs, r2);
+    for (k = 0; k < 2; k++) ck_assert_msg (fabs (r1[k] - r2[k]) < 1e-12, "K2P[%d] between %d and %d: %g != %g", k, i, j, r1[k], r2[k]);
+    packed_alignment_pairwise_distance_K2P (pk, i, j, r2);
+    for (k = 0; k < 2; k++) ck_assert_msg (fabs (r1[k] - r2[k]) < 1e-12, "packed K2P[%d] between %d and %d", k, i, j);
+
+    biomcmc_pairwise_score_matches (raw->character->string[i], raw->character->string[j], raw->nchar, r1);
+    biomcmc_pairwise_score_matches_variable_sites (raw->character->string[i], raw->character->string[j], vs_raw, r2);
+    for (k = 0; k < 5; k++) ck_assert_msg (fabs (r1[k] - r2[k]) < 1e-9, "score[%d] between %d and %d: %g != %g", k, i, j, r1[k], r2[k]);
+    biomcmc_pairwise_score_matches_variable_sites (align->character->string[i], align->character->string[j], vs, r2);
+    for (k = 0; k < 5; k++) ck_assert_msg (fabs (r1[k] - r2[k]) < 1e-9, "weighted score[%d] between %d and %d", k, i, j);
+    packed_alignment_pairwise_score_matches (pk, i, j, r2);
+    for (k = 0; k < 5; k++) ck_assert_msg (fabs (r1[k] - r2[k]) < 1e-9, "packed score[%d] between %d and %d", k, i, j);
+
+    biomcmc_pairwise_score_matches_truncated_idx (raw->character->string[i], raw->character->string[j], raw->nchar, raw->nchar + 1, i1, idx);
+    biomcmc_pairwise_score_matches_truncated_variable_sites (raw->character->string[i], raw->character->string[j], vs_raw, raw->nchar + 1, i2);
+    for (k = 0; k < 4; k++) ck_assert_int_eq (i1[k], i2[k]);
+  }
+  free (idx);
+  del_packed_alignment (pk);
+  del_variable_sites (vs);
+  del_variable_sites (vs_raw);
+  del_alignment (align);
+  del_alignment (raw);
+}
+END_TEST
+
+/* identical sequences have no variable column, thus nothing is packed; distances must be the same as pair by pair */
+/* elements of the distance matrix (from packed sequences, over variable columns) equal the per-pair char kernel up to
+ * rounding, since fractions of ambiguous sites and constant columns are summed in another order */
+START_TEST(distance_matrix_equals_char_kernel_loop)
+{
+  int i, j;
+  double r[2], d, jc, n = 0., mean = 0., m2 = 0., delta;
+  alignment align = alignment_with_constant_columns (40, 3000, _i, true);
+  distance_matrix dist = new_distance_matrix_from_alignment (align);
+
+  for (i = 1; i < dist->size; i++) for (j = 0; j < i; j++) {
+    biomcmc_calc_pairwise_distance_K2P (align->character->string[i], align->character->string[j], align->pattern_freq, align->npat, r);
+    d = pairwise_K2P_distance (r[0], r[1]);
+    jc = -0.75 * log (1. - (4. * (r[0] + r[1]))/3.); /* far from saturation */
+    if (fabs (dist->d[j][i] - d) > 1e-12 * d) ck_abort_msg ("K2P distance (%d,%d) is %.17g but should be %.17g", i, j, dist->d[j][i], d);
+    if (fabs (dist->d[i][j] - jc) > 1e-12 * jc) ck_abort_msg ("JC distance (%d,%d) is %.17g but should be %.17g", i, j, dist->d[i][j], jc);
+    delta = d - mean;
+    mean += delta / (n += 1.);
+    m2 += delta * (d - mean);
+  }
+  ck_assert_msg (fabs (dist->mean_K2P_dist - mean) < 1e-12 * mean, "mean K2P distance is %g instead of %g", dist->mean_K2P_dist, mean);
+  ck_assert_msg (fabs (dist->var_K2P_dist - m2 / (n - 1.)) < 1e-9 * m2 / (n - 1.) + 1e-20, "variance of K2P distance");
+  del_distance_matrix (dist);
+  del_alignment (align);
+}
+END_TEST
+
+START_TEST(distance_matrix_of_identical_sequences)
+{
+  int i, j;
+  double r[2], d, jc;
+  alignment align = alignment_with_constant_columns (7, 300, 1, true);
+  distance_matrix dist = new_distance_matrix_from_alignment (align);
+
+  biomcmc_calc_pairwise_distance_K2P (align->character->string[1], align->character->string[0], align->pattern_freq, align->npat, r);
+  d = -0.5 * log (1. - 2. * r[0] - r[1]) - 0.25 * log (1. - 2. * r[1]);
+  jc = -0.75 * log (1. - 4. * (r[0] + r[1]) / 3.);
+  for (i = 1; i < dist->size; i++) for (j = 0; j < i; j++) {
+    ck_assert_msg (fabs (dist->d[j][i] - d) < 1e-12, "K2P distance (%d,%d) is %g instead of %g", i, j, dist->d[j][i], d);
+    ck_assert_msg (fabs (dist->d[i][j] - jc) < 1e-12, "JC distance (%d,%d) is %g instead of %g", i, j, dist->d[i][j], jc);
+  }
+  ck_assert_msg (fabs (dist->mean_K2P_dist - d) < 1e-12, "mean K2P distance is %g instead of %g", dist->mean_K2P_dist, d);
+  ck_assert_msg (fabs (dist->var_K2P_dist) < 1e-12, "variance of K2P distance is %g", dist->var_K2P_dist);
+  del_distance_matrix (dist);
+  del_alignment (align);
+}
+END_TEST
+
+/* three groups of synthetic sequences, each around its own reference (thus distances within groups are much smaller) */
+alignment
+alignment_with_three_groups (int n_taxa, int n_sites)
+{
+  int i;
+  char name[32];
+  char_vector group_label[3], group_seq[3], taxlabel, character;
+  alignment align;
+
+  for (i = 0; i < 3; i++) synthetic_sequences ((n_taxa + 2) / 3, n_sites, 40, 11 + i, &group_label[i], &group_seq[i]);
+  taxlabel  = new_char_vector (n_taxa);
+  character = new_char_vector (n_taxa);
+  for (i = 0; i < n_taxa; i++) {
+    sprintf (name, "group%d_seq%d", i % 3, i / 3);
+    char_vector_add_string_at_position (taxlabel, name, i);
+    char_vector_add_string_at_position (character, group_seq[i % 3]->string[i / 3], i);
+  }
+  align = new_alignment_from_taxlabel_and_character_vectors (taxlabel, character, filename, true);
+  for (i = 0; i < 3; i++) {
+    del_char_vector (group_label[i]);
+    del_char_vector (group_seq[i]);
+  }
+  del_char_vector (taxlabel);
+  del_char_vector (character);
+  return align;
+}
+
+/* unbounded distance (K2P if type is zero, or incompatible sites otherwise) between all pairs, and its value at quantile q */
+double*
+packed_distances_and_quantile (packed_alignment pk, int type, double q, double *value)
+{
+  int i, j, n = 0;
+  double *d = (double*) biomcmc_malloc (pk->ntax * (pk->ntax - 1) / 2 * sizeof (double)), *sorted;
+
+  for (j = 1; j < pk->ntax; j++) for (i = 0; i < j; i++, n++) {
+    if (type) packed_alignment_mismatch_distance_generator (pk, i, j, d + n);
+    else      packed_alignment_K2P_distance_generator (pk, i, j, d + n);
+  }
+  sorted = (double*) biomcmc_malloc (n * sizeof (double));
+  memcpy (sorted, d, n * sizeof (double));
+  qsort (sorted, n, sizeof (double), compare_double_increasing);
+  *value = sorted[(int) (q * n)];
+  free (sorted);
+  return d;
+}
+
+START_TEST(bounded_distance_generators_loop)
+{
+  int i, j, n = 0;
+  double *d, threshold, r, x;
+  alignment align = alignment_with_three_groups (30, 1500);
+  packed_alignment pk = new_packed_alignment_from_alignment (align);
+  distance_generator dg = new_distance_generator (pk->ntax, 1);
+
+  d = packed_distances_and_quantile (pk, _i, 0.3, &threshold);
+  if (_i) distance_generator_set_bounded_function_data (dg, packed_alignment_mismatch_distance_generator_bounded, (void*) pk);
+  else    distance_generator_set_bounded_function_data (dg, packed_alignment_K2P_distance_generator_bounded, (void*) pk);
+  distance_generator_set_threshold (dg, threshold);
+  for (j = 1; j < pk->ntax; j++) for (i = 0; i < j; i++, n++) {
+    if (_i) packed_alignment_mismatch_distance_generator_bounded (pk, i, j, threshold, &r);
+    else    packed_alignment_K2P_distance_generator_bounded (pk, i, j, threshold, &r);
+    x = distance_generator_get (dg, i, j);
+    if (d[n] <= threshold) { /* exact below the threshold */
+      if ((fabs (r - d[n]) > 1e-12 * d[n]) || (x != r))
+        ck_abort_msg ("bounded distance (%d,%d) is %.17g (generator %.17g) but should be %.17g", i, j, r, x, d[n]);
+    }
+    else if ((r <= threshold) || (x <= threshold)) /* any value above it, otherwise */
+      ck_abort_msg ("bounded distance (%d,%d) is %.17g (generator %.17g) but should be above %.17g", i, j, r, x, threshold);
+  }
+  free (d);
+  del_distance_generator (dg);
+  del_packed_alignment (pk);
+  del_alignment (align);
+}
+END_TEST
+
+/* GOPTICS ordering and clusters must not depend on the generator being bounded, also if the same generator is reused
+ * with a larger epsilon (which needs the lower bounds of the first run to be recalculated) */
+START_TEST(goptics_with_bounded_generator_loop)
+{
+  int i, k;
+  double *d, epsilon[2];
+  alignment align = alignment_with_three_groups (30, 1500);
+  packed_alignment pk = new_packed_alignment_from_alignment (align);
+  distance_generator dg_u = new_distance_generator (pk->ntax, 1), dg_b = new_distance_generator (pk->ntax, 1);
+  goptics_cluster gop_u, gop_b;
+
+  d = packed_distances_and_quantile (pk, _i, 0.1, epsilon);
+  free (d);
+  d = packed_distances_and_quantile (pk, _i, 0.3, epsilon + 1);
+  free (d);
+  if (_i) {
+    distance_generator_set_function_data (dg_u, packed_alignment_mismatch_distance_generator, (void*) pk);
+    distance_generator_set_bounded_function_data (dg_b, packed_alignment_mismatch_distance_generator_bounded, (void*) pk);
+  }
+  else {
+    distance_generator_set_function_data (dg_u, packed_alignment_K2P_distance_generator, (void*) pk);
+    distance_generator_set_bounded_function_data (dg_b, packed_alignment_K2P_distance_generator_bounded, (void*) pk);
+  }
+
+  for (k = 0; k < 2; k++) {
+    gop_u = new_goptics_cluster_run (dg_u, 3, epsilon[k]);
+    gop_b = new_goptics_cluster_run (dg_b, 3, epsilon[k]);
+    ck_assert_int_eq (gop_u->num_edges, gop_b->num_edges);
+    ck_assert_int_gt (gop_u->num_edges, 0);
+    for (i = 0; i < pk->ntax; i++) {
+      ck_assert_int_eq (gop_u->order[i], gop_b->order[i]);
+      ck_assert_int_eq (gop_u->core[i], gop_b->core[i]);
+      /* distances without a neighbour are replaced by twice the largest (exact) distance, which is above epsilon */
+      if ((gop_u->reach_distance[i] <= epsilon[k]) || (gop_b->reach_distance[i] <= epsilon[k]))
+        ck_assert_msg (gop_u->reach_distance[i] == gop_b->reach_distance[i], "reachability distance %d with epsilon %g", i, epsilon[k]);
+      if ((gop_u->core_distance[i] <= epsilon[k]) || (gop_b->core_distance[i] <= epsilon[k]))
+        ck_assert_msg (gop_u->core_distance[i] == gop_b->core_distance[i], "core distance %d with epsilon %g", i, epsilon[k]);
+    }
+    assign_goptics_clusters (gop_u, 0.8 * epsilon[k]);
+    assign_goptics_clusters (gop_b, 0.8 * epsilon[k]);
+    ck_assert_int_eq (gop_u->n_clusters, gop_b->n_clusters);
+    for (i = 0; i < pk->ntax; i++) ck_assert_int_eq (gop_u->cluster[i], gop_b->cluster[i]);
+    del_goptics_cluster (gop_u);
+    del_goptics_cluster (gop_b);
+  }
+  del_distance_generator (dg_u);
+  del_distance_generator (dg_b);
+  del_packed_alignment (pk);
+  del_alignment (align);
+}
+END_TEST
+
+/* temporary FASTA file with the first sequences of the test file, wrapped at width bases per line (or in a single line if
+ * zero), with extra words in the description, and with line breaks "\r\n" or "\n"; odd sequences are in lowercase if
+ * lower is true. Returns the FASTA file name, which must be freed (together with the file and its index) */
+char*
+fasta_index_temporary_file (int n_taxa, int n_sites, int width, bool crlf, bool lower)
+{
+  int i, s, fd;
+  char *tmpname = (char*) biomcmc_malloc (64 * sizeof (char));
+  char_vector taxlabel, character;
+  FILE *stream;
+
+  strcpy (tmpname, "/tmp/check_fasta_index_XXXXXX");
+  if ((fd = mkstemp (tmpname)) < 0) ck_abort_msg ("could not create temporary file");
+  stream = fdopen (fd, "w");
+  truncated_sequences_from_file (n_taxa, n_sites, &taxlabel, &character);
+  for (i = 0; i < n_taxa; i++) {
+    fprintf (stream, ">%s sequence %d of %d%s", taxlabel->string[i], i, n_taxa, crlf ? "\r\n" : "\n");
+    for (s = 0; s < n_sites; s++) {
+      fputc ((lower && (i % 2)) ? tolower (character->string[i][s]) : toupper (character->string[i][s]), stream);
+      if ((width && !((s + 1) % width)) || (s == n_sites - 1)) fputs (crlf ? "\r\n" : "\n", stream);
+    }
+  }
+  fclose (stream);
+  del_char_vector (taxlabel);
+  del_char_vector (character);
+  return tmpname;
+}
+
+void
+fasta_index_remove_temporary_file (char *tmpname)
+{
+  char fainame[80];
+  sprintf (fainame, "%s.fai", tmpname);
+  remove (fainame);
+  remove (tmpname);
+  free (tmpname);
+}
+
+/* sequences from index must be the same as read_fasta_alignment_from_file(), and its names the first word of the
+ * descriptions */
+void
+compare_fasta_index_with_alignment (char *tmpname, int n_taxa, int n_sites)
+{
+  int i, j;
+  char *s, *word, **first;
+  fasta_index fai = new_fasta_index_from_file (tmpname);
+  alignment align = read_fasta_alignment_from_file (tmpname, false), sub;
+
+  ck_assert_int_eq (fai->n_seqs, n_taxa);
+  first = (char**) biomcmc_malloc (4 * n_taxa * sizeof (char*)); /* sequences materialised by concurrent threads */
+#ifdef _OPENMP
+#pragma omp parallel for schedule(dynamic,1)
+#endif
+  for (i = 0; i < 4 * n_taxa; i++) first[i] = fasta_index_sequence (fai, i / 4);
+  for (i = 0; i < 4 * n_taxa; i++) ck_assert_msg (first[i] == first[4 * (i / 4)], "sequence %d was materialised twice", i / 4);
+  ck_assert_int_eq (align->nchar, n_sites);
+  sub = new_alignment_from_fasta_index (fai, NULL, 0, false);
+  ck_assert_int_eq (sub->ntax, n_taxa);
+  ck_assert_int_eq (sub->nchar, n_sites);
+  for (i = 0; i < n_taxa; i++) {
+    ck_assert_int_eq (fai->length[i], n_sites);
+    word = strtok (align->taxlabel->string[i], " \t\r"); /* read_fasta_alignment_from_file() keeps the '\r' */
+    ck_assert_msg (!strcmp (fai->name->string[i], word), "name %d is \"%s\" instead of \"%s\"", i, fai->name->string[i], word);
+    ck_assert_int_eq (fasta_index_find_name (fai, word), i);
+    ck_assert_msg (!strncmp (sub->taxlabel->string[i], word, strlen (word)), "description %d starts with \"%s\"", i, sub->taxlabel->string[i]);
+    s = fasta_index_sequence (fai, i);
+    ck_assert_msg (!memcmp (s, align->character->string[i], n_sites), "sequence %d differs from FASTA file", i);
+    ck_assert_msg (s == first[4 * i], "sequence %d was materialised again", i);
+    ck_assert_msg (!memcmp (sub->character->string[i], align->character->string[i], n_sites), "copy of sequence %d differs", i);
+  }
+  /* the first sequence is always uppercase, thus it is a view if in a single line */
+  if (fai->line_bases[0] == n_sites) ck_assert_msg (fasta_index_sequence (fai, 0) == fai->map + fai->offset[0], "sequence is not a view");
+  else ck_assert (fasta_index_sequence_view (fai, 0) == NULL);
+  del_alignment (sub);
+
+  i = 3;
+  sub = new_alignment_from_fasta_index (fai, &i, 1, false);
+  ck_assert_int_eq (sub->ntax, 1);
+  ck_assert (!memcmp (sub->character->string[0], align->character->string[3], n_sites));
+  del_alignment (sub);
+  for (i = 1; i < n_taxa; i++) for (j = 0; j < i; j++) {
+    double r1[5], r2[5];
+    biomcmc_calc_pairwise_distance_K2P (align->character->string[i], align->character->string[j], NULL, n_sites, r1);
+    fasta_index_K2P_distance_generator (fai, i, j, r2);
+    ck_assert_msg (fabs (pairwise_K2P_distance (r1[0], r1[1]) - r2[0]) < 1e-12, "K2P distance between %d and %d", i, j);
+    biomcmc_pairwise_score_matches (align->character->string[i], align->character->string[j], n_sites, r1);
+    fasta_index_mismatch_distance_generator (fai, i, j, r2);
+    ck_assert_msg (fabs (r1[4] - r1[0] - r2[0]) < 1e-12, "mismatches between %d and %d", i, j);
+  }
+  free (first);
+  del_alignment (align);
+  del_fasta_index (fai);
+}
+
+int fasta_index_width[5] = {0, 60, 60, 0, 77};
+bool fasta_index_crlf[5] = {false, false, true, true, false};
+
+START_TEST(fasta_index_equals_alignment_loop)
+{
+  char *tmpname = fasta_index_temporary_file (12, 1000, fasta_index_width[_i], fasta_index_crlf[_i], (_i == 4));
+  compare_fasta_index_with_alignment (tmpname, 12, 1000); /* creates index */
+  compare_fasta_index_with_alignment (tmpname, 12, 1000); /* reads index */
+  fasta_index_remove_temporary_file (tmpname);
+}
+END_TEST
+
+/* FASTA file replaced after its index was created, within the same second (i.e. the index is not older than the file):
+ * the new file has more sequences (and the same first ones) or distinct sequences */
+int fasta_index_stale_n_taxa[2] = {15, 9};
+
+START_TEST(fasta_index_stale_index_file_loop)
+{
+  char *tmpname = fasta_index_temporary_file (12, 1000, 60, false, false), *other, fainame[80];
+  struct stat st;
+  struct utimbuf times;
+  fasta_index fai = new_fasta_index_from_file (tmpname);
+  del_fasta_index (fai);
+
+  if (_i == 0) other = fasta_index_temporary_file (15, 1000, 60, false, false);
+  else         other = fasta_index_temporary_file (9, 700, 0, false, true);
+  ck_assert (!rename (other, tmpname)); /* replaces the FASTA file, but not its index */
+  free (other);
+  sprintf (fainame, "%s.fai", tmpname);
+  ck_assert (!stat (tmpname, &st));
+  times.actime = times.modtime = st.st_mtime + 10;
+  ck_assert (!utime (fainame, &times));
+  compare_fasta_index_with_alignment (tmpname, fasta_index_stale_n_taxa[_i], (_i ? 700 : 1000));
+  fasta_index_remove_temporary_file (tmpname);
+}
+END_TEST
+
+Suite * alignment_suite(void)
+{
+  Suite *s;
+  TCase *tc_case;
+
+  s = suite_create("Alignment");
+
+  tc_case = tcase_create("site patterns");
+  tcase_add_loop_test (tc_case, sitepattern_equals_pairwise_comparison_loop, 0, 3); // 2, 12 and 91 sequences
+  suite_add_tcase(s, tc_case);
+
+  tc_case = tcase_create("pairwise kernels");
+  tcase_add_loop_test (tc_case, packed_kernels_with_ambiguity_loop, 0, 6);
+  tcase_add_test (tc_case, packed_kernels_from_file);
+  tcase_add_loop_test (tc_case, variable_sites_equal_full_kernels_loop, 0, 3); // some, all or no constant columns
+  suite_add_tcase(s, tc_case);
+
+  tc_case = tcase_create("distance matrix");
+  tcase_add_test (tc_case, distance_matrix_independent_of_threads);
+  tcase_add_test (tc_case, distance_matrix_of_identical_sequences);
+  tcase_add_loop_test (tc_case, distance_matrix_equals_char_kernel_loop, 0, 3); // some, all or no constant columns
+  suite_add_tcase(s, tc_case);
+
+  tc_case = tcase_create("bounded distances");
+  tcase_add_loop_test (tc_case, bounded_distance_generators_loop, 0, 2); // K2P and incompatible sites
+  tcase_add_loop_test (tc_case, goptics_with_bounded_generator_loop, 0, 2);
+  suite_add_tcase(s, tc_case);
+
+  tc_case = tcase_create("fasta index");
+  tcase_add_loop_test (tc_case, fasta_index_equals_alignment_loop, 0, 5); // single or wrapped lines, LF or CRLF
+  tcase_add_loop_test (tc_case, fasta_index_stale_index_file_loop, 0, 2); // added or distinct sequences
+  suite_add_tcase(s, tc_case);
+
+  return s;
+}
+
+int main(void)
+{
+  int number_failed;
+  SRunner *sr;
+
+  sr = srunner_create (alignment_suite());
+  srunner_run_all(sr, CK_VERBOSE);
+  number_failed = srunner_ntests_failed(sr);
+  srunner_free(sr);
+  return (number_failed > 0) ? TEST_FAILURE:TEST_SUCCESS;
+}
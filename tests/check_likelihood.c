@@ -0,0 +1,760 @@
+#include <biomcmc.h>
+#include <likelihood.h>
+#include <likelihood_kernel.h>
+#include <likelihood_mc3.h>
+#include <check.h>
+
+#define TEST_SUCCESS 0
+#define TEST_FAILURE 1
+#define TEST_SKIPPED 77
+#define TEST_HARDERROR 99
+
+#ifndef TEST_FILE_DIR
+#define TEST_FILE_DIR "./files/"
+#endif
+
+int kernel_n_state[3] = {4, 20, 61};
+
+/* all kernels for n_state states over the same (arbitrary) vectors and matrices; result[] has, in order, the partial,
+ * tip and mixed precision vectors followed by their maxima, and both root likelihoods */
+int
+likelihood_kernel_results (int n, double *result)
+{
+  int i, k = 0;
+  double left[64], right[64], tip[64], pi[64], Pl[64*64], Pr[64*64];
+  float fleft[64], fright[64];
+  lk_kernel kern = lk_kernel_nstate[n];
+
+  for (i = 0; i < n; i++) {
+    left[i]  = (double) ((i * 7919) % 1009 + 1) / 1009.;
+    right[i] = (double) ((i * 104729) % 997 + 1) / 997.;
+    tip[i]   = (double) ((i * 31) % 11 + 1) / 11.;
+    pi[i]    = 1. / (double) n;
+    fleft[i] = (float) left[i];
+    fright[i] = (float) right[i];
+  }
+  for (i = 0; i < n * n; i++) {
+    Pl[i] = (double) ((i * 613) % 101 + 1) / (101. * n);
+    Pr[i] = (double) ((i * 331) % 103 + 1) / (103. * n);
+  }
+  result[k + n] = kern->partial (result + k, left, right, Pl, Pr);    k += n + 1;
+  result[k + n] = kern->partial_tip (result + k, tip, right, Pr);     k += n + 1;
+  result[k + n] = kern->partial_mixed (result + k, fleft, fright, Pl, Pr); k += n + 1;
+  result[k + n] = kern->partial_tip_mixed (result + k, tip, fright, Pr);  k += n + 1;
+  result[k++] = kern->root (left, right, Pr, pi);
+  result[k++] = kern->root_mixed (fleft, fright, Pr, pi);
+  return k;
+}
+
+START_TEST(simd_kernels_equal_scalar_loop)
+{
+  int i, n = kernel_n_state[_i], n_res;
+  double scalar[4 * 65 + 2], simd[4 * 65 + 2];
+
+  set_likelihood_kernel (BIOMCMC_SIMD_NONE);
+  n_res = likelihood_kernel_results (n, scalar);
+  if (set_likelihood_kernel (BIOMCMC_SIMD_AVX2) == BIOMCMC_SIMD_AVX2) { /* otherwise not supported by this CPU */
+    likelihood_kernel_results (n, simd);
+    for (i = 0; i < n_res; i++) if (fabs (scalar[i] - simd[i]) > 1e-12 * fabs (scalar[i]))
+      ck_abort_msg ("AVX2 kernel for %d states differs at %d: %.17g %.17g", n, i, scalar[i], simd[i]);
+  }
+  else fprintf (stderr, "AVX2 not available, only scalar kernels were tested\n");
+  set_likelihood_kernel (BIOMCMC_SIMD_AUTO);
+}
+END_TEST
+
+/* small phylogeny (neighbour-joining tree) from the first n_sites of the first n_taxa sequences of the test file (not
+ * aligned, but for the likelihood they look like an alignment); caller must free all three */
+phylogeny
+likelihood_test_phylogeny (int n_taxa, int n_sites, alignment *align, topology *tre)
+{
+  char filename[2048] = TEST_FILE_DIR, *seq;
+  int i;
+  alignment full;
+  char_vector taxlabel, character;
+  distance_matrix dist;
+  phylogeny phy;
+
+  strcat (filename, "bacteria_riboprot.fasta");
+  full = read_fasta_alignment_from_file (filename, false);
+  taxlabel  = new_char_vector (n_taxa);
+  character = new_char_vector (n_taxa);
+  seq = (char*) biomcmc_malloc ((n_sites + 1) * sizeof (char));
+  for (i = 0; i < n_taxa; i++) {
+    memcpy (seq, full->character->string[i], n_sites);
+    seq[n_sites] = '\0';
+    char_vector_add_string_at_position (taxlabel, full->taxlabel->string[i], i);
+    char_vector_add_string_at_position (character, seq, i);
+  }
+  *align = new_alignment_from_taxlabel_and_character_vectors (taxlabel, character, filename, true);
+  dist = new_distance_matrix_from_alignment (*align);
+  *tre = new_topology ((*align)->ntax);
+  bionj_from_distance_matrix (*tre, dist);
+  /* zero lengths would make distinct sister leaves (e.g. after an SPR) impossible */
+  for (i = 0; i < (*tre)->nnodes; i++) if ((*tre)->blength[i] < 0.01) (*tre)->blength[i] = 0.01;
+  update_topology_traversal (*tre);
+  phy = new_phylogeny_from_alignment (*align, 2, 4, 4, dist);
+  del_distance_matrix (dist);
+  del_char_vector (taxlabel);
+  del_char_vector (character);
+  del_alignment (full);
+  free (seq);
+  return phy;
+}
+
+START_TEST(protein_two_taxa_equal_input)
+{
+  char *aa = "ARNDCQEGHILKMFPSTWYV", *seq[2] = {"MKV-LLAGWHX", "MRVSLIAG-YX"};
+  int i, j, n_pat = 11, state[2][11];
+  double pi[20], freq = 0., mu, e, lnL = 0., site;
+  topology tre = new_topology (2);
+  phylogeny phy = new_phylogeny (2, 1, n_pat, 20, 2);
+
+  for (i = 0; i < 20; i++) freq += (pi[i] = (double) (i + 1));
+  for (i = 0; i < 20; i++) pi[i] /= freq;
+  init_evolution_model_parameters (phy->model, 1., 1., 1., pi); /* equal-input model, kappa ignored */
+  for (i = 0; i < 2; i++) for (j = 0; j < n_pat; j++) /* gaps and unknown residues are missing data */
+    state[i][j] = (strchr (aa, seq[i][j]) ? (int) (strchr (aa, seq[i][j]) - aa) : (seq[i][j] == '-' ? -1 : 20));
+  for (i = 0; i < 2; i++) phylogeny_set_leaf_states (phy, i, state[i]);
+  for (j = 0; j < n_pat; j++) phy->weight[j] = (double) (j % 3 + 1);
+  for (phy->nsites = 0, j = 0; j < n_pat; j++) phy->nsites += (j % 3 + 1);
+
+  randomise_topology (tre); /* only one topology with two leaves */
+  tre->blength[0] = 0.1;
+  tre->blength[1] = 0.2;
+  ln_likelihood (phy, tre);
+
+  /* P(b|a,t) = exp(-mu t) delta_ab + (1 - exp(-mu t)) pi_b, with mu s.t. one substitution is expected per unit time */
+  for (freq = 1., i = 0; i < 20; i++) freq -= pi[i] * pi[i];
+  mu = 1. / freq;
+  e = exp (- mu * 0.3); /* both branches, around the root */
+  for (j = 0; j < n_pat; j++) {
+    if ((state[0][j] < 0) || (state[0][j] > 19)) site = ((state[1][j] < 0) || (state[1][j] > 19)) ? 1. : pi[state[1][j]];
+    else if ((state[1][j] < 0) || (state[1][j] > 19)) site = pi[state[0][j]];
+    else site = pi[state[0][j]] * ((state[0][j] == state[1][j]) * e + (1. - e) * pi[state[1][j]]);
+    lnL += log (site) * phy->weight[j];
+  }
+  if (fabs (lnL - phy->lk_proposal) > 1e-10 * fabs (lnL))
+    ck_abort_msg ("ln(likelihood) of two proteins is %.12g but should be %.12g", phy->lk_proposal, lnL);
+  del_phylogeny (phy);
+  del_topology (tre);
+}
+END_TEST
+
+START_TEST(edge_derivatives_finite_differences)
+{
+  int i;
+  double t, lnL, lnL_p, lnL_m, d1, d2, d1_p, d1_m, x, h = 1e-6;
+  alignment align;
+  topology tre;
+  phylogeny phy = likelihood_test_phylogeny (12, 1200, &align, &tre);
+  topol_node nd;
+
+  ln_likelihood (phy, tre);
+  accept_likelihood (phy, tre);
+  ln_likelihood_upstream (phy, tre);
+  for (i = 0; i < tre->nnodes; i++) if ((nd = tre->nodelist[i]) != tre->root) {
+    t = (nd->up == tre->root) ? tre->blength[tre->root->left->id] + tre->blength[tre->root->right->id] : tre->blength[i];
+    if (t < 1e-4) t = 1e-4; /* finite differences must stay inside the valid range */
+    lnL   = ln_likelihood_at_edge (phy, tre, nd, t, &d1, &d2);
+    lnL_p = ln_likelihood_at_edge (phy, tre, nd, t + h, &d1_p, &x);
+    lnL_m = ln_likelihood_at_edge (phy, tre, nd, t - h, &d1_m, &x);
+    if (fabs ((lnL_p - lnL_m) / (2. * h) - d1) > 1e-4 * (1. + fabs (d1)))
+      ck_abort_msg ("first derivative at node %d is %.10g but finite difference is %.10g", i, d1, (lnL_p - lnL_m) / (2. * h));
+    if (fabs ((d1_p - d1_m) / (2. * h) - d2) > 1e-4 * (1. + fabs (d2)))
+      ck_abort_msg ("second derivative at node %d is %.10g but finite difference is %.10g", i, d2, (d1_p - d1_m) / (2. * h));
+    if (fabs (lnL - phy->lk_current) > 1e-6 * fabs (lnL) && (t == tre->blength[i]))
+      ck_abort_msg ("likelihood at edge of node %d is %.10g but full likelihood is %.10g", i, lnL, phy->lk_current);
+  }
+  del_phylogeny (phy);
+  del_topology (tre);
+  del_alignment (align);
+}
+END_TEST
+
+START_TEST(optimise_branch_lengths_under_prior)
+{
+  double lnL0, lnL1, lnL2;
+  alignment align;
+  topology tre;
+  phylogeny phy = likelihood_test_phylogeny (12, 1200, &align, &tre);
+
+  ln_likelihood (phy, tre);
+  lnL0 = phy->lk_proposal;
+  lnL1 = ln_likelihood_optimise_branch_lengths (phy, tre, 1, 1e-4);
+  set_likelihood_to_prior (); /* optimisation must use the real likelihood anyway */
+  lnL2 = ln_likelihood_optimise_branch_lengths (phy, tre, 4, 1e-4);
+  set_likelihood_to_posterior ();
+  if (!(lnL1 > lnL0) || (lnL2 < lnL1 - 1e-6)) ck_abort_msg ("optimised ln(likelihood) %.10g %.10g not better than %.10g", lnL1, lnL2, lnL0);
+  del_phylogeny (phy);
+  del_topology (tre);
+  del_alignment (align);
+}
+END_TEST
+
+START_TEST(zero_weight_patterns_are_skipped)
+{
+  int i, pat;
+  double *pat_lnLk, lnL, d1, x, h = 1e-6;
+  alignment align;
+  topology tre;
+  phylogeny phy = likelihood_test_phylogeny (12, 1200, &align, &tre);
+
+  phy->use_site_repeats = (_i == 1);
+  ln_likelihood (phy, tre);
+  pat_lnLk = (double*) biomcmc_malloc (phy->npat * sizeof (double));
+  memcpy (pat_lnLk, phy->pat_lnLk, phy->npat * sizeof (double));
+  for (pat = 0; pat < phy->npat; pat += 3) phy->weight[pat] = 0.; /* a jackknife replicate */
+  for (lnL = 0., pat = 0; pat < phy->npat; pat++) lnL += pat_lnLk[pat] * phy->weight[pat];
+  lnL -= (double) (phy->nsites) * log ((double) phy->model->nrates);
+
+  ln_likelihood (phy, tre);
+  accept_likelihood (phy, tre);
+  if (fabs (lnL - phy->lk_current) > 1e-8 * fabs (lnL))
+    ck_abort_msg ("ln(likelihood) with zero weights is %.10g but should be %.10g", phy->lk_current, lnL);
+
+  biomcmc_random_number_init (42ULL);
+  for (i = 0; i < 4; i++) { /* moved branches only recalculate the nonzero patterns, as the full likelihood */
+    topology_apply_spr (tre, true);
+    update_topology_traversal (tre);
+    ln_likelihood_moved_branches (phy, tre);
+    accept_likelihood_moved_branches (phy, tre);
+  }
+  biomcmc_random_number_finalize ();
+  lnL = phy->lk_current;
+  ln_likelihood (phy, tre);
+  if (fabs (lnL - phy->lk_proposal) > 1e-8 * fabs (lnL))
+    ck_abort_msg ("moved branches ln(likelihood) with zero weights is %.10g but full is %.10g", lnL, phy->lk_proposal);
+  accept_likelihood (phy, tre);
+
+  ln_likelihood_upstream (phy, tre); /* upstream vectors and edge likelihood skip them as well */
+  lnL = ln_likelihood_at_edge (phy, tre, tre->nodelist[0], tre->blength[0], &d1, NULL);
+  x = ln_likelihood_at_edge (phy, tre, tre->nodelist[0], tre->blength[0] + h, NULL, NULL);
+  if ((fabs (lnL - phy->lk_current) > 1e-6 * fabs (lnL)) || (fabs ((x - lnL) / h - d1) > 1e-2 * (1. + fabs (d1))))
+    ck_abort_msg ("edge ln(likelihood) with zero weights is %.10g (derivative %.10g) but should be %.10g", lnL, d1, phy->lk_current);
+
+  free (pat_lnLk);
+  del_phylogeny (phy);
+  del_topology (tre);
+  del_alignment (align);
+}
+END_TEST
+
+START_TEST(partitioned_likelihood_after_tree_changes)
+{
+  int i, j;
+  double lnL;
+  alignment align;
+  topology tre;
+  phylogeny phy = likelihood_test_phylogeny (12, 1200, &align, &tre);
+  partitioned_phylogeny pp;
+
+  align->n_charset = 2; /* sites 0...399 and 400...799, and the remaining sites as third partition */
+  align->charset_start = (int*) biomcmc_malloc (2 * sizeof (int));
+  align->charset_end   = (int*) biomcmc_malloc (2 * sizeof (int));
+  align->charset_start[0] = 0;   align->charset_end[0] = 399;
+  align->charset_start[1] = 400; align->charset_end[1] = 799;
+  pp = new_partitioned_phylogeny_from_alignment (align, 2, 4, 4, NULL);
+  biomcmc_random_number_init (42ULL); /* for the SPR moves */
+  ck_assert_int_eq (pp->n_part, 3);
+
+  for (i = 0; i < 6; i++) {
+    if (i == 2) tre->blength[tre->nodelist[0]->id] *= 2.; /* no partition_invalidate() after any of these changes */
+    else if (i == 3) update_model_eigenvalues_from_kappa (pp->part[1]->model, 3.);
+    else if (i > 3) { topology_apply_spr (tre, true); update_topology_traversal (tre); }
+    ln_likelihood_partitioned (pp, tre);
+    accept_likelihood_partitioned (pp, tre);
+    for (lnL = 0., j = 0; j < pp->n_part; j++) { /* same trees and models, but without the partition bookkeeping */
+      ln_likelihood (pp->part[j], tre);
+      lnL += pp->part[j]->lk_proposal;
+    }
+    if (fabs (lnL - pp->lk_current) > 1e-8 * fabs (lnL))
+      ck_abort_msg ("partitioned ln(likelihood) at step %d is %.10g but should be %.10g", i, pp->lk_current, lnL);
+  }
+  biomcmc_random_number_finalize ();
+  del_partitioned_phylogeny (pp);
+  del_phylogeny (phy);
+  del_topology (tre);
+  del_alignment (align);
+}
+END_TEST
+
+START_TEST(memory_budget_equals_unbounded)
+{
+  int i;
+  alignment align, align_b;
+  topology tre, tre_b;
+  phylogeny phy = likelihood_test_phylogeny (12, 1200, &align, &tre),
+            phy_b = likelihood_test_phylogeny (12, 1200, &align_b, &tre_b); /* same data, under a budget */
+
+  phylogeny_set_memory_budget (phy_b, 1);
+  phylogeny_set_memory_budget (phy_b, 4 * phy_b->mem->vector_size); /* ten internal nodes, only four vectors */
+  ln_likelihood (phy, tre);
+  accept_likelihood (phy, tre);
+  ln_likelihood (phy_b, tre);
+  accept_likelihood (phy_b, tre);
+  if (fabs (phy->lk_current - phy_b->lk_current) > 1e-9 * fabs (phy->lk_current))
+    ck_abort_msg ("ln(likelihood) under a memory budget is %.12g but unbounded is %.12g", phy_b->lk_current, phy->lk_current);
+
+  biomcmc_random_number_init (42ULL);
+  for (i = 0; i < 12; i++) { /* both phylogenies see the same moves; one in three is rejected */
+    topology_apply_spr (tre, true);
+    update_topology_traversal (tre);
+    ln_likelihood_moved_branches (phy, tre);
+    ln_likelihood_moved_branches (phy_b, tre);
+    if (fabs (phy->lk_proposal - phy_b->lk_proposal) > 1e-9 * fabs (phy->lk_proposal))
+      ck_abort_msg ("proposal %d ln(likelihood) under a memory budget is %.12g but unbounded is %.12g", i, phy_b->lk_proposal, phy->lk_proposal);
+    if (i % 3) {
+      accept_likelihood_moved_branches (phy, tre);
+      accept_likelihood_moved_branches (phy_b, tre);
+      clear_topology_flags (tre);
+    }
+    else topology_reset_random_move (tre);
+    update_topology_traversal (tre);
+  }
+  biomcmc_random_number_finalize ();
+  ln_likelihood (phy_b, tre);
+  if (fabs (phy->lk_current - phy_b->lk_proposal) > 1e-9 * fabs (phy->lk_current))
+    ck_abort_msg ("full ln(likelihood) under a memory budget is %.12g but unbounded is %.12g", phy_b->lk_proposal, phy->lk_current);
+  ck_assert_int_eq (phy_b->mem->peak_resident <= phy_b->mem->max_resident, 1);
+  ck_assert_int_gt ((int) phy_b->mem->n_evicted, 0);
+  ck_assert_int_gt ((int) phy_b->mem->n_recomputed, 0);
+
+  del_phylogeny (phy);
+  del_phylogeny (phy_b);
+  del_topology (tre);
+  del_topology (tre_b);
+  del_alignment (align);
+  del_alignment (align_b);
+}
+END_TEST
+
+START_TEST(multilocus_equals_separate_loci)
+{
+  int i, j, tre_idx[3] = {0, 1, 0}, *idx = (_i ? tre_idx : NULL);
+  double lnLk[3];
+  alignment align;
+  topology tre[2];
+  phylogeny phy = likelihood_test_phylogeny (12, 1200, &align, &tre[0]), loc[3], ref[3];
+
+  align->n_charset = 3; /* genes of distinct sizes, s.t. they are scheduled out of order */
+  align->charset_start = (int*) biomcmc_malloc (3 * sizeof (int));
+  align->charset_end   = (int*) biomcmc_malloc (3 * sizeof (int));
+  align->charset_start[0] = 0;   align->charset_end[0] = 299;
+  align->charset_start[1] = 300; align->charset_end[1] = 899;
+  align->charset_start[2] = 900; align->charset_end[2] = 1199;
+  for (j = 0; j < 3; j++) {
+    loc[j] = new_phylogeny_from_alignment_charset (align, j, 2, 4, 4, NULL);
+    ref[j] = new_phylogeny_from_alignment_charset (align, j, 2, 4, 4, NULL); /* evaluated one at a time */
+  }
+  biomcmc_random_number_init (42ULL);
+  tre[1] = new_topology (tre[0]->nleaves);
+  copy_topology_from_topology (tre[1], tre[0]);
+  for (i = 0; i < 4; i++) topology_apply_spr (tre[1], true); /* second gene tree, if used */
+  update_topology_traversal (tre[1]);
+
+  for (i = 0; i < 10; i++) {
+    if (i) for (j = 0; j < 2; j++) {
+      topology_apply_spr (tre[j], true);
+      update_topology_traversal (tre[j]);
+    }
+    ln_likelihood_multilocus (loc, 3, tre, idx, (i > 0), lnLk);
+    for (j = 0; j < 3; j++) {
+      ln_likelihood (ref[j], tre[(idx ? idx[j] : 0)]);
+      if ((fabs (lnLk[j] - ref[j]->lk_proposal) > 1e-9 * fabs (lnLk[j])) || (lnLk[j] != loc[j]->lk_proposal))
+        ck_abort_msg ("ln(likelihood) of locus %d at step %d is %.12g but separately is %.12g", j, i, lnLk[j], ref[j]->lk_proposal);
+    }
+    if (i % 3 != 2) { /* one in three proposals is rejected */
+      accept_likelihood_multilocus (loc, 3, tre, idx, (i > 0));
+      for (j = 0; j < 3; j++) if (fabs (loc[j]->lk_current - lnLk[j]) > 1e-12 * fabs (lnLk[j]))
+        ck_abort_msg ("accepted ln(likelihood) of locus %d at step %d is %.12g but should be %.12g", j, i, loc[j]->lk_current, lnLk[j]);
+      for (j = 0; j < 2; j++) clear_topology_flags (tre[j]);
+    }
+    else for (j = 0; j < 2; j++) topology_reset_random_move (tre[j]);
+    for (j = 0; j < 2; j++) update_topology_traversal (tre[j]);
+  }
+  biomcmc_random_number_finalize ();
+
+  for (j = 0; j < 3; j++) {
+    del_phylogeny (loc[j]);
+    del_phylogeny (ref[j]);
+  }
+  del_phylogeny (phy);
+  del_topology (tre[0]);
+  del_topology (tre[1]);
+  del_alignment (align);
+}
+END_TEST
+
+START_TEST(likelihood_cache_hits_and_misses)
+{
+  int i, k;
+  double lnL0, b, x;
+  alignment align, align_r;
+  topology tre, tre_r;
+  phylogeny phy = likelihood_test_phylogeny (12, 1200, &align, &tre),
+            ref = likelihood_test_phylogeny (12, 1200, &align_r, &tre_r); /* same data, without cache */
+
+  phylogeny_set_likelihood_cache (phy, 64, true);
+  ln_likelihood (phy, tre);
+  accept_likelihood (phy, tre);
+  lnL0 = phy->lk_current;
+  ck_assert_int_eq ((int) phy->cache->n_hit, 0);
+
+  k = tre->postorder[0]->id; /* internal branch: a new length is a new state */
+  b = tre->blength[k];
+  tre->blength[k] = 2. * b;
+  ln_likelihood (phy, tre);
+  accept_likelihood (phy, tre);
+  ln_likelihood (ref, tre);
+  ck_assert_int_eq ((int) phy->cache->n_hit, 0);
+  if ((phy->lk_current == lnL0) || (fabs (phy->lk_current - ref->lk_proposal) > 1e-9 * fabs (lnL0)))
+    ck_abort_msg ("ln(likelihood) after changing a branch length is %.12g but should be %.12g", phy->lk_current, ref->lk_proposal);
+
+  for (i = 1; tre->blength[i] == tre->blength[0]; i++); /* same lengths on other branches are also a new state */
+  x = tre->blength[0]; tre->blength[0] = tre->blength[i]; tre->blength[i] = x;
+  ln_likelihood (phy, tre);
+  ck_assert_int_eq ((int) phy->cache->n_hit, 0);
+  x = tre->blength[0]; tre->blength[0] = tre->blength[i]; tre->blength[i] = x;
+
+  tre->blength[k] = b; /* first state is found, but its vectors were overwritten */
+  ln_likelihood (phy, tre);
+  ck_assert_int_eq ((int) phy->cache->n_hit, 1);
+  ck_assert_int_eq (phy->cache->hit, true);
+  if (phy->lk_proposal != lnL0) ck_abort_msg ("cached ln(likelihood) is %.12g but should be %.12g", phy->lk_proposal, lnL0);
+  accept_likelihood (phy, tre);
+  ck_assert_int_eq (phy->cache->stale, true);
+
+  biomcmc_random_number_init (42ULL);
+  for (i = 0; i < 3; i++) { /* the first move after a cached state calculates all vectors, and the next ones reuse them */
+    topology_apply_spr (tre, true);
+    update_topology_traversal (tre);
+    ln_likelihood_moved_branches (phy, tre);
+    ln_likelihood (ref, tre);
+    if (fabs (phy->lk_proposal - ref->lk_proposal) > 1e-9 * fabs (lnL0))
+      ck_abort_msg ("ln(likelihood) of move %d after a cache hit is %.12g but should be %.12g", i, phy->lk_proposal, ref->lk_proposal);
+    accept_likelihood_moved_branches (phy, tre);
+    ck_assert_int_eq (phy->cache->stale, false);
+    clear_topology_flags (tre);
+    update_topology_traversal (tre);
+  }
+  biomcmc_random_number_finalize ();
+
+  update_model_eigenvalues_from_kappa (phy->model, phy->model->kappa); /* same values, but a new model version */
+  ln_likelihood (phy, tre);
+  ck_assert_int_eq ((int) phy->cache->n_hit, 1);
+  ck_assert_int_eq ((int) phy->cache->n_lookup, 8);
+
+  del_phylogeny (phy);
+  del_phylogeny (ref);
+  del_topology (tre);
+  del_topology (tre_r);
+  del_alignment (align);
+  del_alignment (align_r);
+}
+END_TEST
+
+START_TEST(batch_of_proposals_equals_one_at_a_time)
+{
+  int i, j;
+  double lnLk[3], lnL;
+  alignment align;
+  topology tre, prop[3];
+  phylogeny phy = likelihood_test_phylogeny (12, 1200, &align, &tre); /* ring of 4 vectors: accepted plus 3 proposals */
+  topol_node nd;
+
+  ln_likelihood (phy, tre);
+  accept_likelihood (phy, tre);
+  phylogeny_link_accepted_to_current (phy);
+  biomcmc_random_number_init (42ULL);
+  for (i = 0; i < 3; i++) prop[i] = new_topology (tre->nleaves);
+  for (i = 0; i < 3; i++) {
+    /* identical proposals share all vectors, and the third shares all but the top changed node */
+    copy_topology_from_topology (prop[0], tre);
+    topology_apply_spr (prop[0], true);
+    update_topology_traversal (prop[0]);
+    copy_topology_from_topology (prop[1], prop[0]);
+    copy_topology_from_topology (prop[2], prop[0]);
+    ck_assert_int_gt (prop[2]->n_undone, 1);
+    nd = prop[2]->undone[prop[2]->n_undone - 2];
+    prop[2]->blength[nd->left->id] *= 1.5;
+
+    ln_likelihood_moved_branches_at_lk_vector_batch (phy, prop, 3, lnLk);
+    for (j = 0; j < 3; j++) {
+      ln_likelihood_moved_branches_at_lk_vector (phy, prop[j], j+1);
+      if (fabs (lnLk[j] - phy->lk_proposal) > 1e-9 * fabs (lnLk[j]))
+        ck_abort_msg ("batch ln(likelihood) of proposal %d is %.12g but one at a time is %.12g", j, lnLk[j], phy->lk_proposal);
+    }
+    if (fabs (lnLk[0] - lnLk[1]) > 1e-12 * fabs (lnLk[0])) ck_abort_msg ("identical proposals have distinct ln(likelihood)s");
+
+    /* accepted vectors of a batch (some shared with other proposals) are used by the next moves */
+    ln_likelihood_moved_branches_at_lk_vector_batch (phy, prop, 3, lnLk);
+    accept_likelihood_moved_branches_at_lk_vector (phy, prop[i], i+1, lnLk[i]);
+    phylogeny_link_current_to_accepted (phy);
+    copy_topology_from_topology (tre, prop[i]);
+    topology_apply_spr (tre, true);
+    update_topology_traversal (tre);
+    ln_likelihood_moved_branches (phy, tre);
+    lnL = phy->lk_proposal;
+    ln_likelihood (phy, tre);
+    if (fabs (lnL - phy->lk_proposal) > 1e-9 * fabs (lnL))
+      ck_abort_msg ("after accepting proposal %d, moved branches ln(likelihood) is %.12g but full is %.12g", i, lnL, phy->lk_proposal);
+    accept_likelihood (phy, tre);
+    phylogeny_link_accepted_to_current (phy);
+  }
+  biomcmc_random_number_finalize ();
+  ln_likelihood_moved_branches_at_lk_vector_batch (phy, prop, 3, lnLk); /* vectors shared by slots are freed only once */
+  del_phylogeny (phy);
+  for (i = 0; i < 3; i++) del_topology (prop[i]);
+  del_topology (tre);
+  del_alignment (align);
+}
+END_TEST
+
+START_TEST(single_precision_close_to_double)
+{
+  int i;
+  double lnL_d[5], lnL_s, x;
+  alignment align;
+  topology tre;
+  phylogeny phy = likelihood_test_phylogeny (12, 1200, &align, &tre);
+
+  biomcmc_random_number_init (42ULL);
+  ln_likelihood (phy, tre);
+  accept_likelihood (phy, tre);
+  lnL_d[0] = phy->lk_current;
+  for (i = 1; i < 5; i++) {
+    topology_apply_spr (tre, true);
+    update_topology_traversal (tre);
+    ln_likelihood_moved_branches (phy, tre);
+    accept_likelihood_moved_branches (phy, tre);
+    lnL_d[i] = phy->lk_current;
+  }
+  biomcmc_random_number_finalize ();
+
+  /* same trees again, now with float storage */
+  del_phylogeny (phy);
+  del_topology (tre);
+  del_alignment (align);
+  phy = likelihood_test_phylogeny (12, 1200, &align, &tre);
+  phylogeny_set_single_precision (phy, true);
+  biomcmc_random_number_init (42ULL);
+  ln_likelihood (phy, tre);
+  accept_likelihood (phy, tre);
+  for (i = 0; i < 5; i++) {
+    if (i) {
+      topology_apply_spr (tre, true);
+      update_topology_traversal (tre);
+      ln_likelihood_moved_branches (phy, tre);
+      accept_likelihood_moved_branches (phy, tre);
+    }
+    lnL_s = phy->lk_current;
+    if (fabs (lnL_s - lnL_d[i]) > 1e-5 * fabs (lnL_d[i]))
+      ck_abort_msg ("ln(likelihood) %d with single precision is %.12g but with double precision is %.12g", i, lnL_s, lnL_d[i]);
+  }
+  biomcmc_random_number_finalize ();
+  ck_assert_int_eq (phy->single_precision, true); /* no fallback for this data set */
+  x = ln_likelihood_precision_discrepancy (phy, tre, NULL, &lnL_s);
+  if ((fabs (x) > 1e-5 * fabs (lnL_d[4])) || (fabs (lnL_s - lnL_d[4]) > 1e-5 * fabs (lnL_d[4])))
+    ck_abort_msg ("precision discrepancy %.6g, with single precision ln(likelihood) %.12g", x, lnL_s);
+  del_phylogeny (phy);
+  del_topology (tre);
+  del_alignment (align);
+}
+END_TEST
+
+START_TEST(single_precision_falls_back_to_double)
+{
+  int i, j, *state;
+  double lnL_d, lnL;
+  alignment align;
+  topology tre;
+  phylogeny phy = likelihood_test_phylogeny (40, 600, &align, &tre);
+
+  /* with random sequences most nodes join subtrees with distinct states, which along such short branches costs ~2^-35:
+   * float vectors must then be rescaled at most nodes */
+  biomcmc_random_number_init (42ULL);
+  state = (int*) biomcmc_malloc (phy->npat * sizeof (int));
+  for (i = 0; i < phy->ntax; i++) {
+    for (j = 0; j < phy->npat; j++) state[j] = 1 << biomcmc_rng_unif_int (4);
+    phylogeny_set_leaf_states (phy, i, state);
+  }
+  for (i = 0; i < tre->nnodes; i++) tre->blength[i] = 1e-10;
+  ln_likelihood (phy, tre);
+  lnL_d = phy->lk_proposal;
+  phylogeny_set_single_precision (phy, true);
+  ln_likelihood (phy, tre);
+  accept_likelihood (phy, tre);
+  ck_assert_int_eq (phy->single_precision, false);
+  if (fabs (phy->lk_current - lnL_d) > 1e-5 * fabs (lnL_d))
+    ck_abort_msg ("ln(likelihood) after falling back to double precision is %.12g but should be %.12g", phy->lk_current, lnL_d);
+
+  topology_apply_spr (tre, true); /* vectors converted from floats are reused by the next moves */
+  update_topology_traversal (tre);
+  ln_likelihood_moved_branches (phy, tre);
+  lnL = phy->lk_proposal;
+  ln_likelihood (phy, tre);
+  if (fabs (lnL - phy->lk_proposal) > 1e-5 * fabs (lnL))
+    ck_abort_msg ("moved branches ln(likelihood) after fallback is %.12g but full is %.12g", lnL, phy->lk_proposal);
+  biomcmc_random_number_finalize ();
+  free (state);
+  del_phylogeny (phy);
+  del_topology (tre);
+  del_alignment (align);
+}
+END_TEST
+
+/* ln(likelihood) of the initial tree and after each of n_spr moves, with n_threads threads and their own pattern chunks */
+void
+likelihood_with_threads (int n_threads, int n_spr, double *lnL)
+{
+  int i;
+  alignment align;
+  topology tre;
+  phylogeny phy;
+
+#ifdef _OPENMP
+  omp_set_num_threads (n_threads);
+#endif
+  phy = likelihood_test_phylogeny (40, 600, &align, &tre); /* few patterns and many leaves: subtree tasks if threaded */
+  ck_assert_int_eq ((tre->nleaves >= 32) && (phy->npat < 512 * 4), 1);
+  phylogeny_set_pattern_affinity (phy, n_threads, true);
+  biomcmc_random_number_init (42ULL);
+  ln_likelihood (phy, tre);
+  accept_likelihood (phy, tre);
+  lnL[0] = phy->lk_current;
+  for (i = 1; i <= n_spr; i++) {
+    topology_apply_spr (tre, true);
+    update_topology_traversal (tre);
+    ln_likelihood_moved_branches (phy, tre);
+    accept_likelihood_moved_branches (phy, tre);
+    lnL[i] = phy->lk_current;
+  }
+  biomcmc_random_number_finalize ();
+  del_phylogeny (phy);
+  del_topology (tre);
+  del_alignment (align);
+}
+
+START_TEST(parallel_likelihood_equals_serial)
+{
+  int i, n_threads = 1;
+  double serial[9], parallel[9];
+
+#ifdef _OPENMP
+  n_threads = omp_get_max_threads ();
+#endif
+  likelihood_with_threads (1, 8, serial);
+  likelihood_with_threads (4, 8, parallel); /* even if there are fewer cores */
+  for (i = 0; i < 9; i++) if (fabs (serial[i] - parallel[i]) > 1e-9 * fabs (serial[i]))
+    ck_abort_msg ("ln(likelihood) %d with four threads is %.12g but with one thread is %.12g", i, parallel[i], serial[i]);
+#ifdef _OPENMP
+  omp_set_num_threads (n_threads);
+#endif
+}
+END_TEST
+
+/* cold chain ln(likelihood) and acceptances after a few MC3 cycles with n_threads threads; also checks that the global
+ * stream is not used by the chains */
+void
+mc3_with_threads (int n_threads, double *result)
+{
+  int c;
+  uint64_t global;
+  alignment align;
+  topology tre;
+  phylogeny phy;
+  mc3_chains mc;
+
+#ifdef _OPENMP
+  omp_set_num_threads (n_threads);
+#endif
+  phy = likelihood_test_phylogeny (12, 1200, &align, &tre);
+  ln_likelihood (phy, tre);
+  accept_likelihood (phy, tre);
+  biomcmc_random_number_init (42ULL);
+  mc = new_mc3_chains (phy, tre, 4, 0.2, 7ULL);
+  mc3_chains_run (mc, 40, 5);
+  global = biomcmc_rng_get ();
+  biomcmc_random_number_finalize ();
+  biomcmc_random_number_init (42ULL);
+  if (global != biomcmc_rng_get ()) ck_abort_msg ("MC3 chains with %d threads used the global random number stream", n_threads);
+  biomcmc_random_number_finalize ();
+  for (c = 0; c < 4; c++) {
+    result[2 * c] = mc->phy[c]->lk_current;
+    result[2 * c + 1] = (double) mc->n_accepted[c];
+  }
+  del_mc3_chains (mc);
+  del_phylogeny (phy);
+  del_topology (tre);
+  del_alignment (align);
+}
+
+START_TEST(mc3_chains_independent_of_threads)
+{
+  int i, n_threads = 1;
+  double serial[8], parallel[8];
+
+#ifdef _OPENMP
+  n_threads = omp_get_max_threads ();
+#endif
+  mc3_with_threads (1, serial);
+  mc3_with_threads (4, parallel);
+  for (i = 0; i < 8; i++) if (fabs (serial[i] - parallel[i]) > 1e-9 * fabs (serial[i]))
+    ck_abort_msg ("MC3 chain %d with four threads has %.12g but with one thread %.12g", i/2, parallel[i], serial[i]);
+#ifdef _OPENMP
+  omp_set_num_threads (n_threads);
+#endif
+}
+END_TEST
+
+Suite * likelihood_suite(void)
+{
+  Suite *s;
+  TCase *tc_case;
+
+  s = suite_create("Likelihood");
+
+  tc_case = tcase_create("kernels");
+  tcase_add_loop_test (tc_case, simd_kernels_equal_scalar_loop, 0, 3); // 4, 20 and 61 states
+  tcase_add_test (tc_case, protein_two_taxa_equal_input);
+  suite_add_tcase(s, tc_case);
+
+  tc_case = tcase_create("branch lengths");
+  tcase_add_test (tc_case, edge_derivatives_finite_differences);
+  tcase_add_test (tc_case, optimise_branch_lengths_under_prior);
+  suite_add_tcase(s, tc_case);
+
+  tc_case = tcase_create("patterns and partitions");
+  tcase_add_loop_test (tc_case, zero_weight_patterns_are_skipped, 0, 2); // without and with site repeats
+  tcase_add_test (tc_case, partitioned_likelihood_after_tree_changes);
+  tcase_add_loop_test (tc_case, multilocus_equals_separate_loci, 0, 2); // one topology, and one per gene
+  tcase_add_test (tc_case, batch_of_proposals_equals_one_at_a_time);
+  tcase_add_test (tc_case, memory_budget_equals_unbounded);
+  tcase_add_test (tc_case, likelihood_cache_hits_and_misses);
+  suite_add_tcase(s, tc_case);
+
+  tc_case = tcase_create("single precision");
+  tcase_add_test (tc_case, single_precision_close_to_double);
+  tcase_add_test (tc_case, single_precision_falls_back_to_double);
+  suite_add_tcase(s, tc_case);
+
+  tc_case = tcase_create("threads");
+  tcase_add_test (tc_case, parallel_likelihood_equals_serial);
+  tcase_add_test (tc_case, mc3_chains_independent_of_threads);
+  suite_add_tcase(s, tc_case);
+
+  return s;
+}
+
+int main(void)
+{
+  int number_failed;
+  SRunner *sr;
+
+  sr = srunner_create (likelihood_suite());
+  srunner_run_all(sr, CK_VERBOSE);
+  number_failed = srunner_ntests_failed(sr);
+  srunner_free(sr);
+  return (number_failed > 0) ? TEST_FAILURE:TEST_SUCCESS;
+}
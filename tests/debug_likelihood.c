@@ -0,0 +1,103 @@
+#include <biomcmc.h>
+#include <likelihood.h>
+#include <likelihood_kernel.h>
+
+#define TEST_SUCCESS 0
+#define TEST_FAILURE 1
+#define TEST_SKIPPED 77
+#define TEST_HARDERROR 99
+
+/* scaling of ln_likelihood() with the number of threads, with partial likelihoods zeroed by the calling thread (all pages
+ * on one NUMA node) and by the threads which use them (first touch). Usage: debug_likelihood <alignment> [max_threads] [reps]
+ * Threads should be bound to cores, e.g. OMP_PROC_BIND=close OMP_PLACES=cores */
+
+double
+time_ln_likelihood (alignment align, topology tree, distance_matrix dist, int n_threads, bool first_touch, int n_reps, double *lnLk)
+{
+  int i;
+  int64_t time0[2];
+  double elapsed;
+  phylogeny phy;
+#ifdef _OPENMP
+  omp_set_num_threads (n_threads);
+#endif
+  phy = new_phylogeny_from_alignment (align, 4, 4, 1, dist);
+  phylogeny_set_pattern_affinity (phy, n_threads, first_touch); /* before vectors are allocated by first ln_likelihood() */
+  ln_likelihood (phy, tree); /* warm up */
+  biomcmc_get_time (time0);
+  for (i = 0; i < n_reps; i++) ln_likelihood (phy, tree);
+  elapsed = biomcmc_update_elapsed_time (time0) / (double) n_reps;
+  *lnLk = phy->lk_proposal;
+  del_phylogeny (phy);
+  return elapsed;
+}
+
+/* throughput of the 4-state partial likelihood kernel for each instruction set, over n_pat patterns */
+void
+time_kernels (int n_pat, int n_reps)
+{
+  int i, r, level;
+  int64_t time0[2];
+  double *left, *right, *res, Pl[16], Pr[16], sum = 0., elapsed, t_scalar = 0.;
+
+  left  = (double*) biomcmc_malloc (4 * n_pat * sizeof (double));
+  right = (double*) biomcmc_malloc (4 * n_pat * sizeof (double));
+  res   = (double*) biomcmc_malloc (4 * n_pat * sizeof (double));
+  for (i = 0; i < 4 * n_pat; i++) { left[i] = (double)(i % 7 + 1) / 7.; right[i] = (double)(i % 5 + 1) / 5.; }
+  for (i = 0; i < 16; i++) { Pl[i] = (double)(i % 5 + 1) / 10.; Pr[i] = (double)(i % 3 + 1) / 9.; }
+  printf ("instruction_set  Mpatterns/s  speedup\n");
+  for (level = BIOMCMC_SIMD_NONE; level <= BIOMCMC_SIMD_AVX2; level++) {
+    if (set_likelihood_kernel (level) != level) continue;
+    biomcmc_get_time (time0);
+    for (r = 0; r < n_reps; r++) for (i = 0; i < n_pat; i++) sum += lk_kernel_partial_4state (res + 4 * i, left + 4 * i, right + 4 * i, Pl, Pr);
+    elapsed = biomcmc_update_elapsed_time (time0);
+    if (level == BIOMCMC_SIMD_NONE) t_scalar = elapsed;
+    printf ("%15d  %11.2f  %7.2f\n", level, (double) n_reps * (double) n_pat / elapsed / 1.e6, t_scalar / elapsed);
+  }
+  set_likelihood_kernel (BIOMCMC_SIMD_AUTO);
+  if (sum < 0.) printf ("%lf\n", sum); /* avoids the loop being optimised away */
+  free (res); free (right); free (left);
+}
+
+int main (int argc, char **argv)
+{
+  int n_threads, max_threads = 1, n_reps = 10;
+  double t_serial, t_touch, t1_serial = 0., t1_touch = 0., lnLk[2];
+  alignment align;
+  distance_matrix dist;
+  topology tree;
+
+  if (argc == 1) {
+    fprintf (stderr, "usage: %s <alignment> [max_threads] [reps]\n", argv[0]);
+    return TEST_SUCCESS;
+  }
+#ifdef _OPENMP
+  max_threads = omp_get_max_threads ();
+#endif
+  if (argc > 2) sscanf (argv[2], " %d ", &max_threads);
+  if (argc > 3) sscanf (argv[3], " %d ", &n_reps);
+
+  time_kernels (1 << 16, 100 * n_reps);
+  biomcmc_random_number_init (0ULL);
+  align = read_alignment_from_file (argv[1]);
+  dist = new_distance_matrix_from_alignment (align);
+  tree = new_topology (align->ntax);
+  bionj_from_distance_matrix (tree, dist);
+  update_topology_traversal (tree);
+  printf ("%d taxa, %d patterns; seconds per ln_likelihood() and speedup over one thread\n", align->ntax, align->npat);
+  printf ("threads    serial_zero  speedup    first_touch  speedup\n");
+
+  for (n_threads = 1; n_threads <= max_threads; n_threads *= 2) {
+    t_serial = time_ln_likelihood (align, tree, dist, n_threads, false, n_reps, lnLk);
+    t_touch  = time_ln_likelihood (align, tree, dist, n_threads, true,  n_reps, lnLk + 1);
+    if (n_threads == 1) { t1_serial = t_serial; t1_touch = t_touch; }
+    if (fabs (lnLk[0] - lnLk[1]) > 1e-6 * fabs (lnLk[0])) biomcmc_error ("ln_likelihood differs: %lf %lf", lnLk[0], lnLk[1]);
+    printf ("%7d    %11.6f  %7.2f    %11.6f  %7.2f\n", n_threads, t_serial, t1_serial / t_serial, t_touch, t1_touch / t_touch);
+  }
+
+  del_topology (tree);
+  del_distance_matrix (dist);
+  del_alignment (align);
+  biomcmc_random_number_finalize();
+  return TEST_SUCCESS;
+}